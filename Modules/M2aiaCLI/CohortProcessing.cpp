@@ -0,0 +1,407 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes.
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <itkImage.h>
+#include <itksys/SystemTools.hxx>
+#include <m2ImzMLImageIO.h>
+#include <m2ImzMLSpectrumImage.h>
+#include <mitkCommandLineParser.h>
+#include <mitkExceptionMacro.h>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdlib.h>
+#include <thread>
+
+std::map<std::string, us::Any> CommandlineParsing(int argc, char *argv[]);
+
+namespace
+{
+  /// Counting semaphore; a stage acquires the units it uses from a global budget.
+  class Budget
+  {
+  public:
+    explicit Budget(unsigned int capacity) : m_Capacity(std::max(1u, capacity)), m_Available(m_Capacity) {}
+
+    unsigned int Acquire(unsigned int n)
+    {
+      n = std::max(1u, std::min(n, m_Capacity));
+      std::unique_lock<std::mutex> lock(m_Mutex);
+      m_Condition.wait(lock, [&] { return m_Available >= n; });
+      m_Available -= n;
+      return n;
+    }
+
+    void Release(unsigned int n)
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Available += n;
+      }
+      m_Condition.notify_all();
+    }
+
+  private:
+    const unsigned int m_Capacity;
+    unsigned int m_Available;
+    std::mutex m_Mutex;
+    std::condition_variable m_Condition;
+  };
+
+  /// Holds units of a budget for the lifetime of a stage.
+  class BudgetLock
+  {
+  public:
+    BudgetLock(Budget &budget, unsigned int n) : m_Budget(budget), m_Units(budget.Acquire(n)) {}
+    ~BudgetLock() { m_Budget.Release(m_Units); }
+    unsigned int GetUnits() const { return m_Units; }
+
+  private:
+    Budget &m_Budget;
+    unsigned int m_Units;
+  };
+
+  struct Dataset
+  {
+    std::string Input;
+    std::string Output;
+
+    std::string Status = "pending";
+    std::string Message;
+    double Parse = 0, Initialize = 0, Write = 0, Total = 0;
+  };
+
+  /**
+   * Reads the manifest: one dataset per line as "input.imzML[,output.imzML]".
+   * Empty lines and lines starting with '#' are ignored. Without an output path,
+   * the output is written to outputDirectory with the file name of the input.
+   */
+  std::vector<Dataset> ReadManifest(const std::string &path, const std::string &outputDirectory)
+  {
+    std::ifstream file(path);
+    if (!file)
+      mitkThrow() << "Can not open manifest " << path;
+
+    const auto manifestDirectory = itksys::SystemTools::GetFilenamePath(path);
+    const auto Resolve = [&](const std::string &p)
+    {
+      return itksys::SystemTools::FileIsFullPath(p) || manifestDirectory.empty()
+               ? p
+               : itksys::SystemTools::CollapseFullPath(p, manifestDirectory);
+    };
+
+    std::vector<Dataset> datasets;
+    std::string line;
+    for (unsigned int row = 1; std::getline(file, line); ++row)
+    {
+      line = itksys::SystemTools::TrimWhitespace(line);
+      if (line.empty() || line[0] == '#')
+        continue;
+
+      Dataset dataset;
+      const auto comma = line.find(',');
+      dataset.Input = Resolve(itksys::SystemTools::TrimWhitespace(line.substr(0, comma)));
+      if (comma != std::string::npos)
+        dataset.Output = Resolve(itksys::SystemTools::TrimWhitespace(line.substr(comma + 1)));
+
+      if (dataset.Output.empty())
+      {
+        if (outputDirectory.empty())
+          mitkThrow() << "Line " << row << " of " << path << " has no output path and no output directory is given.";
+        dataset.Output = outputDirectory + "/" + itksys::SystemTools::GetFilenameName(dataset.Input);
+      }
+      if (dataset.Output == dataset.Input)
+        mitkThrow() << "Line " << row << " of " << path << ": the output would overwrite the input.";
+      datasets.push_back(dataset);
+    }
+    return datasets;
+  }
+
+  double Seconds(std::chrono::steady_clock::time_point start)
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::map<std::string, us::Any> argsMap;
+  std::string params = "";
+
+  if (argc > 1)
+  {
+    argsMap = CommandlineParsing(argc, argv);
+    auto ifs = std::ifstream(argsMap["parameterfile"].ToString());
+    params = std::string(std::istreambuf_iterator<char>{ifs}, {});
+  }
+
+  using namespace std::string_literals;
+  std::map<std::string, std::string> pMap;
+  const auto bsc_s = m2::Find(params, "baseline-correction", "None"s, pMap);
+  const auto bsc_hw = m2::Find(params, "baseline-correction-hw", int(50), pMap);
+  const auto sm_s = m2::Find(params, "smoothing", "None"s, pMap);
+  const auto sm_hw = m2::Find(params, "smoothing-hw", int(2), pMap);
+  const auto norm = m2::Find(params, "normalization", "None"s, pMap);
+  const auto y_output_type = m2::Find(params, "y-type", "Float"s, pMap);
+  const auto x_output_type = m2::Find(params, "x-type", "Float"s, pMap);
+  const auto threads = m2::Find(params, "threads", int(itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads()), pMap);
+  const auto threads_per_file = m2::Find(params, "threads-per-file", int(4), pMap);
+  const auto io_slots = m2::Find(params, "io-slots", int(1), pMap);
+  const auto files_in_flight = m2::Find(params, "files-in-flight", int(0), pMap);
+
+  if (argsMap.find("parameterfile") == argsMap.end())
+  {
+    try
+    {
+      using namespace itksys;
+      auto cwd = SystemTools::GetCurrentWorkingDirectory();
+      auto path = SystemTools::ConvertToOutputPath(SystemTools::JoinPath({cwd, "/m2CohortProcessing.txt.sample"}));
+      std::ofstream ofs(path);
+      for (auto kv : pMap)
+      {
+        ofs << "(" << kv.first << " " << kv.second << ")\n";
+      }
+      MITK_INFO << "A dummy parameter file was written to " << path;
+      return 0;
+    }
+    catch (std::exception &e)
+    {
+      MITK_INFO << "Error on writing a dummy parameter file! " << e.what();
+      return 2;
+    }
+  }
+
+  for (auto kv : argsMap)
+  {
+    MITK_INFO << kv.first << " " << kv.second.ToString();
+  }
+
+  std::vector<Dataset> datasets;
+  std::string outputDirectory;
+  if (argsMap.find("output") != argsMap.end())
+  {
+    outputDirectory = argsMap["output"].ToString();
+    itksys::SystemTools::MakeDirectory(outputDirectory);
+  }
+  try
+  {
+    datasets = ReadManifest(argsMap["manifest"].ToString(), outputDirectory);
+  }
+  catch (std::exception &e)
+  {
+    MITK_ERROR << e.what();
+    return 1;
+  }
+
+  // CPU budget: threads of all stages; I/O budget: concurrent parse and write stages.
+  // A file in flight keeps its parsed meta data in memory, which bounds the number of files in flight.
+  const unsigned int cpuThreads = std::max(1, threads);
+  const unsigned int fileThreads = std::max(1u, std::min<unsigned int>(threads_per_file, cpuThreads));
+  Budget cpu(cpuThreads);
+  Budget io(std::max(1, io_slots));
+  const unsigned int inFlight =
+    std::max(1u,
+             std::min<unsigned int>(files_in_flight > 0 ? files_in_flight : cpuThreads / fileThreads + io_slots,
+                                    datasets.size()));
+
+  MITK_INFO << "Process " << datasets.size() << " datasets, " << inFlight << " in flight, " << cpuThreads
+            << " threads (" << fileThreads << " per file), " << std::max(1, io_slots) << " I/O slots";
+
+  const auto cohortStart = std::chrono::steady_clock::now();
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> done(0);
+  std::mutex logMutex;
+
+  const auto ProcessDataset = [&](Dataset &dataset)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    try
+    {
+      m2::ImzMLSpectrumImage::Pointer image;
+      {
+        // reading the geometry also initializes the normalization image, which reads all spectra
+        BudgetLock cpuLock(cpu, fileThreads);
+        BudgetLock ioLock(io, 1);
+        const auto t = std::chrono::steady_clock::now();
+        m2::ImzMLImageIO imageIO;
+        mitk::AbstractFileReader *reader = &imageIO;
+        reader->SetInput(dataset.Input);
+        imageIO.SetNumberOfThreads(cpuLock.GetUnits());
+        auto data = imageIO.DoRead();
+        image = dynamic_cast<m2::ImzMLSpectrumImage *>(data.front().GetPointer());
+        dataset.Parse = Seconds(t);
+      }
+
+      if (image->GetSpectrumType().Format != m2::SpectrumFormat::ContinuousProfile)
+        mitkThrow() << "Only imzML files in continuous profile mode are accepted for processing!";
+
+      {
+        BudgetLock cpuLock(cpu, fileThreads);
+        const auto t = std::chrono::steady_clock::now();
+        image->SetBaselineCorrectionStrategy(static_cast<m2::BaselineCorrectionType>(m2::BASECOR_MAPPINGS.at(bsc_s)));
+        image->SetBaseLineCorrectionHalfWindowSize(bsc_hw);
+        image->SetSmoothingStrategy(static_cast<m2::SmoothingType>(m2::SMOOTHING_MAPPINGS.at(sm_s)));
+        image->SetSmoothingHalfWindowSize(sm_hw);
+        image->SetNormalizationStrategy(
+          static_cast<m2::NormalizationStrategyType>(m2::NORMALIZATION_MAPPINGS.at(norm)));
+        image->SetNumberOfThreads(cpuLock.GetUnits());
+        image->InitializeImageAccess();
+        dataset.Initialize = Seconds(t);
+      }
+
+      {
+        // spectra are processed one by one while they are written
+        BudgetLock cpuLock(cpu, 1);
+        BudgetLock ioLock(io, 1);
+        const auto t = std::chrono::steady_clock::now();
+        const auto yType = static_cast<m2::NumericType>(m2::CORE_MAPPINGS.at(y_output_type));
+        const auto xType = static_cast<m2::NumericType>(m2::CORE_MAPPINGS.at(x_output_type));
+        image->GetExportSpectrumType().Format = m2::SpectrumFormat::ContinuousProfile;
+        image->GetExportSpectrumType().YAxisType = yType;
+        image->GetExportSpectrumType().XAxisType = xType;
+
+        image->SetNumberOfThreads(cpuLock.GetUnits());
+
+        m2::ImzMLImageIO imageIO;
+        mitk::AbstractFileWriter *writer = &imageIO;
+        writer->SetInput(image);
+        writer->SetOutputLocation(dataset.Output);
+        imageIO.SetSpectrumFormat(m2::SpectrumFormat::ContinuousProfile);
+        imageIO.SetDataTypeYAxis(yType);
+        imageIO.SetDataTypeXAxis(xType);
+        imageIO.Write();
+        dataset.Write = Seconds(t);
+      }
+      dataset.Status = "done";
+    }
+    catch (std::exception &e)
+    {
+      dataset.Status = "failed";
+      dataset.Message = e.what();
+    }
+    dataset.Total = Seconds(start);
+
+    std::lock_guard<std::mutex> lock(logMutex);
+    MITK_INFO << "[" << ++done << "/" << datasets.size() << "] " << dataset.Status << " " << dataset.Input << " ("
+              << dataset.Total << " s)" << (dataset.Message.empty() ? "" : ": " + dataset.Message);
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < inFlight; ++i)
+    workers.emplace_back(
+      [&]
+      {
+        for (size_t k = next++; k < datasets.size(); k = next++)
+          ProcessDataset(datasets[k]);
+      });
+  for (auto &w : workers)
+    w.join();
+
+  auto reportPath = argsMap.find("report") != argsMap.end() ? argsMap["report"].ToString() : std::string();
+  if (reportPath.empty())
+  {
+    const auto manifest = argsMap["manifest"].ToString();
+    reportPath = itksys::SystemTools::GetFilenameWithoutLastExtension(manifest) + "_report.csv";
+    if (!itksys::SystemTools::GetFilenamePath(manifest).empty())
+      reportPath = itksys::SystemTools::GetFilenamePath(manifest) + "/" + reportPath;
+  }
+  std::ofstream report(reportPath);
+  report << "input,output,status,parse_s,initialize_s,write_s,wait_s,total_s,message\n";
+  size_t failed = 0;
+  for (const auto &d : datasets)
+  {
+    failed += d.Status != "done";
+    auto message = d.Message;
+    std::replace(message.begin(), message.end(), ',', ';');
+    std::replace(message.begin(), message.end(), '\n', ' ');
+    report << d.Input << "," << d.Output << "," << d.Status << "," << d.Parse << "," << d.Initialize << ","
+           << d.Write << "," << std::max(0.0, d.Total - d.Parse - d.Initialize - d.Write) << "," << d.Total << ","
+           << message << "\n";
+  }
+
+  MITK_INFO << "Processed " << datasets.size() - failed << " of " << datasets.size() << " datasets in "
+            << Seconds(cohortStart) << " s, report written to " << reportPath;
+  return failed ? 1 : 0;
+}
+
+std::map<std::string, us::Any> CommandlineParsing(int argc, char *argv[])
+{
+  mitkCommandLineParser parser;
+  parser.setArgumentPrefix("--", "-");
+  // required params
+  parser.addArgument("manifest",
+                     "m",
+                     mitkCommandLineParser::File,
+                     "Manifest",
+                     "Text file with one dataset per line: input.imzML[,output.imzML]. Relative paths are relative "
+                     "to the manifest, lines starting with # are ignored.",
+                     us::Any(),
+                     false,
+                     false,
+                     false,
+                     mitkCommandLineParser::Input);
+  parser.addArgument("parameterfile",
+                     "p",
+                     mitkCommandLineParser::File,
+                     "Parameter file",
+                     "Shared by all datasets. A dummy parameter file can be generated by calling the app without "
+                     "any arguments.",
+                     us::Any(),
+                     false,
+                     false,
+                     false,
+                     mitkCommandLineParser::Input);
+  parser.addArgument("output",
+                     "o",
+                     mitkCommandLineParser::Directory,
+                     "Output directory",
+                     "Directory for datasets without an output path in the manifest.",
+                     us::Any(),
+                     true,
+                     false,
+                     false,
+                     mitkCommandLineParser::Output);
+  parser.addArgument("report",
+                     "r",
+                     mitkCommandLineParser::File,
+                     "Timing report",
+                     "Path of the per-file timing report (csv). Defaults to <manifest>_report.csv.",
+                     us::Any(),
+                     true,
+                     false,
+                     false,
+                     mitkCommandLineParser::Output);
+
+  // Miniapp Infos
+  parser.setCategory("M2aia Tools");
+  parser.setTitle("Cohort signal processing");
+  parser.setDescription("Applies the signal processing of the Processing app to a list of imzML files. Parsing, "
+                        "initialization and writing of different files overlap under a global thread and I/O "
+                        "budget. https://m2aia.de (https://bio.tools/m2aia)");
+  parser.setContributor("Jonas Cordes");
+
+  auto parsedArgs = parser.parseArguments(argc, argv);
+  if (parsedArgs.size() == 0)
+  {
+    exit(EXIT_SUCCESS);
+  }
+
+  return parsedArgs;
+}
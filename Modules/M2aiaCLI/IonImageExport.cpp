@@ -0,0 +1,340 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes.
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <boost/progress.hpp>
+#include <chrono>
+#include <itkImage.h>
+#include <itksys/SystemTools.hxx>
+#include <m2ImzMLSpectrumImage.h>
+#include <mitkCommandLineParser.h>
+#include <mitkExceptionMacro.h>
+#include <mitkIOUtil.h>
+#include <mitkImage.h>
+#include <mitkImageCast.h>
+#include <mitkImagePixelReadAccessor.h>
+#include <mitkLabel.h>
+#include <npy/npy.hpp>
+#include <numeric>
+#include <sstream>
+#include <stdlib.h>
+
+std::map<std::string, us::Any> CommandlineParsing(int argc, char *argv[]);
+
+namespace
+{
+  /**
+   * Reads ion image centers from a csv file, one ion per row, centers in the first column.
+   * This covers plain centroid lists and IntervalVector files (center,max,min,mean). A header
+   * row is skipped; if it contains a "tolerance" column, the tolerance of each row is used.
+   */
+  std::vector<std::pair<double, double>> ReadCentroids(const std::string &path, const m2::SpectrumImage *image)
+  {
+    std::ifstream file(path);
+    if (!file)
+      mitkThrow() << "Can not open centroid file " << path;
+
+    const auto Split = [](const std::string &line)
+    {
+      std::vector<std::string> cells;
+      std::stringstream ss(line);
+      std::string cell;
+      while (std::getline(ss, cell, ','))
+        cells.push_back(itksys::SystemTools::TrimWhitespace(cell));
+      return cells;
+    };
+
+    std::vector<std::pair<double, double>> ranges;
+    int toleranceColumn = -1;
+    std::string line;
+    for (unsigned int row = 0; std::getline(file, line); ++row)
+    {
+      const auto cells = Split(line);
+      if (cells.empty() || cells[0].empty())
+        continue;
+
+      double center;
+      try
+      {
+        center = std::stod(cells[0]);
+      }
+      catch (std::exception &)
+      {
+        if (row != 0)
+          mitkThrow() << "Invalid centroid in line " << row + 1 << " of " << path << ": " << line;
+        auto it = std::find(cells.begin(), cells.end(), "tolerance");
+        if (it != cells.end())
+          toleranceColumn = std::distance(cells.begin(), it);
+        continue;
+      }
+
+      double tolerance = image->ApplyTolerance(center);
+      if (toleranceColumn >= 0 && toleranceColumn < int(cells.size()))
+        tolerance = std::stod(cells[toleranceColumn]);
+      ranges.emplace_back(center, tolerance);
+    }
+    return ranges;
+  }
+
+  /// The mask is converted to the label pixel type expected by GetImageArray.
+  mitk::Image::Pointer ReadMask(const std::string &path, const mitk::Image *image)
+  {
+    auto mask = mitk::IOUtil::Load<mitk::Image>(path);
+    for (unsigned int i = 0; i < 3; ++i)
+      if (mask->GetDimension(i) != image->GetDimension(i))
+        mitkThrow() << "The size of the mask " << path << " does not match the size of the image.";
+
+    itk::Image<mitk::Label::PixelType, 3>::Pointer itkMask;
+    mitk::CastToItkImage(mask, itkMask);
+    mitk::Image::Pointer result;
+    mitk::CastToMitkImage(itkMask, result);
+    return result;
+  }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+  std::map<std::string, us::Any> argsMap;
+  std::string params = "";
+
+  if (argc > 1)
+  {
+    argsMap = CommandlineParsing(argc, argv);
+    auto ifs = std::ifstream(argsMap["parameterfile"].ToString());
+    params = std::string(std::istreambuf_iterator<char>{ifs}, {});
+  }
+
+  using namespace std::string_literals;
+  std::map<std::string, std::string> pMap;
+  const auto bsc_s = m2::Find(params, "baseline-correction", "None"s, pMap);
+  const auto bsc_hw = m2::Find(params, "baseline-correction-hw", int(50), pMap);
+  const auto sm_s = m2::Find(params, "smoothing", "None"s, pMap);
+  const auto sm_hw = m2::Find(params, "smoothing-hw", int(2), pMap);
+  const auto norm = m2::Find(params, "normalization", "None"s, pMap);
+  const auto transform = m2::Find(params, "intensity-transformation", "None"s, pMap);
+  const auto pool = m2::Find(params, "pooling", "Maximum"s, pMap);
+  const auto tol = m2::Find(params, "tolerance", double(10), pMap);
+  const auto tol_ppm = m2::Find(params, "tolerance-ppm", bool(true), pMap);
+  const auto threads = m2::Find(params, "threads", int(itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads()), pMap);
+
+  if (argsMap.find("parameterfile") == argsMap.end())
+  {
+    try
+    {
+      using namespace itksys;
+      auto cwd = SystemTools::GetCurrentWorkingDirectory();
+      auto path = SystemTools::ConvertToOutputPath(SystemTools::JoinPath({cwd, "/m2IonImageExport.txt.sample"}));
+      std::ofstream ofs(path);
+      for (auto kv : pMap)
+      {
+        ofs << "(" << kv.first << " " << kv.second << ")\n";
+      }
+      MITK_INFO << "A dummy parameter file was written to " << path;
+      return 0;
+    }
+    catch (std::exception &e)
+    {
+      MITK_INFO << "Error on writing a dummy parameter file! " << e.what();
+      return 2;
+    }
+  }
+
+  for (auto kv : argsMap)
+  {
+    MITK_INFO << kv.first << " " << kv.second.ToString();
+  }
+
+  const auto outputPath = argsMap["output"].ToString();
+  const auto extension = itksys::SystemTools::LowerCase(itksys::SystemTools::GetFilenameLastExtension(outputPath));
+  if (extension != ".npy" && extension != ".nrrd")
+  {
+    MITK_ERROR << "The output file must be a NumPy (.npy) or NRRD (.nrrd) file!";
+    return 1;
+  }
+
+  try
+  {
+    const auto start = std::chrono::steady_clock::now();
+    auto image = mitk::IOUtil::Load(argsMap["input"].ToString()).front();
+    auto imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(image.GetPointer());
+    if (!imzMLImage)
+    {
+      MITK_ERROR << "The input is not an imzML file!";
+      return 1;
+    }
+
+    imzMLImage->SetBaselineCorrectionStrategy(static_cast<m2::BaselineCorrectionType>(m2::BASECOR_MAPPINGS.at(bsc_s)));
+    imzMLImage->SetBaseLineCorrectionHalfWindowSize(bsc_hw);
+    imzMLImage->SetSmoothingStrategy(static_cast<m2::SmoothingType>(m2::SMOOTHING_MAPPINGS.at(sm_s)));
+    imzMLImage->SetSmoothingHalfWindowSize(sm_hw);
+    imzMLImage->SetNormalizationStrategy(
+      static_cast<m2::NormalizationStrategyType>(m2::NORMALIZATION_MAPPINGS.at(norm)));
+    imzMLImage->SetIntensityTransformationStrategy(
+      static_cast<m2::IntensityTransformationType>(m2::INTENSITYTRANSFORMATION_MAPPINGS.at(transform)));
+    imzMLImage->SetRangePoolingStrategy(static_cast<m2::RangePoolingStrategyType>(m2::POOLING_MAPPINGS.at(pool)));
+    imzMLImage->SetTolerance(tol);
+    imzMLImage->SetUseToleranceInPPM(tol_ppm);
+    imzMLImage->SetNumberOfThreads(threads);
+    imzMLImage->InitializeImageAccess();
+
+    const auto ranges = ReadCentroids(argsMap["centroids"].ToString(), imzMLImage);
+    if (ranges.empty())
+    {
+      MITK_ERROR << "No centroids found in " << argsMap["centroids"].ToString();
+      return 1;
+    }
+
+    mitk::Image::Pointer mask;
+    if (argsMap.find("mask") != argsMap.end())
+      mask = ReadMask(argsMap["mask"].ToString(), imzMLImage);
+
+    size_t numberOfSpectra = imzMLImage->GetSpectra().size();
+    if (mask)
+    {
+      mitk::ImagePixelReadAccessor<mitk::Label::PixelType, 3> maskAccess(mask);
+      numberOfSpectra = std::count_if(imzMLImage->GetSpectra().begin(),
+                                      imzMLImage->GetSpectra().end(),
+                                      [&](const auto &s) { return maskAccess.GetPixelByIndex(s.index) != 0; });
+    }
+
+    const auto *dims = imzMLImage->GetDimensions();
+    const size_t pixels = size_t(dims[0]) * dims[1] * dims[2];
+    std::vector<float> data(ranges.size() * pixels);
+
+    MITK_INFO << "Generate " << ranges.size() << " ion images from " << numberOfSpectra << " spectra...";
+    {
+      boost::progress_display show_progress(numberOfSpectra);
+      imzMLImage->GetImageArrayFloat(ranges,
+                                     mask,
+                                     data.data(),
+                                     imzMLImage->GetProcessingParameters(),
+                                     threads,
+                                     [&show_progress](unsigned int n) { show_progress += n; });
+    }
+
+    if (extension == ".npy")
+    {
+      // C order (ions, [z,] y, x)
+      std::vector<unsigned long> shape = {(unsigned long)ranges.size()};
+      if (dims[2] > 1)
+        shape.push_back(dims[2]);
+      shape.push_back(dims[1]);
+      shape.push_back(dims[0]);
+      npy::SaveArrayAsNumpy(outputPath, false, shape.size(), shape.data(), data);
+    }
+    else
+    {
+      // one time step per ion, with the geometry of the spectrum image
+      auto output = mitk::Image::New();
+      output->Initialize(mitk::MakeScalarPixelType<float>(), *imzMLImage->GetGeometry(), 1, ranges.size());
+      for (unsigned int k = 0; k < ranges.size(); ++k)
+        output->SetImportVolume(data.data() + k * pixels, k, 0, mitk::Image::CopyMemory);
+      mitk::IOUtil::Save(output, outputPath);
+    }
+
+    // channel order of the output
+    auto channelsPath = itksys::SystemTools::GetFilenameWithoutLastExtension(outputPath) + "_channels.csv";
+    const auto directory = itksys::SystemTools::GetFilenamePath(outputPath);
+    if (!directory.empty())
+      channelsPath = directory + "/" + channelsPath;
+    std::ofstream channels(channelsPath);
+    channels << "channel,center,tolerance\n";
+    for (size_t k = 0; k < ranges.size(); ++k)
+      channels << k << "," << ranges[k].first << "," << ranges[k].second << "\n";
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    MITK_INFO << "Wrote " << outputPath << " in " << elapsed.count() << " s";
+  }
+  catch (std::exception &e)
+  {
+    MITK_ERROR << e.what();
+    return 1;
+  }
+  return 0;
+}
+
+std::map<std::string, us::Any> CommandlineParsing(int argc, char *argv[])
+{
+  mitkCommandLineParser parser;
+  parser.setArgumentPrefix("--", "-");
+  // required params
+  parser.addArgument("input",
+                     "i",
+                     mitkCommandLineParser::Image,
+                     "Input imzML Image",
+                     "Path to the input imzML",
+                     us::Any(),
+                     false,
+                     false,
+                     false,
+                     mitkCommandLineParser::Input);
+  parser.addArgument("centroids",
+                     "c",
+                     mitkCommandLineParser::File,
+                     "Centroid list",
+                     "CSV file with one ion per row and the centers in the first column (e.g. an exported "
+                     "centroid list). An optional 'tolerance' column overrides the tolerance parameter.",
+                     us::Any(),
+                     false,
+                     false,
+                     false,
+                     mitkCommandLineParser::Input);
+  parser.addArgument("parameterfile",
+                     "p",
+                     mitkCommandLineParser::File,
+                     "Parameter file",
+                     "A dummy parameter file can be generated by calling the app without any arguments.",
+                     us::Any(),
+                     false,
+                     false,
+                     false,
+                     mitkCommandLineParser::Input);
+  parser.addArgument("output",
+                     "o",
+                     mitkCommandLineParser::File,
+                     "Output file",
+                     "Path to the output file (.npy or .nrrd). The channel order is written to <output>_channels.csv.",
+                     us::Any(),
+                     false,
+                     false,
+                     false,
+                     mitkCommandLineParser::Output);
+  parser.addArgument("mask",
+                     "m",
+                     mitkCommandLineParser::Image,
+                     "Mask image",
+                     "Optional label image with the size of the input; only spectra of labeled pixels are processed.",
+                     us::Any(),
+                     true,
+                     false,
+                     false,
+                     mitkCommandLineParser::Input);
+
+  // Miniapp Infos
+  parser.setCategory("M2aia Tools");
+  parser.setTitle("Ion image export");
+  parser.setDescription("Reads an imzML file and exports the ion images of a centroid list in a single pass over "
+                        "the data. https://m2aia.de (https://bio.tools/m2aia)");
+  parser.setContributor("Jonas Cordes");
+
+  auto parsedArgs = parser.parseArguments(argc, argv);
+  if (parsedArgs.size() == 0)
+  {
+    exit(EXIT_SUCCESS);
+  }
+
+  return parsedArgs;
+}
@@ -78,7 +78,9 @@ int main(int /*argc*/, char *argv[])
       return (p.GetX() > 900 && p.GetX() < 3000);
     });
 
-    imagePeaks[I.GetPointer()] = m2::Signal::monoisotopic(peaks, {3, 4, 5, 6, 7, 8, 9, 10}, 0.40);
+    // N-glycans are detected as singly charged ions
+    imagePeaks[I.GetPointer()] =
+      m2::Signal::monoisotopic(peaks, {3, 4, 5, 6, 7, 8, 9, 10}, 0.40, 1e-4, 1.00235, 1, I->GetNumberOfThreads());
     MITK_INFO << I->GetImzMLSpectrumImageSource().m_ImzMLDataPath << " monoisotopic peaks found "
               << imagePeaks[I.GetPointer()].size();
   }
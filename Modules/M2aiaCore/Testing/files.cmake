@@ -1,7 +1,22 @@
 set(MODULE_TESTS
   m2FSMImageIOTest.cpp
   m2ImzMLImageIOTest.cpp
+  m2IonImageCacheTest.cpp
   m2CoreMappingsTest.cpp
   m2ElxUtilTest.cpp
+  m2SignalFusedPipelineTest.cpp
   m2SignalGroupBinningTest.cpp
+  m2SignalIsotopeTest.cpp
+  m2SignalKernelsTest.cpp
+  m2SignalSubrangeTest.cpp
+  m2SignalToleranceBinningTest.cpp
+  m2SparseSpectrumCubeTest.cpp
+  m2SpectrumReadSchedulerTest.cpp
 )
+
+# timings only, not run by default
+if(M2AIA_BUILD_BENCHMARKS)
+  list(APPEND MODULE_TESTS
+    m2SignalKernelsBenchmark.cpp
+  )
+endif()
@@ -116,6 +116,8 @@ private:
       case m2::NumericType::None:
       case m2::NumericType::Float:
       case m2::NumericType::Double:
+      case m2::NumericType::Int32:
+      case m2::NumericType::Int64:
 
         // add your new case here
         {
@@ -16,13 +16,21 @@ See LICENSE.txt for details.
 
 #include "mitkIOUtil.h"
 #include <algorithm>
+#include <cmath>
+#include <itksys/SystemTools.hxx>
 #include <signal/m2Normalization.h>
+#include <m2ImzMLImageIO.h>
 #include <m2ImzMLSpectrumImage.h>
+#include <m2ImzMLSpectrumImageView.h>
+#include <m2ShuffledSpectrumIterator.h>
 #include <m2TestingConfig.h>
 #include <m2TestFixture.h>
+#include <mitkImagePixelReadAccessor.h>
+#include <mitkImagePixelWriteAccessor.h>
 #include <mitkTestingMacros.h>
 #include <numeric>
 #include <random>
+#include <thread>
 
 //#include <boost/algorithm/string.hpp>
 
@@ -31,10 +39,27 @@ class m2ImzMLImageIOTestSuite : public m2::TestFixture
   CPPUNIT_TEST_SUITE(m2ImzMLImageIOTestSuite);
   MITK_TEST(LoadTestData_shouldReturnTrue);
   MITK_TEST(InitializeImageAccess_shouldReturnTrue);
+  MITK_TEST(WriteRead_AllValueTypes_shouldPreserveSpectra);
+  MITK_TEST(GetImage_Region_shouldOnlyWriteRegion);
+  MITK_TEST(GetImage_Progressive_shouldConvergeToFullImage);
+  MITK_TEST(GetImages_shouldEqualGetImage);
+  MITK_TEST(GetImage_Cancelled_shouldNotReadSpectra);
+  MITK_TEST(GetSpectraBatch_shouldEqualGetSpectrum);
+  MITK_TEST(GetImageArray_shouldEqualGetImage);
+  MITK_TEST(View_shouldFreezeProcessing);
+  MITK_TEST(ShuffledSpectrumIterator_shouldVisitEachSpectrumOnce);
 
   CPPUNIT_TEST_SUITE_END();
 
 private:
+  static void DisableProcessing(m2::ImzMLSpectrumImage *image)
+  {
+    image->SetNormalizationStrategy(m2::NormalizationStrategyType::None);
+    image->SetBaselineCorrectionStrategy(m2::BaselineCorrectionType::None);
+    image->SetSmoothingStrategy(m2::SmoothingType::None);
+    image->InitializeImageAccess();
+  }
+
   std::vector<double> ReadDoubleVector(const std::string &fileNameInM2aiaDir, char delim = '\n')
   {
     std::vector<double> signal;
@@ -90,6 +115,362 @@ public:
     CPPUNIT_ASSERT_EQUAL(true, equal(begin(ints), end(ints), begin(reference)));
 	
   }
+
+  void WriteRead_AllValueTypes_shouldPreserveSpectra()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    DisableProcessing(imzMLImage);
+
+    std::vector<float> referenceMzs, referenceInts;
+    imzMLImage->GetSpectrumFloat(0, referenceMzs, referenceInts);
+
+    const auto directory = mitk::IOUtil::CreateTemporaryDirectory();
+    {
+      // a normalized integer export would be rounded to zero
+      imzMLImage->SetNormalizationStrategy(m2::NormalizationStrategyType::TIC);
+      m2::ImzMLImageIO io;
+      io.SetInput(imzMLImage);
+      io.SetOutputLocation(directory + "/lipid_tic.imzML");
+      io.SetSpectrumFormat(m2::SpectrumFormat::ContinuousProfile);
+      io.SetDataTypeXAxis(m2::NumericType::Float);
+      io.SetDataTypeYAxis(m2::NumericType::Int32);
+      CPPUNIT_ASSERT_THROW(io.Write(), mitk::Exception);
+      DisableProcessing(imzMLImage);
+    }
+
+    for (auto xType : {m2::NumericType::Float, m2::NumericType::Double})
+    {
+      for (auto yType : {m2::NumericType::Float, m2::NumericType::Double, m2::NumericType::Int32, m2::NumericType::Int64})
+      {
+        const auto path = directory + "/lipid_" + m2::to_string(xType) + "_" + m2::to_string(yType) + ".imzML";
+
+        m2::ImzMLImageIO io;
+        io.SetInput(imzMLImage);
+        io.SetOutputLocation(path);
+        io.SetSpectrumFormat(m2::SpectrumFormat::ContinuousProfile);
+        io.SetDataTypeXAxis(xType);
+        io.SetDataTypeYAxis(yType);
+
+        // integer intensities are only written if the source intensities are integers
+        const bool isInteger = yType == m2::NumericType::Int32 || yType == m2::NumericType::Int64;
+        const auto sourceType = imzMLImage->GetSpectrumType().YAxisType;
+        if (isInteger && sourceType != m2::NumericType::Int32 && sourceType != m2::NumericType::Int64)
+        {
+          CPPUNIT_ASSERT_THROW(io.Write(), mitk::Exception);
+          continue;
+        }
+        io.Write();
+
+        auto result = mitk::IOUtil::Load(path);
+        m2::ImzMLSpectrumImage::Pointer image = dynamic_cast<m2::ImzMLSpectrumImage *>(result.back().GetPointer());
+        CPPUNIT_ASSERT(image != nullptr);
+        CPPUNIT_ASSERT(image->GetSpectrumType().XAxisType == xType);
+        CPPUNIT_ASSERT(image->GetSpectrumType().YAxisType == yType);
+        DisableProcessing(image);
+
+        std::vector<float> mzs, ints;
+        image->GetSpectrumFloat(0, mzs, ints);
+        CPPUNIT_ASSERT_EQUAL(referenceMzs.size(), mzs.size());
+        CPPUNIT_ASSERT_EQUAL(referenceInts.size(), ints.size());
+        CPPUNIT_ASSERT(std::equal(std::begin(mzs), std::end(mzs), std::begin(referenceMzs)));
+
+        CPPUNIT_ASSERT(std::equal(std::begin(ints), std::end(ints), std::begin(referenceInts)));
+      }
+    }
+    itksys::SystemTools::RemoveADirectory(directory);
+  }
+
+  void GetImage_Region_shouldOnlyWriteRegion()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    DisableProcessing(imzMLImage);
+
+    const auto mz = imzMLImage->GetXAxis()[imzMLImage->GetXAxis().size() / 2];
+    const auto tol = imzMLImage->ApplyTolerance(mz);
+
+    auto reference = mitk::Image::New();
+    reference->Initialize(imzMLImage);
+    imzMLImage->GetImage(mz, tol, nullptr, reference);
+
+    const auto *dims = imzMLImage->GetDimensions();
+    itk::ImageRegion<3> region;
+    itk::Index<3> start;
+    start[0] = dims[0] / 4;
+    start[1] = dims[1] / 4;
+    start[2] = 0;
+    region.SetIndex(start);
+    region.SetSize({dims[0] / 2, dims[1] / 2, dims[2]});
+    m2::IonImageOptions options;
+    options.SetRegion(region);
+
+    auto image = mitk::Image::New();
+    image->Initialize(imzMLImage);
+    {
+      mitk::ImagePixelWriteAccessor<m2::DisplayImagePixelType, 3> acc(image);
+      std::fill(acc.GetData(), acc.GetData() + dims[0] * dims[1] * dims[2], -1);
+    }
+    imzMLImage->GetImage(mz, tol, nullptr, image, options);
+
+    mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> referenceAccess(reference);
+    mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> imageAccess(image);
+    for (const auto &spectrum : imzMLImage->GetSpectra())
+    {
+      const auto expected = region.IsInside(spectrum.index) ? referenceAccess.GetPixelByIndex(spectrum.index) : -1.0;
+      CPPUNIT_ASSERT_EQUAL(expected, imageAccess.GetPixelByIndex(spectrum.index));
+    }
+  }
+
+  void GetImage_Progressive_shouldConvergeToFullImage()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    DisableProcessing(imzMLImage);
+
+    const auto mz = imzMLImage->GetXAxis()[imzMLImage->GetXAxis().size() / 2];
+    const auto tol = imzMLImage->ApplyTolerance(mz);
+
+    auto reference = mitk::Image::New();
+    reference->Initialize(imzMLImage);
+    imzMLImage->GetImage(mz, tol, nullptr, reference);
+    mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> referenceAccess(reference);
+
+    auto image = mitk::Image::New();
+    image->Initialize(imzMLImage);
+    unsigned int previousStride = 0;
+    for (unsigned int stride : {8u, 4u, 2u, 1u})
+    {
+      m2::IonImageOptions options;
+      options.Stride = stride;
+      options.PreviousStride = previousStride;
+      options.FillNearest = true;
+      imzMLImage->GetImage(mz, tol, nullptr, image, options);
+      previousStride = stride;
+
+      // every pass is a complete image: grid pixels are exact, all others are copies of their grid pixel
+      mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> imageAccess(image);
+      for (const auto &spectrum : imzMLImage->GetSpectra())
+      {
+        const auto gridIndex = options.GetGridIndex(spectrum.index);
+        CPPUNIT_ASSERT_EQUAL(referenceAccess.GetPixelByIndex(gridIndex), imageAccess.GetPixelByIndex(spectrum.index));
+      }
+    }
+  }
+
+  void GetImages_shouldEqualGetImage()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    DisableProcessing(imzMLImage);
+
+    const auto &xs = imzMLImage->GetXAxis();
+    std::vector<std::pair<double, double>> ranges;
+    for (auto i : {xs.size() / 3, xs.size() / 2, xs.size() / 2 + 1})
+      ranges.emplace_back(xs[i], imzMLImage->ApplyTolerance(xs[i]));
+
+    std::vector<mitk::Image::Pointer> images;
+    std::vector<mitk::Image *> targets;
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+      images.push_back(mitk::Image::New());
+      images.back()->Initialize(imzMLImage);
+      targets.push_back(images.back());
+    }
+    imzMLImage->GetImages(ranges, nullptr, targets);
+
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+      auto reference = mitk::Image::New();
+      reference->Initialize(imzMLImage);
+      imzMLImage->GetImage(ranges[i].first, ranges[i].second, nullptr, reference);
+
+      mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> referenceAccess(reference);
+      mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> imageAccess(images[i]);
+      for (const auto &spectrum : imzMLImage->GetSpectra())
+        CPPUNIT_ASSERT_EQUAL(referenceAccess.GetPixelByIndex(spectrum.index), imageAccess.GetPixelByIndex(spectrum.index));
+    }
+  }
+
+  void GetImage_Cancelled_shouldNotReadSpectra()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    DisableProcessing(imzMLImage);
+
+    const auto mz = imzMLImage->GetXAxis()[imzMLImage->GetXAxis().size() / 2];
+    m2::IonImageOptions options;
+    options.Cancelled = []() { return true; };
+
+    auto image = mitk::Image::New();
+    image->Initialize(imzMLImage);
+    imzMLImage->GetImage(mz, imzMLImage->ApplyTolerance(mz), nullptr, image, options);
+
+    // the image is reset, but no spectrum was processed
+    mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> imageAccess(image);
+    for (const auto &spectrum : imzMLImage->GetSpectra())
+      CPPUNIT_ASSERT_EQUAL(0.0, imageAccess.GetPixelByIndex(spectrum.index));
+  }
+
+  void GetSpectraBatch_shouldEqualGetSpectrum()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    imzMLImage->SetNormalizationStrategy(m2::NormalizationStrategyType::TIC);
+    imzMLImage->SetSmoothingStrategy(m2::SmoothingType::Gaussian);
+    imzMLImage->InitializeImageAccess();
+
+    // unordered, with a duplicated id
+    const auto n = (unsigned int)imzMLImage->GetSpectra().size();
+    const std::vector<unsigned int> ids = {n - 1, 0, n / 2, 0, 3};
+    std::vector<size_t> lengths;
+    const auto channels = imzMLImage->GetSpectraBatchChannels(ids, &lengths);
+    CPPUNIT_ASSERT_EQUAL(ids.size(), lengths.size());
+
+    for (unsigned int threads : {1u, 4u})
+    {
+      std::vector<float> xs(ids.size() * channels), ys(ids.size() * channels);
+      imzMLImage->GetSpectraBatchFloat(ids, channels, xs.data(), ys.data(), true, threads);
+
+      std::vector<float> mzs, ints;
+      for (size_t i = 0; i < ids.size(); ++i)
+      {
+        imzMLImage->GetSpectrumFloat(ids[i], mzs, ints);
+        CPPUNIT_ASSERT_EQUAL(lengths[i], ints.size());
+        CPPUNIT_ASSERT(std::equal(std::begin(ints), std::end(ints), std::begin(ys) + i * channels));
+        CPPUNIT_ASSERT(std::equal(std::begin(mzs), std::end(mzs), std::begin(xs) + i * channels));
+      }
+    }
+
+    // unprocessed, truncated rows
+    DisableProcessing(imzMLImage);
+    std::vector<double> ys(ids.size() * 10);
+    imzMLImage->GetSpectraBatch(ids, 10, nullptr, ys.data(), false);
+    std::vector<double> ints;
+    imzMLImage->GetIntensities(ids[2], ints);
+    CPPUNIT_ASSERT(std::equal(std::begin(ints), std::begin(ints) + 10, std::begin(ys) + 20));
+  }
+
+  void GetImageArray_shouldEqualGetImage()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    imzMLImage->SetNormalizationStrategy(m2::NormalizationStrategyType::TIC);
+    imzMLImage->SetSmoothingStrategy(m2::SmoothingType::Gaussian);
+    imzMLImage->SetBaselineCorrectionStrategy(m2::BaselineCorrectionType::TopHat);
+    imzMLImage->InitializeImageAccess();
+
+    // overlapping ranges and a range close to the start of the spectrum (short padding)
+    const auto &xs = imzMLImage->GetXAxis();
+    std::vector<std::pair<double, double>> ranges;
+    for (auto i : {xs.size() / 2, size_t(2), xs.size() / 3, xs.size() / 2 + 1})
+      ranges.emplace_back(xs[i], imzMLImage->ApplyTolerance(xs[i]));
+
+    const auto *dims = imzMLImage->GetDimensions();
+    const size_t pixels = size_t(dims[0]) * dims[1] * dims[2];
+    std::vector<double> data(ranges.size() * pixels, -1);
+    imzMLImage->GetImageArray(ranges, nullptr, data.data(), 4);
+
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+      auto reference = mitk::Image::New();
+      reference->Initialize(imzMLImage);
+      imzMLImage->GetImage(ranges[i].first, ranges[i].second, nullptr, reference);
+
+      mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> referenceAccess(reference);
+      const auto *expected = referenceAccess.GetData();
+      CPPUNIT_ASSERT(std::equal(expected, expected + pixels, std::begin(data) + i * pixels));
+    }
+  }
+
+  void View_shouldFreezeProcessing()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    imzMLImage->SetNormalizationStrategy(m2::NormalizationStrategyType::TIC);
+    imzMLImage->SetSmoothingStrategy(m2::SmoothingType::Gaussian);
+    imzMLImage->InitializeImageAccess();
+
+    const auto n = (unsigned int)imzMLImage->GetSpectra().size();
+    std::vector<std::vector<float>> expected(n);
+    for (unsigned int id = 0; id < n; ++id)
+      imzMLImage->GetIntensitiesFloat(id, expected[id]);
+
+    const m2::ImzMLSpectrumImageView view(imzMLImage);
+    DisableProcessing(imzMLImage);
+
+    // each thread reads all spectra with its own clone, in a different order
+    const unsigned int threads = 4;
+    std::vector<int> equal(threads, 0);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; ++t)
+      workers.emplace_back(
+        [&, t](m2::ImzMLSpectrumImageView clone)
+        {
+          std::vector<float> ints;
+          bool ok = true;
+          for (unsigned int i = 0; i < n; ++i)
+          {
+            const auto id = (i + t * n / threads) % n;
+            clone.GetIntensitiesFloat(id, ints);
+            ok = ok && ints == expected[id];
+          }
+          equal[t] = ok;
+        },
+        view.Clone());
+    for (auto &w : workers)
+      w.join();
+    CPPUNIT_ASSERT(std::all_of(std::begin(equal), std::end(equal), [](int ok) { return ok; }));
+
+    // the image itself uses the new settings
+    std::vector<float> ints;
+    imzMLImage->GetIntensitiesFloat(0, ints);
+    CPPUNIT_ASSERT(ints != expected[0]);
+  }
+
+  void ShuffledSpectrumIterator_shouldVisitEachSpectrumOnce()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer imzMLImage = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    imzMLImage->SetSmoothingStrategy(m2::SmoothingType::Gaussian);
+    imzMLImage->InitializeImageAccess();
+    const m2::ImzMLSpectrumImageView view(imzMLImage);
+    const auto n = view.GetNumberOfSpectra();
+
+    m2::ShuffledSpectrumIterator::Options options;
+    options.Seed = 7;
+    options.BlockSize = 8;
+    options.BufferSize = 32;
+
+    const auto Epoch = [&](unsigned int threads, unsigned int epoch)
+    {
+      options.Threads = threads;
+      m2::ShuffledSpectrumIterator iterator(view, options);
+      iterator.StartEpoch(epoch);
+      std::vector<unsigned int> order;
+      m2::ShuffledSpectrumIterator::Spectrum spectrum;
+      std::vector<float> expected;
+      while (iterator.Next(spectrum))
+      {
+        view.GetIntensitiesFloat(spectrum.Id, expected);
+        CPPUNIT_ASSERT(spectrum.YValues == expected);
+        order.push_back(spectrum.Id);
+      }
+      CPPUNIT_ASSERT_EQUAL(epoch + 1, iterator.GetEpoch());
+      return order;
+    };
+
+    const auto order = Epoch(1, 0);
+    auto sorted = order;
+    std::sort(std::begin(sorted), std::end(sorted));
+    std::vector<unsigned int> all(n);
+    std::iota(std::begin(all), std::end(all), 0);
+    CPPUNIT_ASSERT(sorted == all);
+
+    // the order depends on seed and epoch only
+    CPPUNIT_ASSERT(order == Epoch(4, 0));
+    CPPUNIT_ASSERT(order != Epoch(4, 1));
+  }
 };
 
 MITK_TEST_SUITE_REGISTRATION(m2ImzMLImageIO)
@@ -0,0 +1,194 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <cppunit/TestAssert.h>
+#include <m2ImzMLSpectrumImage.h>
+#include <m2IonImageCache.h>
+#include <m2TestFixture.h>
+#include <m2TestingConfig.h>
+#include <mitkIOUtil.h>
+#include <mitkImagePixelReadAccessor.h>
+#include <mitkImagePixelWriteAccessor.h>
+#include <mitkTestingMacros.h>
+
+class m2IonImageCacheTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2IonImageCacheTestSuite);
+  MITK_TEST(Get_shouldReturnInsertedImage);
+  MITK_TEST(Insert_OverCapacity_shouldEvictLeastRecentlyUsed);
+  MITK_TEST(Get_Spilled_shouldRestoreImage);
+  MITK_TEST(Key_DifferentState_shouldMiss);
+  MITK_TEST(Get_DifferentSize_shouldMissAndDropEntry);
+  MITK_TEST(InitializeImageAccess_shouldInvalidateCache);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  static constexpr unsigned int N = 32;
+  static constexpr size_t ImageBytes = N * N * sizeof(m2::DisplayImagePixelType);
+
+  static mitk::Image::Pointer CreateImage(double value)
+  {
+    auto image = mitk::Image::New();
+    unsigned int dims[3] = {N, N, 1};
+    image->Initialize(mitk::MakeScalarPixelType<m2::DisplayImagePixelType>(), 3, dims);
+    mitk::ImagePixelWriteAccessor<m2::DisplayImagePixelType, 3> access(image);
+    for (unsigned int i = 0; i < N * N; ++i)
+      access.GetData()[i] = value + i;
+    return image;
+  }
+
+  static bool Equal(const mitk::Image *a, const mitk::Image *b)
+  {
+    mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> accessA(a), accessB(b);
+    return std::equal(accessA.GetData(), accessA.GetData() + N * N, accessB.GetData());
+  }
+
+  static m2::IonImageCacheKey Key(double mz)
+  {
+    m2::IonImageCacheKey key;
+    key.mz = mz;
+    key.tol = 0.1;
+    return key;
+  }
+
+public:
+  void Get_shouldReturnInsertedImage()
+  {
+    m2::IonImageCache cache(4 * ImageBytes);
+    auto image = CreateImage(1);
+    auto target = CreateImage(0);
+    CPPUNIT_ASSERT(!cache.Get(Key(100), target));
+    cache.Insert(Key(100), image);
+    CPPUNIT_ASSERT(cache.Contains(Key(100)));
+    CPPUNIT_ASSERT(cache.Get(Key(100), target));
+    CPPUNIT_ASSERT(Equal(image, target));
+
+    const auto statistics = cache.GetStatistics();
+    CPPUNIT_ASSERT_EQUAL(1ull, statistics.hits);
+    CPPUNIT_ASSERT_EQUAL(1ull, statistics.misses);
+    CPPUNIT_ASSERT_EQUAL(ImageBytes, statistics.bytes);
+  }
+
+  void Insert_OverCapacity_shouldEvictLeastRecentlyUsed()
+  {
+    m2::IonImageCache cache(2 * ImageBytes);
+    auto target = CreateImage(0);
+    cache.Insert(Key(100), CreateImage(1));
+    cache.Insert(Key(200), CreateImage(2));
+    CPPUNIT_ASSERT(cache.Get(Key(100), target)); // 200 is now the least recently used
+    cache.Insert(Key(300), CreateImage(3));
+
+    CPPUNIT_ASSERT(cache.Contains(Key(100)));
+    CPPUNIT_ASSERT(!cache.Contains(Key(200)));
+    CPPUNIT_ASSERT(cache.Contains(Key(300)));
+    CPPUNIT_ASSERT_EQUAL(1ull, cache.GetStatistics().evictions);
+    CPPUNIT_ASSERT(cache.GetStatistics().bytes <= cache.GetCapacity());
+
+    cache.SetCapacity(0);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), cache.GetStatistics().entries);
+  }
+
+  void Get_Spilled_shouldRestoreImage()
+  {
+    m2::IonImageCache cache(ImageBytes, 4 * ImageBytes);
+    auto first = CreateImage(1);
+    cache.Insert(Key(100), first);
+    cache.Insert(Key(200), CreateImage(2));
+
+    auto statistics = cache.GetStatistics();
+    CPPUNIT_ASSERT_EQUAL(1ull, statistics.spills);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), statistics.spilledEntries);
+    CPPUNIT_ASSERT(cache.Contains(Key(100)));
+
+    // restored into memory, which spills the other image
+    auto target = CreateImage(0);
+    CPPUNIT_ASSERT(cache.Get(Key(100), target));
+    CPPUNIT_ASSERT(Equal(first, target));
+    statistics = cache.GetStatistics();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), statistics.entries);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), statistics.spilledEntries);
+    CPPUNIT_ASSERT(cache.Contains(Key(200)));
+
+    cache.Clear();
+    CPPUNIT_ASSERT(!cache.Contains(Key(100)));
+    CPPUNIT_ASSERT(!cache.Contains(Key(200)));
+    CPPUNIT_ASSERT_EQUAL(size_t(0), cache.GetStatistics().spilledBytes);
+  }
+
+  void Key_DifferentState_shouldMiss()
+  {
+    m2::IonImageCache cache(4 * ImageBytes);
+    auto key = Key(100);
+    cache.Insert(key, CreateImage(1));
+
+    auto target = CreateImage(0);
+    auto other = key;
+    other.state = 1;
+    CPPUNIT_ASSERT(!cache.Get(other, target));
+    other = key;
+    other.pooling = m2::RangePoolingStrategyType::Mean;
+    CPPUNIT_ASSERT(!cache.Get(other, target));
+    CPPUNIT_ASSERT(cache.Get(key, target));
+  }
+
+  void Get_DifferentSize_shouldMissAndDropEntry()
+  {
+    m2::IonImageCache cache(4 * ImageBytes);
+    cache.Insert(Key(100), CreateImage(1));
+
+    auto target = mitk::Image::New();
+    unsigned int dims[3] = {N / 2, N, 1};
+    target->Initialize(mitk::MakeScalarPixelType<m2::DisplayImagePixelType>(), 3, dims);
+    CPPUNIT_ASSERT(!cache.Get(Key(100), target));
+    CPPUNIT_ASSERT(!cache.Contains(Key(100)));
+
+    const auto statistics = cache.GetStatistics();
+    CPPUNIT_ASSERT_EQUAL(0ull, statistics.hits);
+    CPPUNIT_ASSERT_EQUAL(1ull, statistics.misses);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), statistics.bytes);
+  }
+
+  void InitializeImageAccess_shouldInvalidateCache()
+  {
+    auto v = mitk::IOUtil::Load(GetTestDataFilePath("lipid.imzML", M2AIA_DATA_DIR));
+    m2::ImzMLSpectrumImage::Pointer image = dynamic_cast<m2::ImzMLSpectrumImage *>(v.back().GetPointer());
+    image->SetNormalizationStrategy(m2::NormalizationStrategyType::TIC);
+    image->InitializeImageAccess();
+
+    const auto mz = image->GetXAxis()[image->GetXAxis().size() / 2];
+    const auto tol = image->ApplyTolerance(mz);
+    auto ionImage = mitk::Image::New();
+    ionImage->Initialize(image);
+    image->GetImage(mz, tol, nullptr, ionImage);
+
+    auto target = mitk::Image::New();
+    target->Initialize(image);
+    image->InsertImageIntoCache(mz, tol, nullptr, ionImage);
+    CPPUNIT_ASSERT(image->GetImageFromCache(mz, tol, nullptr, target));
+
+    // the content of the normalization image changed
+    image->GetNormalizationImage()->Modified();
+    CPPUNIT_ASSERT(!image->GetImageFromCache(mz, tol, nullptr, target));
+
+    image->InsertImageIntoCache(mz, tol, nullptr, ionImage);
+    CPPUNIT_ASSERT(image->GetImageFromCache(mz, tol, nullptr, target));
+    image->InitializeImageAccess();
+    CPPUNIT_ASSERT(!image->GetImageFromCache(mz, tol, nullptr, target));
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2IonImageCache)
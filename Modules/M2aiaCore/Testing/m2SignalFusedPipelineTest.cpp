@@ -0,0 +1,138 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <cmath>
+#include <cppunit/TestAssert.h>
+#include <m2TestFixture.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2Baseline.h>
+#include <signal/m2FusedPipeline.h>
+#include <signal/m2Pooling.h>
+#include <signal/m2Smoothing.h>
+#include <signal/m2Transformer.h>
+
+class m2SignalFusedPipelineTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SignalFusedPipelineTestSuite);
+  MITK_TEST(FusedPipeline_Float_EqualsChain);
+  MITK_TEST(FusedPipeline_Double_EqualsChain);
+  MITK_TEST(FusedPipeline_UnsupportedConfiguration);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  // the processing of the profile branch of ImzMLSpectrumImageSource::GetImagePrivate
+  template <class T>
+  static T Chain(std::vector<T> ints,
+                 size_t first,
+                 size_t last,
+                 T norm,
+                 bool normalize,
+                 m2::Signal::SmoothingFunctor<T> &smoother,
+                 m2::Signal::BaselineFunctor<T> &baseline,
+                 m2::Signal::IntensityTransformationFunctor<T> &transformer,
+                 m2::RangePoolingStrategyType pooling)
+  {
+    std::vector<T> b(ints.size());
+    if (normalize)
+      std::transform(std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
+    smoother(std::begin(ints), std::end(ints));
+    baseline(std::begin(ints), std::end(ints), std::begin(b));
+    transformer(std::begin(ints), std::end(ints));
+    return m2::Signal::RangePooling<T>(std::next(std::begin(ints), first), std::next(std::begin(ints), last), pooling);
+  }
+
+  template <class T>
+  void Compare()
+  {
+    using namespace m2;
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist(0, 1000);
+    std::uniform_real_distribution<double> normDist(0.5, 100);
+
+    const unsigned int hws = 5;
+    const size_t n = 200, first = hws, last = n - hws;
+    std::vector<std::vector<T>> spectra(20, std::vector<T>(n));
+    for (auto &s : spectra)
+      for (size_t i = 0; i < n; ++i)
+        s[i] = dist(gen) * (1 + std::sin(i / 10.0)); // baseline-like trend
+
+    for (bool normalize : {false, true})
+      for (auto smoothing : {SmoothingType::None, SmoothingType::SavitzkyGolay, SmoothingType::Gaussian})
+        for (auto baselineType : {BaselineCorrectionType::None, BaselineCorrectionType::TopHat})
+          for (auto transformation : {IntensityTransformationType::None,
+                                      IntensityTransformationType::Log10,
+                                      IntensityTransformationType::Log2,
+                                      IntensityTransformationType::SquareRoot})
+            for (auto pooling :
+                 {RangePoolingStrategyType::Sum, RangePoolingStrategyType::Mean, RangePoolingStrategyType::Maximum})
+            {
+              Signal::SmoothingFunctor<T> smoother;
+              Signal::BaselineFunctor<T> baseline;
+              Signal::IntensityTransformationFunctor<T> transformer;
+              smoother.Initialize(smoothing, 4);
+              baseline.Initialize(baselineType, hws);
+              transformer.Initialize(transformation);
+
+              Signal::FusedPipeline<T> fused;
+              CPPUNIT_ASSERT(
+                fused.Initialize(normalize, smoother.GetKernel(), baselineType, hws, transformation, pooling));
+
+              std::vector<T> ints, work(n), b(n);
+              for (const auto &s : spectra)
+              {
+                const T norm = normDist(gen);
+                const T expected =
+                  Chain(s, first, last, norm, normalize, smoother, baseline, transformer, pooling);
+                ints = s;
+                const T result = fused(ints, first, last, norm, work, b);
+
+                if (smoothing == SmoothingType::None)
+                {
+                  CPPUNIT_ASSERT_EQUAL(expected, result);
+                }
+                else
+                {
+                  double scale = 0;
+                  for (auto v : s)
+                    scale += std::abs(v) / (normalize ? norm : 1);
+                  CPPUNIT_ASSERT_DOUBLES_EQUAL(expected, result, Signal::FusedPipeline<T>::Tolerance() * scale);
+                }
+              }
+            }
+  }
+
+public:
+  void FusedPipeline_Float_EqualsChain() { Compare<float>(); }
+
+  void FusedPipeline_Double_EqualsChain() { Compare<double>(); }
+
+  void FusedPipeline_UnsupportedConfiguration()
+  {
+    using namespace m2;
+    Signal::FusedPipeline<float> fused;
+    CPPUNIT_ASSERT(!fused.Initialize(
+      true, {}, BaselineCorrectionType::Median, 5, IntensityTransformationType::None, RangePoolingStrategyType::Sum));
+    CPPUNIT_ASSERT(!fused.IsFused());
+    CPPUNIT_ASSERT(!fused.Initialize(
+      true, {}, BaselineCorrectionType::None, 5, IntensityTransformationType::None, RangePoolingStrategyType::Median));
+    CPPUNIT_ASSERT(fused.Initialize(
+      true, {}, BaselineCorrectionType::TopHat, 5, IntensityTransformationType::None, RangePoolingStrategyType::Sum));
+    CPPUNIT_ASSERT(fused.IsFused());
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SignalFusedPipeline)
@@ -30,9 +30,39 @@ class m2SignalGroupBinningTestSuite : public m2::TestFixture
   MITK_TEST(RunGroupBinning_Strict_Tol0_002);
   MITK_TEST(RunGroupBinning_Strict_Tol0_100);
   MITK_TEST(RunGroupBinning_Strict_ProcessedCentroidData);
+  MITK_TEST(RunGroupBinning_EqualsMaxElementSplitting);
 
   CPPUNIT_TEST_SUITE_END();
 
+  // splitting as before the MaxGapTree: search of the largest gap in each segment
+  template <class F>
+  static std::vector<std::pair<int, int>> ReferenceSegments(const std::vector<double> &xs,
+                                                            const std::vector<double> &ys,
+                                                            const std::vector<int> &ss,
+                                                            F f,
+                                                            double tolerance)
+  {
+    using namespace std;
+    vector<double> d(xs.size());
+    adjacent_difference(begin(xs), end(xs), begin(d));
+    d[0] = -1;
+    vector<pair<int, int>> boundary{{0, int(xs.size())}}, segments;
+    while (!boundary.empty())
+    {
+      auto [left, right] = boundary.back();
+      boundary.pop_back();
+      int gapIdx = distance(begin(d), max_element(begin(d) + left + 1, begin(d) + right));
+      for (auto c : {make_pair(left, gapIdx), make_pair(gapIdx, right)})
+      {
+        if (f(begin(xs) + c.first, begin(xs) + c.second, begin(ys) + c.first, begin(ss) + c.first, tolerance) == 0)
+          boundary.push_back(c);
+        else
+          segments.push_back(c);
+      }
+    }
+    return segments;
+  }
+
 public:
   void RunGroupBinning_Strict_ProcessedCentroidData()
   {
@@ -205,6 +235,69 @@ public:
 
     CPPUNIT_ASSERT_EQUAL(1, (int)ssNew[4].size());
   }
+
+  void RunGroupBinning_EqualsMaxElementSplitting()
+  {
+    using namespace std;
+    // fragmented data: many sources with jittered peaks at common and unique positions
+    mt19937 gen(7);
+    normal_distribution<double> jitter(0, 0.002);
+    uniform_real_distribution<double> position(100, 1000);
+    vector<double> centers(3000);
+    for (auto &c : centers)
+      c = position(gen);
+    vector<double> xs, ys;
+    vector<int> ss;
+    for (int source = 0; source < 40; ++source)
+      for (auto c : centers)
+      {
+        if (gen() % 3 == 0)
+          continue;
+        xs.push_back(c + jitter(gen));
+        ys.push_back(source + 1);
+        ss.push_back(source);
+      }
+
+    auto indices = m2::argsort(xs);
+    auto xsSorted = m2::argsortApply(xs, indices);
+    auto ysSorted = m2::argsortApply(ys, indices);
+    auto ssSorted = m2::argsortApply(ss, indices);
+
+    using dIt = std::vector<double>::const_iterator;
+    using iIt = std::vector<int>::const_iterator;
+    auto F = m2::Signal::grouperStrict<dIt, dIt, dIt, iIt>;
+
+    auto segments = ReferenceSegments(xsSorted, ysSorted, ssSorted, F, 1e-5);
+    vector<m2::Interval> expected;
+    vector<vector<int>> expectedSources;
+    for (auto [left, right] : segments)
+    {
+      m2::Interval i;
+      for (int k = left; k < right; ++k)
+      {
+        i.x(xsSorted[k]);
+        i.y(ysSorted[k]);
+      }
+      expected.push_back(i);
+      expectedSources.emplace_back(begin(ssSorted) + left, begin(ssSorted) + right);
+    }
+    auto order = m2::argsort(expected);
+    expected = m2::argsortApply(expected, order);
+    expectedSources = m2::argsortApply(expectedSources, order);
+    CPPUNIT_ASSERT(expected.size() > centers.size());
+
+    for (unsigned int threads : {1u, 4u})
+    {
+      auto [bins, sources] = m2::Signal::groupBinning(xsSorted, ysSorted, ssSorted, F, 1e-5, threads);
+      CPPUNIT_ASSERT_EQUAL(expected.size(), bins.size());
+      for (size_t i = 0; i < bins.size(); ++i)
+      {
+        CPPUNIT_ASSERT_EQUAL(expected[i].x.sum(), bins[i].x.sum());
+        CPPUNIT_ASSERT_EQUAL(expected[i].x.count(), bins[i].x.count());
+        CPPUNIT_ASSERT(expectedSources[i] == sources[i]);
+      }
+    }
+  }
 };
 
 MITK_TEST_SUITE_REGISTRATION(m2SignalGroupBinning)
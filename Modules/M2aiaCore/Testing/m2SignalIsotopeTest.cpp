@@ -0,0 +1,194 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <cppunit/TestAssert.h>
+#include <m2TestFixture.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2PeakDetection.h>
+
+class m2SignalIsotopeTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SignalIsotopeTestSuite);
+  MITK_TEST(PseudoCluster_EqualsLinearSearch);
+  MITK_TEST(Monoisotopic_EqualsLinearSearch);
+  MITK_TEST(PseudoCluster_Charge);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  // pseudoCluster as before the indexed search: linear search of the closest peak
+  static std::vector<std::vector<unsigned int>> ReferencePseudoCluster(const std::vector<double> &x,
+                                                                       unsigned int size,
+                                                                       double distance,
+                                                                       double tolerance)
+  {
+    std::vector<std::vector<unsigned int>> r;
+    for (unsigned int i = 0; i < (x.size() > size ? x.size() - size : 0); ++i)
+    {
+      bool eval = true;
+      std::vector<unsigned int> indices{i};
+      for (unsigned int s = 1; s < size && eval; ++s)
+      {
+        double minDistance = std::numeric_limits<double>::max();
+        unsigned int minElem = 0;
+        for (unsigned ik = i + 1; ik < x.size(); ++ik)
+        {
+          double dist = std::abs(x[ik] - (x[i] + s * distance));
+          if (dist < minDistance)
+          {
+            minDistance = dist;
+            minElem = ik;
+          }
+          else if (dist > minDistance)
+            break;
+        }
+        if (minDistance < (x[i] * tolerance))
+          indices.push_back(minElem);
+        else
+          eval = false;
+      }
+      if (eval)
+        r.emplace_back(indices);
+    }
+    return r;
+  }
+
+  static std::vector<m2::Interval> ReferenceMonoisotopic(const std::vector<m2::Interval> &peaks,
+                                                         std::vector<unsigned int> sizes,
+                                                         double minCor,
+                                                         double tolerance,
+                                                         double distance)
+  {
+    using namespace m2::Signal;
+    std::sort(sizes.begin(), sizes.end(), std::greater<int>());
+    std::vector<double> mzs;
+    for (const auto &p : peaks)
+      mzs.push_back(p.x.mean());
+
+    std::vector<std::vector<unsigned int>> patterns;
+    for (auto size : sizes)
+    {
+      auto pc = ReferencePseudoCluster(mzs, size, distance, tolerance);
+      if (pc.empty())
+        continue;
+      std::vector<std::vector<double>> ypc;
+      std::vector<double> xpc;
+      for (const auto &p : pc)
+      {
+        std::vector<double> u;
+        double sum = 0;
+        for (const auto &i : p)
+        {
+          u.push_back(peaks[i].y.mean());
+          sum += peaks[i].y.mean();
+        }
+        for (auto &v : u)
+          v /= sum;
+        ypc.emplace_back(u);
+        xpc.push_back(peaks[p[0]].x.mean());
+      }
+      std::vector<unsigned int> isotopes(size);
+      std::iota(std::begin(isotopes), std::end(isotopes), 0);
+      auto cr = colCors(ypc, Psum(xpc, isotopes));
+      std::vector<std::vector<unsigned int>> pccr;
+      for (unsigned int i = 0; i < cr.size(); ++i)
+        if (cr[i] > minCor)
+          pccr.emplace_back(pc[i]);
+      if (pccr.empty())
+        continue;
+      auto pattern = moveVectorsWithUniqueElementsOnly(pccr);
+      patterns.insert(std::end(patterns), std::begin(pattern), std::end(pattern));
+    }
+    std::sort(std::begin(patterns), std::end(patterns));
+    std::vector<m2::Interval> result;
+    for (const auto &r : moveVectorsWithUniqueElementsOnly(patterns))
+      result.emplace_back(peaks[r[0]]);
+    return result;
+  }
+
+  // isotope patterns with poisson-like intensities between random noise peaks
+  static std::vector<m2::Interval> Peaks(unsigned int patterns, unsigned int noise)
+  {
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<double> mz(500, 3000), intensity(10, 1000), jitter(-0.02, 0.02);
+    std::vector<m2::Interval> peaks;
+    for (unsigned int p = 0; p < patterns; ++p)
+    {
+      const double x = mz(gen);
+      const auto pattern = m2::Signal::Psum({x}, {0, 1, 2, 3, 4}).front();
+      for (unsigned int k = 0; k < pattern.size(); ++k)
+        peaks.emplace_back(x + k * 1.00235 + jitter(gen) * 1e-2, 1000 * pattern[k] * (1 + jitter(gen)));
+    }
+    for (unsigned int i = 0; i < noise; ++i)
+      peaks.emplace_back(mz(gen), intensity(gen));
+    // duplicated positions
+    peaks.push_back(peaks[3]);
+    peaks.push_back(peaks[noise / 2]);
+    std::sort(std::begin(peaks), std::end(peaks));
+    return peaks;
+  }
+
+public:
+  void PseudoCluster_EqualsLinearSearch()
+  {
+    const auto peaks = Peaks(200, 3000);
+    std::vector<double> mzs;
+    for (const auto &p : peaks)
+      mzs.push_back(p.x.mean());
+
+    for (unsigned int size : {2, 3, 5, 7})
+      for (double tolerance : {1e-5, 1e-4})
+      {
+        const auto expected = ReferencePseudoCluster(mzs, size, 1.00235, tolerance);
+        CPPUNIT_ASSERT(expected == m2::Signal::pseudoCluster(mzs, size, 1.00235, tolerance));
+        CPPUNIT_ASSERT(expected == m2::Signal::pseudoCluster(mzs, size, 1.00235, tolerance, 1, 4));
+      }
+
+    CPPUNIT_ASSERT(m2::Signal::pseudoCluster({}, 3).empty());
+    CPPUNIT_ASSERT(m2::Signal::pseudoCluster({100, 101.00235, 102.0047}, 3).empty());
+  }
+
+  void Monoisotopic_EqualsLinearSearch()
+  {
+    const auto peaks = Peaks(200, 3000);
+    const std::vector<unsigned int> sizes = {3, 4, 5, 6, 7, 8, 9, 10};
+    for (double minCor : {0.4, 0.95})
+    {
+      const auto expected = ReferenceMonoisotopic(peaks, sizes, minCor, 1e-4, 1.00235);
+      CPPUNIT_ASSERT(!expected.empty());
+      for (unsigned int threads : {1, 4})
+      {
+        const auto result = m2::Signal::monoisotopic(peaks, sizes, minCor, 1e-4, 1.00235, 1, threads);
+        CPPUNIT_ASSERT_EQUAL(expected.size(), result.size());
+        for (size_t i = 0; i < expected.size(); ++i)
+          CPPUNIT_ASSERT_EQUAL(expected[i].x.mean(), result[i].x.mean());
+      }
+    }
+  }
+
+  void PseudoCluster_Charge()
+  {
+    const std::vector<double> mzs = {800.0, 800.501175, 801.00235, 801.7, 802.2, 803.0};
+    const auto singly = m2::Signal::pseudoCluster(mzs, 3);
+    CPPUNIT_ASSERT_EQUAL(size_t(0), singly.size());
+
+    const auto doubly = m2::Signal::pseudoCluster(mzs, 3, 1.00235, 1e-4, 2);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), doubly.size());
+    CPPUNIT_ASSERT(doubly.front() == std::vector<unsigned int>({0, 1, 2}));
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SignalIsotope)
@@ -0,0 +1,109 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <chrono>
+#include <cppunit/TestAssert.h>
+#include <m2TestFixture.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2SignalKernels.h>
+
+/**
+ * Timings of the scalar and the vectorized kernels. Not part of the default tests, it is only
+ * registered if the CMake option M2AIA_BUILD_BENCHMARKS is enabled.
+ */
+class m2SignalKernelsBenchmarkSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SignalKernelsBenchmarkSuite);
+  MITK_TEST(Kernels_Benchmark);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  template <class T>
+  static std::vector<T> RandomSpectrum(size_t n, unsigned int seed)
+  {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> dist(0, 1e4);
+    std::vector<T> ys(n);
+    for (auto &y : ys)
+      y = dist(gen);
+    return ys;
+  }
+
+  template <class T>
+  static std::vector<T> MassAxis(size_t n)
+  {
+    std::vector<T> xs(n);
+    for (size_t i = 0; i < n; ++i)
+      xs[i] = 400 + i * 0.0123 + 1e-7 * i * i;
+    return xs;
+  }
+
+  // runs the measurement for each instruction set supported by this CPU
+  template <class F>
+  static void ForEachInstructionSet(F measure)
+  {
+    using namespace m2::Signal::Kernels;
+    const auto initial = GetInstructionSet();
+    for (auto set : {InstructionSet::Scalar, InstructionSet::AVX2})
+    {
+      if (!SetInstructionSet(set))
+        continue;
+      measure();
+    }
+    SetInstructionSet(initial);
+  }
+
+public:
+  // prints timings of the scalar and the vectorized kernels, does not assert on speed
+  void Kernels_Benchmark()
+  {
+    using namespace m2;
+    const auto ys = RandomSpectrum<float>(1 << 16, 3);
+    const auto xs = MassAxis<float>(ys.size());
+    const unsigned int runs = 200;
+
+    ForEachInstructionSet(
+      [&]()
+      {
+        const auto Measure = [&](const std::string &what, auto &&f)
+        {
+          const auto start = std::chrono::high_resolution_clock::now();
+          for (unsigned int i = 0; i < runs; ++i)
+            f();
+          const std::chrono::duration<double, std::micro> d = std::chrono::high_resolution_clock::now() - start;
+          MITK_INFO << Signal::Kernels::ToString(Signal::Kernels::GetInstructionSet()) << " " << what << ": "
+                    << d.count() / runs << "us per spectrum (" << ys.size() << " values)";
+        };
+
+        double sink = 0;
+        Measure("Sum", [&]() { sink += Signal::Kernels::Sum(ys.data(), ys.size()); });
+        Measure("TIC", [&]() { sink += Signal::Kernels::TotalIonCurrent(xs.data(), ys.data(), ys.size()); });
+        Measure("RMS", [&]() { sink += Signal::Kernels::SumOfSquares(ys.data(), ys.size()); });
+        auto buffer = ys;
+        Measure("Log2",
+                [&]()
+                {
+                  std::copy(std::begin(ys), std::end(ys), std::begin(buffer));
+                  Signal::Kernels::Transform(IntensityTransformationType::Log2, buffer.data(), buffer.size());
+                });
+        CPPUNIT_ASSERT(sink > 0);
+      });
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SignalKernelsBenchmark)
@@ -0,0 +1,202 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <cmath>
+#include <cppunit/TestAssert.h>
+#include <limits>
+#include <m2TestFixture.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2Normalization.h>
+#include <signal/m2SignalKernels.h>
+
+class m2SignalKernelsTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SignalKernelsTestSuite);
+  MITK_TEST(Reductions_EqualReference);
+  MITK_TEST(Transform_EqualsReference);
+  MITK_TEST(Transform_SpecialValues);
+  MITK_TEST(Median_EqualsSortedReference);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  using InstructionSet = m2::Signal::Kernels::InstructionSet;
+
+  template <class T>
+  static std::vector<T> RandomSpectrum(size_t n, unsigned int seed)
+  {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> dist(0, 1e4);
+    std::vector<T> ys(n);
+    for (auto &y : ys)
+      y = dist(gen);
+    return ys;
+  }
+
+  template <class T>
+  static std::vector<T> MassAxis(size_t n)
+  {
+    std::vector<T> xs(n);
+    for (size_t i = 0; i < n; ++i)
+      xs[i] = 400 + i * 0.0123 + 1e-7 * i * i;
+    return xs;
+  }
+
+  // runs the check for each instruction set supported by this CPU
+  template <class F>
+  static void ForEachInstructionSet(F check)
+  {
+    using namespace m2::Signal::Kernels;
+    const auto initial = GetInstructionSet();
+    for (auto set : {InstructionSet::Scalar, InstructionSet::AVX2})
+    {
+      if (!SetInstructionSet(set))
+        continue;
+      check();
+    }
+    SetInstructionSet(initial);
+  }
+
+  template <class X, class Y>
+  void CheckReductions()
+  {
+    using namespace m2::Signal;
+    const double eps = 1e-12;
+    for (size_t n : {0, 1, 2, 7, 8, 9, 1023, 5000})
+    {
+      const auto ys = RandomSpectrum<Y>(n, n);
+      const auto xs = MassAxis<X>(n);
+
+      double sum = std::accumulate(std::begin(ys), std::end(ys), double(0));
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(sum, Kernels::Sum(ys.data(), n), eps * sum);
+
+      if (n)
+      {
+        const double rms = RootMeanSquare(std::begin(ys), std::end(ys));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(rms, std::sqrt(Kernels::SumOfSquares(ys.data(), n) / n), eps * rms);
+        CPPUNIT_ASSERT_EQUAL(double(*std::max_element(std::begin(ys), std::end(ys))), Kernels::Maximum(ys.data(), n));
+        const double tic = TotalIonCurrent(std::begin(xs), std::end(xs), std::begin(ys));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(tic, Kernels::TotalIonCurrent(xs.data(), ys.data(), n), eps * tic);
+      }
+    }
+  }
+
+public:
+  void Reductions_EqualReference()
+  {
+    ForEachInstructionSet(
+      [this]()
+      {
+        CheckReductions<float, float>();
+        CheckReductions<float, double>();
+        CheckReductions<double, float>();
+        CheckReductions<double, double>();
+      });
+  }
+
+  void Transform_EqualsReference()
+  {
+    using namespace m2;
+    ForEachInstructionSet(
+      []()
+      {
+        auto ys = RandomSpectrum<float>(1001, 1);
+        // small values, log(1 + y) close to 0
+        for (size_t i = 0; i < 100; ++i)
+          ys[i] = i * 1e-6f;
+
+        for (auto type : {IntensityTransformationType::Log2,
+                          IntensityTransformationType::Log10,
+                          IntensityTransformationType::SquareRoot})
+        {
+          auto result = ys;
+          Signal::Kernels::Transform(type, result.data(), result.size());
+
+          // each value is computed the same way, independent of its position
+          auto shifted = std::vector<float>(std::next(std::begin(ys), 3), std::end(ys));
+          Signal::Kernels::Transform(type, shifted.data(), shifted.size());
+
+          for (size_t i = 0; i < ys.size(); ++i)
+          {
+            float expected;
+            if (type == IntensityTransformationType::Log2)
+              expected = std::log2(ys[i] + 1);
+            else if (type == IntensityTransformationType::Log10)
+              expected = std::log10(ys[i] + 1);
+            else
+              expected = std::sqrt(ys[i]);
+
+            if (type == IntensityTransformationType::SquareRoot)
+              CPPUNIT_ASSERT_EQUAL(expected, result[i]);
+            else
+              CPPUNIT_ASSERT_DOUBLES_EQUAL(
+                expected, result[i], 4 * std::numeric_limits<float>::epsilon() * std::abs(expected));
+            if (i >= 3)
+              CPPUNIT_ASSERT_EQUAL(result[i], shifted[i - 3]);
+          }
+        }
+
+        // double precision log is not approximated
+        auto ds = RandomSpectrum<double>(101, 2);
+        auto result = ds;
+        Signal::Kernels::Transform(IntensityTransformationType::Log10, result.data(), result.size());
+        for (size_t i = 0; i < ds.size(); ++i)
+          CPPUNIT_ASSERT_EQUAL(std::log10(ds[i] + 1), result[i]);
+      });
+  }
+
+  void Transform_SpecialValues()
+  {
+    using namespace m2;
+    ForEachInstructionSet(
+      []()
+      {
+        const float inf = std::numeric_limits<float>::infinity();
+        std::vector<float> ys = {0, -1, -2, inf, std::numeric_limits<float>::quiet_NaN(), 1e-40f, 3, 7, 15};
+        auto result = ys;
+        Signal::Kernels::Transform(IntensityTransformationType::Log2, result.data(), result.size());
+        CPPUNIT_ASSERT_EQUAL(0.0f, result[0]);
+        CPPUNIT_ASSERT_EQUAL(-inf, result[1]);
+        CPPUNIT_ASSERT(std::isnan(result[2]));
+        CPPUNIT_ASSERT_EQUAL(inf, result[3]);
+        CPPUNIT_ASSERT(std::isnan(result[4]));
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0f, result[6], 1e-6);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(4.0f, result[8], 1e-6);
+
+        // regular values next to special ones are computed as without them
+        std::vector<float> regular(std::next(std::begin(ys), 5), std::end(ys));
+        Signal::Kernels::Transform(IntensityTransformationType::Log2, regular.data(), regular.size());
+        for (size_t i = 0; i < regular.size(); ++i)
+          CPPUNIT_ASSERT_EQUAL(regular[i], result[i + 5]);
+      });
+  }
+
+  void Median_EqualsSortedReference()
+  {
+    for (size_t n : {1, 2, 3, 4, 5, 100, 101})
+    {
+      auto ys = RandomSpectrum<float>(n, n);
+      auto sorted = ys;
+      std::sort(std::begin(sorted), std::end(sorted));
+      const double expected = n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(expected, m2::Signal::Median(std::begin(ys), std::end(ys)), 1e-9);
+    }
+    std::vector<float> empty;
+    CPPUNIT_ASSERT_EQUAL(0.0, m2::Signal::Median(std::begin(empty), std::end(empty)));
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SignalKernels)
@@ -0,0 +1,157 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <cppunit/TestAssert.h>
+#include <m2TestFixture.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2PeakDetection.h>
+
+class m2SignalSubrangeTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SignalSubrangeTestSuite);
+  MITK_TEST(Subrange_InsideData);
+  MITK_TEST(Subrange_EmptyData);
+  MITK_TEST(Subrange_EmptyWindow);
+  MITK_TEST(Subrange_WindowOutsideData);
+  MITK_TEST(Subrange_DuplicateValues);
+  MITK_TEST(Subranges_EqualsSubrange);
+  MITK_TEST(Subranges_UnsortedWindows);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  using RangeType = std::pair<unsigned int, unsigned int>;
+
+  static RangeType Reference(const std::vector<float> &xs, double lower, double upper)
+  {
+    const auto s = std::lower_bound(std::begin(xs), std::end(xs), lower);
+    const auto e = std::upper_bound(std::begin(xs), std::end(xs), upper);
+    return {std::distance(std::begin(xs), s), e > s ? std::distance(s, e) : 0};
+  }
+
+public:
+  void Subrange_InsideData()
+  {
+    std::vector<float> xs = {100, 200, 300, 400, 500};
+    auto r = m2::Signal::Subrange(xs, 150, 450);
+    CPPUNIT_ASSERT_EQUAL(1u, r.first);
+    CPPUNIT_ASSERT_EQUAL(3u, r.second);
+
+    // bounds are inclusive
+    r = m2::Signal::Subrange(xs, 200, 400);
+    CPPUNIT_ASSERT_EQUAL(1u, r.first);
+    CPPUNIT_ASSERT_EQUAL(3u, r.second);
+
+    r = m2::Signal::Subrange(xs, 0, 1000);
+    CPPUNIT_ASSERT_EQUAL(0u, r.first);
+    CPPUNIT_ASSERT_EQUAL(5u, r.second);
+  }
+
+  void Subrange_EmptyData()
+  {
+    std::vector<float> xs;
+    auto r = m2::Signal::Subrange(xs, 0, 1000);
+    CPPUNIT_ASSERT_EQUAL(0u, r.first);
+    CPPUNIT_ASSERT_EQUAL(0u, r.second);
+  }
+
+  void Subrange_EmptyWindow()
+  {
+    std::vector<float> xs = {100, 200, 300, 400, 500};
+    // window between two values
+    auto r = m2::Signal::Subrange(xs, 210, 290);
+    CPPUNIT_ASSERT_EQUAL(2u, r.first);
+    CPPUNIT_ASSERT_EQUAL(0u, r.second);
+
+    // inverted window
+    r = m2::Signal::Subrange(xs, 400, 200);
+    CPPUNIT_ASSERT_EQUAL(0u, r.second);
+  }
+
+  void Subrange_WindowOutsideData()
+  {
+    std::vector<float> xs = {100, 200, 300, 400, 500};
+    auto r = m2::Signal::Subrange(xs, 10, 50);
+    CPPUNIT_ASSERT_EQUAL(0u, r.first);
+    CPPUNIT_ASSERT_EQUAL(0u, r.second);
+
+    // previously the last element was returned
+    r = m2::Signal::Subrange(xs, 600, 700);
+    CPPUNIT_ASSERT_EQUAL(5u, r.first);
+    CPPUNIT_ASSERT_EQUAL(0u, r.second);
+  }
+
+  void Subrange_DuplicateValues()
+  {
+    std::vector<float> xs = {100, 200, 200, 200, 300};
+    auto r = m2::Signal::Subrange(xs, 200, 200);
+    CPPUNIT_ASSERT_EQUAL(1u, r.first);
+    CPPUNIT_ASSERT_EQUAL(3u, r.second);
+
+    r = m2::Signal::Subrange(xs, 150, 250);
+    CPPUNIT_ASSERT_EQUAL(1u, r.first);
+    CPPUNIT_ASSERT_EQUAL(3u, r.second);
+
+    std::vector<float> same(8, 42);
+    r = m2::Signal::Subrange(same, 42, 42);
+    CPPUNIT_ASSERT_EQUAL(0u, r.first);
+    CPPUNIT_ASSERT_EQUAL(8u, r.second);
+  }
+
+  void Subranges_EqualsSubrange()
+  {
+    std::mt19937 gen(42);
+    for (unsigned int run = 0; run < 200; ++run)
+    {
+      std::vector<float> xs(gen() % 64);
+      for (auto &x : xs)
+        x = float(gen() % 40) / 2; // many duplicates
+      std::sort(std::begin(xs), std::end(xs));
+
+      std::vector<std::pair<double, double>> windows(gen() % 32);
+      for (auto &w : windows)
+      {
+        const double center = (double(gen() % 50) - 5) / 2;
+        const double tol = double(gen() % 6) / 4;
+        w = {center - tol, center + tol};
+      }
+      std::sort(std::begin(windows), std::end(windows));
+
+      std::vector<RangeType> result;
+      m2::Signal::Subranges(xs, windows, result);
+      CPPUNIT_ASSERT_EQUAL(windows.size(), result.size());
+      for (size_t i = 0; i < windows.size(); ++i)
+      {
+        const auto expected = Reference(xs, windows[i].first, windows[i].second);
+        CPPUNIT_ASSERT(expected == m2::Signal::Subrange(xs, windows[i].first, windows[i].second));
+        CPPUNIT_ASSERT(expected == result[i]);
+      }
+    }
+  }
+
+  void Subranges_UnsortedWindows()
+  {
+    std::vector<float> xs = {100, 200, 300, 400, 500};
+    std::vector<std::pair<double, double>> windows = {{450, 550}, {90, 110}, {600, 700}, {190, 410}, {0, 10}};
+    std::vector<RangeType> result;
+    m2::Signal::Subranges(xs, windows, result);
+    for (size_t i = 0; i < windows.size(); ++i)
+      CPPUNIT_ASSERT(Reference(xs, windows[i].first, windows[i].second) == result[i]);
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SignalSubrange)
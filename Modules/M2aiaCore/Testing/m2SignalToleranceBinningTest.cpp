@@ -0,0 +1,160 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <cppunit/TestAssert.h>
+#include <m2TestFixture.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2Binning.h>
+#include <signal/m2ToleranceBinning.h>
+
+class m2SignalToleranceBinningTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SignalToleranceBinningTestSuite);
+  MITK_TEST(ToleranceBasedBinning_SplitsAtLargestGap);
+  MITK_TEST(ToleranceBinning_EqualsToleranceBasedBinning);
+  MITK_TEST(ToleranceBinning_ThreadsAndRunsGiveSameBins);
+  MITK_TEST(ToleranceBinning_KeepsDoublePrecision);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  // peak lists of a few hundred pixels around common m/z positions
+  static std::vector<std::vector<m2::Signal::PeakTuple>> PeakLists(unsigned int pixels, unsigned int peaks)
+  {
+    std::mt19937 gen(42);
+    std::normal_distribution<double> jitter(0, 0.002);
+    std::uniform_real_distribution<double> intensity(1, 1000);
+    std::vector<double> centers(peaks);
+    for (unsigned int i = 0; i < peaks; ++i)
+      centers[i] = 400 + i * 1.37;
+
+    std::vector<std::vector<m2::Signal::PeakTuple>> lists(pixels);
+    for (unsigned int p = 0; p < pixels; ++p)
+      for (auto c : centers)
+        lists[p].push_back({c + jitter(gen), float(intensity(gen)), p});
+    return lists;
+  }
+
+  static void AssertEqual(const std::vector<m2::Interval> &expected, const std::vector<m2::Interval> &actual)
+  {
+    CPPUNIT_ASSERT_EQUAL(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+      CPPUNIT_ASSERT_EQUAL(expected[i].x.count(), actual[i].x.count());
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(expected[i].x.mean(), actual[i].x.mean(), 1e-9);
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(expected[i].y.sum(), actual[i].y.sum(), 1e-9 * expected[i].y.sum());
+    }
+  }
+
+public:
+  void ToleranceBasedBinning_SplitsAtLargestGap()
+  {
+    std::vector<m2::Interval> peaks;
+    for (double x : {100.0, 100.001, 100.002, 100.5, 100.501})
+      peaks.emplace_back(x, 1);
+
+    std::vector<m2::Interval> bins;
+    m2::Signal::toleranceBasedBinning(std::begin(peaks), std::end(peaks), std::back_inserter(bins), 1e-4);
+    CPPUNIT_ASSERT_EQUAL(size_t(2), bins.size());
+    CPPUNIT_ASSERT_EQUAL(3u, bins[0].x.count());
+    CPPUNIT_ASSERT_EQUAL(2u, bins[1].x.count());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(100.001, bins[0].x.mean(), 1e-9);
+
+    bins.clear();
+    m2::Signal::toleranceBasedBinning(std::begin(peaks), std::end(peaks), std::back_inserter(bins), 1, true);
+    CPPUNIT_ASSERT_EQUAL(size_t(1), bins.size());
+    CPPUNIT_ASSERT_EQUAL(5u, bins[0].x.count());
+  }
+
+  void ToleranceBinning_EqualsToleranceBasedBinning()
+  {
+    const double tolerance = 20e-6;
+    const auto lists = PeakLists(50, 40);
+
+    m2::Signal::ToleranceBinning binning(tolerance);
+    std::vector<m2::Signal::PeakTuple> tuples;
+    for (auto list : lists)
+    {
+      tuples.insert(std::end(tuples), std::begin(list), std::end(list));
+      binning.Add(std::move(list));
+    }
+    CPPUNIT_ASSERT_EQUAL(tuples.size(), binning.GetNumberOfTuples());
+    const auto bins = binning.Run();
+    CPPUNIT_ASSERT_EQUAL(size_t(0), binning.GetNumberOfTuples());
+
+    // reference: toleranceBasedBinning on each group of peaks separated by gaps larger than the tolerance
+    m2::Signal::ToleranceBinning::Sort(tuples, 1);
+    std::vector<m2::Interval> peaks, expected;
+    for (size_t i = 0; i < tuples.size(); ++i)
+    {
+      if (i > 0 && tuples[i].mz - tuples[i - 1].mz > tuples[i - 1].mz * tolerance)
+      {
+        m2::Signal::toleranceBasedBinning(std::begin(peaks), std::end(peaks), std::back_inserter(expected), tolerance);
+        peaks.clear();
+      }
+      peaks.emplace_back(tuples[i].mz, tuples[i].intensity);
+    }
+    m2::Signal::toleranceBasedBinning(std::begin(peaks), std::end(peaks), std::back_inserter(expected), tolerance);
+
+    AssertEqual(expected, bins);
+  }
+
+  void ToleranceBinning_ThreadsAndRunsGiveSameBins()
+  {
+    const auto lists = PeakLists(400, 300);
+    const auto Bin = [&lists](unsigned int threads, size_t memoryLimit, std::vector<unsigned int> &pixelCounts)
+    {
+      m2::Signal::ToleranceBinning binning(10e-6, false, threads);
+      binning.SetMemoryLimit(memoryLimit);
+      for (auto list : lists)
+        binning.Add(std::move(list));
+      if (memoryLimit)
+        CPPUNIT_ASSERT(binning.GetNumberOfRuns() > 1);
+      return binning.Run(&pixelCounts);
+    };
+
+    std::vector<unsigned int> expectedCounts, counts;
+    const auto expected = Bin(1, 0, expectedCounts);
+    CPPUNIT_ASSERT_EQUAL(expected.size(), expectedCounts.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+      CPPUNIT_ASSERT(expectedCounts[i] <= expected[i].x.count());
+
+    AssertEqual(expected, Bin(4, 0, counts));
+    CPPUNIT_ASSERT(expectedCounts == counts);
+
+    AssertEqual(expected, Bin(4, 1 << 18, counts));
+    CPPUNIT_ASSERT(expectedCounts == counts);
+  }
+
+  void ToleranceBinning_KeepsDoublePrecision()
+  {
+    // 2e-5 apart, both would be rounded to the same float
+    for (size_t memoryLimit : {size_t(0), size_t(1)})
+    {
+      m2::Signal::ToleranceBinning binning(1e-5, true);
+      binning.SetMemoryLimit(memoryLimit);
+      binning.Add(std::vector<double>{1000.00001}, std::vector<double>{1}, 0);
+      binning.Add(std::vector<double>{1000.00003}, std::vector<double>{1}, 1);
+
+      const auto bins = binning.Run();
+      CPPUNIT_ASSERT_EQUAL(size_t(2), bins.size());
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(1000.00001, bins[0].x.mean(), 1e-9);
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(1000.00003, bins[1].x.mean(), 1e-9);
+    }
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SignalToleranceBinning)
@@ -0,0 +1,230 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <cmath>
+#include <cppunit/TestAssert.h>
+#include <m2ImzMLSpectrumImage.h>
+#include <m2SparseSpectrumCube.h>
+#include <m2TestFixture.h>
+#include <m2TestingConfig.h>
+#include <mitkCoreServices.h>
+#include <mitkIOUtil.h>
+#include <mitkIPreferences.h>
+#include <mitkIPreferencesService.h>
+#include <mitkImagePixelReadAccessor.h>
+#include <mitkTestingMacros.h>
+#include <random>
+#include <signal/m2PeakDetection.h>
+#include <signal/m2Pooling.h>
+
+class m2SparseSpectrumCubeTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SparseSpectrumCubeTestSuite);
+  MITK_TEST(Query_ProcessedData_shouldEqualRangePooling);
+  MITK_TEST(Query_ContinuousData_shouldEqualRangePooling);
+  MITK_TEST(GetImage_SparseCube_shouldEqualFileBackedImage);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  using CubeType = m2::SparseSpectrumCube<float>;
+  using Spectrum = std::pair<std::vector<double>, std::vector<float>>;
+
+  const std::vector<m2::RangePoolingStrategyType> m_Strategies = {m2::RangePoolingStrategyType::Maximum,
+                                                                  m2::RangePoolingStrategyType::Sum,
+                                                                  m2::RangePoolingStrategyType::Mean};
+
+  static double Reference(const Spectrum &spectrum, double lower, double upper, m2::RangePoolingStrategyType strategy)
+  {
+    const auto r = m2::Signal::Subrange(spectrum.first, lower, upper);
+    const auto s = std::next(std::begin(spectrum.second), r.first);
+    std::vector<float> values(s, std::next(s, r.second));
+    return m2::Signal::RangePooling<double>(std::begin(values), std::end(values), strategy);
+  }
+
+  // windows between, on and around the positions of the axis, including empty windows and the range edges
+  static std::vector<std::pair<double, double>> Windows(const std::vector<double> &axis)
+  {
+    const auto first = axis.front(), last = axis.back();
+    const auto between = (axis[3] + axis[4]) / 2;
+    std::vector<std::pair<double, double>> windows = {
+      {first, first}, // single positions at the edges
+      {last, last},
+      {first - 10, first - 1}, // outside of the range
+      {last + 1, last + 10},
+      {first - 1, last + 1}, // everything
+      {axis[3], axis[7]}, // inclusive bounds
+      {axis[5], axis[5]},
+      {between, between}, // empty windows between two positions
+      {axis[10] + 1e-9, axis[11] - 1e-9},
+      {last - 1, last + 1},
+    };
+    std::mt19937 gen(7);
+    std::uniform_real_distribution<double> center(first, last), width(0, (last - first) / 20);
+    for (unsigned int i = 0; i < 20; ++i)
+    {
+      const auto c = center(gen), w = width(gen);
+      windows.emplace_back(c - w, c + w);
+    }
+    return windows;
+  }
+
+  void Compare(const CubeType &cube,
+               const std::vector<Spectrum> &spectra,
+               const std::vector<std::pair<double, double>> &windows,
+               unsigned int threads)
+  {
+    std::vector<double> values;
+    for (auto strategy : m_Strategies)
+    {
+      for (const auto &w : windows)
+      {
+        cube.Query(w.first, w.second, strategy, threads, values);
+        CPPUNIT_ASSERT_EQUAL(spectra.size(), values.size());
+        for (unsigned int id = 0; id < spectra.size(); ++id)
+        {
+          const auto expected = Reference(spectra[id], w.first, w.second, strategy);
+          CPPUNIT_ASSERT_DOUBLES_EQUAL(expected, values[id], 1e-6 * std::max(1.0, std::abs(expected)));
+        }
+      }
+    }
+  }
+
+public:
+  void Query_ProcessedData_shouldEqualRangePooling()
+  {
+    // peaks on a common grid, so that columns are shared by several spectra; some spectra are empty
+    std::mt19937 gen(42);
+    std::vector<double> grid(500);
+    for (unsigned int i = 0; i < grid.size(); ++i)
+      grid[i] = 100 + i * 0.2;
+    std::bernoulli_distribution hasPeak(0.05);
+    std::uniform_real_distribution<float> intensity(1, 1000);
+
+    std::vector<Spectrum> spectra(300);
+    std::vector<CubeType::Entry> entries;
+    for (unsigned int id = 0; id < spectra.size(); ++id)
+    {
+      if (id % 17 == 0)
+        continue;
+      for (auto x : grid)
+        if (hasPeak(gen))
+        {
+          spectra[id].first.push_back(x);
+          spectra[id].second.push_back(intensity(gen));
+          entries.push_back({x, id, spectra[id].second.back()});
+        }
+    }
+
+    CubeType cube;
+    cube.Build(std::move(entries), spectra.size());
+    Compare(cube, spectra, Windows(grid), 1);
+    Compare(cube, spectra, Windows(grid), 4);
+  }
+
+  void Query_ContinuousData_shouldEqualRangePooling()
+  {
+    // zeros are not stored; every 10th axis position is zero in all spectra and has no column
+    std::mt19937 gen(42);
+    std::vector<double> axis(1000);
+    for (unsigned int i = 0; i < axis.size(); ++i)
+      axis[i] = 100 + i * 0.1;
+    std::bernoulli_distribution isZero(0.5);
+    std::uniform_real_distribution<float> intensity(1, 1000);
+
+    // enough entries for a multi-threaded query
+    std::vector<Spectrum> spectra(400);
+    std::vector<CubeType::Entry> entries;
+    for (unsigned int id = 0; id < spectra.size(); ++id)
+    {
+      spectra[id].first = axis;
+      spectra[id].second.assign(axis.size(), 0);
+      for (unsigned int k = 0; k < axis.size(); ++k)
+      {
+        if (k % 10 == 0 || isZero(gen))
+          continue;
+        spectra[id].second[k] = intensity(gen);
+        entries.push_back({axis[k], id, spectra[id].second[k]});
+      }
+    }
+    CPPUNIT_ASSERT(entries.size() > 2 * (1 << 16));
+
+    CubeType cube;
+    cube.Build(std::move(entries), spectra.size(), axis);
+    Compare(cube, spectra, Windows(axis), 1);
+    Compare(cube, spectra, Windows(axis), 4);
+  }
+
+  void GetImage_SparseCube_shouldEqualFileBackedImage()
+  {
+    const auto path = GetTestDataFilePath("processed_centroids.imzML", M2AIA_DATA_DIR);
+    const std::string key = "m2aia.signal.SparseCentroidCube";
+    auto *preferences = mitk::CoreServices::GetPreferencesService()->GetSystemPreferences();
+    const bool enabled = preferences->GetBool(key, false);
+
+    const auto Load = [&](bool useCube)
+    {
+      preferences->PutBool(key, useCube);
+      auto data = mitk::IOUtil::Load(path);
+      m2::ImzMLSpectrumImage::Pointer image = dynamic_cast<m2::ImzMLSpectrumImage *>(data.back().GetPointer());
+      CPPUNIT_ASSERT(image != nullptr);
+      image->SetNormalizationStrategy(m2::NormalizationStrategyType::None);
+      image->SetIntensityTransformationStrategy(m2::IntensityTransformationType::None);
+      image->InitializeImageAccess();
+      return image;
+    };
+    auto reference = Load(false);
+    auto image = Load(true);
+    preferences->PutBool(key, enabled);
+
+    // windows at the peaks of a spectrum, edges of the mass range and between peaks
+    std::vector<double> xs, ys;
+    for (unsigned int id = 0; id < reference->GetSpectra().size() && xs.size() <= 12; ++id)
+      reference->GetSpectrum(id, xs, ys);
+    CPPUNIT_ASSERT(xs.size() > 12);
+    auto windows = Windows(xs);
+    const auto &axis = reference->GetXAxis();
+    windows.emplace_back(axis.front(), axis.front());
+    windows.emplace_back(axis.back(), axis.back());
+
+    const auto *dims = reference->GetDimensions();
+    const auto pixels = dims[0] * dims[1] * dims[2];
+    for (auto strategy : m_Strategies)
+    {
+      reference->SetRangePoolingStrategy(strategy);
+      image->SetRangePoolingStrategy(strategy);
+      for (const auto &w : windows)
+      {
+        const auto mz = (w.first + w.second) / 2, tol = (w.second - w.first) / 2;
+        auto expected = mitk::Image::New();
+        expected->Initialize(reference);
+        reference->GetImage(mz, tol, nullptr, expected);
+        auto result = mitk::Image::New();
+        result->Initialize(image);
+        image->GetImage(mz, tol, nullptr, result);
+
+        mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> expectedAccess(expected);
+        mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> resultAccess(result);
+        for (unsigned int i = 0; i < pixels; ++i)
+        {
+          const double e = expectedAccess.GetData()[i];
+          CPPUNIT_ASSERT_DOUBLES_EQUAL(e, resultAccess.GetData()[i], 1e-5 * std::max(1.0, std::abs(e)));
+        }
+      }
+    }
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SparseSpectrumCube)
@@ -0,0 +1,158 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <atomic>
+#include <cppunit/TestAssert.h>
+#include <fstream>
+#include <itksys/SystemTools.hxx>
+#include <m2SpectrumReadScheduler.h>
+#include <m2TestFixture.h>
+#include <mitkIOUtil.h>
+#include <mitkTestingMacros.h>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <vector>
+
+class m2SpectrumReadSchedulerTestSuite : public m2::TestFixture
+{
+  CPPUNIT_TEST_SUITE(m2SpectrumReadSchedulerTestSuite);
+  MITK_TEST(Run_ContiguousRequests_shouldCoalesce);
+  MITK_TEST(Run_NarrowWindows_shouldNotReadGaps);
+  MITK_TEST(Run_SmallFile_shouldSplitWorkAcrossThreads);
+  MITK_TEST(Run_Cancelled_shouldStopEarly);
+
+  CPPUNIT_TEST_SUITE_END();
+
+  // a file of consecutive 32 bit integers, spectra are simulated as slices of it
+  const unsigned int m_Values = 1 << 20;
+  std::string m_Path;
+
+  // every request of values [first, first + length) is checked against the file content
+  void Read(m2::SpectrumReadScheduler &scheduler,
+            const std::vector<std::pair<unsigned int, unsigned int>> &requests,
+            unsigned int threads,
+            std::set<unsigned int> *usedThreads = nullptr)
+  {
+    for (unsigned int i = 0; i < requests.size(); ++i)
+      scheduler.Add(requests[i].first * sizeof(int), requests[i].second * sizeof(int), i);
+
+    std::vector<int> visited(requests.size(), 0);
+    std::atomic<unsigned int> errors(0);
+    std::mutex mutex;
+    scheduler.Run(threads,
+                  [&](unsigned int t, unsigned int id, const char *data)
+                  {
+                    const int *values = reinterpret_cast<const int *>(data);
+                    for (unsigned int k = 0; k < requests[id].second; ++k)
+                      if (values[k] != int(requests[id].first + k))
+                        ++errors;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++visited[id];
+                    if (usedThreads)
+                      usedThreads->insert(t);
+                  });
+
+    CPPUNIT_ASSERT_EQUAL(0u, errors.load());
+    CPPUNIT_ASSERT(std::all_of(std::begin(visited), std::end(visited), [](int v) { return v == 1; }));
+  }
+
+  static unsigned long long RequestedBytes(const std::vector<std::pair<unsigned int, unsigned int>> &requests)
+  {
+    unsigned long long n = 0;
+    for (const auto &r : requests)
+      n += r.second * sizeof(int);
+    return n;
+  }
+
+public:
+  void setUp() override
+  {
+    std::ofstream f;
+    m_Path = mitk::IOUtil::CreateTemporaryFile(f, std::ios_base::out | std::ios_base::binary, "m2SchedulerXXXXXX.ibd");
+    std::vector<int> values(m_Values);
+    std::iota(std::begin(values), std::end(values), 0);
+    f.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(int));
+  }
+
+  void tearDown() override { itksys::SystemTools::RemoveFile(m_Path); }
+
+  void Run_ContiguousRequests_shouldCoalesce()
+  {
+    // full spectra of a continuous file, in reversed pixel order
+    std::vector<std::pair<unsigned int, unsigned int>> requests;
+    for (unsigned int first = 0; first + 1000 <= m_Values; first += 1000)
+      requests.emplace(std::begin(requests), first, 1000);
+
+    m2::SpectrumReadScheduler scheduler(m_Path);
+    Read(scheduler, requests, 1);
+    CPPUNIT_ASSERT_EQUAL(RequestedBytes(requests), scheduler.GetNumberOfBytesRead());
+    CPPUNIT_ASSERT(scheduler.GetNumberOfBlocks() < requests.size() / 10);
+  }
+
+  void Run_NarrowWindows_shouldNotReadGaps()
+  {
+    // a narrow m/z window in spectra of 4096 values: a few bytes per spectrum, gaps below the maximum gap
+    std::vector<std::pair<unsigned int, unsigned int>> requests;
+    for (unsigned int first = 2000; first + 4 <= m_Values; first += 4096)
+      requests.emplace_back(first, 4);
+
+    m2::SpectrumReadScheduler scheduler(m_Path);
+    CPPUNIT_ASSERT(4092 * sizeof(int) < scheduler.GetMaximumGap());
+    Read(scheduler, requests, 4);
+    CPPUNIT_ASSERT_EQUAL(RequestedBytes(requests), scheduler.GetNumberOfBytesRead());
+    CPPUNIT_ASSERT_EQUAL(requests.size(), scheduler.GetNumberOfBlocks());
+
+    // small gaps are still merged, but never more than half of a read is skipped
+    requests.clear();
+    for (unsigned int first = 0; first + 16 <= m_Values; first += 24)
+      requests.emplace_back(first, 16);
+    scheduler.Clear();
+    Read(scheduler, requests, 4);
+    CPPUNIT_ASSERT(scheduler.GetNumberOfBlocks() < requests.size() / 10);
+    CPPUNIT_ASSERT(scheduler.GetNumberOfBytesRead() <= 2 * RequestedBytes(requests));
+  }
+
+  void Run_SmallFile_shouldSplitWorkAcrossThreads()
+  {
+    // far below the maximum block size, which previously resulted in a single block
+    std::vector<std::pair<unsigned int, unsigned int>> requests;
+    for (unsigned int first = 0; first + 100 <= 100000; first += 100)
+      requests.emplace_back(first, 100);
+
+    const unsigned int threads = 4;
+    m2::SpectrumReadScheduler scheduler(m_Path);
+    Read(scheduler, requests, threads);
+    CPPUNIT_ASSERT(scheduler.GetNumberOfBlocks() >= threads);
+    CPPUNIT_ASSERT_EQUAL(RequestedBytes(requests), scheduler.GetNumberOfBytesRead());
+  }
+
+  void Run_Cancelled_shouldStopEarly()
+  {
+    m2::SpectrumReadScheduler scheduler(m_Path);
+    for (unsigned int i = 0; i < 1000; ++i)
+      scheduler.Add(i * 4096 * sizeof(int), 4 * sizeof(int), i);
+    scheduler.SetCancelCallback([] { return true; });
+
+    std::atomic<unsigned int> visited(0);
+    scheduler.Run(2, [&](unsigned int, unsigned int, const char *) { ++visited; });
+    CPPUNIT_ASSERT_EQUAL(0u, visited.load());
+    CPPUNIT_ASSERT_EQUAL(m2::SpectrumReadScheduler::LengthType(0), scheduler.GetNumberOfBytesRead());
+  }
+};
+
+MITK_TEST_SUITE_REGISTRATION(m2SpectrumReadScheduler)
@@ -20,10 +20,18 @@ set(H_FILES
   
   include/m2SpectrumImage.h
   include/m2ISpectrumImageDataAccess.h
+  include/m2IonImageOptions.h
   include/m2ISpectrumImageSource.h
   
   include/m2ImzMLSpectrumImage.h
   include/m2ImzMLSpectrumImageSource.hpp
+  include/m2ImzMLSpectrumImageView.h
+  include/m2SpectrumProcessingParameters.h
+  include/m2SpectrumReadScheduler.h
+  include/m2ShuffledSpectrumIterator.h
+  include/m2SpectrumCache.h
+  include/m2IonImageCache.h
+  include/m2SparseSpectrumCube.h
   
   include/m2FsmSpectrumImage.h
 
@@ -33,6 +41,7 @@ set(H_FILES
 
   include/signal/m2Baseline.h
   include/signal/m2EstimateFwhm.h
+  include/signal/m2FusedPipeline.h
   include/signal/m2MedianAbsoluteDeviation.h
   include/signal/m2Morphology.h
   include/signal/m2Normalization.h
@@ -41,7 +50,9 @@ set(H_FILES
   include/signal/m2Pooling.h
   include/signal/m2RunningMedian.h
   include/signal/m2SignalCommon.h
+  include/signal/m2SignalKernels.h
   include/signal/m2Smoothing.h
+  include/signal/m2ToleranceBinning.h
   include/signal/m2Transformer.h
 
 )
@@ -52,10 +63,16 @@ set(CPP_FILES
   m2SpectrumImageStack.cpp
   m2CoreObjectFactory.cpp 
   m2ImzMLSpectrumImage.cpp
+  m2ImzMLSpectrumImageView.cpp
   m2FsmSpectrumImage.cpp
   m2SubdivideImage2DFilter.cpp
   m2SpectrumImageDataInteractor.cpp
   m2IntervalVector.cpp
+  m2SpectrumReadScheduler.cpp
+  m2ShuffledSpectrumIterator.cpp
+  m2IonImageCache.cpp
+  m2SignalKernels.cpp
+  m2ToleranceBinning.cpp
   
   IO/m2ImzMLParser.cpp
   IO/m2ImzMLImageIO.cpp
@@ -17,6 +17,7 @@ See LICENSE.txt for details.
 
 #include <mitkDataNode.h>
 #include <mitkLabelSetImage.h>
+#include <cstdint>
 #include <type_traits>
 
 namespace m2
@@ -103,7 +104,9 @@ namespace m2
   {
     None = 0,
     Float = 1,
-    Double = 2
+    Double = 2,
+    Int32 = 3,
+    Int64 = 4
   };
 
   inline std::string to_string(const NumericType &type) noexcept
@@ -116,6 +119,10 @@ namespace m2
         return "Float";
       case NumericType::Double:
         return "Double";
+      case NumericType::Int32:
+        return "Int32";
+      case NumericType::Int64:
+        return "Int64";
     }
     return "";
   }
@@ -130,6 +137,10 @@ namespace m2
         return sizeof(float);
       case NumericType::Double:
         return sizeof(double);
+      case NumericType::Int32:
+        return sizeof(int32_t);
+      case NumericType::Int64:
+        return sizeof(int64_t);
     }
     return 0;
   }
@@ -171,8 +182,10 @@ namespace m2
                                                                 {"Sum", 4},
                                                                 {"Variance", 5},
                                                                 {"PeakIndicators", 6},
-                                                                {"Float", 0},
-                                                                {"Double", 1}};
+                                                                {"Float", 1},
+                                                                {"Double", 2},
+                                                                {"Int32", 3},
+                                                                {"Int64", 4}};
 
   using DisplayImagePixelType = double;
   using NormImagePixelType = double;
@@ -188,6 +201,13 @@ namespace m2
 
   /// m2Utils
 
+  /// @brief Combine the hash of v into seed (boost::hash_combine).
+  template <class T>
+  inline void HashCombine(size_t &seed, const T &v)
+  {
+    seed ^= std::hash<T>()(v) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  }
+
   const auto Find = [](const auto &str, const auto &searchString, auto defaultValue, auto &map)
   {
     auto p = str.find(searchString);
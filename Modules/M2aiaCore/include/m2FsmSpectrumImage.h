@@ -44,7 +44,11 @@ namespace m2
     itkSetEnumMacro(ImageAccessInitialized, bool);
     itkGetEnumMacro(ImageAccessInitialized, bool);
 
-    void GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const override;
+    void GetImage(double mz,
+                  double tol,
+                  const mitk::Image *mask,
+                  mitk::Image *img,
+                  const m2::IonImageOptions &options = {}) const override;
     
 
     struct SpectrumData
@@ -120,7 +124,11 @@ namespace m2
       data = p->GetXAxis();
     }
     
-    void GetImagePrivate(double mz, double tol, const mitk::Image *mask, mitk::Image *image) override;
+    void GetImagePrivate(double mz,
+                         double tol,
+                         const mitk::Image *mask,
+                         mitk::Image *image,
+                         const m2::IonImageOptions &options = {}) override;
     void InitializeImageAccess() override;
     void InitializeGeometry() override;
   };
@@ -15,6 +15,7 @@ See LICENSE.txt for details.
 #pragma once
 
 #include <M2aiaCoreExports.h>
+#include <m2IonImageOptions.h>
 #include <vector>
 
 namespace mitk
@@ -41,7 +42,17 @@ namespace m2
     virtual void GetIntensities(unsigned int id,
                      std::vector<double> &xs) const = 0;
 
-    virtual void GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const = 0;
+    /**
+     * @brief Generate the ion image of the range [mz-tol, mz+tol].
+     * @param mask Optional label image; pixels with label 0 are set to 0.
+     * @param img Target image with the geometry of the spectrum image.
+     * @param options Optional restriction to a region or to a subset of mask labels.
+     */
+    virtual void GetImage(double mz,
+                          double tol,
+                          const mitk::Image *mask,
+                          mitk::Image *img,
+                          const m2::IonImageOptions &options = {}) const = 0;
   };
 
 } // namespace m2
\ No newline at end of file
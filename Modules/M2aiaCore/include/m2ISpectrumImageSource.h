@@ -16,7 +16,14 @@ See LICENSE.txt for details.
 #pragma once
 
 #include <M2aiaCoreExports.h>
+#include <fstream>
+#include <functional>
+#include <m2IonImageOptions.h>
+#include <m2SpectrumCache.h>
+#include <m2SpectrumProcessingParameters.h>
+#include <memory>
 #include <mitkImage.h>
+#include <utility>
 #include <vector>
 #include <signal/m2SignalCommon.h>
 
@@ -31,10 +38,84 @@ namespace m2
     virtual void GetXValues(unsigned int /*id*/, std::vector<float> &) {};
     virtual void GetXValues(unsigned int /*id*/, std::vector<double> &) {};
 
+    /**
+     * @brief Read the spectra with the given ids into row-major (ids.size() x channels) buffers.
+     * Rows are zero padded, longer spectra are truncated. xd may be nullptr.
+     * @param processing Processing applied to the intensities, nullptr for raw intensities.
+     * @param stream Optional file stream of the binary data, used for single threaded reads.
+     */
+    virtual void GetSpectraBatch(const std::vector<unsigned int> & /*ids*/,
+                                 size_t /*channels*/,
+                                 float * /*xd*/,
+                                 float * /*yd*/,
+                                 const m2::SpectrumProcessingParameters * /*processing*/,
+                                 unsigned int /*threads*/,
+                                 std::ifstream * /*stream*/){};
+    virtual void GetSpectraBatch(const std::vector<unsigned int> & /*ids*/,
+                                 size_t /*channels*/,
+                                 double * /*xd*/,
+                                 double * /*yd*/,
+                                 const m2::SpectrumProcessingParameters * /*processing*/,
+                                 unsigned int /*threads*/,
+                                 std::ifstream * /*stream*/){};
+
+    /**
+     * @brief Normalization factor of each spectrum id. The normalization image is
+     * initialized if necessary; concurrent calls are safe.
+     */
+    virtual std::shared_ptr<const std::vector<double>> GetNormalizationFactors(m2::NormalizationStrategyType /*type*/)
+    {
+      return nullptr;
+    };
+
     virtual void InitializeImageAccess() {};
     virtual void InitializeGeometry() {};
-    virtual void GetImagePrivate(double /*x*/ , double  /*tol*/, const mitk::Image * /*mask*/, mitk::Image * /*target*/) {};
+    virtual void GetImagePrivate(double /*x*/,
+                                 double /*tol*/,
+                                 const mitk::Image * /*mask*/,
+                                 mitk::Image * /*target*/,
+                                 const m2::IonImageOptions & /*options*/ = {}){};
+
+    /**
+     * @brief Generate one ion image per range [mz-tol, mz+tol]. The default calls
+     * GetImagePrivate for each range.
+     */
+    virtual void GetImagesPrivate(const std::vector<std::pair<double, double>> &ranges,
+                                  const mitk::Image *mask,
+                                  const std::vector<mitk::Image *> &targets,
+                                  const std::function<bool()> &cancelled = {})
+    {
+      m2::IonImageOptions options;
+      options.Cancelled = cancelled;
+      for (size_t i = 0; i < ranges.size() && !options.IsCancelled(); ++i)
+        GetImagePrivate(ranges[i].first, ranges[i].second, mask, targets[i], options);
+    }
+
+    /**
+     * @brief Generate one ion image per range [mz-tol, mz+tol] into a contiguous
+     * (ranges.size() x pixels) buffer. The buffer layout matches the image buffer (x fastest).
+     * Does not modify the image and may be called concurrently.
+     * @param progress Optional, called with the number of spectra completed since the previous call.
+     * Calls are serialized.
+     */
+    virtual void GetImageArrayPrivate(const std::vector<std::pair<double, double>> & /*ranges*/,
+                                      const mitk::Image * /*mask*/,
+                                      float * /*data*/,
+                                      const m2::SpectrumProcessingParameters & /*processing*/,
+                                      unsigned int /*threads*/,
+                                      const std::function<void(unsigned int)> & /*progress*/){};
+    virtual void GetImageArrayPrivate(const std::vector<std::pair<double, double>> & /*ranges*/,
+                                      const mitk::Image * /*mask*/,
+                                      double * /*data*/,
+                                      const m2::SpectrumProcessingParameters & /*processing*/,
+                                      unsigned int /*threads*/,
+                                      const std::function<void(unsigned int)> & /*progress*/){};
+
     virtual void InitializeNormalizationImage(m2::NormalizationStrategyType /*type*/){};
+
+    virtual void SetSpectrumCacheSize(size_t /*bytes*/) {};
+    virtual void ClearSpectrumCache() {};
+    virtual m2::SpectrumCacheStatistics GetSpectrumCacheStatistics() const { return {}; };
   };
 
 } // namespace m2
\ No newline at end of file
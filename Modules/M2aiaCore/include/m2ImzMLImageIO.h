@@ -80,6 +80,12 @@ namespace m2
     void SetDataTypeYAxis(m2::NumericType type){m_DataTypeYAxis = type;}
     void SetSpectrumFormat(m2::SpectrumFormat type){m_SpectrumFormat = type;}
 
+    /**
+     * @brief Number of threads of the read image, already used by DoRead to initialize the
+     * geometry (e.g. the TIC normalization image). 0 (default) keeps the default of the image.
+     */
+    void SetNumberOfThreads(unsigned int n){m_NumberOfThreads = n;}
+
     ConfidenceLevel GetWriterConfidenceLevel() const override;
     std::string GetIBDOutputPath() const;
     std::string GetImzMLOutputPath() const;
@@ -99,6 +105,7 @@ namespace m2
     m2::NumericType m_DataTypeXAxis = m2::NumericType::Float;
     m2::NumericType m_DataTypeYAxis = m2::NumericType::Float;
     m2::SpectrumFormat m_SpectrumFormat = m2::SpectrumFormat::None;
+    unsigned int m_NumberOfThreads = 0;
 
   
     std::map<std::string, std::string> TextToCodeMap = {{"16-bit float"s, "1000520"s},
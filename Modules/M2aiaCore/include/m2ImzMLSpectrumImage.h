@@ -25,7 +25,7 @@ See LICENSE.txt for details.
 namespace m2
 {
 
-  template <class MassAxisType, class IntensityType>
+  template <class MassAxisType, class IntensityType, class StoredIntensityType = IntensityType>
   class ImzMLSpectrumImageSource;
 
   /**
@@ -91,7 +91,59 @@ namespace m2
     itkGetMacro(Spectra, SpectrumVectorType &);
     itkGetConstReferenceMacro(Spectra, SpectrumVectorType);
 
-    void GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const override;
+    void GetImage(double mz,
+                  double tol,
+                  const mitk::Image *mask,
+                  mitk::Image *img,
+                  const m2::IonImageOptions &options = {}) const override;
+
+    void GetImages(const std::vector<std::pair<double, double>> &ranges,
+                   const mitk::Image *mask,
+                   const std::vector<mitk::Image *> &imgs,
+                   const std::function<bool()> &cancelled = {}) const override;
+
+    /**
+     * @brief Generate one ion image per range (center, tolerance) into a contiguous buffer of
+     * ranges.size() x pixels values, each image in the layout of the image buffer (x fastest).
+     * All spectra are read in a single pass; normalization, smoothing, baseline correction,
+     * intensity transformation and pooling are applied as in GetImage. The image itself is
+     * not modified, so concurrent calls are safe.
+     * @param threads Number of threads, 0 uses GetNumberOfThreads().
+     */
+    void GetImageArrayFloat(const std::vector<std::pair<double, double>> &ranges,
+                            const mitk::Image *mask,
+                            float *data,
+                            unsigned int threads = 0) const;
+
+    /**
+     * @brief See GetImageArrayFloat().
+     */
+    void GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                       const mitk::Image *mask,
+                       double *data,
+                       unsigned int threads = 0) const;
+
+    /**
+     * @brief As above, with the given processing instead of the current settings.
+     * @param progress Optional, called with the number of spectra completed since the previous call.
+     */
+    void GetImageArrayFloat(const std::vector<std::pair<double, double>> &ranges,
+                            const mitk::Image *mask,
+                            float *data,
+                            const m2::SpectrumProcessingParameters &processing,
+                            unsigned int threads = 0,
+                            const std::function<void(unsigned int)> &progress = {}) const;
+    void GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                       const mitk::Image *mask,
+                       double *data,
+                       const m2::SpectrumProcessingParameters &processing,
+                       unsigned int threads = 0,
+                       const std::function<void(unsigned int)> &progress = {}) const;
+
+    /**
+     * @brief Completes a strided (progressive) pass, see m2::IonImageOptions::FillNearest.
+     */
+    void FillNearest(const mitk::Image *mask, mitk::Image *img, const m2::IonImageOptions &options) const;
 
     double GetXMin() const;
     double GetXMax() const;
@@ -150,6 +202,80 @@ namespace m2
      */
     void GetIntensities(unsigned int id, std::vector<double> &xs) const override;
 
+    /**
+     * @brief Read many spectra into one contiguous, row-major (ids.size() x channels) buffer.
+     * Spectra are read in the order of their offsets in the *.ibd file and processed by multiple threads.
+     * Rows are zero padded to channels values, longer spectra are truncated (see GetSpectraBatchChannels()).
+     * @param ids The spectrum IDs, one row each.
+     * @param channels Number of values per row.
+     * @param xs Buffer for the x values or nullptr.
+     * @param ys Buffer for the intensities.
+     * @param processed If true, normalization, smoothing, baseline correction and intensity transformation are applied as in GetIntensities.
+     * @param threads Number of threads, 0 uses GetNumberOfThreads().
+     */
+    void GetSpectraBatchFloat(const std::vector<unsigned int> &ids,
+                              size_t channels,
+                              float *xs,
+                              float *ys,
+                              bool processed = true,
+                              unsigned int threads = 0) const;
+
+    /**
+     * @brief See GetSpectraBatchFloat().
+     */
+    void GetSpectraBatch(const std::vector<unsigned int> &ids,
+                         size_t channels,
+                         double *xs,
+                         double *ys,
+                         bool processed = true,
+                         unsigned int threads = 0) const;
+
+    /**
+     * @brief As above, with the given processing instead of the current settings.
+     * @param processing The processing parameters, nullptr for raw intensities.
+     * @param stream Optional stream of the *.ibd file, reused by single threaded reads.
+     */
+    void GetSpectraBatchFloat(const std::vector<unsigned int> &ids,
+                              size_t channels,
+                              float *xs,
+                              float *ys,
+                              const m2::SpectrumProcessingParameters *processing,
+                              unsigned int threads,
+                              std::ifstream *stream = nullptr) const;
+    void GetSpectraBatch(const std::vector<unsigned int> &ids,
+                         size_t channels,
+                         double *xs,
+                         double *ys,
+                         const m2::SpectrumProcessingParameters *processing,
+                         unsigned int threads,
+                         std::ifstream *stream = nullptr) const;
+
+    /**
+     * @brief The current processing settings, including the normalization factor of each
+     * spectrum. The normalization image is initialized if necessary.
+     */
+    m2::SpectrumProcessingParameters GetProcessingParameters() const;
+
+    /**
+     * @brief Number of channels required to hold the given spectra without truncation.
+     * @param lengths If given, receives the number of values of each spectrum.
+     */
+    size_t GetSpectraBatchChannels(const std::vector<unsigned int> &ids, std::vector<size_t> *lengths = nullptr) const;
+
+    /**
+     * @brief Set the memory budget of the spectrum cache used by GetSpectrum and GetIntensities.
+     * The default is read from the preference "m2aia.signal.SpectrumCacheSize" (in MB).
+     * @param bytes Cache size in bytes, 0 disables caching.
+     */
+    void SetSpectrumCacheSize(size_t bytes);
+
+    /**
+     * @brief Hit/miss statistics of the spectrum cache.
+     */
+    m2::SpectrumCacheStatistics GetSpectrumCacheStatistics() const;
+
+    void ClearSpectrumCache();
+
     std::string GetMzGroupID() const {return m_MzGroupID;}
     std::string GetIntensityGroupID() const {return m_IntensityGroupID;}
 
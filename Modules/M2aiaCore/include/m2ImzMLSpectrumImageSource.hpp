@@ -21,6 +21,9 @@ See LICENSE.txt for details.
 #include <m2ImzMLSpectrumImage.h>
 #include <m2Timer.h>
 #include <m2Process.hpp>
+#include <m2SparseSpectrumCube.h>
+#include <m2SpectrumCache.h>
+#include <m2SpectrumReadScheduler.h>
 #include <mitkCoreServices.h>
 #include <mitkIPreferences.h>
 #include <mitkIPreferencesService.h>
@@ -29,28 +32,82 @@ See LICENSE.txt for details.
 #include <mitkImagePixelWriteAccessor.h>
 #include <mitkLabelSetImage.h>
 #include <mitkProperties.h>
+#include <cstring>
+#include <limits>
 #include <mutex>
+#include <numeric>
+#include <type_traits>
 #include <signal/m2Baseline.h>
+#include <signal/m2FusedPipeline.h>
 #include <signal/m2Morphology.h>
 #include <signal/m2Normalization.h>
 #include <signal/m2PeakDetection.h>
 #include <signal/m2Pooling.h>
 #include <signal/m2RunningMedian.h>
+#include <signal/m2SignalKernels.h>
 #include <signal/m2Smoothing.h>
 #include <signal/m2Transformer.h>
 namespace m2
 {
   class ImzMLSpectrumImage;
 
-  template <class MassAxisType, class IntensityType>
+  /**
+   * @brief Spectrum access for imzML files.
+   * @tparam MassAxisType Type of the m/z values in the *.ibd file.
+   * @tparam IntensityType Type used for processing the intensities.
+   * @tparam StoredIntensityType Type of the intensities in the *.ibd file. Integer
+   * intensities are processed as IntensityType = double.
+   */
+  template <class MassAxisType, class IntensityType, class StoredIntensityType>
   class ImzMLSpectrumImageSource : public m2::ISpectrumImageSource
   {
   private:
     m2::ImzMLSpectrumImage *p;
 
   public:
-    explicit ImzMLSpectrumImageSource(m2::ImzMLSpectrumImage *owner) : p(owner) {}
-    virtual void GetImagePrivate(double mz, double tol, const mitk::Image *mask, mitk::Image *image);
+    explicit ImzMLSpectrumImageSource(m2::ImzMLSpectrumImage *owner) : p(owner)
+    {
+      // memory budget in MB shared by the mass axis and the intensity cache
+      unsigned int cacheSize = 256;
+      if (auto *preferencesService = mitk::CoreServices::GetPreferencesService())
+        if (auto *preferences = preferencesService->GetSystemPreferences())
+          cacheSize = preferences->GetInt("m2aia.signal.SpectrumCacheSize", cacheSize);
+      SetSpectrumCacheSize(size_t(cacheSize) * 1024 * 1024);
+    }
+    void GetImagePrivate(double mz,
+                         double tol,
+                         const mitk::Image *mask,
+                         mitk::Image *image,
+                         const m2::IonImageOptions &options = {}) override;
+
+    /**
+     * @brief Continuous centroid and processed spectra are read once for all ranges.
+     * Profile spectra are processed (smoothing, baseline) on the padded range only, so
+     * a shared read would change the results; they are generated one by one.
+     */
+    void GetImagesPrivate(const std::vector<std::pair<double, double>> &ranges,
+                          const mitk::Image *mask,
+                          const std::vector<mitk::Image *> &targets,
+                          const std::function<bool()> &cancelled = {}) override;
+
+    void GetImageArrayPrivate(const std::vector<std::pair<double, double>> &ranges,
+                              const mitk::Image *mask,
+                              float *data,
+                              const m2::SpectrumProcessingParameters &processing,
+                              unsigned int threads,
+                              const std::function<void(unsigned int)> &progress) override
+    {
+      GetImageArray<float>(ranges, mask, data, processing, threads, progress);
+    }
+    void GetImageArrayPrivate(const std::vector<std::pair<double, double>> &ranges,
+                              const mitk::Image *mask,
+                              double *data,
+                              const m2::SpectrumProcessingParameters &processing,
+                              unsigned int threads,
+                              const std::function<void(unsigned int)> &progress) override
+    {
+      GetImageArray<double>(ranges, mask, data, processing, threads, progress);
+    }
     // void GetSpectrumPrivate(unsigned int, std::vector<float> &, std::vector<float> &, unsigned int) override {}
 
     void InitializeImageAccess() override;
@@ -83,6 +140,14 @@ namespace m2
      */
     virtual void InitializeImageAccessProcessedData();
 
+    /**
+     * @brief Load centroid data into an in-memory sparse cube if enabled by the
+     * preference "m2aia.signal.SparseCentroidCube" and if the data fits into the memory
+     * budget "m2aia.signal.SparseCentroidCubeMemoryBudget" (MB). Otherwise ion images
+     * are read from disk.
+     */
+    virtual void InitializeSparseCube();
+
     /**
      * @brief Calculate and store the normalization image
     */
@@ -105,23 +170,79 @@ namespace m2
       f.read((char *)vec, length * sizeof(DataType));
     }
 
+    /**
+     * @brief Copy binary data provided by the SpectrumReadScheduler to a vector.
+     * @param data Pointer to the first byte of the data.
+     * @param length The number of elements to copy.
+     * @param vec Pointer to the vector to store the data.
+     */
+    template <class LengthType, class DataType>
+    static void bufferToVector(const char *data, LengthType length, DataType *vec) noexcept
+    {
+      std::memcpy(vec, data, length * sizeof(DataType));
+    }
+
+    /**
+     * @brief Copy intensities provided by the SpectrumReadScheduler to a vector and
+     * convert them from StoredIntensityType to IntensityType.
+     * @param data Pointer to the first byte of the data.
+     * @param length The number of elements to copy.
+     * @param vec Pointer to the vector to store the data.
+     */
+    template <class LengthType>
+    static void intensityBufferToVector(const char *data, LengthType length, IntensityType *vec) noexcept
+    {
+      if (std::is_same<StoredIntensityType, IntensityType>::value)
+      {
+        std::memcpy(vec, data, length * sizeof(IntensityType));
+        return;
+      }
+
+      StoredIntensityType v;
+      for (LengthType i = 0; i < length; ++i)
+      {
+        std::memcpy(&v, data + i * sizeof(StoredIntensityType), sizeof(StoredIntensityType));
+        vec[i] = static_cast<IntensityType>(v);
+      }
+    }
+
+    /**
+     * @brief Read intensities from the file stream, see intensityBufferToVector.
+     */
+    template <class OffsetType, class LengthType>
+    static void intensityDataToVector(std::ifstream &f, OffsetType offset, LengthType length, IntensityType *vec)
+    {
+      if (std::is_same<StoredIntensityType, IntensityType>::value)
+      {
+        binaryDataToVector(f, offset, length, vec);
+        return;
+      }
+
+      std::vector<char> buffer(length * sizeof(StoredIntensityType));
+      f.seekg(offset);
+      f.read(buffer.data(), buffer.size());
+      intensityBufferToVector(buffer.data(), length, vec);
+    }
+
     template <class ItXFirst, class ItXLast, class ItYFirst, class ItYLast>
     static inline double GetNormalizationFactor(
       m2::NormalizationStrategyType strategy, ItXFirst xFirst, ItXLast xLast, ItYFirst yFirst, ItYLast yLast)
     {
-      using namespace std;
+      // contiguous data, see m2::Signal::Kernels
+      const size_t nx = std::distance(xFirst, xLast);
+      const size_t ny = std::distance(yFirst, yLast);
       switch (strategy)
       {
         case m2::NormalizationStrategyType::TIC:
-          return m2::Signal::TotalIonCurrent(xFirst, xLast, yFirst);
+          return nx ? m2::Signal::Kernels::TotalIonCurrent(&*xFirst, &*yFirst, nx) : 0;
         case m2::NormalizationStrategyType::Sum:
-          return accumulate(yFirst, yLast, double(0.0));
+          return ny ? m2::Signal::Kernels::Sum(&*yFirst, ny) : 0;
         case m2::NormalizationStrategyType::Mean:
-          return accumulate(yFirst, yLast, double(0.0)) / double(std::distance(yFirst, yLast));
+          return (ny ? m2::Signal::Kernels::Sum(&*yFirst, ny) : 0) / double(ny);
         case m2::NormalizationStrategyType::Max:
-          return *max_element(yFirst, yLast);
+          return ny ? m2::Signal::Kernels::Maximum(&*yFirst, ny) : 0;
         case m2::NormalizationStrategyType::RMS:
-          return m2::Signal::RootMeanSquare(yFirst, yLast);
+          return std::sqrt((ny ? m2::Signal::Kernels::SumOfSquares(&*yFirst, ny) : 0) / double(ny));
         case m2::NormalizationStrategyType::None:
         case m2::NormalizationStrategyType::Internal:
         case m2::NormalizationStrategyType::External:
@@ -141,18 +262,252 @@ namespace m2
     virtual void GetXValues(unsigned int id, std::vector<float> &yd) { GetXValues<float>(id, yd); }
     virtual void GetXValues(unsigned int id, std::vector<double> &yd) { GetXValues<double>(id, yd); }
 
+    void GetSpectraBatch(const std::vector<unsigned int> &ids,
+                         size_t channels,
+                         float *xd,
+                         float *yd,
+                         const m2::SpectrumProcessingParameters *processing,
+                         unsigned int threads,
+                         std::ifstream *stream) override
+    {
+      GetSpectraBatch<float>(ids, channels, xd, yd, processing, threads, stream);
+    }
+    void GetSpectraBatch(const std::vector<unsigned int> &ids,
+                         size_t channels,
+                         double *xd,
+                         double *yd,
+                         const m2::SpectrumProcessingParameters *processing,
+                         unsigned int threads,
+                         std::ifstream *stream) override
+    {
+      GetSpectraBatch<double>(ids, channels, xd, yd, processing, threads, stream);
+    }
+
+    std::shared_ptr<const std::vector<double>> GetNormalizationFactors(m2::NormalizationStrategyType type) override;
+
+    void SetSpectrumCacheSize(size_t bytes) override
+    {
+      m_XCache.SetCapacity(bytes / 4);
+      m_YCache.SetCapacity(bytes - bytes / 4);
+    }
+
+    void ClearSpectrumCache() override
+    {
+      m_XCache.Clear();
+      m_YCache.Clear();
+    }
+
+    m2::SpectrumCacheStatistics GetSpectrumCacheStatistics() const override
+    {
+      auto stats = m_XCache.GetStatistics();
+      stats += m_YCache.GetStatistics();
+      return stats;
+    }
+
   private:
+    /// @brief Optional in-memory representation of centroid data, see InitializeSparseCube()
+    m2::SparseSpectrumCube<IntensityType> m_SparseCube;
+
+    /// @brief Mass axes, keyed by their offset in the *.ibd file; continuous data share one entry.
+    m2::SpectrumCache<MassAxisType> m_XCache;
+
+    /// @brief Processed intensities, keyed by spectrum id and ProcessingParameterHash().
+    m2::SpectrumCache<IntensityType> m_YCache;
+
+    /// @brief Hash of all parameters that influence the result of GetYValues.
+    size_t ProcessingParameterHash() const
+    {
+      size_t seed = 0;
+      m2::HashCombine(seed, static_cast<unsigned int>(p->GetNormalizationStrategy()));
+      m2::HashCombine(seed, static_cast<unsigned int>(p->GetSmoothingStrategy()));
+      m2::HashCombine(seed, p->GetSmoothingHalfWindowSize());
+      m2::HashCombine(seed, static_cast<unsigned int>(p->GetBaselineCorrectionStrategy()));
+      m2::HashCombine(seed, p->GetBaseLineCorrectionHalfWindowSize());
+      m2::HashCombine(seed, static_cast<unsigned int>(p->GetIntensityTransformationStrategy()));
+      return seed;
+    }
+
+    using SpectrumWorkerType = std::function<void(
+      unsigned int t, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)>;
+
+    /**
+     * @brief Read the spectra with the given ids in the order of their offsets in the *.ibd file.
+     * Each thread owns the vectors passed to the worker; they are reused for the next spectrum.
+     * @param ids Indices into the spectrum meta data vector.
+     * @param readMzs If false, only intensities are read and the mzs vector is left empty.
+     * @param threads Number of processing threads.
+     * @param worker Called once for each spectrum.
+     * @param cancelled Optional, reading stops early if it returns true.
+     */
+    void ReadSpectra(const std::vector<unsigned int> &ids,
+                     bool readMzs,
+                     unsigned int threads,
+                     const SpectrumWorkerType &worker,
+                     const std::function<bool()> &cancelled = {});
+
     template <class OutputType>
     void GetYValues(unsigned int id, std::vector<OutputType> &yd);
     template <class OutputType>
     void GetXValues(unsigned int id, std::vector<OutputType> &xd);
+
+    /// @brief Guards the lazy initialization of normalization images in GetNormalizationFactors.
+    std::mutex m_NormalizationMutex;
+
+    /**
+     * @brief Processing chain of GetYValues, configured by SpectrumProcessingParameters
+     * instead of the current settings of the image.
+     */
+    class Processing
+    {
+    public:
+      explicit Processing(const m2::SpectrumProcessingParameters &parameters) : m_Parameters(parameters)
+      {
+        m_Smoother.Initialize(parameters.Smoothing, parameters.SmoothingHalfWindowSize);
+        m_BaselineSubtractor.Initialize(parameters.BaselineCorrection, parameters.BaselineCorrectionHalfWindowSize);
+        m_Transformer.Initialize(parameters.IntensityTransformation);
+      }
+
+      const m2::SpectrumProcessingParameters &GetParameters() const { return m_Parameters; }
+      std::vector<double> GetSmoothingKernel() const { return m_Smoother.GetKernel(); }
+
+      IntensityType GetNormalizationFactor(unsigned int id) const
+      {
+        return m_Parameters.UseNormalization() ? IntensityType((*m_Parameters.NormalizationFactors)[id])
+                                               : IntensityType(1);
+      }
+
+      /// @brief Normalization, smoothing, baseline correction and intensity transformation.
+      void operator()(IntensityType norm, std::vector<IntensityType> &ints, std::vector<IntensityType> &baseline)
+      {
+        if (m_Parameters.UseNormalization())
+          std::transform(std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
+        m_Smoother(std::begin(ints), std::end(ints));
+        baseline.resize(ints.size());
+        m_BaselineSubtractor(std::begin(ints), std::end(ints), std::begin(baseline));
+        m_Transformer(std::begin(ints), std::end(ints));
+      }
+
+    private:
+      const m2::SpectrumProcessingParameters &m_Parameters;
+      m2::Signal::SmoothingFunctor<IntensityType> m_Smoother;
+      m2::Signal::BaselineFunctor<IntensityType> m_BaselineSubtractor;
+      m2::Signal::IntensityTransformationFunctor<IntensityType> m_Transformer;
+    };
+
+    /**
+     * @brief All spectra are read once for all ranges. Profile spectra are read from the first
+     * to the last range (plus padding); each range is then processed on its own padded subrange
+     * as in GetImagePrivate, so the results are identical for equal processing parameters.
+     */
+    template <class OutputType>
+    void GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                       const mitk::Image *mask,
+                       OutputType *data,
+                       const m2::SpectrumProcessingParameters &parameters,
+                       unsigned int threads,
+                       const std::function<void(unsigned int)> &progress);
+
+    /**
+     * @brief Spectra are read through ReadSpectra (offset order, one file handle per reader) and
+     * written directly into the output rows. A single thread reads sequentially from the given
+     * stream instead. Continuous spectra share the cached mass axis. The spectrum cache is
+     * bypassed, batches are usually read once.
+     */
+    template <class OutputType>
+    void GetSpectraBatch(const std::vector<unsigned int> &ids,
+                         size_t channels,
+                         OutputType *xd,
+                         OutputType *yd,
+                         const m2::SpectrumProcessingParameters *parameters,
+                         unsigned int threads,
+                         std::ifstream *stream);
   };
 
 } // namespace m2
 
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeNormalizationImage(m2::NormalizationStrategyType type){
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::ReadSpectra(const std::vector<unsigned int> &ids,
+                                                                            bool readMzs,
+                                                                            unsigned int threads,
+                                                                            const SpectrumWorkerType &worker,
+                                                                            const std::function<bool()> &cancelled)
+{
+  const auto &spectra = p->GetSpectra();
+  m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+  scheduler.Reserve(ids.size());
+  scheduler.SetCancelCallback(cancelled);
+
+  // Mass axis and intensities are read with a single request if both arrays
+  // are stored next to each other (the common layout of processed imzML files).
+  const auto joinedRange = [&](const auto &spectrum)
+  {
+    const auto mzEnd = spectrum.mzOffset + spectrum.mzLength * sizeof(MassAxisType);
+    const auto intEnd = spectrum.intOffset + spectrum.intLength * sizeof(StoredIntensityType);
+    const auto first = std::min(spectrum.mzOffset, spectrum.intOffset);
+    return std::make_pair(first, std::max(mzEnd, intEnd) - first);
+  };
+
+  bool joined = readMzs;
+  for (unsigned int i = 0; joined && i < ids.size(); ++i)
+  {
+    const auto &spectrum = spectra[ids[i]];
+    const auto bytes = spectrum.mzLength * sizeof(MassAxisType) + spectrum.intLength * sizeof(StoredIntensityType);
+    joined = joinedRange(spectrum).second <= bytes + scheduler.GetMaximumGap();
+  }
+
+  for (auto id : ids)
+  {
+    const auto &spectrum = spectra[id];
+    if (joined)
+    {
+      const auto range = joinedRange(spectrum);
+      scheduler.Add(range.first, range.second, id);
+    }
+    else
+    {
+      scheduler.Add(spectrum.intOffset, spectrum.intLength * sizeof(StoredIntensityType), id);
+    }
+  }
+
+  std::vector<std::vector<MassAxisType>> mzsT(threads);
+  std::vector<std::vector<IntensityType>> intsT(threads);
+  std::vector<std::ifstream> filesT(threads);
+
+  scheduler.Run(threads,
+                [&](unsigned int t, unsigned int id, const char *data)
+                {
+                  const auto &spectrum = spectra[id];
+                  auto &mzs = mzsT[t];
+                  auto &ints = intsT[t];
+                  ints.resize(spectrum.intLength);
+
+                  if (joined)
+                  {
+                    const auto first = joinedRange(spectrum).first;
+                    mzs.resize(spectrum.mzLength);
+                    bufferToVector(data + (spectrum.mzOffset - first), spectrum.mzLength, mzs.data());
+                    intensityBufferToVector(data + (spectrum.intOffset - first), spectrum.intLength, ints.data());
+                  }
+                  else
+                  {
+                    intensityBufferToVector(data, spectrum.intLength, ints.data());
+                    if (readMzs)
+                    {
+                      // fallback for files storing all mass axes apart from the intensities
+                      if (!filesT[t].is_open())
+                        filesT[t].open(p->GetBinaryDataPath(), std::ios::binary);
+                      mzs.resize(spectrum.mzLength);
+                      binaryDataToVector(filesT[t], spectrum.mzOffset, spectrum.mzLength, mzs.data());
+                    }
+                  }
+
+                  worker(t, id, mzs, ints);
+                });
+}
+
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeNormalizationImage(m2::NormalizationStrategyType type){
 
   // initialize the normalization iamge
   auto image = p->GetNormalizationImage(type);
@@ -167,44 +522,52 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeNormal
   int threads = p->GetNumberOfThreads();
   using namespace std;
 
-  // split image in individual regions and process in parallel each spectrum
-  Process::Map(
-    spectra.size(),
-    threads,
-    [&](unsigned int /*thread*/, unsigned int a, unsigned int b)
-    {
-      
-      
-      ifstream f(p->GetBinaryDataPath(), ifstream::binary);
-      vector<MassAxisType> mzs;
-      vector<IntensityType> ints;
+  // these factors do not depend on the spectrum data
+  if (type == NormalizationStrategyType::None || type == NormalizationStrategyType::Internal ||
+      type == NormalizationStrategyType::External)
+  {
+    for (const auto &spectrum : spectra)
+      accNorm->SetPixelByIndex(spectrum.index,
+                               type == NormalizationStrategyType::Internal ? spectrum.inFileNormalizationFactor : 1.0);
+    return;
+  }
 
-      for (unsigned long int i = a; i < b; i++)
-      {
-        auto &spectrum = spectra[i];
-
-        mzs.resize(spectrum.mzLength);
-        ints.resize(spectrum.intLength);
-        binaryDataToVector(f, spectrum.mzOffset, spectrum.mzLength, mzs.data());
-        binaryDataToVector(f, spectrum.intOffset, spectrum.intLength, ints.data());
-
-        double v;       
-        if(type == NormalizationStrategyType::Internal)
-          v = spectrum.inFileNormalizationFactor;
-        else
-           v = GetNormalizationFactor(type, begin(mzs), end(mzs), begin(ints), end(ints));
-        
-        accNorm->SetPixelByIndex(spectrum.index, v); 
-      }
-    });
+  // continuous data share a single mass axis that is read only once
+  const bool sharedMassAxis = all_of(begin(spectra),
+                                     end(spectra),
+                                     [&](const auto &spectrum) { return spectrum.mzOffset == spectra[0].mzOffset; });
+  const bool useMassAxis = type == NormalizationStrategyType::TIC;
+  vector<MassAxisType> sharedMzs;
+  if (useMassAxis && sharedMassAxis)
+  {
+    ifstream f(p->GetBinaryDataPath(), ifstream::binary);
+    sharedMzs.resize(spectra[0].mzLength);
+    binaryDataToVector(f, spectra[0].mzOffset, spectra[0].mzLength, sharedMzs.data());
+  }
+
+  vector<unsigned int> ids(spectra.size());
+  iota(begin(ids), end(ids), 0);
+
+  // process each spectrum in parallel, in order of the binary data offsets
+  ReadSpectra(ids,
+              useMassAxis && !sharedMassAxis,
+              threads,
+              [&](unsigned int /*thread*/, unsigned int id, vector<MassAxisType> &mzs, vector<IntensityType> &ints)
+              {
+                const auto &xs = sharedMassAxis ? sharedMzs : mzs;
+                double v = GetNormalizationFactor(type, begin(xs), end(xs), begin(ints), end(ints));
+                accNorm->SetPixelByIndex(spectra[id].index, v);
+              });
 
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetImagePrivate(double xRangeCenter,
-                                                                                double xRangeTol,
-                                                                                const mitk::Image *mask,
-                                                                                mitk::Image *destImage)
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::GetImagePrivate(
+  double xRangeCenter,
+  double xRangeTol,
+  const mitk::Image *mask,
+  mitk::Image *destImage,
+  const m2::IonImageOptions &options)
 {
 
   // Check normalization strategy
@@ -218,7 +581,9 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetImagePrivate(
     p->SetNormalizationImageStatus(currentType, true);
   } 
 
-  AccessByItk(destImage, [](auto itkImg) { itkImg->FillBuffer(0); });
+  // a restricted request only overwrites the selected pixels
+  if (!options.IsRestricted())
+    AccessByItk(destImage, [](auto itkImg) { itkImg->FillBuffer(0); });
   using namespace m2;
   // accessors
   mitk::ImagePixelWriteAccessor<DisplayImagePixelType, 3> imageAccess(destImage);
@@ -233,10 +598,54 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetImagePrivate(
   
   // Profile (continuous) spectrum
   const auto spectrumType = p->GetSpectrumType();
-  const unsigned threads = p->GetNumberOfThreads();
+  const unsigned threads = options.GetThreads(p->GetNumberOfThreads());
+  const auto &spectra = p->GetSpectra();
+
+  // collect spectra inside of the mask; pixels outside of the mask remain 0
+  std::vector<unsigned int> ids;
+  ids.reserve(spectra.size());
+  for (unsigned int i = 0; i < spectra.size(); ++i)
+  {
+    const auto &index = spectra[i].index;
+    if (!options.IsInside(index) || !options.IsSampled(index))
+      continue;
+
+    if (maskAccess && !options.Labels.empty())
+    {
+      if (options.IsLabelSelected(maskAccess->GetPixelByIndex(index)))
+      {
+        imageAccess.SetPixelByIndex(index, 0);
+        ids.push_back(i);
+      }
+      continue;
+    }
+
+    if (options.IsRestricted())
+      imageAccess.SetPixelByIndex(index, 0);
+    if (!maskAccess || maskAccess->GetPixelByIndex(index) != 0)
+      ids.push_back(i);
+  }
+
+  if (options.IsCancelled())
+    return;
 
+  // centroid data held in memory: the ion image is a gather over the peaks in range
+  if (!m_SparseCube.IsEmpty() && m2::SparseSpectrumCube<IntensityType>::SupportsPooling(p->GetRangePoolingStrategy()))
+  {
+    std::vector<double> values;
+    m_SparseCube.Query(
+      xRangeCenter - xRangeTol, xRangeCenter + xRangeTol, p->GetRangePoolingStrategy(), threads, values);
+    for (auto id : ids)
+    {
+      const auto &spectrum = spectra[id];
+      double val = values[id];
+      if (useNormalization)
+        val /= IntensityType(normAccess.GetPixelByIndex(spectrum.index));
+      imageAccess.SetPixelByIndex(spectrum.index, val);
+    }
+  }
 
-  if (spectrumType.Format == m2::SpectrumFormat::ContinuousProfile)
+  else if (spectrumType.Format == m2::SpectrumFormat::ContinuousProfile)
   {
     // xRangeCenter subrange
     const auto mzs = p->GetXAxis();
@@ -253,7 +662,9 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetImagePrivate(
     // 2) Subrange from '(' to ')' with center 'c', offset left '>' and offset right '<'
     // |>>>>>>>>>>>>>>>(********c********)<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<|
     auto subRes = m2::Signal::Subrange(mzs, xRangeCenter - xRangeTol, xRangeCenter + xRangeTol);
-    
+    if (subRes.second == 0)
+      return;
+
     const unsigned int offset_right = (mzs.size() - (subRes.first + subRes.second));
     const unsigned int offset_left = subRes.first;
 
@@ -269,118 +680,277 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetImagePrivate(
     // 4) We read data from the *ibd from '[' to ']' using a padded left offset
     // Continue at 5.
     const auto newLength = subRes.second + padding_left + padding_right;
-    const auto newOffsetModifier = (subRes.first - padding_left) * sizeof(IntensityType);
+    const auto newOffsetModifier = (subRes.first - padding_left) * sizeof(StoredIntensityType);
 
-    const auto &spectra = p->GetSpectra();
-    m2::Process::Map(spectra.size(),
-                     threads,
-                     [&](auto /*id*/, auto a, auto b)
-                     {
-                       std::ifstream f(p->GetBinaryDataPath(), std::iostream::binary);
-                       std::vector<IntensityType> ints(newLength);
-                       std::vector<IntensityType> baseline(newLength);
-                       // 5) (For a specific thread), save the true range positions '(' and ')'
-                       // for pooling in the data vector. Continue at 6.
-                       // |>>>>>>>>>[^^^^^(********c********)^^^^^]<<<<<<<<<<<<<<<<<<<<<<<<<|
-                       auto s = std::next(std::begin(ints), padding_left);
-                       auto e = std::prev(std::end(ints), padding_right);
-
-                       for (unsigned int i = a; i < b; ++i)
-                       {
-                         const auto &spectrum = spectra[i];
-
-                         // check if outside of mask
-                         if (maskAccess && maskAccess->GetPixelByIndex(spectrum.index) == 0)
-                         {
-                           imageAccess.SetPixelByIndex(spectrum.index, 0);
-                           continue;
-                         }
-                         // 6) (For a specific pixel) recalculate the new offset
-                         // |>>>>>>>>>[^^^^^(********c********)^^^^^]<<<<<<<<<<<<<<<<<<<<<<<<<|
-                         const auto newOffset = spectrum.intOffset + newOffsetModifier; // new offset
-                         binaryDataToVector(f, newOffset, newLength, ints.data());
-
-                         // ----- Normalization
-                         if (useNormalization)
-                         { // check if it is not NormalizationStrategy::None.
-                           IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
-                           std::transform(
-                             std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
-                         }
-                        
-                         // ----- Smoothing
-                         m_Smoother(std::begin(ints), std::end(ints));
-
-                         // ----- Baseline Substraction
-                         m_BaselineSubtractor(std::begin(ints), std::end(ints), std::begin(baseline));
-
-                         // ----- Intensity Transformation
-                         m_Transformer(std::begin(ints), std::end(ints));
-
-                         // ----- Pool the range
-                         const auto val = Signal::RangePooling<IntensityType>(s, e, p->GetRangePoolingStrategy());
-
-                         // finally set the pixel value
-                         imageAccess.SetPixelByIndex(spectrum.index, val);
-                       }
-                     });
-  }
-
-  else if (any(spectrumType.Format & (m2::SpectrumFormat::ContinuousCentroid | m2::SpectrumFormat::ProcessedCentroid |
-                                      m2::SpectrumFormat::ProcessedProfile)))
+    // 5) (For a specific pixel) recalculate the new offset. Requests are
+    // issued in the order of the offsets in the *.ibd file.
+    // |>>>>>>>>>[^^^^^(********c********)^^^^^]<<<<<<<<<<<<<<<<<<<<<<<<<|
+    m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+    scheduler.Reserve(ids.size());
+    scheduler.SetCancelCallback(options.Cancelled);
+    for (auto id : ids)
+      scheduler.Add(spectra[id].intOffset + newOffsetModifier, newLength * sizeof(StoredIntensityType), id);
+
+    std::vector<std::vector<IntensityType>> intsT(threads, std::vector<IntensityType>(newLength));
+    std::vector<std::vector<IntensityType>> baselineT(threads, std::vector<IntensityType>(newLength));
+
+    // common configurations are processed by a fused kernel, the others by the chain below
+    m2::Signal::FusedPipeline<IntensityType> fused;
+    std::vector<std::vector<IntensityType>> workT;
+    if (fused.Initialize(useNormalization,
+                         m_Smoother.GetKernel(),
+                         _BaseLineCorrectionStrategy,
+                         _BaselineCorrectionHWS,
+                         p->GetIntensityTransformationStrategy(),
+                         p->GetRangePoolingStrategy()))
+      workT.resize(threads, std::vector<IntensityType>(newLength));
+
+    scheduler.Run(threads,
+                  [&](unsigned int t, unsigned int id, const char *data)
+                  {
+                    const auto &spectrum = spectra[id];
+                    auto &ints = intsT[t];
+                    intensityBufferToVector(data, newLength, ints.data());
+
+                    if (fused.IsFused())
+                    {
+                      const IntensityType norm = useNormalization ? normAccess.GetPixelByIndex(spectrum.index) : 1;
+                      imageAccess.SetPixelByIndex(
+                        spectrum.index,
+                        fused(ints, padding_left, newLength - padding_right, norm, workT[t], baselineT[t]));
+                      return;
+                    }
+
+                    // 6) Save the true range positions '(' and ')' for pooling in the data vector.
+                    // |>>>>>>>>>[^^^^^(********c********)^^^^^]<<<<<<<<<<<<<<<<<<<<<<<<<|
+                    auto s = std::next(std::begin(ints), padding_left);
+                    auto e = std::prev(std::end(ints), padding_right);
+
+                    // ----- Normalization
+                    if (useNormalization)
+                    { // check if it is not NormalizationStrategy::None.
+                      IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
+                      std::transform(
+                        std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
+                    }
+
+                    // ----- Smoothing
+                    m_Smoother(std::begin(ints), std::end(ints));
+
+                    // ----- Baseline Substraction
+                    m_BaselineSubtractor(std::begin(ints), std::end(ints), std::begin(baselineT[t]));
+
+                    // ----- Intensity Transformation
+                    m_Transformer(std::begin(ints), std::end(ints));
+
+                    // ----- Pool the range
+                    const auto val = Signal::RangePooling<IntensityType>(s, e, p->GetRangePoolingStrategy());
+
+                    // finally set the pixel value
+                    imageAccess.SetPixelByIndex(spectrum.index, val);
+                  });
+  }
+
+  else if (spectrumType.Format == m2::SpectrumFormat::ContinuousCentroid)
   {
-    const auto &spectra = p->GetSpectra();
-    m2::Process::Map(
-      spectra.size(),
-      threads,
-      [&](auto /*id*/, auto a, auto b)
+    // all spectra share the mass axis, the subrange is the same for each pixel
+    const auto &mzs = p->GetXAxis();
+    const auto subRes = m2::Signal::Subrange(mzs, xRangeCenter - xRangeTol, xRangeCenter + xRangeTol);
+    if (subRes.second == 0)
+      return;
+
+    m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+    scheduler.Reserve(ids.size());
+    scheduler.SetCancelCallback(options.Cancelled);
+    for (auto id : ids)
+      scheduler.Add(spectra[id].intOffset + subRes.first * sizeof(StoredIntensityType), subRes.second * sizeof(StoredIntensityType), id);
+
+    std::vector<std::vector<IntensityType>> intsT(threads, std::vector<IntensityType>(subRes.second));
+    scheduler.Run(threads,
+                  [&](unsigned int t, unsigned int id, const char *data)
+                  {
+                    const auto &spectrum = spectra[id];
+                    auto &ints = intsT[t];
+                    intensityBufferToVector(data, subRes.second, ints.data());
+
+                    if (useNormalization)
+                    {
+                      IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
+                      std::transform(
+                        std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
+                    }
+
+                    auto val = Signal::RangePooling<IntensityType>(
+                      std::begin(ints), std::end(ints), p->GetRangePoolingStrategy());
+                    imageAccess.SetPixelByIndex(spectrum.index, val);
+                  });
+  }
+
+  else if (any(spectrumType.Format & (m2::SpectrumFormat::ProcessedCentroid | m2::SpectrumFormat::ProcessedProfile)))
+  {
+    ReadSpectra(ids,
+                true,
+                threads,
+                [&](unsigned int /*t*/, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)
+                {
+                  const auto &spectrum = spectra[id];
+                  auto subRes = m2::Signal::Subrange(mzs, xRangeCenter - xRangeTol, xRangeCenter + xRangeTol);
+                  if (subRes.second == 0)
+                    return;
+
+                  auto s = std::next(std::begin(ints), subRes.first);
+                  auto e = std::next(s, subRes.second);
+
+                  // TODO: Is it useful to normalize centroid data?
+                  if (useNormalization)
+                  {
+                    IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
+                    std::transform(s, e, s, [&norm](auto &v) { return v / norm; });
+                  }
+
+                  auto val = Signal::RangePooling<IntensityType>(s, e, p->GetRangePoolingStrategy());
+                  imageAccess.SetPixelByIndex(spectrum.index, val);
+                },
+                options.Cancelled);
+  }
+}
+
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::GetImagesPrivate(
+  const std::vector<std::pair<double, double>> &ranges,
+  const mitk::Image *mask,
+  const std::vector<mitk::Image *> &targets,
+  const std::function<bool()> &cancelled)
+{
+  const auto format = p->GetSpectrumType().Format;
+  const bool sharedRead = m_SparseCube.IsEmpty() && ranges.size() > 1 &&
+                          (format == m2::SpectrumFormat::ContinuousCentroid ||
+                           any(format & (m2::SpectrumFormat::ProcessedCentroid | m2::SpectrumFormat::ProcessedProfile)));
+  if (!sharedRead)
+  {
+    // keep the selection of the displayed ion image
+    auto center = p->GetProperty("m2aia.xs.selection.center");
+    auto tolerance = p->GetProperty("m2aia.xs.selection.tolerance");
+    ISpectrumImageSource::GetImagesPrivate(ranges, mask, targets, cancelled);
+    if (center && tolerance)
+    {
+      p->SetProperty("m2aia.xs.selection.center", center);
+      p->SetProperty("m2aia.xs.selection.tolerance", tolerance);
+    }
+    return;
+  }
+
+  bool useNormalization = p->GetNormalizationStrategy() != m2::NormalizationStrategyType::None;
+  auto currentType = p->GetNormalizationStrategy();
+  if (!p->GetNormalizationImageStatus(currentType))
+  {
+    InitializeNormalizationImage(currentType);
+    p->SetNormalizationImageStatus(currentType, true);
+  }
+
+  using namespace m2;
+  using WriteAccessorType = mitk::ImagePixelWriteAccessor<DisplayImagePixelType, 3>;
+  std::vector<std::shared_ptr<WriteAccessorType>> imageAccess;
+  for (auto *target : targets)
+  {
+    AccessByItk(target, [](auto itkImg) { itkImg->FillBuffer(0); });
+    imageAccess.push_back(std::make_shared<WriteAccessorType>(target));
+  }
+  mitk::ImagePixelReadAccessor<NormImagePixelType, 3> normAccess(p->GetNormalizationImage());
+  std::shared_ptr<mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType, 3>> maskAccess;
+  if (mask)
+    maskAccess.reset(new mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType, 3>(mask));
+
+  const unsigned threads = p->GetNumberOfThreads();
+  const auto &spectra = p->GetSpectra();
+  const auto pooling = p->GetRangePoolingStrategy();
+
+  std::vector<unsigned int> ids;
+  ids.reserve(spectra.size());
+  for (unsigned int i = 0; i < spectra.size(); ++i)
+    if (!maskAccess || maskAccess->GetPixelByIndex(spectra[i].index) != 0)
+      ids.push_back(i);
+
+  std::vector<std::pair<double, double>> windows;
+  for (const auto &range : ranges)
+    windows.emplace_back(range.first - range.second, range.first + range.second);
+
+  const auto normalize = [&](const auto &spectrum, std::vector<IntensityType> &ints)
+  {
+    if (!useNormalization)
+      return;
+    IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
+    std::transform(std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
+  };
+
+  if (format == m2::SpectrumFormat::ContinuousCentroid)
+  {
+    // read the union of all ranges once per spectrum
+    const auto &mzs = p->GetXAxis();
+    std::vector<std::pair<unsigned int, unsigned int>> subRanges;
+    m2::Signal::Subranges(mzs, windows, subRanges);
+    unsigned int first = std::numeric_limits<unsigned int>::max(), last = 0;
+    for (const auto &r : subRanges)
+      if (r.second > 0)
       {
-        std::ifstream f(p->GetBinaryDataPath(), std::iostream::binary);
-        std::vector<IntensityType> ints;
-        std::vector<MassAxisType> mzs;
-        for (unsigned int i = a; i < b; ++i)
-        {
-          auto &spectrum = spectra[i];
-          if (maskAccess && maskAccess->GetPixelByIndex(spectrum.index) == 0)
-          {
-            imageAccess.SetPixelByIndex(spectrum.index, 0);
-            continue;
-          }
-
-          mzs.resize(spectrum.mzLength);
-          binaryDataToVector(
-            f, spectrum.mzOffset, spectrum.mzLength, mzs.data()); // !! read mass axis for each spectrum
-
-          auto subRes = m2::Signal::Subrange(mzs, xRangeCenter - xRangeTol, xRangeCenter + xRangeTol);
-          if (subRes.second == 0)
-          {
-            imageAccess.SetPixelByIndex(spectrum.index, 0);
-            continue;
-          }
-
-          ints.resize(subRes.second);
-          binaryDataToVector(f, spectrum.intOffset + subRes.first * sizeof(IntensityType), subRes.second, ints.data());
-
-          // TODO: Is it useful to normalize centroid data?
-          if (useNormalization)
-          {
-            IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
-            std::transform(std::begin(ints),
-                           std::end(ints),
-                           std::begin(ints),
-                           [&norm](auto &v) { return v / norm; });
-          }
-
-          auto val =
-            Signal::RangePooling<IntensityType>(std::begin(ints), std::end(ints), p->GetRangePoolingStrategy());
-          imageAccess.SetPixelByIndex(spectrum.index, val);
-        }
-      });
+        first = std::min(first, r.first);
+        last = std::max(last, r.first + r.second);
+      }
+    if (first >= last)
+      return;
+    const unsigned int length = last - first;
+
+    m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+    scheduler.Reserve(ids.size());
+    scheduler.SetCancelCallback(cancelled);
+    for (auto id : ids)
+      scheduler.Add(spectra[id].intOffset + first * sizeof(StoredIntensityType), length * sizeof(StoredIntensityType), id);
+
+    std::vector<std::vector<IntensityType>> intsT(threads, std::vector<IntensityType>(length));
+    scheduler.Run(threads,
+                  [&](unsigned int t, unsigned int id, const char *data)
+                  {
+                    const auto &spectrum = spectra[id];
+                    auto &ints = intsT[t];
+                    intensityBufferToVector(data, length, ints.data());
+                    normalize(spectrum, ints);
+                    for (size_t k = 0; k < subRanges.size(); ++k)
+                    {
+                      if (subRanges[k].second == 0)
+                        continue;
+                      auto s = std::next(std::begin(ints), subRanges[k].first - first);
+                      auto e = std::next(s, subRanges[k].second);
+                      imageAccess[k]->SetPixelByIndex(spectrum.index, Signal::RangePooling<IntensityType>(s, e, pooling));
+                    }
+                  });
+  }
+  else
+  {
+    std::vector<std::vector<std::pair<unsigned int, unsigned int>>> subRangesT(threads);
+    ReadSpectra(ids,
+                true,
+                threads,
+                [&](unsigned int t, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)
+                {
+                  const auto &spectrum = spectra[id];
+                  auto &subRanges = subRangesT[t];
+                  m2::Signal::Subranges(mzs, windows, subRanges);
+                  normalize(spectrum, ints);
+                  for (size_t k = 0; k < subRanges.size(); ++k)
+                  {
+                    if (subRanges[k].second == 0)
+                      continue;
+                    auto s = std::next(std::begin(ints), subRanges[k].first);
+                    auto e = std::next(s, subRanges[k].second);
+                    imageAccess[k]->SetPixelByIndex(spectrum.index, Signal::RangePooling<IntensityType>(s, e, pooling));
+                  }
+                },
+                cancelled);
   }
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeGeometry()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeGeometry()
 {
   std::array<itk::SizeValueType, 3> imageSize = {p->GetPropertyValue<unsigned int>("[IMS:1000042] max count of pixels x"),
                                                  p->GetPropertyValue<unsigned int>("[IMS:1000043] max count of pixels y"),
@@ -492,10 +1062,13 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeGeomet
   acc.SetPixelByIndex({max_dim0 - 1, max_dim1 - 1, 0}, max_dim1 + max_dim0);
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageAccess()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeImageAccess()
 {
   p->SetImageAccessInitialized(false);
+
+  // processing functors and normalization images are re-initialized
+  m_YCache.Clear();
   //////////---------------------------
   const auto spectrumType = p->GetSpectrumType();
 
@@ -540,18 +1113,90 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
                      }
                    });
   p->SetNumberOfValidPixels(spectra.size());
+
+  InitializeSparseCube();
   p->SetImageAccessInitialized(true);
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageAccessProcessedProfile()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeSparseCube()
+{
+  m_SparseCube.Clear();
+
+  bool enabled = false;
+  unsigned int budget = 4096;
+  if (auto *preferencesService = mitk::CoreServices::GetPreferencesService())
+    if (auto *preferences = preferencesService->GetSystemPreferences())
+    {
+      enabled = preferences->GetBool("m2aia.signal.SparseCentroidCube", enabled);
+      budget = preferences->GetInt("m2aia.signal.SparseCentroidCubeMemoryBudget", budget);
+    }
+
+  const auto format = p->GetSpectrumType().Format;
+  if (!enabled || !any(format & m2::SpectrumFormat::Centroid))
+    return;
+
+  using CubeType = m2::SparseSpectrumCube<IntensityType>;
+  const auto &spectra = p->GetSpectra();
+  size_t entries = 0;
+  for (const auto &spectrum : spectra)
+    entries += spectrum.intLength;
+
+  const auto required = CubeType::EstimateBuildMemory(entries);
+  if (required > size_t(budget) * 1024 * 1024)
+  {
+    MITK_INFO("m2::ImzMLSpectrumImage") << "Sparse centroid cube requires " << required / (1024 * 1024)
+                                        << " MB (budget " << budget << " MB). Ion images are read from disk.";
+    return;
+  }
+
+  m2::Timer t("Initialization of the sparse centroid cube took");
+  t.printIf = [](m2::Timer::Duration d) -> bool { return d.count() > 1.0; };
+
+  // continuous data share the mass axis, zeros are implicit
+  const bool continuous = format == m2::SpectrumFormat::ContinuousCentroid;
+  const auto &xAxis = p->GetXAxis();
+  const unsigned int threads = p->GetNumberOfThreads();
+  std::vector<std::vector<typename CubeType::Entry>> entriesT(threads);
+
+  std::vector<unsigned int> ids(spectra.size());
+  std::iota(std::begin(ids), std::end(ids), 0);
+  ReadSpectra(ids,
+              !continuous,
+              threads,
+              [&](unsigned int t, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)
+              {
+                auto &target = entriesT[t];
+                for (size_t k = 0; k < ints.size(); ++k)
+                {
+                  if (continuous && ints[k] == 0)
+                    continue;
+                  target.push_back({continuous ? xAxis[k] : double(mzs[k]), id, ints[k]});
+                }
+              });
+
+  auto all = std::move(entriesT[0]);
+  for (unsigned int t = 1; t < threads; ++t)
+  {
+    all.insert(std::end(all), std::begin(entriesT[t]), std::end(entriesT[t]));
+    std::vector<typename CubeType::Entry>().swap(entriesT[t]);
+  }
+
+  m_SparseCube.Build(std::move(all), spectra.size(), continuous ? xAxis : std::vector<double>{});
+  MITK_INFO("m2::ImzMLSpectrumImage") << "Sparse centroid cube: " << m_SparseCube.GetNumberOfColumns() << " peaks, "
+                                      << m_SparseCube.GetNumberOfEntries() << " entries, "
+                                      << m_SparseCube.GetMemoryUsage() / (1024 * 1024) << " MB";
+}
+
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeImageAccessProcessedProfile()
 {
   // MITK_INFO("m2::ImzMLSpectrumImage") << "Start InitializeImageAccessProcessedProfile";
   InitializeImageAccessProcessedData();
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageAccessContinuousProfile()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeImageAccessContinuousProfile()
 {
 
   std::vector<std::vector<double>> skylineT;
@@ -591,37 +1236,30 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   m_Transformer.Initialize(p->GetIntensityTransformationStrategy());
 
   auto &spectra = p->GetSpectra();
-
-  m2::Process::Map(
-    spectra.size(),
-    threads,
-    [&](unsigned int t, unsigned int a, unsigned int b)
-    {
-      std::vector<IntensityType> ints(mzs.size(), 0);
-      std::vector<IntensityType> baseline(mzs.size(), 0);
-      std::ifstream f(p->GetBinaryDataPath(), std::ifstream::binary);
-
-      for (unsigned long int i = a; i < b; i++)
-      {
-        auto &spectrum = spectra[i];
-
-        // Read data from file ------------
-        binaryDataToVector(f, spectrum.intOffset, spectrum.intLength, ints.data());
-        const auto nFac = accNorm.GetPixelByIndex(spectrum.index);
-        
-        std::transform(std::begin(ints),
-                       std::end(ints),
-                       std::begin(ints),
-                       [&nFac](const auto &a) { return a / nFac; });
-        
-        m_Smoother(std::begin(ints), std::end(ints));
-        m_BaselineSubtractor(std::begin(ints), std::end(ints), std::begin(baseline));
-        m_Transformer(std::begin(ints), std::end(ints));
-
-        std::transform(std::begin(ints), std::end(ints), sumT.at(t).begin(), sumT.at(t).begin(), plus);
-        std::transform(std::begin(ints), std::end(ints), skylineT.at(t).begin(), skylineT.at(t).begin(), Maximum);
-      }
-    });
+  std::vector<unsigned int> ids(spectra.size());
+  std::iota(std::begin(ids), std::end(ids), 0);
+  std::vector<std::vector<IntensityType>> baselineT(threads, std::vector<IntensityType>(mzs.size(), 0));
+
+  ReadSpectra(ids,
+              false,
+              threads,
+              [&](unsigned int t, unsigned int id, std::vector<MassAxisType> & /*mzs*/, std::vector<IntensityType> &ints)
+              {
+                auto &spectrum = spectra[id];
+                const auto nFac = accNorm.GetPixelByIndex(spectrum.index);
+
+                std::transform(std::begin(ints),
+                               std::end(ints),
+                               std::begin(ints),
+                               [&nFac](const auto &a) { return a / nFac; });
+
+                m_Smoother(std::begin(ints), std::end(ints));
+                m_BaselineSubtractor(std::begin(ints), std::end(ints), std::begin(baselineT[t]));
+                m_Transformer(std::begin(ints), std::end(ints));
+
+                std::transform(std::begin(ints), std::end(ints), sumT.at(t).begin(), sumT.at(t).begin(), plus);
+                std::transform(std::begin(ints), std::end(ints), skylineT.at(t).begin(), skylineT.at(t).begin(), Maximum);
+              });
 
   auto &skyline = p->GetSkylineSpectrum();
   skyline.clear();
@@ -646,8 +1284,8 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   std::transform(sum.begin(), sum.end(), mean.begin(), [&](auto &a) { return a / double(N); });
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageAccessContinuousCentroid()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeImageAccessContinuousCentroid()
 {
   std::vector<MassAxisType> mzs;
 
@@ -677,42 +1315,28 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   NormImageReadAccess accNorm(p->GetNormalizationImage(currentType)); 
 
   auto &spectra = p->GetSpectra();
-
-  m2::Process::Map(spectra.size(),
-                   p->GetNumberOfThreads(),
-                   [&](unsigned int t, unsigned int a, unsigned int b)
-                   {
-                     std::ifstream f;
-                     f.open(p->GetBinaryDataPath(), std::ios::binary);
-
-                     std::vector<IntensityType> ints;
-                     auto iO = spectra[0].intOffset;
-                     auto iL = spectra[0].intLength;
-                     ints.resize(iL);
-
-                     for (unsigned i = a; i < b; i++)
-                     {
-                       auto &spectrum = spectra[i];
-                       iO = spectrum.intOffset;
-                       binaryDataToVector(f, iO, iL, ints.data());
-
-                      auto nFac = accNorm.GetPixelByIndex(spectrum.index);
-                      std::transform(std::begin(ints),
-                                    std::end(ints),
-                                    std::begin(ints),
-                                    [&nFac](auto &v) { return v / nFac; });
-                       
-
-                       for (size_t i = 0; i < mzs.size(); ++i)
-                       {
-                         //  peaksT[t][i].index(i);
-                         peaksT[t][i].x(mzs[i]);
-                         peaksT[t][i].y(ints[i]);
-                       }
-                     }
-
-                     f.close();
-                   });
+  std::vector<unsigned int> ids(spectra.size());
+  std::iota(std::begin(ids), std::end(ids), 0);
+
+  ReadSpectra(ids,
+              false,
+              p->GetNumberOfThreads(),
+              [&](unsigned int t, unsigned int id, std::vector<MassAxisType> & /*mzs*/, std::vector<IntensityType> &ints)
+              {
+                auto &spectrum = spectra[id];
+                auto nFac = accNorm.GetPixelByIndex(spectrum.index);
+                std::transform(std::begin(ints),
+                               std::end(ints),
+                               std::begin(ints),
+                               [&nFac](auto &v) { return v / nFac; });
+
+                for (size_t i = 0; i < mzs.size(); ++i)
+                {
+                  //  peaksT[t][i].index(i);
+                  peaksT[t][i].x(mzs[i]);
+                  peaksT[t][i].y(ints[i]);
+                }
+              });
 
   auto &skyline = p->GetSkylineSpectrum();
   auto &sum = p->GetSumSpectrum();
@@ -737,15 +1361,15 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   }
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageAccessProcessedCentroid()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeImageAccessProcessedCentroid()
 {
   // MITK_INFO("m2::ImzMLSpectrumImage") << "Start InitializeImageAccessProcessedCentroid";
   InitializeImageAccessProcessedData();
 }
 
-template <class MassAxisType, class IntensityType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageAccessProcessedData()
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::InitializeImageAccessProcessedData()
 {
   std::vector<std::list<m2::Interval>> peaksT(p->GetNumberOfThreads());
 
@@ -771,24 +1395,25 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   NormImageReadAccess accNorm(p->GetNormalizationImage(currentType)); 
   
   // Find min max x values
-  m2::Process::Map(spectra.size(),
-                   T,
-                   [&](unsigned int t, unsigned int a, unsigned int b)
-                   {
-                     std::ifstream f(p->GetBinaryDataPath(), std::ios::binary);
-                     std::vector<MassAxisType> mzs;
-                     std::list<m2::Interval> peaks, tempList;
-                     // find x min/max
-                     for (unsigned i = a; i < b; i++)
-                     {
-                       const auto &mzO = spectra[i].mzOffset;
-                       const auto &mzL = spectra[i].mzLength;
-                       mzs.resize(mzL);
-                       binaryDataToVector(f, mzO, mzL, mzs.data());
-                       xMin[t] = std::min(xMin[t], (double)mzs.front());
-                       xMax[t] = std::max(xMax[t], (double)mzs.back());
-                     }
-                   });
+  {
+    m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+    scheduler.Reserve(spectra.size());
+    for (unsigned int i = 0; i < spectra.size(); ++i)
+      scheduler.Add(spectra[i].mzOffset, spectra[i].mzLength * sizeof(MassAxisType), i);
+
+    scheduler.Run(T,
+                  [&](unsigned int t, unsigned int id, const char *data)
+                  {
+                    const auto &mzL = spectra[id].mzLength;
+                    if (mzL == 0)
+                      return;
+                    MassAxisType first, last;
+                    bufferToVector(data, 1, &first);
+                    bufferToVector(data + (mzL - 1) * sizeof(MassAxisType), 1, &last);
+                    xMin[t] = std::min(xMin[t], (double)first);
+                    xMax[t] = std::max(xMax[t], (double)last);
+                  });
+  }
 
   // find overall min/max
   double binSize = 1;
@@ -799,55 +1424,40 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   min = *std::min_element(std::begin(xMin), std::end(xMin));
   binSize = (max - min) / double(binsN);
 
-  m2::Process::Map(spectra.size(),
-                   T,
-                   [&](unsigned int t, unsigned int a, unsigned int b)
-                   {
-                     std::ifstream f(p->GetBinaryDataPath(), std::ios::binary);
-                     std::vector<MassAxisType> mzs;
-                     std::vector<IntensityType> ints;
-
-                     for (unsigned i = a; i < b; i++)
-                     {
-                       auto &spectrum = spectra[i];
-                       const auto &mzO = spectrum.mzOffset;
-                       const auto &mzL = spectrum.mzLength;
-                       mzs.resize(mzL);
-                       binaryDataToVector(f, mzO, mzL, mzs.data());
-
-                       const auto &intO = spectrum.intOffset;
-                       const auto &intL = spectrum.intLength;
-                       ints.resize(intL);
-                       binaryDataToVector(f, intO, intL, ints.data());
-
-                       // Normalization
-                       double nFac = accNorm.GetPixelByIndex(spectrum.index); 
-                        
-                        std::transform(std::begin(ints),
-                                      std::end(ints),
-                                      std::begin(ints),
-                                      [&nFac](auto &v) { return v / nFac; });
-                       
-
-                       for (unsigned int k = 0; k < mzs.size(); ++k)
-                       {
-                         // find index of the bin for the k'th m/z value of the pixel
-                         auto j = (long)((mzs[k] - min) / binSize);
-
-                         if (j >= binsN)
-                           j = binsN - 1;
-                         else if (j < 0)
-                           j = 0;
-
-                         xT[t][j] += mzs[k];                                   // mass sum
-                         yT[t][j] += ints[k] < 10e-256 ? 0 : ints[k];          // intensitiy sum
-                         yMaxT[t][j] = std::max(yMaxT[t][j], double(ints[k])); // intensitiy max
-                         hT[t][j]++;                                           // hits
-                       }
-                     }
-
-                     f.close();
-                   });
+  std::vector<unsigned int> ids(spectra.size());
+  std::iota(std::begin(ids), std::end(ids), 0);
+
+  ReadSpectra(ids,
+              true,
+              T,
+              [&](unsigned int t, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)
+              {
+                auto &spectrum = spectra[id];
+
+                // Normalization
+                double nFac = accNorm.GetPixelByIndex(spectrum.index);
+
+                std::transform(std::begin(ints),
+                               std::end(ints),
+                               std::begin(ints),
+                               [&nFac](auto &v) { return v / nFac; });
+
+                for (unsigned int k = 0; k < mzs.size(); ++k)
+                {
+                  // find index of the bin for the k'th m/z value of the pixel
+                  auto j = (long)((mzs[k] - min) / binSize);
+
+                  if (j >= binsN)
+                    j = binsN - 1;
+                  else if (j < 0)
+                    j = 0;
+
+                  xT[t][j] += mzs[k];                                   // mass sum
+                  yT[t][j] += ints[k] < 10e-256 ? 0 : ints[k];          // intensitiy sum
+                  yMaxT[t][j] = std::max(yMaxT[t][j], double(ints[k])); // intensitiy max
+                  hT[t][j]++;                                           // hits
+                }
+              });
 
   // REDUCE
   for (unsigned int i = 1; i < T; ++i)
@@ -899,48 +1509,46 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::InitializeImageA
   p->SetPropertyValue<unsigned>("m2aia.xs.n", mzAxis.size());
 }
 
-template <class MassAxisType, class IntensityType>
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
 template <class OutputType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetXValues(unsigned int id, std::vector<OutputType> &xd)
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::GetXValues(unsigned int id, std::vector<OutputType> &xd)
 {
-  std::ifstream f(p->GetBinaryDataPath(), std::ios::binary);
-
   const auto &spectrum = p->GetSpectra()[id];
   const auto &length = spectrum.mzLength;
   const auto &offset = spectrum.mzOffset;
 
-  if (std::is_same<MassAxisType, OutputType>::value)
+  auto xs = m_XCache.Get(offset, 0);
+  if (!xs)
   {
-    xd.resize(length);
-    binaryDataToVector(f, offset, length, xd.data());
-  }
-  else
-  {
-    std::vector<MassAxisType> xs;
-    xs.resize(length);
-    binaryDataToVector(f, offset, length, xs.data());
-    // copy and convert
-    xd.resize(length);
-    std::copy(std::begin(xs), std::end(xs), std::begin(xd));
+    std::ifstream f(p->GetBinaryDataPath(), std::ios::binary);
+    std::vector<MassAxisType> data(length);
+    binaryDataToVector(f, offset, length, data.data());
+    xs = m_XCache.Put(offset, 0, std::move(data));
   }
+
+  // copy and convert
+  xd.resize(length);
+  std::copy(std::begin(*xs), std::end(*xs), std::begin(xd));
 }
 
-template <class MassAxisType, class IntensityType>
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
 template <class OutputType>
-void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetYValues(unsigned int id, std::vector<OutputType> &yd)
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::GetYValues(unsigned int id, std::vector<OutputType> &yd)
 {
-  std::ifstream f(p->GetBinaryDataPath(), std::ios::binary);
-
   const auto &spectrum = p->GetSpectra()[id];
   const auto &length = spectrum.intLength;
   const auto &offset = spectrum.intOffset;
 
-  mitk::ImagePixelReadAccessor<m2::NormImagePixelType, 3> normAccess(p->GetNormalizationImage());
-
+  const auto hash = ProcessingParameterHash();
+  auto cached = m_YCache.Get(id, hash);
+  if (!cached)
   {
+    std::ifstream f(p->GetBinaryDataPath(), std::ios::binary);
+    mitk::ImagePixelReadAccessor<m2::NormImagePixelType, 3> normAccess(p->GetNormalizationImage());
+
     std::vector<IntensityType> ys;
     ys.resize(length);
-    binaryDataToVector(f, offset, length, ys.data());
+    intensityDataToVector(f, offset, length, ys.data());
     if (p->GetNormalizationStrategy() != m2::NormalizationStrategyType::None)
     { // check if it is not NormalizationStrategy::None.
       IntensityType norm = normAccess.GetPixelByIndex(spectrum.index);
@@ -957,8 +1565,334 @@ void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType>::GetYValues(unsig
     // ----- Intensity Transformation
     m_Transformer(std::begin(ys), std::end(ys));
 
-    // copy and convert
-    yd.resize(length);
-    std::copy(std::begin(ys), std::end(ys), std::begin(yd));
+    cached = m_YCache.Put(id, hash, std::move(ys));
+  }
+
+  // copy and convert
+  yd.resize(length);
+  std::copy(std::begin(*cached), std::end(*cached), std::begin(yd));
+}
+
+
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+std::shared_ptr<const std::vector<double>> m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::
+  GetNormalizationFactors(m2::NormalizationStrategyType type)
+{
+  if (type == m2::NormalizationStrategyType::None)
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(m_NormalizationMutex);
+  if (!p->GetNormalizationImageStatus(type))
+  {
+    InitializeNormalizationImage(type);
+    p->SetNormalizationImageStatus(type, true);
+  }
+
+  const auto &spectra = p->GetSpectra();
+  auto factors = std::make_shared<std::vector<double>>();
+  factors->reserve(spectra.size());
+  mitk::ImagePixelReadAccessor<m2::NormImagePixelType, 3> normAccess(p->GetNormalizationImage(type));
+  for (const auto &spectrum : spectra)
+    factors->push_back(normAccess.GetPixelByIndex(spectrum.index));
+  return factors;
+}
+
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+template <class OutputType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::GetSpectraBatch(
+  const std::vector<unsigned int> &ids,
+  size_t channels,
+  OutputType *xd,
+  OutputType *yd,
+  const m2::SpectrumProcessingParameters *parameters,
+  unsigned int threads,
+  std::ifstream *stream)
+{
+  const auto &spectra = p->GetSpectra();
+  if (ids.empty() || channels == 0)
+    return;
+
+  // (id, row) pairs sorted by id; an id may be requested for more than one row
+  std::vector<std::pair<unsigned int, size_t>> rows(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+  {
+    if (ids[i] >= spectra.size())
+      mitkThrow() << "Spectrum id " << ids[i] << " is out of range [0, " << spectra.size() << ").";
+    rows[i] = {ids[i], i};
+  }
+  std::sort(std::begin(rows), std::end(rows));
+
+  std::vector<unsigned int> uniqueIds;
+  uniqueIds.reserve(rows.size());
+  for (const auto &r : rows)
+    if (uniqueIds.empty() || uniqueIds.back() != r.first)
+      uniqueIds.push_back(r.first);
+
+  // continuous spectra share one mass axis
+  const bool continuous = any(p->GetSpectrumType().Format &
+                              (m2::SpectrumFormat::ContinuousProfile | m2::SpectrumFormat::ContinuousCentroid));
+  std::vector<MassAxisType> sharedMzs;
+  if (xd && continuous)
+    GetXValues(uniqueIds.front(), sharedMzs);
+  const bool readMzs = xd && !continuous;
+
+  std::unique_ptr<Processing> processing;
+  if (parameters)
+    processing.reset(new Processing(*parameters));
+
+  threads = std::max(1u, std::min<unsigned int>(threads, uniqueIds.size()));
+  std::vector<std::vector<IntensityType>> baselineT(threads);
+
+  const auto WriteRow = [channels](OutputType *row, const auto &values)
+  {
+    const auto n = std::min(channels, values.size());
+    std::copy(std::begin(values), std::next(std::begin(values), n), row);
+    std::fill(row + n, row + channels, OutputType(0));
+  };
+
+  const auto worker =
+    [&](unsigned int t, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)
+  {
+    if (processing)
+      (*processing)(processing->GetNormalizationFactor(id), ints, baselineT[t]);
+
+    const auto range = std::equal_range(std::begin(rows),
+                                        std::end(rows),
+                                        std::make_pair(id, size_t(0)),
+                                        [](const auto &a, const auto &b) { return a.first < b.first; });
+    for (auto r = range.first; r != range.second; ++r)
+    {
+      WriteRow(yd + r->second * channels, ints);
+      if (xd)
+        WriteRow(xd + r->second * channels, continuous ? sharedMzs : mzs);
+    }
+  };
+
+  if (threads > 1)
+  {
+    ReadSpectra(uniqueIds, readMzs, threads, worker);
+    return;
+  }
+
+  // single thread: sequential reads in offset order, without reader and worker threads
+  std::ifstream local;
+  if (!stream)
+  {
+    local.open(p->GetBinaryDataPath(), std::ios::binary);
+    stream = &local;
+  }
+  else if (!stream->is_open())
+  {
+    stream->open(p->GetBinaryDataPath(), std::ios::binary);
+  }
+  stream->clear();
+  if (!*stream)
+    mitkThrow() << "Can not open binary data file " << p->GetBinaryDataPath();
+
+  std::sort(std::begin(uniqueIds),
+            std::end(uniqueIds),
+            [&spectra](unsigned int a, unsigned int b) { return spectra[a].intOffset < spectra[b].intOffset; });
+
+  std::vector<MassAxisType> mzs;
+  std::vector<IntensityType> ints;
+  for (auto id : uniqueIds)
+  {
+    const auto &spectrum = spectra[id];
+    ints.resize(spectrum.intLength);
+    intensityDataToVector(*stream, spectrum.intOffset, spectrum.intLength, ints.data());
+    if (readMzs)
+    {
+      mzs.resize(spectrum.mzLength);
+      binaryDataToVector(*stream, spectrum.mzOffset, spectrum.mzLength, mzs.data());
+    }
+    if (!*stream)
+      mitkThrow() << "Reading spectrum " << id << " from " << p->GetBinaryDataPath() << " failed.";
+    worker(0, id, mzs, ints);
+  }
+}
+
+template <class MassAxisType, class IntensityType, class StoredIntensityType>
+template <class OutputType>
+void m2::ImzMLSpectrumImageSource<MassAxisType, IntensityType, StoredIntensityType>::GetImageArray(
+  const std::vector<std::pair<double, double>> &ranges,
+  const mitk::Image *mask,
+  OutputType *data,
+  const m2::SpectrumProcessingParameters &parameters,
+  unsigned int threads,
+  const std::function<void(unsigned int)> &progress)
+{
+  using namespace m2;
+  const auto *dims = p->GetDimensions();
+  const size_t pixels = size_t(dims[0]) * dims[1] * dims[2];
+  std::fill(data, data + ranges.size() * pixels, OutputType(0));
+  const auto &spectra = p->GetSpectra();
+  if (ranges.empty() || spectra.empty())
+    return;
+
+  Processing processing(parameters);
+  std::shared_ptr<mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType, 3>> maskAccess;
+  if (mask)
+    maskAccess.reset(new mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType, 3>(mask));
+
+  const auto format = p->GetSpectrumType().Format;
+  const auto pooling = parameters.RangePooling;
+  const bool useNormalization = parameters.UseNormalization();
+  threads = std::max(1u, threads);
+
+  std::vector<unsigned int> ids;
+  ids.reserve(spectra.size());
+  for (unsigned int i = 0; i < spectra.size(); ++i)
+    if (!maskAccess || maskAccess->GetPixelByIndex(spectra[i].index) != 0)
+      ids.push_back(i);
+
+  std::vector<std::pair<double, double>> windows;
+  for (const auto &range : ranges)
+    windows.emplace_back(range.first - range.second, range.first + range.second);
+
+  const auto Write = [&](const auto &spectrum, size_t k, double value)
+  {
+    const auto &index = spectrum.index;
+    data[k * pixels + index[0] + dims[0] * (index[1] + size_t(dims[1]) * index[2])] = OutputType(value);
+  };
+
+  std::mutex progressMutex;
+  const auto Progress = [&]()
+  {
+    if (!progress)
+      return;
+    std::lock_guard<std::mutex> lock(progressMutex);
+    progress(1);
+  };
+
+  if (format == m2::SpectrumFormat::ContinuousProfile || format == m2::SpectrumFormat::ContinuousCentroid)
+  {
+    // the shared mass axis, as read by InitializeImageAccess
+    std::vector<double> mzs;
+    GetXValues(0, mzs);
+    std::vector<std::pair<unsigned int, unsigned int>> subRanges;
+    m2::Signal::Subranges(mzs, windows, subRanges);
+
+    // padded subranges as in GetImagePrivate, baseline correction requires a border
+    const bool profile = format == m2::SpectrumFormat::ContinuousProfile;
+    const auto baselineStrategy = parameters.BaselineCorrection;
+    const auto baselineHws = parameters.BaselineCorrectionHalfWindowSize;
+    const bool pad = profile && baselineStrategy != m2::BaselineCorrectionType::None;
+    std::vector<std::pair<unsigned int, unsigned int>> padded(subRanges.size(), {0, 0});
+    unsigned int first = std::numeric_limits<unsigned int>::max(), last = 0;
+    for (size_t k = 0; k < subRanges.size(); ++k)
+    {
+      const auto &r = subRanges[k];
+      if (r.second == 0)
+        continue;
+      const unsigned int offsetLeft = r.first;
+      const unsigned int offsetRight = mzs.size() - (r.first + r.second);
+      const unsigned int paddingLeft = pad ? std::min<unsigned int>(offsetLeft, baselineHws) : 0;
+      const unsigned int paddingRight = pad ? std::min<unsigned int>(offsetRight, baselineHws) : 0;
+      padded[k] = {paddingLeft, paddingRight};
+      first = std::min(first, r.first - paddingLeft);
+      last = std::max(last, r.first + r.second + paddingRight);
+    }
+    if (first >= last)
+    {
+      if (progress)
+        progress(ids.size());
+      return;
+    }
+    const unsigned int length = last - first;
+
+    m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+    scheduler.Reserve(ids.size());
+    for (auto id : ids)
+      scheduler.Add(
+        spectra[id].intOffset + first * sizeof(StoredIntensityType), length * sizeof(StoredIntensityType), id);
+
+    m2::Signal::FusedPipeline<IntensityType> fused;
+    if (profile)
+      fused.Initialize(useNormalization,
+                       processing.GetSmoothingKernel(),
+                       baselineStrategy,
+                       baselineHws,
+                       parameters.IntensityTransformation,
+                       pooling);
+
+    std::vector<std::vector<IntensityType>> blockT(threads, std::vector<IntensityType>(length));
+    std::vector<std::vector<IntensityType>> intsT(threads), workT(threads), baselineT(threads);
+    scheduler.Run(threads,
+                  [&](unsigned int t, unsigned int id, const char *bytes)
+                  {
+                    const auto &spectrum = spectra[id];
+                    auto &block = blockT[t];
+                    intensityBufferToVector(bytes, length, block.data());
+                    const IntensityType norm = processing.GetNormalizationFactor(id);
+
+                    for (size_t k = 0; k < subRanges.size(); ++k)
+                    {
+                      if (subRanges[k].second == 0)
+                        continue;
+
+                      // copy the padded range, ranges may overlap and are modified by the processing
+                      const auto paddingLeft = padded[k].first;
+                      const auto paddingRight = padded[k].second;
+                      auto &ints = intsT[t];
+                      const auto s = std::next(std::begin(block), subRanges[k].first - paddingLeft - first);
+                      ints.assign(s, std::next(s, subRanges[k].second + paddingLeft + paddingRight));
+
+                      if (!profile)
+                      {
+                        if (useNormalization)
+                          std::transform(
+                            std::begin(ints), std::end(ints), std::begin(ints), [&norm](auto &v) { return v / norm; });
+                        Write(spectrum, k, Signal::RangePooling<IntensityType>(std::begin(ints), std::end(ints), pooling));
+                        continue;
+                      }
+
+                      if (fused.IsFused())
+                      {
+                        workT[t].resize(ints.size());
+                        baselineT[t].resize(ints.size());
+                        Write(spectrum,
+                              k,
+                              fused(ints, paddingLeft, ints.size() - paddingRight, norm, workT[t], baselineT[t]));
+                        continue;
+                      }
+
+                      processing(norm, ints, baselineT[t]);
+                      Write(spectrum,
+                            k,
+                            Signal::RangePooling<IntensityType>(std::next(std::begin(ints), paddingLeft),
+                                                                std::prev(std::end(ints), paddingRight),
+                                                                pooling));
+                    }
+                    Progress();
+                  });
+  }
+  else if (any(format & (m2::SpectrumFormat::ProcessedCentroid | m2::SpectrumFormat::ProcessedProfile)))
+  {
+    std::vector<std::vector<std::pair<unsigned int, unsigned int>>> subRangesT(threads);
+    std::vector<std::vector<IntensityType>> valuesT(threads);
+    ReadSpectra(ids,
+                true,
+                threads,
+                [&](unsigned int t, unsigned int id, std::vector<MassAxisType> &mzs, std::vector<IntensityType> &ints)
+                {
+                  const auto &spectrum = spectra[id];
+                  auto &subRanges = subRangesT[t];
+                  m2::Signal::Subranges(mzs, windows, subRanges);
+                  const IntensityType norm = processing.GetNormalizationFactor(id);
+                  auto &values = valuesT[t];
+                  for (size_t k = 0; k < subRanges.size(); ++k)
+                  {
+                    if (subRanges[k].second == 0)
+                      continue;
+                    // ranges may overlap, the intensities are normalized on a copy
+                    const auto s = std::next(std::begin(ints), subRanges[k].first);
+                    values.assign(s, std::next(s, subRanges[k].second));
+                    if (useNormalization)
+                      std::transform(
+                        std::begin(values), std::end(values), std::begin(values), [&norm](auto &v) { return v / norm; });
+                    Write(spectrum, k, Signal::RangePooling<IntensityType>(std::begin(values), std::end(values), pooling));
+                  }
+                  Progress();
+                });
   }
 }
@@ -0,0 +1,106 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <M2aiaCoreExports.h>
+#include <fstream>
+#include <m2ImzMLSpectrumImage.h>
+#include <m2SpectrumProcessingParameters.h>
+#include <memory>
+#include <vector>
+
+namespace m2
+{
+  /**
+   * @class ImzMLSpectrumImageView
+   * @brief Read-only access to an ImzMLSpectrumImage with frozen processing parameters.
+   *
+   * The processing settings of the image, including the normalization factors, are copied
+   * when the view is created. Changing the settings of the image afterwards does not affect
+   * the view. Reads never modify the image; the parsed meta data of the spectra is shared.
+   *
+   * Copies share the image and the parameters, but each copy owns its own stream of the
+   * *.ibd file, which is reused by single threaded reads. A view is used by one thread at a
+   * time: copy (Clone) it for each worker thread, then no locks are involved.
+   *
+   * The image must not be re-initialized (InitializeGeometry, InitializeProcessor) while
+   * views read from it.
+   */
+  class M2AIACORE_EXPORT ImzMLSpectrumImageView
+  {
+  public:
+    /// @brief View with the current processing settings of the image.
+    explicit ImzMLSpectrumImageView(const ImzMLSpectrumImage *image);
+    ImzMLSpectrumImageView(const ImzMLSpectrumImage *image, m2::SpectrumProcessingParameters processing);
+    ImzMLSpectrumImageView(const ImzMLSpectrumImageView &other);
+    ImzMLSpectrumImageView &operator=(const ImzMLSpectrumImageView &other);
+    ~ImzMLSpectrumImageView();
+
+    /// @brief Cheap copy for another thread, see class description.
+    ImzMLSpectrumImageView Clone() const { return *this; }
+
+    const ImzMLSpectrumImage *GetImage() const;
+    const m2::SpectrumProcessingParameters &GetProcessingParameters() const;
+    unsigned int GetNumberOfSpectra() const;
+
+    void GetSpectrum(unsigned int id, std::vector<double> &xs, std::vector<double> &ys) const;
+    void GetSpectrumFloat(unsigned int id, std::vector<float> &xs, std::vector<float> &ys) const;
+    void GetIntensities(unsigned int id, std::vector<double> &ys) const;
+    void GetIntensitiesFloat(unsigned int id, std::vector<float> &ys) const;
+
+    /**
+     * @brief See ImzMLSpectrumImage::GetSpectraBatchFloat.
+     * @param processed If false, the raw intensities are returned.
+     */
+    void GetSpectraBatchFloat(const std::vector<unsigned int> &ids,
+                              size_t channels,
+                              float *xs,
+                              float *ys,
+                              bool processed = true,
+                              unsigned int threads = 1) const;
+    void GetSpectraBatch(const std::vector<unsigned int> &ids,
+                         size_t channels,
+                         double *xs,
+                         double *ys,
+                         bool processed = true,
+                         unsigned int threads = 1) const;
+
+    /// @brief See ImzMLSpectrumImage::GetImageArrayFloat.
+    void GetImageArrayFloat(const std::vector<std::pair<double, double>> &ranges,
+                            const mitk::Image *mask,
+                            float *data,
+                            unsigned int threads = 1) const;
+    void GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                       const mitk::Image *mask,
+                       double *data,
+                       unsigned int threads = 1) const;
+
+  private:
+    struct State
+    {
+      ImzMLSpectrumImage::ConstPointer Image;
+      m2::SpectrumProcessingParameters Processing;
+    };
+
+    template <class T>
+    void ReadSpectrum(unsigned int id, std::vector<T> *xs, std::vector<T> &ys) const;
+
+    std::ifstream *GetStream() const;
+
+    std::shared_ptr<const State> m_State;
+    mutable std::unique_ptr<std::ifstream> m_Stream;
+  };
+
+} // namespace m2
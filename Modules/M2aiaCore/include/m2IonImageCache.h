@@ -0,0 +1,151 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <M2aiaCoreExports.h>
+#include <cstddef>
+#include <list>
+#include <m2CoreCommon.h>
+#include <memory>
+#include <mitkImage.h>
+#include <mutex>
+#include <signal/m2SignalCommon.h>
+#include <unordered_map>
+#include <vector>
+
+namespace Poco
+{
+  class TemporaryFile;
+}
+
+namespace m2
+{
+  /**
+   * @brief Identifies a finished ion image: the queried range, all processing
+   * parameters that change pixel values and the content of the mask. Further state
+   * of the image (e.g. normalization images, settings of stacks) is hashed into state.
+   */
+  struct IonImageCacheKey
+  {
+    double mz = 0;
+    double tol = 0;
+    NormalizationStrategyType normalization = NormalizationStrategyType::None;
+    SmoothingType smoothing = SmoothingType::None;
+    unsigned int smoothingHalfWindowSize = 0;
+    BaselineCorrectionType baseline = BaselineCorrectionType::None;
+    unsigned int baselineHalfWindowSize = 0;
+    RangePoolingStrategyType pooling = RangePoolingStrategyType::None;
+    IntensityTransformationType transformation = IntensityTransformationType::None;
+    size_t maskHash = 0;
+    size_t state = 0;
+
+    bool operator==(const IonImageCacheKey &rhs) const;
+    size_t Hash() const;
+  };
+
+  /// @brief Usage statistics of an IonImageCache.
+  struct IonImageCacheStatistics
+  {
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+    unsigned long long spills = 0;
+    size_t entries = 0;
+    size_t spilledEntries = 0;
+    size_t bytes = 0;
+    size_t spilledBytes = 0;
+    size_t capacity = 0;
+  };
+
+  /**
+   * @class IonImageCache
+   * @brief Thread-safe LRU cache of finished ion images limited by a memory budget.
+   *
+   * Least recently used images are dropped if the budget is exceeded. If spilling is
+   * enabled, they are written deflate-compressed to temporary files instead and are
+   * restored (and moved back into memory) by the next Get. The spilled data is limited
+   * by its own budget, measured in compressed bytes on disk.
+   *
+   * Compression and file I/O are done without holding the lock. An image is not found
+   * while it is being spilled; images spilled across a Clear are discarded.
+   */
+  class M2AIACORE_EXPORT IonImageCache
+  {
+  public:
+    using BufferType = std::vector<m2::DisplayImagePixelType>;
+
+    explicit IonImageCache(size_t capacityInBytes = 0, size_t spillCapacityInBytes = 0);
+    ~IonImageCache();
+
+    /// @brief Copies a cached image into the pixel buffer of target. Returns false on a miss.
+    bool Get(const IonImageCacheKey &key, mitk::Image *target);
+
+    /// @brief True if the image is cached in memory or spilled. Does not count as hit or miss.
+    bool Contains(const IonImageCacheKey &key) const;
+
+    /// @brief Inserts a copy of the pixel buffer of source (pixel type m2::DisplayImagePixelType).
+    void Insert(const IonImageCacheKey &key, const mitk::Image *source);
+
+    void SetCapacity(size_t capacityInBytes);
+    size_t GetCapacity() const;
+
+    /// @brief 0 disables spilling.
+    void SetSpillCapacity(size_t capacityInBytes);
+    size_t GetSpillCapacity() const;
+
+    void Clear();
+    IonImageCacheStatistics GetStatistics() const;
+
+    /// @brief Content hash of a mask image; 0 if no mask is given.
+    static size_t HashMask(const mitk::Image *mask);
+
+  private:
+    struct KeyHash
+    {
+      size_t operator()(const IonImageCacheKey &k) const { return k.Hash(); }
+    };
+
+    struct Entry
+    {
+      IonImageCacheKey key;
+      std::shared_ptr<BufferType> data;          // in memory
+      std::shared_ptr<Poco::TemporaryFile> file; // spilled
+      size_t bytes; // in memory or on disk
+      size_t pixels;
+    };
+
+    using ListType = std::list<Entry>;
+    using MapType = std::unordered_map<IonImageCacheKey, ListType::iterator, KeyHash>;
+
+    // require the lock; removed entries are returned and are spilled or destroyed (removing
+    // their temporary files) after the lock was released
+    ListType Shrink();
+    ListType ShrinkSpilled();
+    ListType Remove(const IonImageCacheKey &key);
+
+    // without the lock
+    void Spill(ListType &&entries, size_t generation);
+    static std::shared_ptr<BufferType> Restore(const Entry &entry);
+
+    mutable std::mutex m_Mutex;
+    size_t m_Capacity;
+    size_t m_SpillCapacity;
+    size_t m_Generation = 0; // incremented by Clear
+    ListType m_List, m_SpilledList;
+    MapType m_Map, m_SpilledMap;
+    IonImageCacheStatistics m_Statistics;
+  };
+
+} // namespace m2
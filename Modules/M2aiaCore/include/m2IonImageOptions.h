@@ -0,0 +1,120 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <itkImageRegion.h>
+#include <mitkLabel.h>
+#include <vector>
+
+namespace m2
+{
+  /**
+   * @brief Optional restrictions of an ion image request, see ISpectrumImageDataAccess::GetImage.
+   *
+   * By default all pixels are processed and the target image is reset before it is written.
+   * If a region or a subset of mask labels is selected, only spectra of selected pixels
+   * are read and processed. All other pixels of the target image are not touched and keep
+   * their previous (stale) values.
+   *
+   * For progressive (coarse to fine) generation, a pass processes only pixels on a grid
+   * with the spacing Stride (in x and y, relative to the region start). Pixels already
+   * processed by the previous pass (grid spacing PreviousStride) are skipped. With FillNearest,
+   * the remaining pixels get the value of the grid pixel at their lower-left grid corner,
+   * so each pass results in a complete image.
+   *
+   * If a cancellation callback is given, it is polled by the worker loops. A cancelled
+   * request returns early and leaves the target image incomplete.
+   */
+  struct IonImageOptions
+  {
+    /// @brief Process only pixels inside of this region (index space of the spectrum image).
+    bool UseRegion = false;
+    itk::ImageRegion<3> Region;
+
+    /// @brief Process only pixels with one of these mask labels. Ignored if no mask is given.
+    std::vector<mitk::Label::PixelType> Labels;
+
+    /// @brief Grid spacing of a progressive pass; 1 processes all pixels.
+    unsigned int Stride = 1;
+
+    /// @brief Grid spacing of the previous pass (a multiple of Stride); 0 for the first pass.
+    unsigned int PreviousStride = 0;
+
+    /// @brief Fill pixels between the grid points, see class description.
+    bool FillNearest = false;
+
+    /// @brief Returns true if the result is no longer needed.
+    std::function<bool()> Cancelled;
+
+    bool IsCancelled() const { return Cancelled && Cancelled(); }
+
+    /// @brief Upper bound of worker threads used for this request; 0 uses the number of threads of the image.
+    unsigned int Threads = 0;
+
+    unsigned int GetThreads(unsigned int imageThreads) const
+    {
+      return std::max(1u, Threads ? std::min(Threads, imageThreads) : imageThreads);
+    }
+
+    void SetRegion(const itk::ImageRegion<3> &region)
+    {
+      Region = region;
+      UseRegion = true;
+    }
+
+    /// @brief True if pixels outside of the selection keep their values.
+    bool IsRestricted() const { return UseRegion || !Labels.empty() || PreviousStride > 0; }
+
+    bool IsInside(const itk::Index<3> &index) const { return !UseRegion || Region.IsInside(index); }
+
+    bool IsOnGrid(const itk::Index<3> &index, unsigned int stride) const
+    {
+      if (stride <= 1)
+        return true;
+      const auto x = index[0] - (UseRegion ? Region.GetIndex(0) : 0);
+      const auto y = index[1] - (UseRegion ? Region.GetIndex(1) : 0);
+      return x % stride == 0 && y % stride == 0;
+    }
+
+    /// @brief True if the pixel is processed in this pass.
+    bool IsSampled(const itk::Index<3> &index) const
+    {
+      return IsOnGrid(index, Stride) && !(PreviousStride > 0 && IsOnGrid(index, PreviousStride));
+    }
+
+    /// @brief Grid pixel used by FillNearest for the given pixel.
+    itk::Index<3> GetGridIndex(const itk::Index<3> &index) const
+    {
+      auto gridIndex = index;
+      for (unsigned int i = 0; i < 2; ++i)
+      {
+        const auto origin = UseRegion ? Region.GetIndex(i) : 0;
+        gridIndex[i] -= (index[i] - origin) % Stride;
+      }
+      return gridIndex;
+    }
+
+    /// @brief Label 0 (background) is never selected.
+    bool IsLabelSelected(mitk::Label::PixelType label) const
+    {
+      if (label == 0)
+        return false;
+      return Labels.empty() || std::find(std::begin(Labels), std::end(Labels), label) != std::end(Labels);
+    }
+  };
+
+} // namespace m2
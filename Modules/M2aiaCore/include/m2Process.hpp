@@ -43,6 +43,7 @@ namespace m2
       if (n == 0)
       { // recursively reduce threads to get non-zero n
         Map(N, T / 2, worker);
+        return;
       }
 
       // start the workers
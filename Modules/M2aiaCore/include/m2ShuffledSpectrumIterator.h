@@ -0,0 +1,129 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <M2aiaCoreExports.h>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <m2ImzMLSpectrumImageView.h>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace m2
+{
+  /**
+   * @class ShuffledSpectrumIterator
+   * @brief Iterates the spectra of an image in pseudo-random order at (nearly) sequential read speed.
+   *
+   * Reading spectra one by one in random order results in small random reads of the *.ibd
+   * file. Instead, the spectra are sorted by file offset and split into blocks of BlockSize
+   * spectra. Each epoch visits the blocks in random order; every block is one sequential read.
+   * The spectra of the blocks are collected in a shuffle buffer of BufferSize spectra, from
+   * which Next draws at random.
+   *
+   * Blocks are read and processed (with the frozen parameters of the view) by background
+   * threads, at most PrefetchBlocks ahead of the consumer. The order only depends on the seed
+   * and the epoch, not on the number of threads. Block boundaries are shifted in each epoch,
+   * so neighbouring spectra are not always drawn from the same block.
+   *
+   * Usage:
+   * @code
+   * m2::ShuffledSpectrumIterator it(m2::ImzMLSpectrumImageView(image), options);
+   * m2::ShuffledSpectrumIterator::Spectrum s;
+   * for (unsigned int epoch = 0; epoch < epochs; ++epoch)
+   *   while (it.Next(s)) { ... }
+   * @endcode
+   */
+  class M2AIACORE_EXPORT ShuffledSpectrumIterator
+  {
+  public:
+    struct Options
+    {
+      std::uint64_t Seed = 0;
+      /// @brief Number of offset-contiguous spectra read at once.
+      unsigned int BlockSize = 128;
+      /// @brief Number of spectra to draw from; larger buffers improve randomization but require memory.
+      unsigned int BufferSize = 2048;
+      /// @brief Number of blocks read ahead of the consumer.
+      unsigned int PrefetchBlocks = 8;
+      /// @brief Number of background threads reading and processing blocks.
+      unsigned int Threads = 2;
+      bool ReadXValues = false;
+      /// @brief If false, raw intensities are returned.
+      bool Processed = true;
+    };
+
+    struct Spectrum
+    {
+      unsigned int Id = 0;
+      std::vector<float> XValues; ///< empty if Options::ReadXValues is false
+      std::vector<float> YValues;
+    };
+
+    /**
+     * @param view The view is cloned for each background thread.
+     * @param ids Spectra to iterate, all spectra if empty.
+     */
+    ShuffledSpectrumIterator(const ImzMLSpectrumImageView &view, Options options, std::vector<unsigned int> ids = {});
+    ~ShuffledSpectrumIterator();
+
+    ShuffledSpectrumIterator(const ShuffledSpectrumIterator &) = delete;
+    ShuffledSpectrumIterator &operator=(const ShuffledSpectrumIterator &) = delete;
+
+    /// @brief Restart the iteration with the order of the given epoch.
+    void StartEpoch(unsigned int epoch);
+
+    /**
+     * @brief Move the next spectrum of the current epoch into spectrum.
+     * Returns false once all spectra of the epoch were returned; the following call starts
+     * the next epoch. Rethrows errors of the background threads.
+     */
+    bool Next(Spectrum &spectrum);
+
+    unsigned int GetEpoch() const { return m_Epoch; }
+    size_t GetNumberOfSpectra() const { return m_Ids.size(); }
+    const Options &GetOptions() const { return m_Options; }
+
+  private:
+    void Stop();
+    bool FetchBlock();
+    void Worker(ImzMLSpectrumImageView view);
+    std::vector<Spectrum> ReadBlock(const ImzMLSpectrumImageView &view, size_t first, size_t last) const;
+
+    ImzMLSpectrumImageView m_View;
+    Options m_Options;
+    std::vector<unsigned int> m_Ids; // sorted by file offset
+
+    unsigned int m_Epoch = 0;
+    bool m_Started = false;
+    std::mt19937_64 m_Random;
+    std::vector<std::pair<size_t, size_t>> m_Blocks; // ranges of m_Ids in visiting order
+    std::vector<Spectrum> m_Buffer;
+
+    std::mutex m_Mutex;
+    std::condition_variable m_ReadyCondition, m_SpaceCondition;
+    std::map<size_t, std::vector<Spectrum>> m_Ready;
+    size_t m_NextRead = 0, m_NextConsumed = 0;
+    bool m_Abort = false;
+    std::exception_ptr m_Error;
+    std::vector<std::thread> m_Workers;
+  };
+
+} // namespace m2
@@ -0,0 +1,222 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <m2Process.hpp>
+#include <mitkExceptionMacro.h>
+#include <signal/m2SignalCommon.h>
+#include <vector>
+
+namespace m2
+{
+  /**
+   * @class SparseSpectrumCube
+   * @brief In-memory compressed sparse column representation of centroid data.
+   *
+   * Columns are the distinct m/z values of all spectra in ascending order. Each column
+   * holds the ids of the spectra containing the peak and the corresponding intensities.
+   * An ion image of the range [lower, upper] is a gather over a contiguous column range.
+   *
+   * For continuous centroid data all spectra share the mass axis and zero intensities are
+   * not stored (sharedAxis argument of Build); the Mean pooling then divides by the number of
+   * axis values in the range, as the range pooling on the full spectrum does.
+   */
+  template <class ValueType>
+  class SparseSpectrumCube
+  {
+  public:
+    struct Entry
+    {
+      double x;
+      unsigned int id;
+      ValueType value;
+    };
+
+    /// @brief Memory required during Build for the given number of entries.
+    static size_t EstimateBuildMemory(size_t numberOfEntries)
+    {
+      return numberOfEntries * (sizeof(Entry) + sizeof(unsigned int) + sizeof(ValueType));
+    }
+
+    /// @brief Median pooling requires all values of a pixel and is not supported.
+    static bool SupportsPooling(m2::RangePoolingStrategyType strategy)
+    {
+      return strategy != m2::RangePoolingStrategyType::Median;
+    }
+
+    /**
+     * @brief Build the column structure. The entries vector is consumed.
+     * @param entries Triplets of (m/z, spectrum id, intensity) in any order.
+     * @param numberOfSpectra Upper bound of spectrum ids.
+     * @param sharedAxis The mass axis of continuous data, empty otherwise. See class description.
+     */
+    void Build(std::vector<Entry> &&entries, unsigned int numberOfSpectra, std::vector<double> sharedAxis = {})
+    {
+      Clear();
+      std::sort(std::begin(entries),
+                std::end(entries),
+                [](const Entry &a, const Entry &b) { return a.x < b.x || (a.x == b.x && a.id < b.id); });
+
+      m_NumberOfSpectra = numberOfSpectra;
+      m_SharedAxis = std::move(sharedAxis);
+      m_Ids.reserve(entries.size());
+      m_Values.reserve(entries.size());
+
+      for (const auto &e : entries)
+      {
+        if (m_X.empty() || m_X.back() != e.x)
+        {
+          m_X.push_back(e.x);
+          m_ColumnPointer.push_back(m_Ids.size());
+        }
+        m_Ids.push_back(e.id);
+        m_Values.push_back(e.value);
+      }
+      m_ColumnPointer.push_back(m_Ids.size());
+
+      std::vector<Entry>().swap(entries);
+      m_X.shrink_to_fit();
+      m_ColumnPointer.shrink_to_fit();
+    }
+
+    void Clear()
+    {
+      m_X.clear();
+      m_ColumnPointer.clear();
+      m_Ids.clear();
+      m_Values.clear();
+      m_SharedAxis.clear();
+      m_X.shrink_to_fit();
+      m_ColumnPointer.shrink_to_fit();
+      m_Ids.shrink_to_fit();
+      m_Values.shrink_to_fit();
+      m_SharedAxis.shrink_to_fit();
+      m_NumberOfSpectra = 0;
+    }
+
+    bool IsEmpty() const { return m_ColumnPointer.empty(); }
+    size_t GetNumberOfColumns() const { return m_X.size(); }
+    size_t GetNumberOfEntries() const { return m_Ids.size(); }
+
+    size_t GetMemoryUsage() const
+    {
+      return (m_X.capacity() + m_SharedAxis.capacity()) * sizeof(double) + m_ColumnPointer.capacity() * sizeof(size_t) +
+             m_Ids.capacity() * sizeof(unsigned int) + m_Values.capacity() * sizeof(ValueType);
+    }
+
+    /**
+     * @brief Pool the values of all peaks in [lower, upper] for each spectrum.
+     * @param values Resized to the number of spectra; spectra without peaks in range are 0.
+     */
+    void Query(double lower,
+               double upper,
+               m2::RangePoolingStrategyType strategy,
+               unsigned int threads,
+               std::vector<double> &values) const
+    {
+      values.assign(m_NumberOfSpectra, 0);
+      if (IsEmpty() || strategy == m2::RangePoolingStrategyType::None)
+        return;
+
+      const size_t first = std::distance(std::begin(m_X), std::lower_bound(std::begin(m_X), std::end(m_X), lower));
+      const size_t last = std::distance(std::begin(m_X), std::upper_bound(std::begin(m_X), std::end(m_X), upper));
+      if (first >= last)
+        return;
+
+      const bool useMax = strategy == m2::RangePoolingStrategyType::Maximum;
+      const size_t entries = m_ColumnPointer[last] - m_ColumnPointer[first];
+
+      // small ranges are not worth the per-thread buffers
+      const unsigned int T = std::max(
+        1u, std::min<unsigned int>({threads, (unsigned int)(entries / (1 << 16)), (unsigned int)(last - first)}));
+      std::vector<std::vector<double>> accT(T);
+      std::vector<std::vector<unsigned int>> countT(T);
+
+      const auto gather = [&](unsigned int t, size_t a, size_t b)
+      {
+        auto &acc = t == 0 ? values : accT[t];
+        auto &count = countT[t];
+        if (t != 0)
+          acc.assign(m_NumberOfSpectra, 0);
+        count.assign(m_NumberOfSpectra, 0);
+        for (size_t c = a; c < b; ++c)
+        {
+          for (size_t k = m_ColumnPointer[c]; k < m_ColumnPointer[c + 1]; ++k)
+          {
+            const auto id = m_Ids[k];
+            const double v = m_Values[k];
+            if (useMax)
+              acc[id] = count[id] ? std::max(acc[id], v) : v;
+            else
+              acc[id] += v;
+            ++count[id];
+          }
+        }
+      };
+
+      if (T == 1)
+        gather(0, first, last);
+      else
+        m2::Process::Map(last - first,
+                         T,
+                         [&](unsigned int t, unsigned int a, unsigned int b) { gather(t, first + a, first + b); });
+
+      // merge thread results into values/countT[0]
+      auto &count = countT[0];
+      for (unsigned int t = 1; t < accT.size(); ++t)
+      {
+        if (countT[t].empty())
+          continue;
+        for (unsigned int id = 0; id < m_NumberOfSpectra; ++id)
+        {
+          if (countT[t][id] == 0)
+            continue;
+          if (useMax)
+            values[id] = count[id] ? std::max(values[id], accT[t][id]) : accT[t][id];
+          else
+            values[id] += accT[t][id];
+          count[id] += countT[t][id];
+        }
+      }
+
+      // zeros of continuous data are implicit, all axis values in range are counted
+      const bool dense = !m_SharedAxis.empty();
+      size_t columns = 0;
+      if (dense)
+        columns = std::distance(std::lower_bound(std::begin(m_SharedAxis), std::end(m_SharedAxis), lower),
+                                std::upper_bound(std::begin(m_SharedAxis), std::end(m_SharedAxis), upper));
+      for (unsigned int id = 0; id < m_NumberOfSpectra; ++id)
+      {
+        if (count[id] == 0)
+          continue;
+        if (useMax && dense && count[id] < columns)
+          values[id] = std::max(values[id], 0.0);
+        if (strategy == m2::RangePoolingStrategyType::Mean)
+          values[id] /= double(dense ? columns : count[id]);
+      }
+    }
+
+  private:
+    std::vector<double> m_X;
+    std::vector<size_t> m_ColumnPointer;
+    std::vector<unsigned int> m_Ids;
+    std::vector<ValueType> m_Values;
+    std::vector<double> m_SharedAxis;
+    unsigned int m_NumberOfSpectra = 0;
+  };
+
+} // namespace m2
@@ -0,0 +1,196 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace m2
+{
+  /// @brief Usage statistics of a SpectrumCache.
+  struct SpectrumCacheStatistics
+  {
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+    unsigned long long evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t capacity = 0;
+
+    SpectrumCacheStatistics &operator+=(const SpectrumCacheStatistics &rhs)
+    {
+      hits += rhs.hits;
+      misses += rhs.misses;
+      evictions += rhs.evictions;
+      entries += rhs.entries;
+      bytes += rhs.bytes;
+      capacity += rhs.capacity;
+      return *this;
+    }
+  };
+
+  /**
+   * @class SpectrumCache
+   * @brief Thread-safe LRU cache of decoded spectrum data limited by a memory budget.
+   *
+   * Entries are identified by a spectrum key (e.g. the spectrum id or the byte offset
+   * of a shared mass axis) and a hash of the processing parameters that were applied.
+   * Values are shared and immutable, a value returned by Get remains valid after eviction.
+   */
+  template <class ValueType>
+  class SpectrumCache
+  {
+  public:
+    using ValuePointer = std::shared_ptr<const std::vector<ValueType>>;
+
+    explicit SpectrumCache(size_t capacityInBytes = 0) : m_Capacity(capacityInBytes) {}
+
+    /// @brief Returns the cached vector or nullptr. Counts as hit or miss.
+    ValuePointer Get(unsigned long long key, size_t parameterHash)
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      auto it = m_Map.find({key, parameterHash});
+      if (it == m_Map.end())
+      {
+        ++m_Statistics.misses;
+        return nullptr;
+      }
+      ++m_Statistics.hits;
+      m_List.splice(m_List.begin(), m_List, it->second);
+      return it->second->value;
+    }
+
+    /// @brief Insert a copy of the data and evict least recently used entries if the budget is exceeded.
+    template <class InputType>
+    ValuePointer Put(unsigned long long key, size_t parameterHash, const std::vector<InputType> &data)
+    {
+      return Insert(key, parameterHash, std::make_shared<std::vector<ValueType>>(std::begin(data), std::end(data)));
+    }
+
+    /// @brief Insert the data without copying it.
+    ValuePointer Put(unsigned long long key, size_t parameterHash, std::vector<ValueType> &&data)
+    {
+      return Insert(key, parameterHash, std::make_shared<std::vector<ValueType>>(std::move(data)));
+    }
+
+    void SetCapacity(size_t capacityInBytes)
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Capacity = capacityInBytes;
+      Shrink();
+    }
+
+    size_t GetCapacity() const
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      return m_Capacity;
+    }
+
+    void Clear()
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Map.clear();
+      m_List.clear();
+      m_Statistics.bytes = 0;
+    }
+
+    SpectrumCacheStatistics GetStatistics() const
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      auto s = m_Statistics;
+      s.entries = m_Map.size();
+      s.capacity = m_Capacity;
+      return s;
+    }
+
+    void ResetStatistics()
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Statistics.hits = m_Statistics.misses = m_Statistics.evictions = 0;
+    }
+
+  private:
+    struct Key
+    {
+      unsigned long long key;
+      size_t hash;
+      bool operator==(const Key &rhs) const { return key == rhs.key && hash == rhs.hash; }
+    };
+
+    struct KeyHash
+    {
+      size_t operator()(const Key &k) const
+      {
+        return std::hash<unsigned long long>()(k.key) ^ (k.hash + 0x9e3779b97f4a7c15ULL + (k.key << 6) + (k.key >> 2));
+      }
+    };
+
+    struct Entry
+    {
+      Key key;
+      ValuePointer value;
+      size_t bytes;
+    };
+
+    ValuePointer Insert(unsigned long long key, size_t parameterHash, ValuePointer value)
+    {
+      const size_t bytes = value->size() * sizeof(ValueType);
+
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      if (bytes > m_Capacity)
+        return value;
+
+      const Key k{key, parameterHash};
+      auto it = m_Map.find(k);
+      if (it != m_Map.end())
+      {
+        m_Statistics.bytes -= it->second->bytes;
+        m_List.erase(it->second);
+        m_Map.erase(it);
+      }
+
+      m_List.push_front({k, value, bytes});
+      m_Map[k] = m_List.begin();
+      m_Statistics.bytes += bytes;
+      Shrink();
+      return value;
+    }
+
+    // requires the lock
+    void Shrink()
+    {
+      while (m_Statistics.bytes > m_Capacity && !m_List.empty())
+      {
+        const auto &last = m_List.back();
+        m_Statistics.bytes -= last.bytes;
+        m_Map.erase(last.key);
+        m_List.pop_back();
+        ++m_Statistics.evictions;
+      }
+    }
+
+    mutable std::mutex m_Mutex;
+    size_t m_Capacity;
+    std::list<Entry> m_List;
+    std::unordered_map<Key, typename std::list<Entry>::iterator, KeyHash> m_Map;
+    SpectrumCacheStatistics m_Statistics;
+  };
+
+} // namespace m2
@@ -20,6 +20,7 @@ See LICENSE.txt for details.
 #include <m2CoreCommon.h>
 #include <signal/m2SignalCommon.h>
 #include <m2ISpectrumImageDataAccess.h>
+#include <m2IonImageCache.h>
 #include <m2SpectrumInfo.h>
 #include <m2ElxRegistrationHelper.h>
 
@@ -143,7 +144,45 @@ namespace m2
     virtual void InitializeProcessor() = 0;
     virtual void InitializeNormalizationImage(m2::NormalizationStrategyType /*type*/) =0;
 
-    void GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const override;
+    void GetImage(double mz,
+                  double tol,
+                  const mitk::Image *mask,
+                  mitk::Image *img,
+                  const m2::IonImageOptions &options = {}) const override;
+
+    /**
+     * @brief Generate one ion image per range (mz, tol), e.g. for prefetching. Derived
+     * classes may share a single pass over the data between all ranges.
+     * @param cancelled Optional, generation stops early if it returns true.
+     */
+    virtual void GetImages(const std::vector<std::pair<double, double>> &ranges,
+                           const mitk::Image *mask,
+                           const std::vector<mitk::Image *> &imgs,
+                           const std::function<bool()> &cancelled = {}) const;
+
+    /**
+     * @brief Copies a finished ion image from the ion image cache into img and updates the
+     * selection properties as GetImage does. Returns false if it is not cached for the
+     * current processing parameters.
+     */
+    bool GetImageFromCache(double mz, double tol, const mitk::Image *mask, mitk::Image *img);
+
+    /**
+     * @brief Stores an ion image that was generated by GetImage (without restrictions)
+     * with the current processing parameters.
+     */
+    void InsertImageIntoCache(double mz, double tol, const mitk::Image *mask, const mitk::Image *img);
+
+    m2::IonImageCacheKey GetIonImageCacheKey(double mz, double tol, const mitk::Image *mask) const;
+
+    /**
+     * @brief Cache of finished ion images. Budgets are read from the preferences
+     * "m2aia.signal.IonImageCacheSize" and "m2aia.signal.IonImageCacheSpillSize" (in MB,
+     * 0 disables spilling to compressed temporary files). The cache is cleared by
+     * InitializeImageAccess.
+     */
+    m2::IonImageCache &GetIonImageCache() { return *m_IonImageCache; }
+
     // void InsertImageArtifact(const std::string &key, mitk::Image *img);
 
     template <class T>
@@ -166,6 +205,10 @@ namespace m2
     void SetSpectrumType(const SpectrumInfo &other) { m_SpectrumType = other; }
 
   protected:
+    /// @brief Hash of the state that changes ion images but is not a processing parameter of the
+    /// key, e.g. the current normalization image. Derived classes add their own state.
+    virtual size_t GetIonImageCacheState() const;
+
     bool mutable m_InSaveMode = false;
     double m_Tolerance = 10;
     double m_BinningTolerance = 50;
@@ -181,6 +224,7 @@ namespace m2
     bool m_ImageGeometryInitialized = false;
 
     std::shared_ptr<m2::ElxRegistrationHelper> m_ElxRegistrationHelper;
+    std::shared_ptr<m2::IonImageCache> m_IonImageCache;
 
     unsigned int m_NumberOfValidPixels = 0;
     unsigned int m_BaseLineCorrectionHalfWindowSize = 100;
@@ -17,7 +17,9 @@ See LICENSE.txt for details.
 #include <M2aiaCoreExports.h>
 #include <m2SpectrumImage.h>
 #include <m2ElxRegistrationHelper.h>
+#include <limits>
 #include <memory>
+#include <mutex>
 
 namespace m2
 {
@@ -54,10 +56,57 @@ namespace m2
     /// @param sliceIndex Index where the warped image will be added along the z-axis of the the 3D volume
     void CopyWarpedImageToStackImage(mitk::Image *warped, mitk::Image *stack, unsigned sliceIndex) const;
 
+    /// @brief Copies warped image data to the slice of the stack data at the given index.
+    /// The slice-wise maximum normalization is computed as a parallel reduction.
+    /// @param sliceSize Number of pixels of a slice
+    /// @param threads Number of threads used for the copy
+    void CopyWarpedImageToStackData(mitk::Image *warped,
+                                    m2::DisplayImagePixelType *stackData,
+                                    unsigned int sliceSize,
+                                    unsigned sliceIndex,
+                                    unsigned int threads) const;
+
+
+    /// @brief Resampling of a slice to the stack geometry. For each target pixel, the index of the
+    /// source pixel at the lower left of the transformed position and the bilinear weights of the
+    /// neighbours along x and y. Target pixels that are not interpolated entirely from inside of the
+    /// source image have an invalid index.
+    struct WarpTable
+    {
+      static constexpr unsigned int InvalidIndex = std::numeric_limits<unsigned int>::max();
+      unsigned int sourceSize = 0;
+      unsigned int stepX = 0;
+      unsigned int stepY = 0;
+      std::vector<unsigned int> index;
+      std::vector<float> fx;
+      std::vector<float> fy;
+    };
+
+    /// @brief Computes the table of a slice by warping coordinate ramps and a mask of the moving image once.
+    std::shared_ptr<const WarpTable> GetWarpTable(unsigned int sliceIndex) const;
+
+    /// @brief Spectrum id of each pixel of a slice, or WarpTable::InvalidIndex for pixels without a spectrum.
+    std::shared_ptr<const std::vector<unsigned int>> GetSpectrumIds(unsigned int sliceIndex) const;
+
+    /// @brief Resamples the (unwarped) ion image of a slice into the stack data using its table.
+    void ApplyWarpTable(const WarpTable &table,
+                        mitk::Image *ionImage,
+                        m2::DisplayImagePixelType *stackData,
+                        unsigned int sliceSize,
+                        unsigned sliceIndex,
+                        unsigned int threads) const;
+
+    size_t GetIonImageCacheState() const override;
 
     unsigned int m_StackSize;
     double m_SpacingZ;
     bool m_UseSliceWiseMaximumNormalization = true;
+    bool m_UseWarpTables = true;
+    /// @brief Number of bins of the current overview spectra; 0 if they have to be computed.
+    int m_OverviewBins = 0;
+    mutable std::vector<std::shared_ptr<const WarpTable>> m_WarpTables;
+    mutable std::vector<std::shared_ptr<const std::vector<unsigned int>>> m_SpectrumIds;
+    mutable std::mutex m_WarpTablesMutex;
 
   public:
     // 
@@ -75,12 +124,39 @@ namespace m2
     bool GetUseSliceWiseMaximumNormalization(){return m_UseSliceWiseMaximumNormalization;}
     void SetUseSliceWiseMaximumNormalization(bool v){m_UseSliceWiseMaximumNormalization = v;}
 
-    virtual void GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const override;
-    virtual void GetSpectrumFloat(unsigned int, std::vector<float> &, std::vector<float> &) const override{}
-    virtual void GetIntensitiesFloat(unsigned int, std::vector<float> &) const override{}
-
-    virtual void GetSpectrum(unsigned int, std::vector<double> &, std::vector<double> &) const override{}
-    virtual void GetIntensities(unsigned int, std::vector<double> &) const override{}
+    /// @brief If enabled (default), ion images of registered slices are resampled with precomputed
+    /// tables (bilinear interpolation) instead of a transformix call per slice and request.
+    bool GetUseWarpTables() const { return m_UseWarpTables; }
+    void SetUseWarpTables(bool v) { m_UseWarpTables = v; }
+
+    /// @brief Slices are processed concurrently. The number of threads of this stack (or options.Threads)
+    /// is the budget shared by the concurrent slices and their own ion image generation.
+    void GetImage(double mz,
+                  double tol,
+                  const mitk::Image *mask,
+                  mitk::Image *img,
+                  const m2::IonImageOptions &options = {}) const override;
+
+    /// @brief Maps a voxel (linear index in the stack image) to a slice and the spectrum id of the
+    /// nearest source pixel in that slice, through the slice transformation.
+    /// @return False if the voxel has no source spectrum.
+    bool GetSourceSpectrum(unsigned int voxelIndex, unsigned int &sliceIndex, unsigned int &spectrumId) const;
+
+    /// @brief Spectra of many voxels. Voxels of different slices are read in parallel, voxels without
+    /// a source spectrum give empty vectors.
+    /// @param threads Number of threads; 0 uses the number of threads of the stack.
+    void GetSpectra(const std::vector<unsigned int> &voxelIndices,
+                    std::vector<std::vector<double>> &xs,
+                    std::vector<std::vector<double>> &ys,
+                    unsigned int threads = 0) const;
+
+    /// @brief The id is the linear voxel index, see GetSourceSpectrum. Spectra are given on the
+    /// x axis of their slice; voxels without a source spectrum give empty vectors.
+    void GetSpectrumFloat(unsigned int id, std::vector<float> &xs, std::vector<float> &ys) const override;
+    void GetIntensitiesFloat(unsigned int id, std::vector<float> &ys) const override;
+
+    void GetSpectrum(unsigned int id, std::vector<double> &xs, std::vector<double> &ys) const override;
+    void GetIntensities(unsigned int id, std::vector<double> &ys) const override;
   };
 
 } // namespace m2
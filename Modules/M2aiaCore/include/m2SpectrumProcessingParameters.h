@@ -0,0 +1,54 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <m2CoreCommon.h>
+#include <memory>
+#include <signal/m2SignalCommon.h>
+#include <vector>
+
+namespace m2
+{
+  /**
+   * @brief Signal processing applied to spectra and ion images.
+   *
+   * A copy of the processing settings of a spectrum image at one point in time, see
+   * ImzMLSpectrumImage::GetProcessingParameters. Unlike the settings of the image, the
+   * parameters do not change, so reads based on them can run concurrently with
+   * changes of the image settings.
+   */
+  struct SpectrumProcessingParameters
+  {
+    NormalizationStrategyType Normalization = NormalizationStrategyType::None;
+    SmoothingType Smoothing = SmoothingType::None;
+    unsigned int SmoothingHalfWindowSize = 0;
+    BaselineCorrectionType BaselineCorrection = BaselineCorrectionType::None;
+    unsigned int BaselineCorrectionHalfWindowSize = 0;
+    IntensityTransformationType IntensityTransformation = IntensityTransformationType::None;
+    RangePoolingStrategyType RangePooling = RangePoolingStrategyType::Maximum;
+
+    /// @brief One factor per spectrum id; nullptr if Normalization is None. Shared by copies.
+    std::shared_ptr<const std::vector<double>> NormalizationFactors;
+
+    double Tolerance = 0;
+    bool UseToleranceInPPM = true;
+
+    bool UseNormalization() const { return Normalization != NormalizationStrategyType::None && NormalizationFactors; }
+
+    /// @brief See SpectrumImage::ApplyTolerance.
+    double ApplyTolerance(double xValue) const { return UseToleranceInPPM ? m2::PartPerMillionToFactor(Tolerance) * xValue : Tolerance; }
+  };
+
+} // namespace m2
@@ -0,0 +1,134 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <M2aiaCoreExports.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace m2
+{
+  /**
+   * @class SpectrumReadScheduler
+   * @brief Reads byte ranges of a binary data file in file-offset order.
+   *
+   * Pixel order in imzML files often does not match the byte order in the *.ibd file
+   * (e.g. cropped or re-sorted exports). Reading spectra in pixel order then results in
+   * random I/O. The scheduler sorts all requested (offset, length) pairs, coalesces
+   * neighbouring ranges into larger blocks and streams these blocks through a bounded
+   * queue to the processing workers.
+   *
+   * Ranges are only merged if the skipped bytes do not exceed the requested bytes of the
+   * resulting block, i.e. at most half of every read is discarded. Narrow windows of large
+   * spectra are therefore read one by one instead of reading the whole file. Blocks are
+   * limited to a number of requests such that all processing threads get work.
+   *
+   * Usage:
+   * @code
+   * m2::SpectrumReadScheduler scheduler(p->GetBinaryDataPath());
+   * for (unsigned int i = 0; i < spectra.size(); ++i)
+   *   scheduler.Add(spectra[i].intOffset, spectra[i].intLength * sizeof(IntensityType), i);
+   * scheduler.Run(threads, [&](unsigned int t, unsigned int id, const char *data) { ... });
+   * @endcode
+   */
+  class M2AIACORE_EXPORT SpectrumReadScheduler
+  {
+  public:
+    using OffsetType = unsigned long long;
+    using LengthType = unsigned long long;
+
+    /// @brief Called for each request; data points to the requested bytes and is valid only during the call.
+    using WorkerType = std::function<void(unsigned int threadId, unsigned int requestId, const char *data)>;
+
+    struct Request
+    {
+      OffsetType offset;
+      LengthType length;
+      unsigned int id;
+    };
+
+    explicit SpectrumReadScheduler(std::string path);
+
+    /// @brief Add a read request of length bytes at offset. The id is passed to the worker.
+    void Add(OffsetType offset, LengthType length, unsigned int id);
+    void Reserve(size_t n) { m_Requests.reserve(n); }
+    void Clear() { m_Requests.clear(); }
+    size_t GetNumberOfRequests() const { return m_Requests.size(); }
+
+    /// @brief Two requests are merged into one read if they are at most this many bytes apart
+    /// and the gap does not exceed the requested bytes of the merged block.
+    void SetMaximumGap(LengthType v) { m_MaximumGap = v; }
+    LengthType GetMaximumGap() const { return m_MaximumGap; }
+
+    /// @brief Upper bound of a merged read. Single requests larger than this are read as they are.
+    void SetMaximumBlockSize(LengthType v) { m_MaximumBlockSize = v; }
+    LengthType GetMaximumBlockSize() const { return m_MaximumBlockSize; }
+
+    /// @brief Number of blocks that may be read ahead of the processing workers.
+    void SetQueueDepth(unsigned int v) { m_QueueDepth = v; }
+    unsigned int GetQueueDepth() const { return m_QueueDepth; }
+
+    /**
+     * @brief Number of threads issuing reads. If 0 (default), one reader is used for large
+     * blocks (sequential throughput) and one reader per processing thread for small blocks,
+     * where the read latency dominates. More readers also help on network file systems.
+     */
+    void SetNumberOfReaders(unsigned int v) { m_NumberOfReaders = v; }
+    unsigned int GetNumberOfReaders() const { return m_NumberOfReaders; }
+
+    /// @brief Polled before each block is read. If it returns true, Run stops early without an error.
+    void SetCancelCallback(std::function<bool()> f) { m_Cancelled = std::move(f); }
+
+    /**
+     * @brief Read all requests and hand them to worker threads.
+     * Requests are processed in offset order per block, blocks may complete in any order.
+     * Throws if the file can not be read or if any worker throws.
+     * @param threads Number of processing threads, threadId is in range [0, threads).
+     * @param worker Callback invoked once per request.
+     */
+    void Run(unsigned int threads, const WorkerType &worker);
+
+    /// @brief Number of reads planned by the last call to Run.
+    size_t GetNumberOfBlocks() const { return m_NumberOfBlocks; }
+
+    /// @brief Number of bytes read by the last call to Run, including the gaps between merged requests.
+    /// Blocks that were not read because Run was cancelled or failed are not counted.
+    LengthType GetNumberOfBytesRead() const { return m_NumberOfBytesRead; }
+
+  private:
+    struct Block
+    {
+      OffsetType offset;
+      LengthType length;
+      LengthType requested; // sum of the lengths of the covered requests
+      size_t first, last;   // range of (sorted) requests covered by this block
+    };
+
+    std::vector<Block> CreateBlocks(unsigned int threads);
+
+    std::string m_Path;
+    std::vector<Request> m_Requests;
+    LengthType m_MaximumGap = 64 * 1024;
+    LengthType m_MaximumBlockSize = 16 * 1024 * 1024;
+    unsigned int m_QueueDepth = 8;
+    unsigned int m_NumberOfReaders = 0;
+    std::function<bool()> m_Cancelled;
+
+    size_t m_NumberOfBlocks = 0;
+    LengthType m_NumberOfBytesRead = 0;
+  };
+
+} // namespace m2
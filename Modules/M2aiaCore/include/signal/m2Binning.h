@@ -18,8 +18,10 @@ See LICENSE.txt for details.
 #include <M2aiaCoreExports.h>
 #include "m2SignalCommon.h"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <m2IntervalVector.h>
+#include <m2Process.hpp>
 #include <numeric>
 #include <unordered_map>
 #include <vector>
@@ -30,60 +32,50 @@ namespace m2
 {
   namespace Signal
   {
+    /**
+     * @brief Merges sorted peaks. A range of peaks is split at its largest gap as long as one
+     * of its peaks deviates by tolerance or more from the mean position (relative to the mean,
+     * or absolute if absoluteDistance is set). The merged peaks are written in ascending order.
+     * For large peak lists of many pixels, see m2::Signal::ToleranceBinning.
+     */
     template <class PeakItFirst, class PeakItLast, class OutIterType>
     inline void toleranceBasedBinning(
       PeakItFirst s, PeakItLast e, OutIterType output, double tolerance, bool absoluteDistance = false)
     {
-      if (s == e)
-        return;
-
-      unsigned int size = 0;
-      const auto accPeak = std::accumulate(s, e, m2::Interval());
-      const auto meanX = accPeak.GetX();
-
-      bool dirty = false;
-      decltype(s) i = s;
-      while (i != e)
-      {
-        if (std::abs(i->GetX() - meanX) >= ((meanX * tolerance) * (!absoluteDistance) + (absoluteDistance * tolerance)))
-        {
-          dirty = true;
-          break;
-        }
-        ++i;
-      }
-
-      if (dirty && size >= 2)
+      // ranges are processed depth first, the left half before the right one
+      std::vector<std::pair<PeakItFirst, PeakItFirst>> ranges{{s, e}};
+      while (!ranges.empty())
       {
-        decltype(s) pivot;
+        const auto [first, last] = ranges.back();
+        ranges.pop_back();
+        if (first == last)
+          continue;
+
+        m2::Interval newPeak = *first;
+        std::for_each(std::next(first), last, [&newPeak](const m2::Interval &p) { newPeak += p; });
+        const auto meanX = newPeak.x.mean();
+        const auto limit = absoluteDistance ? tolerance : meanX * tolerance;
+        const bool dirty =
+          std::any_of(first, last, [&](const m2::Interval &p) { return std::abs(p.x.mean() - meanX) >= limit; });
+
+        if (dirty && std::distance(first, last) >= 2)
         {
-          decltype(s) s0 = s;
-          decltype(s) s1 = std::next(s);
-          pivot = s1;
+          auto pivot = std::next(first);
           double max = 0; // max distance of mz neighbors is split position
-          while (s1 != e)
+          for (auto s0 = first, s1 = std::next(first); s1 != last; ++s0, ++s1)
           {
-            if (s1->GetX() - s0->GetX() > max)
+            if (s1->x.mean() - s0->x.mean() > max)
             {
-              max = s1->GetX() - s0->GetX();
+              max = s1->x.mean() - s0->x.mean();
               pivot = s1;
             }
-            ++s1;
-            ++s0;
           }
+          ranges.emplace_back(pivot, last);
+          ranges.emplace_back(first, pivot);
+          continue;
         }
 
-        toleranceBasedBinning(s, pivot, output, tolerance, absoluteDistance);
-        toleranceBasedBinning(pivot, e, output, tolerance, absoluteDistance);
-      }
-      else
-      {
         // output a new peak
-        m2::Interval newPeak = *s;
-        ++s;
-
-        std::for_each(s, e, [&newPeak](const m2::Interval &p) { newPeak += p; });
-
         (*output) = newPeak;
         ++output;
       }
@@ -167,124 +159,186 @@ namespace m2
       return mean_xs;
     }
 
+    /**
+     * @class MaxGapTree
+     * @brief Cartesian tree over the gaps d[i] = xs[i] - xs[i - 1] (i >= 1) of sorted values.
+     *
+     * The root of the subtree that spans the gaps of a segment [left, right) is the position
+     * of its first maximal gap, i.e. the split position of groupBinning. Its children are the
+     * roots of the two halves. The tree is built in linear time with a stack; nodes without
+     * a child return -1.
+     */
+    class MaxGapTree
+    {
+    public:
+      template <class XType>
+      explicit MaxGapTree(const std::vector<XType> &xs)
+      {
+        const int n = xs.size();
+        m_Left.assign(n, -1);
+        m_Right.assign(n, -1);
+        std::vector<int> stack;
+        for (int i = 1; i < n; ++i)
+        {
+          const auto gap = xs[i] - xs[i - 1];
+          int last = -1;
+          // ties: the left gap stays the ancestor, as std::max_element returns the first maximum
+          while (!stack.empty() && xs[stack.back()] - xs[stack.back() - 1] < gap)
+          {
+            last = stack.back();
+            stack.pop_back();
+          }
+          if (!stack.empty())
+            m_Right[stack.back()] = i;
+          m_Left[i] = last;
+          stack.push_back(i);
+        }
+        m_Root = stack.empty() ? -1 : stack.front();
+      }
+
+      int GetRoot() const { return m_Root; }
+      int GetLeft(int node) const { return node < 0 ? -1 : m_Left[node]; }
+      int GetRight(int node) const { return node < 0 ? -1 : m_Right[node]; }
+
+    private:
+      std::vector<int> m_Left, m_Right;
+      int m_Root = -1;
+    };
+
+    /**
+     * @brief Splits sorted values recursively at the largest gap until the functor accepts a
+     * segment (returns a value != 0). Returns the accepted segments as intervals together with
+     * their sources, sorted by the mean x value.
+     *
+     * The split positions are looked up in a MaxGapTree (O(n) instead of a search over each
+     * segment). With threads > 1, large inputs are split sequentially until the segments are
+     * small, which are then processed in parallel; the result is identical. The functor must be
+     * thread-safe in that case.
+     */
     template <typename XType, typename YType, typename SourceType, typename Functor>
     inline std::tuple<std::vector<m2::Interval>, std::vector<std::vector<SourceType>>> groupBinning(
       const std::vector<XType> &xs,
       const std::vector<YType> &ys,
       const std::vector<SourceType> &sources,
-      // const std::vector<SourceType> &indices,
       Functor f,
-      double tolerance)
+      double tolerance,
+      unsigned int threads = 1)
     {
       using namespace std;
-      using xvec = vector<XType>;
-      // using yvec = vector<YType>;
       using svec = vector<SourceType>;
 
-      xvec d;
-      d.resize(xs.size());
-      adjacent_difference(xs.begin(), xs.end(), begin(d));
-      d[0] = -1;
-
-
-      std::vector<m2::Interval> I;
-      
-      // svec bin_assignments;
-      // bin_assignments.resize(xs.size(), -1);
-
-      auto n = static_cast<int>(xs.size());
-      vector<pair<int, int>> boundary{{0, n}};
-      boundary.reserve(xs.size());
-      
-      vector<svec> bin_counts;
-      bin_counts.reserve(xs.size());
-            
-      std::vector<m2::Interval> intervals;
-      intervals.reserve(xs.size());
-      
-      int current_id = 0;
-      while (!boundary.empty())
+      struct Segment
       {
-        auto left = boundary.back().first;
-        auto right = boundary.back().second;
-        boundary.pop_back();
+        int left, right, node;
+      };
 
+      std::vector<m2::Interval> intervals;
+      vector<svec> bin_counts;
+      const auto n = static_cast<int>(xs.size());
+      if (n == 0)
+        return std::make_tuple(intervals, bin_counts);
 
-        int gapIdx = distance(begin(d), max_element(begin(d)+left+1,begin(d)+right));
-        // MITK_INFO << " ---- [" << left << "/" << gapIdx << "/" << right << "]";
-        
+      const MaxGapTree tree(xs);
 
-        auto l = f(begin(xs) + left, begin(xs) + gapIdx, begin(ys) + left, begin(sources) + left, tolerance);
-        if (l == 0){
-          boundary.push_back({left, gapIdx});
-          // MITK_INFO << "left : " << left << " " << gapIdx;
-        }
-        else
+      // accepted halves are emitted, the others are pushed (left first, so the right one is processed next)
+      const auto split = [&](const Segment &s, vector<Segment> &boundary, vector<m2::Interval> &I, vector<svec> &S)
+      {
+        const int gapIdx = s.node < 0 ? s.right : s.node;
+        for (const Segment &c : {Segment{s.left, gapIdx, tree.GetLeft(s.node)},
+                                 Segment{gapIdx, s.right, tree.GetRight(s.node)}})
         {
+          if (f(begin(xs) + c.left, begin(xs) + c.right, begin(ys) + c.left, begin(sources) + c.left, tolerance) == 0)
+          {
+            boundary.push_back(c);
+            continue;
+          }
           m2::Interval i;
-          auto yIt = begin(ys) + left;
-          auto xIt = begin(xs) + left;
-          for(; xIt != begin(xs) + gapIdx; ++xIt, ++yIt){
+          auto yIt = begin(ys) + c.left;
+          for (auto xIt = begin(xs) + c.left; xIt != begin(xs) + c.right; ++xIt, ++yIt)
+          {
             i.x(*xIt);
             i.y(*yIt);
           }
-
-          
-          // fill(begin(bin_assignments) + left, begin(bin_assignments) + gapIdx, current_id);
-          intervals.emplace_back(i);
-          bin_counts.emplace_back(begin(sources) + left, begin(sources) + gapIdx);
-          current_id += 1;
-          
+          I.emplace_back(i);
+          S.emplace_back(begin(sources) + c.left, begin(sources) + c.right);
         }
+      };
 
-        auto r = f(begin(xs) + gapIdx, begin(xs) + right, begin(ys) + gapIdx, begin(sources) + gapIdx, tolerance);
-        if (r == 0){
-          boundary.push_back({gapIdx, right});
-          // MITK_INFO << "right : " << gapIdx << " " << right;
+      const auto process = [&](Segment s, vector<m2::Interval> &I, vector<svec> &S)
+      {
+        vector<Segment> boundary{s};
+        while (!boundary.empty())
+        {
+          s = boundary.back();
+          boundary.pop_back();
+          split(s, boundary, I, S);
         }
-        else
+      };
+
+      const int grain = std::max(n / int(std::max(threads, 1u) * 16), 1 << 12);
+      if (threads <= 1 || n <= grain)
+      {
+        process({0, n, tree.GetRoot()}, intervals, bin_counts);
+      }
+      else
+      {
+        // all emissions of a popped segment follow each other, so a small segment can be
+        // processed later and its results inserted at the position it was popped
+        vector<Segment> tasks;
+        vector<size_t> taskPositions;
+        vector<Segment> boundary{{0, n, tree.GetRoot()}};
+        while (!boundary.empty())
         {
-          m2::Interval i;
-          auto yIt = begin(ys) + gapIdx;
-          auto xIt = begin(xs) + gapIdx;
-          for(; xIt != begin(xs) + right; ++xIt, ++yIt){
-            i.x(*xIt);
-            i.y(*yIt);
+          const auto s = boundary.back();
+          boundary.pop_back();
+          if (s.right - s.left <= grain)
+          {
+            tasks.push_back(s);
+            taskPositions.push_back(intervals.size());
+            continue;
           }
+          split(s, boundary, intervals, bin_counts);
+        }
 
-          // fill(begin(bin_assignments) + gapIdx, begin(bin_assignments) + right, current_id);
-          // bin_xs.push_back(r);
-          intervals.emplace_back(i);
-          bin_counts.emplace_back(begin(sources) + gapIdx, begin(sources) + right);
-          current_id += 1;
-          // MITK_INFO << "right [pure]: " << gapIdx << " " << right << " <" << r << ">";
+        vector<vector<m2::Interval>> taskIntervals(tasks.size());
+        vector<vector<svec>> taskCounts(tasks.size());
+        std::atomic<size_t> next(0);
+        m2::Process::Map(threads,
+                         threads,
+                         [&](unsigned int, unsigned int, unsigned int)
+                         {
+                           for (size_t k = next++; k < tasks.size(); k = next++)
+                             process(tasks[k], taskIntervals[k], taskCounts[k]);
+                         });
+
+        vector<m2::Interval> mergedIntervals;
+        vector<svec> mergedCounts;
+        mergedIntervals.reserve(intervals.size());
+        mergedCounts.reserve(intervals.size());
+        size_t pos = 0;
+        for (size_t k = 0; k <= tasks.size(); ++k)
+        {
+          const size_t stop = k < tasks.size() ? taskPositions[k] : intervals.size();
+          for (; pos < stop; ++pos)
+          {
+            mergedIntervals.emplace_back(std::move(intervals[pos]));
+            mergedCounts.emplace_back(std::move(bin_counts[pos]));
+          }
+          if (k < tasks.size())
+          {
+            std::move(begin(taskIntervals[k]), end(taskIntervals[k]), back_inserter(mergedIntervals));
+            std::move(begin(taskCounts[k]), end(taskCounts[k]), back_inserter(mergedCounts));
+          }
         }
+        intervals = std::move(mergedIntervals);
+        bin_counts = std::move(mergedCounts);
       }
 
-      // int binId = 0;
-      // int curr = bin_assignments[0];
-      // transform(begin(bin_assignments), end(bin_assignments), begin(bin_assignments), [&binId, &curr](auto & val){
-      //   if(val != curr){
-      //     ++binId;
-      //     curr = val;
-      //   }
-      //   return binId;
-      // });
-
-      intervals.shrink_to_fit();
-     
-
-      // vector<svec> sorted_bin_counts;
-      // sorted_bin_xs.resize(bin_xs.size());
-      // sorted_bin_counts.resize(bin_counts.size());
-
       auto indices = m2::argsort(intervals);
       auto sorted_bin_xs = m2::argsortApply(intervals, indices);
       auto sorted_bin_counts = m2::argsortApply(bin_counts, indices);
 
-
-    return std::make_tuple(sorted_bin_xs, sorted_bin_counts);
-
+      return std::make_tuple(sorted_bin_xs, sorted_bin_counts);
     }
 
     //     auto l = grouper(xs.cbegin() + left, xs.cbegin() + gapIdx, ys.cbegin() + left, ss.cbegin() + left,
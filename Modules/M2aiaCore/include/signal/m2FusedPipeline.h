@@ -0,0 +1,286 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <algorithm>
+#include <signal/m2Morphology.h>
+#include <signal/m2SignalCommon.h>
+#include <signal/m2SignalKernels.h>
+#include <type_traits>
+#include <vector>
+
+namespace m2
+{
+  namespace Signal
+  {
+    /**
+     * @class FusedPipeline
+     * @brief Fused normalization, smoothing, baseline correction, intensity transformation
+     * and range pooling of a (padded) spectrum range.
+     *
+     * Each supported configuration is a separate template instance, so no stage is switched
+     * per value. Normalization is applied while smoothing (or while pooling, if there is no
+     * smoothing). The baseline is subtracted and the result is pooled in one pass over the
+     * pooling range only; a transformation runs vectorized on that range in between. All
+     * buffers are per thread and sized to the padded range.
+     *
+     * Supported are all smoothing kernels, TopHat or no baseline correction, all intensity
+     * transformations and Sum, Mean or Maximum pooling. For other configurations
+     * Initialize returns false and the generic chain has to be used.
+     *
+     * With smoothing, the normalization factor is applied to the convolution result instead of
+     * each input value. The result differs from the generic chain only by rounding, by at most
+     * Tolerance() relative to the sum of the absolute normalized intensities of the padded range.
+     * All other configurations give identical results.
+     */
+    template <class T>
+    class FusedPipeline
+    {
+    public:
+      using KernelType = T (*)(std::vector<T> &ints,
+                               size_t first,
+                               size_t last,
+                               T norm,
+                               const std::vector<double> &smoothingKernel,
+                               unsigned int baselineHws,
+                               std::vector<T> &work,
+                               std::vector<T> &baseline);
+
+      static constexpr double Tolerance() { return std::is_same<T, float>::value ? 1e-5 : 1e-12; }
+
+      /// @brief smoothingKernel is empty if no smoothing is applied. Returns false if the configuration is not supported.
+      bool Initialize(bool normalize,
+                      const std::vector<double> &smoothingKernel,
+                      BaselineCorrectionType baseline,
+                      unsigned int baselineHws,
+                      IntensityTransformationType transformation,
+                      RangePoolingStrategyType pooling)
+      {
+        m_SmoothingKernel = smoothingKernel;
+        m_BaselineHws = baselineHws;
+        m_Kernel = nullptr;
+        // a kernel of size one shifts the data in m2::Signal::filter, keep that behaviour
+        if (!m_SmoothingKernel.empty() && m_SmoothingKernel.size() < 3)
+          return false;
+        if (baseline == BaselineCorrectionType::TopHat && baselineHws == 0)
+          return false;
+        m_Kernel = SelectNormalization(normalize, !m_SmoothingKernel.empty(), baseline, transformation, pooling);
+        return m_Kernel != nullptr;
+      }
+
+      bool IsFused() const { return m_Kernel != nullptr; }
+
+      /**
+       * @brief Processes ints (modified) and returns the pooled value of [first, last).
+       * work and baseline are scratch buffers of at least the size of ints.
+       */
+      T operator()(std::vector<T> &ints, size_t first, size_t last, T norm, std::vector<T> &work, std::vector<T> &baseline) const
+      {
+        return m_Kernel(ints, first, last, norm, m_SmoothingKernel, m_BaselineHws, work, baseline);
+      }
+
+    private:
+      template <bool Normalize, bool Smooth, bool TopHat, IntensityTransformationType X, RangePoolingStrategyType P>
+      static T Run(std::vector<T> &ints,
+                   size_t first,
+                   size_t last,
+                   T norm,
+                   const std::vector<double> &kernel,
+                   unsigned int baselineHws,
+                   std::vector<T> &work,
+                   std::vector<T> &baseline)
+      {
+        const size_t n = ints.size();
+        std::vector<T> *y = &ints;
+
+        // normalization is part of the convolution, borders are extended as in m2::Signal::filter
+        if constexpr (Smooth)
+        {
+          const size_t ks = kernel.size();
+          const size_t h = ks / 2;
+          const double *k = kernel.data();
+          const T *x = ints.data();
+          T *out = work.data();
+          for (size_t i = 0; i < n; ++i)
+          {
+            T acc = 0;
+            if (i >= h && i + h < n)
+            {
+              const T *xi = x + i - h;
+              for (size_t j = 0; j < ks; ++j)
+                acc += k[j] * xi[j];
+            }
+            else
+            {
+              for (size_t j = 0; j < ks; ++j)
+              {
+                const auto idx = std::min(std::max(long(i + j) - long(h), 0l), long(n) - 1);
+                acc += k[j] * x[idx];
+              }
+            }
+            if constexpr (Normalize)
+              out[i] = acc / norm;
+            else
+              out[i] = acc;
+          }
+          y = &work;
+        }
+
+        // erosion and dilation pick values of y, for a positive factor the opening of the
+        // normalized values equals the normalized opening; no extra normalization pass
+        bool scaled = Normalize && !Smooth;
+        if constexpr (TopHat)
+        {
+          if (Normalize && !Smooth && !(norm > 0))
+          {
+            std::transform(std::begin(ints), std::end(ints), std::begin(work), [norm](const T &v) { return v / norm; });
+            y = &work;
+            scaled = false;
+          }
+          Erosion(std::begin(*y), std::end(*y), baselineHws, std::begin(baseline));
+          Dilation(std::begin(baseline), std::next(std::begin(baseline), n), baselineHws, std::begin(baseline));
+        }
+
+        if (first >= last)
+          return 0;
+
+        const T *yv = y->data();
+        const T *bv = baseline.data();
+        const auto value = [&](size_t i)
+        {
+          T v = yv[i];
+          if constexpr (TopHat)
+          {
+            if (scaled)
+              v = std::max(T(0), v / norm - bv[i] / norm);
+            else
+              v = std::max(T(0), v - bv[i]);
+          }
+          else if (scaled)
+          {
+            v = v / norm;
+          }
+          return v;
+        };
+
+        // the transformation is vectorized, it runs on the pooling range stored in ints
+        const T *pv = nullptr;
+        if constexpr (X != IntensityTransformationType::None)
+        {
+          T *range = ints.data();
+          for (size_t i = first; i < last; ++i)
+            range[i] = value(i);
+          Kernels::Transform(X, range + first, last - first);
+          pv = range;
+        }
+
+        const auto pooled = [&](size_t i)
+        {
+          if constexpr (X != IntensityTransformationType::None)
+            return pv[i];
+          else
+            return value(i);
+        };
+
+        T acc = pooled(first);
+        for (size_t i = first + 1; i < last; ++i)
+        {
+          if constexpr (P == RangePoolingStrategyType::Maximum)
+          {
+            const T v = pooled(i);
+            if (acc < v)
+              acc = v;
+          }
+          else
+          {
+            acc = acc + pooled(i);
+          }
+        }
+
+        if constexpr (P == RangePoolingStrategyType::Mean)
+          return acc / T(last - first);
+        else
+          return acc;
+      }
+
+      template <bool Normalize, bool Smooth, bool TopHat, IntensityTransformationType X>
+      static KernelType SelectPooling(RangePoolingStrategyType pooling)
+      {
+        switch (pooling)
+        {
+          case RangePoolingStrategyType::Sum:
+            return &Run<Normalize, Smooth, TopHat, X, RangePoolingStrategyType::Sum>;
+          case RangePoolingStrategyType::Mean:
+            return &Run<Normalize, Smooth, TopHat, X, RangePoolingStrategyType::Mean>;
+          case RangePoolingStrategyType::Maximum:
+            return &Run<Normalize, Smooth, TopHat, X, RangePoolingStrategyType::Maximum>;
+          default:
+            return nullptr;
+        }
+      }
+
+      template <bool Normalize, bool Smooth, bool TopHat>
+      static KernelType SelectTransformation(IntensityTransformationType transformation, RangePoolingStrategyType pooling)
+      {
+        switch (transformation)
+        {
+          case IntensityTransformationType::None:
+            return SelectPooling<Normalize, Smooth, TopHat, IntensityTransformationType::None>(pooling);
+          case IntensityTransformationType::Log10:
+            return SelectPooling<Normalize, Smooth, TopHat, IntensityTransformationType::Log10>(pooling);
+          case IntensityTransformationType::Log2:
+            return SelectPooling<Normalize, Smooth, TopHat, IntensityTransformationType::Log2>(pooling);
+          case IntensityTransformationType::SquareRoot:
+            return SelectPooling<Normalize, Smooth, TopHat, IntensityTransformationType::SquareRoot>(pooling);
+        }
+        return nullptr;
+      }
+
+      template <bool Normalize, bool Smooth>
+      static KernelType SelectBaseline(BaselineCorrectionType baseline,
+                                       IntensityTransformationType transformation,
+                                       RangePoolingStrategyType pooling)
+      {
+        switch (baseline)
+        {
+          case BaselineCorrectionType::None:
+            return SelectTransformation<Normalize, Smooth, false>(transformation, pooling);
+          case BaselineCorrectionType::TopHat:
+            return SelectTransformation<Normalize, Smooth, true>(transformation, pooling);
+          default:
+            return nullptr;
+        }
+      }
+
+      static KernelType SelectNormalization(bool normalize,
+                                            bool smooth,
+                                            BaselineCorrectionType baseline,
+                                            IntensityTransformationType transformation,
+                                            RangePoolingStrategyType pooling)
+      {
+        if (normalize)
+          return smooth ? SelectBaseline<true, true>(baseline, transformation, pooling)
+                        : SelectBaseline<true, false>(baseline, transformation, pooling);
+        return smooth ? SelectBaseline<false, true>(baseline, transformation, pooling)
+                      : SelectBaseline<false, false>(baseline, transformation, pooling);
+      }
+
+      KernelType m_Kernel = nullptr;
+      std::vector<double> m_SmoothingKernel;
+      unsigned int m_BaselineHws = 0;
+    };
+
+  } // namespace Signal
+} // namespace m2
@@ -64,21 +64,19 @@ namespace m2
       return m2::Signal::Median(std::begin(ints), std::end(ints));
     }
 
+    /// @brief Partially reorders the range in place; returns 0 for an empty range.
     template <class ItFirst, class ItLast>
     double Median(ItFirst first, ItLast last) noexcept
     {
       const size_t n = std::distance(first, last);
-      if ((n % 2) == 0)
-      {
-        std::nth_element(first, first + n / 2, last);
-        std::nth_element(first, first + n / 2 + 1, last);
-        return 0.5 * (*(first + n / 2) + *(first + (n / 2 + 1)));
-      }
-      else
-      {
-        std::nth_element(first, first + (n / 2), last);
-        return *(first + n / 2);
-      }
+      if (n == 0)
+        return 0;
+      const auto mid = first + n / 2;
+      std::nth_element(first, mid, last);
+      if ((n % 2) == 1)
+        return *mid;
+      // the lower middle value is the largest one of the lower partition
+      return 0.5 * (*std::max_element(first, mid) + *mid);
     }
 
   }; // namespace Signal
@@ -17,6 +17,7 @@ See LICENSE.txt for details.
 
 #include <M2aiaCoreExports.h>
 #include <m2CoreCommon.h>
+#include <m2Process.hpp>
 #include <signal/m2MedianAbsoluteDeviation.h>
 #include <signal/m2Binning.h>
 #include <vector>
@@ -102,55 +103,74 @@ namespace m2
       }
     }
 
-    inline std::vector<std::vector<unsigned int>> pseudoCluster(const std::vector<double> &x,
-                                                                unsigned int size = 3L,
-                                                                double distance = 1.00235,
-                                                                double tolerance = 1e-4)
+    /**
+     * @brief Isotope chains of sorted peak positions x.
+     * For each start peak i, the peak closest to x[i] + s * distance / charge (s = 1, 2, ...) among the peaks
+     * following i is appended while it is closer than x[i] * tolerance; a chain holds at most maxSize indices
+     * (including i). Closest peaks are found by binary search in x, the lower one on a tie.
+     * Chains are computed for the start peaks [0, count) using the given number of threads.
+     */
+    inline std::vector<std::vector<unsigned int>> isotopeChains(const std::vector<double> &x,
+                                                                unsigned int count,
+                                                                unsigned int maxSize,
+                                                                double distance,
+                                                                double tolerance,
+                                                                unsigned int charge = 1,
+                                                                unsigned int threads = 1)
     {
-      std::vector<std::vector<unsigned int>> r;
+      count = std::min<unsigned int>(count, x.size());
+      std::vector<std::vector<unsigned int>> chains(count);
+      if (count == 0)
+        return chains;
 
-      for (unsigned int i = 0; i < (x.size() - size > x.size() ? 0:x.size()- size); ++i)
+      const double spacing = distance / std::max(charge, 1u);
+      const auto worker = [&](unsigned int, unsigned int start, unsigned int end)
       {
-        bool eval = true;
-        std::vector<unsigned int> indices;
-        indices.push_back(i);
-
-        for (unsigned int s = 1; s < size; ++s)
+        for (unsigned int i = start; i < end; ++i)
         {
-          std::vector<double> c;
-          double minDistance = std::numeric_limits<double>::max();
-          unsigned int minElem = 0;
-          for (unsigned ik = i + 1; ik < x.size(); ++ik)
+          auto &chain = chains[i];
+          chain.push_back(i);
+          const auto first = std::next(std::begin(x), i + 1);
+          for (unsigned int s = 1; s < maxSize; ++s)
           {
-            double dist = std::abs(x[ik] - (x[i] + s * distance));
-            if (dist < minDistance)
-            {
-              minDistance = dist;
-              minElem = ik;
-            }
-            else if (dist > minDistance)
-            {
+            const double target = x[i] + s * spacing;
+            auto candidate = std::lower_bound(first, std::end(x), target);
+            if (candidate == first && candidate == std::end(x))
               break;
-            }
-          }
+            // the first of equal positions, as found by a linear search from i + 1
+            if (candidate == std::end(x) ||
+                (candidate != first && std::abs(*std::prev(candidate) - target) <= std::abs(*candidate - target)))
+              candidate = std::lower_bound(first, candidate, *std::prev(candidate));
 
-          if (minDistance < (x[i] * tolerance))
-          {
-            indices.push_back(minElem);
-          }
-          else
-          {
-            eval = false;
-            break;
+            if (!(std::abs(*candidate - target) < x[i] * tolerance))
+              break;
+            chain.push_back(std::distance(std::begin(x), candidate));
           }
         }
+      };
 
-        if (eval)
-        {
-          r.emplace_back(indices);
-        }
-      }
+      if (threads > 1 && count >= 1024)
+        m2::Process::Map(count, threads, worker);
+      else
+        worker(0, 0, count);
+      return chains;
+    }
 
+    /**
+     * @brief Groups of size peaks with isotope spacing (distance / charge), see isotopeChains.
+     * x is expected to be sorted; the last size peaks do not start a group.
+     */
+    inline std::vector<std::vector<unsigned int>> pseudoCluster(const std::vector<double> &x,
+                                                                unsigned int size = 3L,
+                                                                double distance = 1.00235,
+                                                                double tolerance = 1e-4,
+                                                                unsigned int charge = 1,
+                                                                unsigned int threads = 1)
+    {
+      const unsigned int count = x.size() > size ? x.size() - size : 0;
+      auto r = isotopeChains(x, count, size, distance, tolerance, charge, threads);
+      r.erase(std::remove_if(std::begin(r), std::end(r), [size](const auto &c) { return c.size() < size; }),
+              std::end(r));
       return r;
     }
 
@@ -212,7 +232,8 @@ namespace m2
     }
 
     // Calculate the correlation for two matrices columnwise.
-    inline std::vector<double> colCors(std::vector<std::vector<double>> x, std::vector<std::vector<double>> y) noexcept
+    inline std::vector<double> colCors(const std::vector<std::vector<double>> &x,
+                                       const std::vector<std::vector<double>> &y) noexcept
     {
       if (x.size() != y.size())
         return {};
@@ -266,68 +287,113 @@ namespace m2
       return resultPccr;
     }
 
-    //  Model isotopic distribution by poisson distribution.
+    /**
+     * @brief Isotope patterns of the given size among the isotope chains of x (see isotopeChains) whose
+     * intensities correlate with a poisson model by more than minCor. Only the chains long enough are
+     * evaluated, in parallel using the given number of threads.
+     */
     inline std::vector<std::vector<unsigned int>> monoisotopicPattern(const std::vector<Interval> &x,
-                                                                      double minCor = 0.95,
-                                                                      double tolerance = 1e-4,
-                                                                      double distance = 1.00235,
-                                                                      unsigned int size = 3L)
+                                                                      const std::vector<std::vector<unsigned int>> &chains,
+                                                                      double minCor,
+                                                                      unsigned int size,
+                                                                      unsigned int threads = 1)
     {
-      std::vector<std::vector<unsigned int>> pccr;
+      // same start peaks as pseudoCluster
+      const unsigned int count = std::min<size_t>(chains.size(), x.size() > size ? x.size() - size : 0);
+      std::vector<unsigned int> candidates;
+      for (unsigned int i = 0; i < count; ++i)
+        if (chains[i].size() >= size)
+          candidates.push_back(i);
+      if (candidates.empty())
+        return {};
+
+      std::vector<unsigned int> isotopes;
+      unsigned int n = 0;
+      std::generate_n(std::back_inserter(isotopes), size, [&n]() { return n++; });
+
+      std::vector<char> accepted(candidates.size(), 0);
+      const auto worker = [&](unsigned int, unsigned int start, unsigned int end)
       {
-        std::vector<double> mzs;
-        for (const auto &p : x)
-          mzs.push_back(p.x.mean());
-
-        auto pc = pseudoCluster(mzs, size, distance, tolerance);
-        if (pc.empty())
-          return {};
-        std::vector<std::vector<double>> ypc;
-        std::vector<double> xpc;
-        for (const auto &p : pc)
+        std::vector<std::vector<double>> ypc(1);
+        for (unsigned int c = start; c < end; ++c)
         {
-          std::vector<double> u;
+          const auto &chain = chains[candidates[c]];
+          auto &u = ypc.front();
+          u.clear();
           double sum = 0;
-          for (const auto &i : p)
+          for (unsigned int k = 0; k < size; ++k)
           {
-            u.push_back(x[i].y.mean());
-            sum += x[i].y.mean();
+            u.push_back(x[chain[k]].y.mean());
+            sum += x[chain[k]].y.mean();
           }
           std::transform(std::begin(u), std::end(u), std::begin(u), [&sum](const auto &v) { return v / sum; });
-          ypc.emplace_back(u);
-          xpc.push_back(x[p[0]].x.mean());
+          const auto psum = Psum({x[chain[0]].x.mean()}, isotopes);
+          accepted[c] = colCors(ypc, psum).front() > minCor;
         }
-        std::vector<unsigned int> isotopes;
-        unsigned int n = 0;
-        std::generate_n(std::back_inserter(isotopes), size, [&n]() { return n++; });
-        auto psum = Psum(xpc, isotopes);
+      };
+
+      if (threads > 1 && candidates.size() >= 256)
+        m2::Process::Map(candidates.size(), threads, worker);
+      else
+        worker(0, 0, candidates.size());
 
-        auto cr = colCors(ypc, psum);
-        for (unsigned int i = 0; i < cr.size(); ++i)
+      std::vector<std::vector<unsigned int>> pccr;
+      for (unsigned int c = 0; c < candidates.size(); ++c)
+        if (accepted[c])
         {
-          if (cr[i] > minCor)
-            pccr.emplace_back(std::move(pc[i]));
+          const auto &chain = chains[candidates[c]];
+          pccr.emplace_back(std::begin(chain), std::next(std::begin(chain), size));
         }
-      }
+
       if (pccr.empty())
         return {};
       else
         return moveVectorsWithUniqueElementsOnly(pccr);
     }
 
+    //  Model isotopic distribution by poisson distribution.
+    inline std::vector<std::vector<unsigned int>> monoisotopicPattern(const std::vector<Interval> &x,
+                                                                      double minCor = 0.95,
+                                                                      double tolerance = 1e-4,
+                                                                      double distance = 1.00235,
+                                                                      unsigned int size = 3L,
+                                                                      unsigned int charge = 1,
+                                                                      unsigned int threads = 1)
+    {
+      std::vector<double> mzs;
+      for (const auto &p : x)
+        mzs.push_back(p.x.mean());
+
+      const unsigned int count = mzs.size() > size ? mzs.size() - size : 0;
+      const auto chains = isotopeChains(mzs, count, size, distance, tolerance, charge, threads);
+      return monoisotopicPattern(x, chains, minCor, size, threads);
+    }
+
     // Loop through multiple .monoisotopicPattern outputs and remove duplicated
-    // peaks.
+    // peaks. The isotope chains are searched once for the largest size.
     inline std::vector<Interval> monoisotopic(const std::vector<Interval> &peaks,
                                                std::vector<unsigned int> size = {3, 4, 5, 6, 7, 8, 9, 10},
                                                double minCor = 0.95,
                                                double tolerance = 1e-4,
-                                               double distance = 1.00235)
+                                               double distance = 1.00235,
+                                               unsigned int charge = 1,
+                                               unsigned int threads = 1)
     {
+      if (size.empty())
+        return {};
       sort(size.begin(), size.end(), std::greater<int>());
+
+      std::vector<double> mzs;
+      for (const auto &p : peaks)
+        mzs.push_back(p.x.mean());
+      const unsigned int smallest = size.back();
+      const unsigned int count = mzs.size() > smallest ? mzs.size() - smallest : 0;
+      const auto chains = isotopeChains(mzs, count, size.front(), distance, tolerance, charge, threads);
+
       std::vector<std::vector<unsigned int>> patterns;
       for (auto s : size)
       {
-        auto pattern = monoisotopicPattern(peaks, minCor, tolerance, distance, s);
+        auto pattern = monoisotopicPattern(peaks, chains, minCor, s, threads);
         patterns.insert(std::end(patterns), std::begin(pattern), std::end(pattern));
       }
 
@@ -367,32 +433,121 @@ namespace m2
       return peaks;
     }
 
+    /**
+     * @brief Branchless binary search: index of the first element in [first, first + n) that is not less than value.
+     * The loop has a fixed number of iterations for a given n, which keeps it free of mispredicted branches.
+     */
+    template <class T>
+    inline size_t LowerBound(const T *first, size_t n, double value) noexcept
+    {
+      if (n == 0)
+        return 0;
+      const T *base = first;
+      while (n > 1)
+      {
+        const size_t half = n / 2;
+        base = (base[half] < value) ? base + half : base;
+        n -= half;
+      }
+      return (base - first) + (*base < value);
+    }
+
+    /**
+     * @brief Branchless binary search: index of the first element in [first, first + n) that is greater than value.
+     */
+    template <class T>
+    inline size_t UpperBound(const T *first, size_t n, double value) noexcept
+    {
+      if (n == 0)
+        return 0;
+      const T *base = first;
+      while (n > 1)
+      {
+        const size_t half = n / 2;
+        base = (value < base[half]) ? base : base + half;
+        n -= half;
+      }
+      return (base - first) + !(value < *base);
+    }
+
+    /**
+     * @brief Find the elements of the sorted container mzs within [lower, upper].
+     * @return Pair of start index and number of elements. If no element is in range,
+     * the number of elements is 0 and the start index is the insertion position of lower.
+     */
     template <class MassAxisType>
     inline auto Subrange(const MassAxisType &mzs, const double &lower, const double &upper) noexcept
       -> std::pair<unsigned int, unsigned int>
     {
-      auto start = mzs.cend() - 1;
-      auto end = mzs.cend();
-      for (auto it = mzs.cbegin(); it < mzs.cend(); ++it)
+      const auto *data = mzs.data();
+      const size_t n = mzs.size();
+      const size_t start = LowerBound(data, n, lower);
+      const size_t end = UpperBound(data, n, upper);
+      return {start, end > start ? end - start : 0};
+    }
+
+    /**
+     * @brief Resolve many windows [lower, upper] against one sorted container in a single sweep.
+     * Windows are expected to be sorted by their lower bound (e.g. peak centers with a tolerance);
+     * unsorted windows are still resolved correctly, but require a new binary search.
+     * The result is identical to calling Subrange for each window.
+     * @param mzs Sorted mass axis.
+     * @param windows Pairs of lower and upper bounds.
+     * @param result Pairs of start index and number of elements, see Subrange.
+     */
+    template <class MassAxisType>
+    inline void Subranges(const MassAxisType &mzs,
+                          const std::vector<std::pair<double, double>> &windows,
+                          std::vector<std::pair<unsigned int, unsigned int>> &result) noexcept
+    {
+      const auto *data = mzs.data();
+      const size_t n = mzs.size();
+      result.resize(windows.size());
+
+      // galloping search from position 'from': cheap if the next boundary is close
+      const auto gallop = [&](size_t from, auto pred)
       {
-        if (*it >= lower)
+        size_t step = 1, lo = from, hi = from;
+        while (hi < n && pred(data[hi]))
         {
-          start = it;
-          break;
+          lo = hi + 1;
+          hi = from + step;
+          step *= 2;
         }
-      }
-      for (auto it = mzs.cbegin(); it < mzs.cend(); ++it)
-      {
-        if (*it > upper)
+        hi = std::min(hi, n);
+        while (lo < hi)
         {
-          end = it;
-          break;
+          const size_t mid = lo + (hi - lo) / 2;
+          if (pred(data[mid]))
+            lo = mid + 1;
+          else
+            hi = mid;
         }
-      }
+        return lo;
+      };
 
-      // auto start = std::upper_bound(std::begin(mzs), std::end(mzs), lower) - 1;
-      // auto end = std::upper_bound(std::begin(mzs), std::end(mzs), upper) - 1;
-      return {std::distance(std::begin(mzs), start), std::distance(start, end)};
+      size_t start = 0, end = 0;
+      double prevLower = std::numeric_limits<double>::lowest();
+      double prevUpper = std::numeric_limits<double>::lowest();
+      for (size_t i = 0; i < windows.size(); ++i)
+      {
+        const double lower = windows[i].first;
+        const double upper = windows[i].second;
+
+        if (lower < prevLower)
+          start = LowerBound(data, n, lower);
+        else
+          start = gallop(start, [lower](const auto &v) { return v < lower; });
+
+        if (upper < prevUpper)
+          end = UpperBound(data, n, upper);
+        else
+          end = gallop(end, [upper](const auto &v) { return !(upper < v); });
+
+        result[i] = {start, end > start ? end - start : 0};
+        prevLower = lower;
+        prevUpper = upper;
+      }
     }
 
   }; // namespace Signal
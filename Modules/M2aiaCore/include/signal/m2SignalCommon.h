@@ -21,6 +21,7 @@ See LICENSE.txt for details.
 
 
 #include <type_traits>
+#include <vector>
 
 template <typename E>
 constexpr auto to_underlying(E e) noexcept
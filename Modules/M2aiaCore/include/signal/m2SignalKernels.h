@@ -0,0 +1,79 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <M2aiaCoreExports.h>
+#include <cstddef>
+#include <signal/m2SignalCommon.h>
+#include <string>
+
+namespace m2
+{
+  namespace Signal
+  {
+    /**
+     * @brief Vectorized kernels for contiguous intensity (and mass axis) arrays.
+     *
+     * The implementation is chosen at runtime: AVX2 if the CPU supports it, otherwise
+     * plain loops. Sums are accumulated in double precision like m2::Signal::TotalIonCurrent
+     * and m2::Signal::RootMeanSquare, only the order of the additions differs.
+     *
+     * Log2 and Log10 of float data use a polynomial approximation of the natural logarithm
+     * (relative error below 4 float ulp, see Transform). Values that are not finite, not
+     * positive or denormal after adding 1 are passed one by one to std::log2/std::log10, their
+     * neighbours are still approximated. Sqrt is exact. Results do not depend on the position
+     * of a value in the array or on the other values.
+     */
+    namespace Kernels
+    {
+      enum class InstructionSet : unsigned int
+      {
+        Scalar = 0,
+        AVX2
+      };
+
+      /// @brief Kernels in use; by default the best one supported by the CPU.
+      M2AIACORE_EXPORT InstructionSet GetInstructionSet();
+
+      /// @brief Returns false (and keeps the current set) if the CPU does not support it.
+      M2AIACORE_EXPORT bool SetInstructionSet(InstructionSet set);
+
+      M2AIACORE_EXPORT bool IsSupported(InstructionSet set);
+
+      M2AIACORE_EXPORT std::string ToString(InstructionSet set);
+
+      M2AIACORE_EXPORT double Sum(const float *y, size_t n);
+      M2AIACORE_EXPORT double Sum(const double *y, size_t n);
+
+      M2AIACORE_EXPORT double SumOfSquares(const float *y, size_t n);
+      M2AIACORE_EXPORT double SumOfSquares(const double *y, size_t n);
+
+      /// @brief Returns 0 if n is 0.
+      M2AIACORE_EXPORT double Maximum(const float *y, size_t n);
+      M2AIACORE_EXPORT double Maximum(const double *y, size_t n);
+
+      /// @brief Trapezoidal area, see m2::Signal::TotalIonCurrent.
+      M2AIACORE_EXPORT double TotalIonCurrent(const float *x, const float *y, size_t n);
+      M2AIACORE_EXPORT double TotalIonCurrent(const float *x, const double *y, size_t n);
+      M2AIACORE_EXPORT double TotalIonCurrent(const double *x, const float *y, size_t n);
+      M2AIACORE_EXPORT double TotalIonCurrent(const double *x, const double *y, size_t n);
+
+      /// @brief In-place intensity transformation, see m2::Signal::IntensityTransformationFunctor.
+      M2AIACORE_EXPORT void Transform(IntensityTransformationType type, float *y, size_t n);
+      M2AIACORE_EXPORT void Transform(IntensityTransformationType type, double *y, size_t n);
+
+    } // namespace Kernels
+  }   // namespace Signal
+} // namespace m2
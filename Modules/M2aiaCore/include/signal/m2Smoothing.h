@@ -172,6 +172,7 @@ namespace m2
     public:
       void InitializeKernel()
       {
+        m_isKernelInitialized = false;
         switch (m_strategy)
         {
           case m2::SmoothingType::SavitzkyGolay:
@@ -202,6 +203,9 @@ namespace m2
         InitializeKernel();
       }
 
+      /// @brief The convolution kernel; empty if no smoothing is applied.
+      std::vector<double> GetKernel() const { return m_isKernelInitialized ? m_kernel : std::vector<double>(); }
+
       
       void operator()(typename std::vector<ItValueType>::iterator start, typename std::vector<ItValueType>::iterator end)
       {
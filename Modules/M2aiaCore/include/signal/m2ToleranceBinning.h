@@ -0,0 +1,107 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+#pragma once
+
+#include <M2aiaCoreExports.h>
+#include <algorithm>
+#include <m2IntervalVector.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Poco
+{
+  class TemporaryFile;
+}
+
+namespace m2
+{
+  namespace Signal
+  {
+    /// @brief A peak of one pixel. The m/z is kept in double precision (also in the spill files),
+    /// the intensity is only accumulated into the bin statistics and stored as float.
+    struct PeakTuple
+    {
+      double mz;
+      float intensity;
+      unsigned int pixel;
+    };
+
+    /**
+     * @class ToleranceBinning
+     * @brief Merges the peak lists of many pixels into bins of similar m/z.
+     *
+     * Peaks are collected as (m/z, intensity, pixel) tuples, sorted in parallel (chunk sort
+     * and parallel pairwise merges) and swept once in m/z order:
+     * 1) A new cluster starts where the gap to the previous m/z exceeds the tolerance (relative
+     *    to the previous m/z, or absolute if absoluteDistance is set).
+     * 2) Clusters are refined as in m2::Signal::toleranceBasedBinning: a cluster with a peak that
+     *    deviates by tolerance or more from the mean m/z is split at its largest gap.
+     * The bins are returned as intervals (x: m/z, y: intensity) in ascending m/z order.
+     *
+     * If a memory limit is set, tuples exceeding it are sorted and written to temporary files
+     * (runs). Run() then streams a k-way merge of all runs into the sweep.
+     *
+     * Add may be called concurrently.
+     */
+    class M2AIACORE_EXPORT ToleranceBinning
+    {
+    public:
+      explicit ToleranceBinning(double tolerance, bool absoluteDistance = false, unsigned int threads = 1);
+      ~ToleranceBinning();
+
+      /// @brief Bytes of tuples held in memory before a run is written to disk; 0 (default) for no limit.
+      void SetMemoryLimit(size_t bytes);
+      size_t GetMemoryLimit() const;
+
+      template <class MzType, class IntensityType>
+      void Add(const std::vector<MzType> &mzs, const std::vector<IntensityType> &ints, unsigned int pixel)
+      {
+        std::vector<PeakTuple> tuples(std::min(mzs.size(), ints.size()));
+        for (size_t i = 0; i < tuples.size(); ++i)
+          tuples[i] = {double(mzs[i]), float(ints[i]), pixel};
+        Add(std::move(tuples));
+      }
+
+      void Add(std::vector<PeakTuple> &&tuples);
+
+      size_t GetNumberOfTuples() const;
+      size_t GetNumberOfRuns() const;
+
+      /**
+       * @brief Bins all tuples added so far and clears them.
+       * @param pixelCounts If given, receives the number of distinct pixels of each bin.
+       */
+      std::vector<m2::Interval> Run(std::vector<unsigned int> *pixelCounts = nullptr);
+
+      /// @brief Sorts tuples by m/z (then pixel and intensity) using the given number of threads.
+      static void Sort(std::vector<PeakTuple> &tuples, unsigned int threads);
+
+    private:
+      // requires the lock
+      void Spill();
+
+      mutable std::mutex m_Mutex;
+      double m_Tolerance;
+      bool m_AbsoluteDistance;
+      unsigned int m_Threads;
+      size_t m_MemoryLimit = 0;
+      size_t m_NumberOfTuples = 0;
+      std::vector<PeakTuple> m_Tuples;
+      std::vector<std::shared_ptr<Poco::TemporaryFile>> m_Runs;
+    };
+
+  } // namespace Signal
+} // namespace m2
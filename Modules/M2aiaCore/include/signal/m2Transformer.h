@@ -18,6 +18,7 @@ See LICENSE.txt for details.
 #include <functional>
 #include <math.h>
 #include <signal/m2SignalCommon.h>
+#include <signal/m2SignalKernels.h>
 
 namespace m2
 {
@@ -39,20 +40,8 @@ namespace m2
       void operator()(typename std::vector<ItValueType>::iterator start,
                       typename std::vector<ItValueType>::iterator end)
       {
-        switch (m_strategy)
-        {
-          case m2::IntensityTransformationType::Log10:
-            std::transform(start, end, start, [](const auto & a){return std::log10(a+1);});
-            break;
-          case m2::IntensityTransformationType::Log2:
-            std::transform(start, end, start, [](const auto & a){return std::log2(a+1);});
-            break;
-          case m2::IntensityTransformationType::SquareRoot:
-            std::transform(start, end, start, [](const auto & a){return std::sqrt(a);});
-            break;
-          case m2::IntensityTransformationType::None:
-            break;
-        }
+        if (start != end)
+          m2::Signal::Kernels::Transform(m_strategy, &*start, std::distance(start, end));
       }
     };
   } // namespace Signal
@@ -29,6 +29,7 @@ See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
 #include <mitkImagePixelReadAccessor.h>
 #include <mitkImagePixelWriteAccessor.h>
 #include <mitkLocaleSwitch.h>
+#include <cmath>
 #include <signal/m2PeakDetection.h>
 #include <signal/m2Pooling.h>
 
@@ -40,7 +41,9 @@ void writeData(ItFirst itFirst, ItLast itLast, OStreamType &os)
                 itLast,
                 [&os](const auto &v)
                 {
-                  const ConversionType c(v);
+                  // integer output is rounded to the nearest value
+                  const ConversionType c =
+                    std::is_integral<ConversionType>::value ? ConversionType(std::llround(v)) : ConversionType(v);
                   os.write((char *)(&c), sizeof(ConversionType));
                 });
 }
@@ -174,6 +177,9 @@ namespace m2
           writeData<double>(start, end, b);
           offsetDelta = mzs.size() * sizeof(double);
           break;
+        case m2::NumericType::Int32:
+        case m2::NumericType::Int64:
+          mitkThrow() << "Integer m/z values are not supported";
         case m2::NumericType::None:
           mitkThrow() << "m2::NumericType of yAxisOutput not set";
       }
@@ -210,6 +216,14 @@ namespace m2
             writeData<double>(start, end, b);
             offsetDelta = ints.size() * sizeof(double);
             break;
+          case m2::NumericType::Int32:
+            writeData<int32_t>(start, end, b);
+            offsetDelta = ints.size() * sizeof(int32_t);
+            break;
+          case m2::NumericType::Int64:
+            writeData<int64_t>(start, end, b);
+            offsetDelta = ints.size() * sizeof(int64_t);
+            break;
           case m2::NumericType::None:
             mitkThrow() << "m2::NumericType of yAxisOutput not set";
         }
@@ -268,6 +282,9 @@ namespace m2
           writeData<double>(std::begin(mzsMasked), std::end(mzsMasked), b);
           offsetDelta = spectra[0].mzLength * sizeof(double);
           break;
+        case m2::NumericType::Int32:
+        case m2::NumericType::Int64:
+          mitkThrow() << "Integer m/z values are not supported";
         case NumericType::None:
           mitkThrow() << "m2::NumericType of xAxisOutput not set";
       }
@@ -277,6 +294,15 @@ namespace m2
 
     MITK_INFO("ImzMLImageIO") << "Write x axis done!";
 
+    // the windows are the same for all spectra and are resolved in a single sweep per spectrum
+    std::vector<std::pair<double, double>> windows;
+    std::vector<std::pair<unsigned int, unsigned int>> subRanges;
+    for (const Interval &I : m_Intervals->GetIntervals())
+    {
+      const auto tol = input->ApplyTolerance(I.x.mean());
+      windows.emplace_back(I.x.mean() - tol, I.x.mean() + tol);
+    }
+
     for (size_t id = 0; id < spectra.size(); ++id)
     {
       auto &s = spectra[id];
@@ -289,14 +315,12 @@ namespace m2
         input->GetSpectrumFloat(id, mzs, ints);
         intsMasked.clear();
 
-        for (const Interval &I : m_Intervals->GetIntervals())
+        m2::Signal::Subranges(mzs, windows, subRanges);
+        for (const auto &subRes : subRanges)
         {
-          double val = 0;
-          const auto tol = input->ApplyTolerance(I.x.mean());
-          const auto subRes = m2::Signal::Subrange(mzs, I.x.mean() - tol, I.x.mean() + tol);
           const auto s = std::next(std::begin(ints), subRes.first);
           const auto e = std::next(s, subRes.second);
-          val = Signal::RangePooling<double>(s, e, input->GetRangePoolingStrategy());
+          const double val = Signal::RangePooling<double>(s, e, input->GetRangePoolingStrategy());
 
           intsMasked.push_back(val);
         }
@@ -314,6 +338,14 @@ namespace m2
             writeData<double>(std::begin(intsMasked), std::end(intsMasked), b);
             offsetDelta = s.intLength * sizeof(double);
             break;
+          case m2::NumericType::Int32:
+            writeData<int32_t>(std::begin(intsMasked), std::end(intsMasked), b);
+            offsetDelta = s.intLength * sizeof(int32_t);
+            break;
+          case m2::NumericType::Int64:
+            writeData<int64_t>(std::begin(intsMasked), std::end(intsMasked), b);
+            offsetDelta = s.intLength * sizeof(int64_t);
+            break;
           case m2::NumericType::None:
             mitkThrow() << "m2::NumericType of yAxisOutput not set";
         }
@@ -342,6 +374,26 @@ namespace m2
     ValidateOutputLocation();
 
     const auto *input = static_cast<const m2::ImzMLSpectrumImage *>(this->GetInput());
+
+    // integer intensities are rounded, so they are only written if no fraction can be lost
+    if (m_DataTypeYAxis == m2::NumericType::Int32 || m_DataTypeYAxis == m2::NumericType::Int64)
+    {
+      const auto sourceType = input->GetSpectrumType().YAxisType;
+      if (sourceType != m2::NumericType::Int32 && sourceType != m2::NumericType::Int64)
+        mitkThrow() << "Integer intensities can not be written: the source intensities are of type "
+                    << m2::to_string(sourceType) << ".";
+      if (input->GetNormalizationStrategy() != m2::NormalizationStrategyType::None ||
+          input->GetIntensityTransformationStrategy() != m2::IntensityTransformationType::None ||
+          input->GetSmoothingStrategy() != m2::SmoothingType::None ||
+          input->GetBaselineCorrectionStrategy() != m2::BaselineCorrectionType::None)
+        mitkThrow() << "Integer intensities can not be written: normalization, intensity transformation, "
+                       "smoothing and baseline correction have to be disabled.";
+      if (m_SpectrumFormat == m2::SpectrumFormat::ContinuousCentroid &&
+          input->GetRangePoolingStrategy() != m2::RangePoolingStrategyType::Sum &&
+          input->GetRangePoolingStrategy() != m2::RangePoolingStrategyType::Maximum)
+        mitkThrow() << "Integer intensities can not be written: centroids have to be pooled by sum or maximum.";
+    }
+
     input->SaveModeOn();
 
     std::string uuidString;
@@ -445,6 +497,9 @@ namespace m2
           context["mz_data_type"] = "32-bit float";
           mzBytes = 4;
           break;
+        case m2::NumericType::Int32:
+        case m2::NumericType::Int64:
+          mitkThrow() << "Integer m/z values are not supported";
         case m2::NumericType::None:
           mitkThrow() << "m2::NumericType of xAxisOutput not set";
       }
@@ -459,6 +514,14 @@ namespace m2
           context["int_data_type"] = "32-bit float";
           intBytes = 4;
           break;
+        case m2::NumericType::Int32:
+          context["int_data_type"] = "32-bit integer";
+          intBytes = 4;
+          break;
+        case m2::NumericType::Int64:
+          context["int_data_type"] = "64-bit integer";
+          intBytes = 8;
+          break;
         case m2::NumericType::None:
           mitkThrow() << "m2::NumericType of yAxisOutput not set";
       }
@@ -593,6 +656,8 @@ namespace m2
       m2::ImzMLParser::ReadImageSpectrumMetaData(object);
     }
     {
+      if (m_NumberOfThreads > 0)
+        object->SetNumberOfThreads(m_NumberOfThreads);
       object->InitializeGeometry();
     }
     {
@@ -18,9 +18,12 @@ See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
 #include <itksys/SystemTools.hxx>
 #include <m2ImzMLImageIO.h>
 #include <m2ImzMLSpectrumImage.h>
+#include <m2ImzMLSpectrumImageView.h>
+#include <m2ShuffledSpectrumIterator.h>
 #include <mitkCoreServices.h>
 #include <mitkIPreferencesService.h>
 #include <mitkImageReadAccessor.h>
+#include <type_traits>
 
 // PYTHON EXPORT
 namespace m2
@@ -34,6 +37,103 @@ namespace m2
       m2::ImzMLSpectrumImage::Pointer Image;
     };
 
+    // Fills data with N ion images (N x pixels, each in the layout of GetImageArrayFloat32) in one pass
+    // over the spectra. If tols is null, the tolerance of the handle is applied to each center.
+    // Returns 0 on success, -1 on error.
+    template <class T>
+    int GetImageArrays(m2::sys::ImageHandle *handle,
+                       const double *centers,
+                       const double *tols,
+                       unsigned int N,
+                       T *data,
+                       unsigned int threads)
+    {
+      try
+      {
+        std::vector<std::pair<double, double>> ranges(N);
+        for (unsigned int i = 0; i < N; ++i)
+          ranges[i] = {centers[i], tols ? tols[i] : handle->Image->ApplyTolerance(centers[i])};
+        if constexpr (std::is_same<T, float>::value)
+          handle->Image->GetImageArrayFloat(ranges, nullptr, data, threads);
+        else
+          handle->Image->GetImageArray(ranges, nullptr, data, threads);
+        return 0;
+      }
+      catch (std::exception &e)
+      {
+        MITK_ERROR << e.what();
+        return -1;
+      }
+    }
+
+    // Read-only view of an image with frozen processing parameters. Each worker (thread or
+    // process) uses its own clone of a view, see m2::ImzMLSpectrumImageView.
+    class ImageViewHandle
+    {
+    public:
+      explicit ImageViewHandle(const m2::ImzMLSpectrumImageView &view) : View(view) {}
+      m2::ImzMLSpectrumImageView View;
+    };
+
+    class SpectrumIteratorHandle
+    {
+    public:
+      std::unique_ptr<m2::ShuffledSpectrumIterator> Iterator;
+    };
+
+    template <class T>
+    int ViewGetSpectraBatch(m2::sys::ImageViewHandle *handle,
+                            const unsigned int *id,
+                            unsigned int N,
+                            unsigned int channels,
+                            T *xd,
+                            T *yd,
+                            int processed,
+                            unsigned int threads)
+    {
+      try
+      {
+        const std::vector<unsigned int> ids(id, id + N);
+        if constexpr (std::is_same<T, float>::value)
+          handle->View.GetSpectraBatchFloat(ids, channels, xd, yd, processed != 0, threads);
+        else
+          handle->View.GetSpectraBatch(ids, channels, xd, yd, processed != 0, threads);
+        return 0;
+      }
+      catch (std::exception &e)
+      {
+        MITK_ERROR << e.what();
+        return -1;
+      }
+    }
+
+    // As GetImageArrays; if tols is null, the frozen tolerance of the view is applied.
+    template <class T>
+    int ViewGetImageArrays(m2::sys::ImageViewHandle *handle,
+                           const double *centers,
+                           const double *tols,
+                           unsigned int N,
+                           T *data,
+                           unsigned int threads)
+    {
+      try
+      {
+        const auto &processing = handle->View.GetProcessingParameters();
+        std::vector<std::pair<double, double>> ranges(N);
+        for (unsigned int i = 0; i < N; ++i)
+          ranges[i] = {centers[i], tols ? tols[i] : processing.ApplyTolerance(centers[i])};
+        if constexpr (std::is_same<T, float>::value)
+          handle->View.GetImageArrayFloat(ranges, nullptr, data, threads);
+        else
+          handle->View.GetImageArray(ranges, nullptr, data, threads);
+        return 0;
+      }
+      catch (std::exception &e)
+      {
+        MITK_ERROR << e.what();
+        return -1;
+      }
+    }
   } // namespace sys
 
 } // namespace m2
@@ -64,6 +164,26 @@ extern "C"
     std::copy((m2::DisplayImagePixelType *)(acc.GetData()), (m2::DisplayImagePixelType *)(acc.GetData()) + N, data);
   }
 
+  M2AIACORE_EXPORT int GetImageArraysFloat32(m2::sys::ImageHandle *handle,
+                                             const double *centers,
+                                             const double *tols,
+                                             unsigned int N,
+                                             float *data,
+                                             unsigned int threads)
+  {
+    return m2::sys::GetImageArrays(handle, centers, tols, N, data, threads);
+  }
+
+  M2AIACORE_EXPORT int GetImageArraysFloat64(m2::sys::ImageHandle *handle,
+                                             const double *centers,
+                                             const double *tols,
+                                             unsigned int N,
+                                             double *data,
+                                             unsigned int threads)
+  {
+    return m2::sys::GetImageArrays(handle, centers, tols, N, data, threads);
+  }
+
   M2AIACORE_EXPORT void GetMaskArray(m2::sys::ImageHandle *handle, mitk::Label::PixelType *data)
   {
     auto mask = handle->Image->GetMaskImage();
@@ -129,19 +249,7 @@ extern "C"
 
   M2AIACORE_EXPORT unsigned int GetYDataTypeSizeInBytes(m2::sys::ImageHandle *handle)
   {
-    auto id = handle->Image->GetSpectrumType().YAxisType;
-    if (id == m2::NumericType::Float)
-    {
-      return sizeof(float);
-    }
-    else if (id == m2::NumericType::Double)
-    {
-      return sizeof(double);
-    }
-    else
-    {
-      return 0;
-    }
+    return m2::to_bytes(handle->Image->GetSpectrumType().YAxisType);
   }
 
   M2AIACORE_EXPORT void GetSpectrum(m2::sys::ImageHandle *handle, unsigned int id, float *xd, float *yd)
@@ -154,11 +262,74 @@ extern "C"
 
   M2AIACORE_EXPORT void GetSpectra(m2::sys::ImageHandle *handle, unsigned int *id, unsigned int N, float *yd)
   {
-    std::vector<float> ys;
-    for (unsigned int i = 0; i < N; ++i)
+    const std::vector<unsigned int> ids(id, id + N);
+    handle->Image->GetSpectraBatchFloat(ids, handle->Image->GetSpectraBatchChannels(ids), nullptr, yd);
+  }
+
+  // Returns the number of channels (row length) required by GetSpectraBatch* for the given ids.
+  // If lengths is not null, it receives the number of values of each spectrum (N values).
+  M2AIACORE_EXPORT unsigned int GetSpectraBatchChannels(m2::sys::ImageHandle *handle,
+                                                        const unsigned int *id,
+                                                        unsigned int N,
+                                                        unsigned int *lengths)
+  {
+    try
     {
-      handle->Image->GetIntensitiesFloat(id[i], ys);
-      std::copy(ys.begin(), ys.end(), yd + i * ys.size());
+      std::vector<size_t> n;
+      const auto channels = handle->Image->GetSpectraBatchChannels(std::vector<unsigned int>(id, id + N), &n);
+      if (lengths)
+        std::copy(n.begin(), n.end(), lengths);
+      return channels;
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return 0;
+    }
+  }
+
+  // Writes N spectra into row-major (N x channels) buffers, rows are zero padded.
+  // xd may be null. Returns 0 on success, -1 on error.
+  M2AIACORE_EXPORT int GetSpectraBatchFloat32(m2::sys::ImageHandle *handle,
+                                              const unsigned int *id,
+                                              unsigned int N,
+                                              unsigned int channels,
+                                              float *xd,
+                                              float *yd,
+                                              int processed,
+                                              unsigned int threads)
+  {
+    try
+    {
+      handle->Image->GetSpectraBatchFloat(
+        std::vector<unsigned int>(id, id + N), channels, xd, yd, processed != 0, threads);
+      return 0;
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return -1;
+    }
+  }
+
+  M2AIACORE_EXPORT int GetSpectraBatchFloat64(m2::sys::ImageHandle *handle,
+                                              const unsigned int *id,
+                                              unsigned int N,
+                                              unsigned int channels,
+                                              double *xd,
+                                              double *yd,
+                                              int processed,
+                                              unsigned int threads)
+  {
+    try
+    {
+      handle->Image->GetSpectraBatch(std::vector<unsigned int>(id, id + N), channels, xd, yd, processed != 0, threads);
+      return 0;
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return -1;
     }
   }
 
@@ -361,4 +532,185 @@ extern "C"
   {
     delete p;
   }
+
+  // Creates a view with the current processing settings of the image. Later changes of the
+  // image settings do not affect the view. Returns null on error.
+  M2AIACORE_EXPORT m2::sys::ImageViewHandle *CreateImageView(m2::sys::ImageHandle *handle)
+  {
+    try
+    {
+      return new m2::sys::ImageViewHandle(m2::ImzMLSpectrumImageView(handle->Image));
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return nullptr;
+    }
+  }
+
+  // Cheap copy of a view for another worker; shares the parsed image and the parameters.
+  M2AIACORE_EXPORT m2::sys::ImageViewHandle *CloneImageView(m2::sys::ImageViewHandle *view)
+  {
+    return new m2::sys::ImageViewHandle(view->View.Clone());
+  }
+
+  M2AIACORE_EXPORT void DestroyImageView(m2::sys::ImageViewHandle *view)
+  {
+    delete view;
+  }
+
+  // xd may be null. Returns 0 on success, -1 on error.
+  M2AIACORE_EXPORT int ViewGetSpectrum(m2::sys::ImageViewHandle *view, unsigned int id, float *xd, float *yd)
+  {
+    try
+    {
+      std::vector<float> xs, ys;
+      if (xd)
+      {
+        view->View.GetSpectrumFloat(id, xs, ys);
+        std::copy(xs.begin(), xs.end(), xd);
+      }
+      else
+      {
+        view->View.GetIntensitiesFloat(id, ys);
+      }
+      std::copy(ys.begin(), ys.end(), yd);
+      return 0;
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return -1;
+    }
+  }
+
+  M2AIACORE_EXPORT int ViewGetSpectraBatchFloat32(m2::sys::ImageViewHandle *view,
+                                                  const unsigned int *id,
+                                                  unsigned int N,
+                                                  unsigned int channels,
+                                                  float *xd,
+                                                  float *yd,
+                                                  int processed,
+                                                  unsigned int threads)
+  {
+    return m2::sys::ViewGetSpectraBatch(view, id, N, channels, xd, yd, processed, threads);
+  }
+
+  M2AIACORE_EXPORT int ViewGetSpectraBatchFloat64(m2::sys::ImageViewHandle *view,
+                                                  const unsigned int *id,
+                                                  unsigned int N,
+                                                  unsigned int channels,
+                                                  double *xd,
+                                                  double *yd,
+                                                  int processed,
+                                                  unsigned int threads)
+  {
+    return m2::sys::ViewGetSpectraBatch(view, id, N, channels, xd, yd, processed, threads);
+  }
+
+  M2AIACORE_EXPORT int ViewGetImageArraysFloat32(m2::sys::ImageViewHandle *view,
+                                                 const double *centers,
+                                                 const double *tols,
+                                                 unsigned int N,
+                                                 float *data,
+                                                 unsigned int threads)
+  {
+    return m2::sys::ViewGetImageArrays(view, centers, tols, N, data, threads);
+  }
+
+  M2AIACORE_EXPORT int ViewGetImageArraysFloat64(m2::sys::ImageViewHandle *view,
+                                                 const double *centers,
+                                                 const double *tols,
+                                                 unsigned int N,
+                                                 double *data,
+                                                 unsigned int threads)
+  {
+    return m2::sys::ViewGetImageArrays(view, centers, tols, N, data, threads);
+  }
+
+  // Iterates the spectra of the view (all if ids is null) in shuffled order, see
+  // m2::ShuffledSpectrumIterator. Returns null on error.
+  M2AIACORE_EXPORT m2::sys::SpectrumIteratorHandle *CreateSpectrumIterator(m2::sys::ImageViewHandle *view,
+                                                                           const unsigned int *ids,
+                                                                           unsigned int N,
+                                                                           uint64_t seed,
+                                                                           unsigned int blockSize,
+                                                                           unsigned int bufferSize,
+                                                                           unsigned int threads,
+                                                                           int readXValues)
+  {
+    try
+    {
+      m2::ShuffledSpectrumIterator::Options options;
+      options.Seed = seed;
+      options.BlockSize = blockSize;
+      options.BufferSize = bufferSize;
+      options.Threads = threads;
+      options.ReadXValues = readXValues != 0;
+      std::vector<unsigned int> selection;
+      if (ids)
+        selection.assign(ids, ids + N);
+      auto handle = new m2::sys::SpectrumIteratorHandle();
+      handle->Iterator.reset(new m2::ShuffledSpectrumIterator(view->View, options, std::move(selection)));
+      return handle;
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return nullptr;
+    }
+  }
+
+  M2AIACORE_EXPORT void DestroySpectrumIterator(m2::sys::SpectrumIteratorHandle *handle)
+  {
+    delete handle;
+  }
+
+  M2AIACORE_EXPORT void SpectrumIteratorStartEpoch(m2::sys::SpectrumIteratorHandle *handle, unsigned int epoch)
+  {
+    handle->Iterator->StartEpoch(epoch);
+  }
+
+  M2AIACORE_EXPORT unsigned int SpectrumIteratorGetEpoch(m2::sys::SpectrumIteratorHandle *handle)
+  {
+    return handle->Iterator->GetEpoch();
+  }
+
+  // Writes the next (up to) N spectra into row-major (N x channels) buffers, rows are zero padded.
+  // ids and xd may be null. Returns the number of rows written; fewer than N (or 0) at the end of
+  // an epoch, the following call starts the next epoch. Returns -1 on error.
+  M2AIACORE_EXPORT int SpectrumIteratorNext(m2::sys::SpectrumIteratorHandle *handle,
+                                            unsigned int N,
+                                            unsigned int channels,
+                                            unsigned int *ids,
+                                            float *xd,
+                                            float *yd)
+  {
+    try
+    {
+      m2::ShuffledSpectrumIterator::Spectrum spectrum;
+      const auto WriteRow = [channels](float *row, const std::vector<float> &values)
+      {
+        const auto n = std::min<size_t>(channels, values.size());
+        std::copy(values.begin(), values.begin() + n, row);
+        std::fill(row + n, row + channels, 0.0f);
+      };
+
+      unsigned int i = 0;
+      for (; i < N && handle->Iterator->Next(spectrum); ++i)
+      {
+        if (ids)
+          ids[i] = spectrum.Id;
+        if (xd)
+          WriteRow(xd + size_t(i) * channels, spectrum.XValues);
+        WriteRow(yd + size_t(i) * channels, spectrum.YValues);
+      }
+      return i;
+    }
+    catch (std::exception &e)
+    {
+      MITK_ERROR << e.what();
+      return -1;
+    }
+  }
 }
\ No newline at end of file
@@ -29,16 +29,19 @@ See LICENSE.txt for details.
 #include <signal/m2Smoothing.h>
 
 
-void m2::FsmSpectrumImage::GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const{
-  m_Processor->GetImagePrivate(mz, tol, mask, img);
+void m2::FsmSpectrumImage::GetImage(
+  double mz, double tol, const mitk::Image *mask, mitk::Image *img, const m2::IonImageOptions &options) const{
+  m_Processor->GetImagePrivate(mz, tol, mask, img, options);
 }
 
 void m2::FsmSpectrumImage::FsmProcessor::GetImagePrivate(double cmInv,
                                                             double tol,
                                                             const mitk::Image *mask,
-                                                            mitk::Image *destImage)
+                                                            mitk::Image *destImage,
+                                                            const m2::IonImageOptions &options)
 {
-  AccessByItk(destImage, [](auto itkImg) { itkImg->FillBuffer(0); });
+  if (!options.IsRestricted())
+    AccessByItk(destImage, [](auto itkImg) { itkImg->FillBuffer(0); });
   using namespace m2;
   // accessors
   mitk::ImagePixelWriteAccessor<DisplayImagePixelType, 3> imageAccess(destImage);
@@ -69,20 +72,27 @@ void m2::FsmSpectrumImage::FsmProcessor::GetImagePrivate(double cmInv,
   const auto subRes = m2::Signal::Subrange(xs, cmInv - tol, cmInv + tol);
   const auto n = p->GetSpectra().size();
   // map all spectra to several threads for processing
-  const unsigned t = p->GetNumberOfThreads();
+  const unsigned t = options.GetThreads(p->GetNumberOfThreads());
 
   m2::Process::Map(n,
                    t,
                    [&](auto /*id*/, auto a, auto b)
                    {
                      auto &spectra = p->GetSpectra();
-                     for (unsigned int i = a; i < b; ++i)
+                     for (unsigned int i = a; i < b && !options.IsCancelled(); ++i)
                      {
                        auto &spectrum = spectra[i];
                        auto &ys = spectrum.data;
                        auto s = std::next(std::begin(ys), subRes.first);
                        auto e = std::next(std::begin(ys), subRes.first + subRes.second);
 
+                       if (!options.IsInside(spectrum.index))
+                         continue;
+
+                       if (maskAccess && !options.Labels.empty() &&
+                           !options.IsLabelSelected(maskAccess->GetPixelByIndex(spectrum.index)))
+                         continue;
+
                        if (maskAccess && maskAccess->GetPixelByIndex(spectrum.index) == 0)
                        {
                          imageAccess.SetPixelByIndex(spectrum.index, 0);
@@ -110,6 +120,7 @@ void m2::FsmSpectrumImage::InitializeGeometry()
 
 void m2::FsmSpectrumImage::InitializeImageAccess()
 {
+  m_IonImageCache->Clear();
   this->m_Processor->InitializeImageAccess();
   this->SetImageAccessInitialized(true);
 }
@@ -43,76 +43,178 @@ double m2::ImzMLSpectrumImage::GetXMax() const{
 }
 
 
-void m2::ImzMLSpectrumImage::GetImage(double mz, double tol, const mitk::Image *mask, mitk::Image *img) const
+void m2::ImzMLSpectrumImage::GetImage(
+  double mz, double tol, const mitk::Image *mask, mitk::Image *img, const m2::IonImageOptions &options) const
 {
   try{
-    m_SpectrumImageSource->GetImagePrivate(mz, tol, mask, img);
+    m_SpectrumImageSource->GetImagePrivate(mz, tol, mask, img, options);
+    if (options.IsCancelled())
+      return;
+    if (options.FillNearest && options.Stride > 1)
+      FillNearest(mask, img, options);
     m_CurrentX = mz;
   }catch(std::exception & e){
     MITK_ERROR << "Ion image could not be generated! Queried range is [" << mz-tol << ", " <<mz+tol << "]\n" << e.what();
   }
 }
 
-void m2::ImzMLSpectrumImage::InitializeProcessor()
+void m2::ImzMLSpectrumImage::GetImages(const std::vector<std::pair<double, double>> &ranges,
+                                      const mitk::Image *mask,
+                                      const std::vector<mitk::Image *> &imgs,
+                                      const std::function<bool()> &cancelled) const
 {
-  m_MzGroupID = GetPropertyValue<std::string>("m2aia.imzml.mzGroupID");
-  m_IntensityGroupID = GetPropertyValue<std::string>("m2aia.imzml.intensityGroupID");
-  
-  auto intensitiesDataTypeString = GetPropertyValue<std::string>("m2aia.imzml." + m_IntensityGroupID + ".value_type");
-  auto mzValueTypeString = GetPropertyValue<std::string>("m2aia.imzml." + m_MzGroupID + ".value_type");
+  try
+  {
+    m_SpectrumImageSource->GetImagesPrivate(ranges, mask, imgs, cancelled);
+  }
+  catch (std::exception &e)
+  {
+    MITK_ERROR << "Ion images could not be generated!\n" << e.what();
+  }
+}
+
+void m2::ImzMLSpectrumImage::GetImageArrayFloat(const std::vector<std::pair<double, double>> &ranges,
+                                                const mitk::Image *mask,
+                                                float *data,
+                                                unsigned int threads) const
+{
+  GetImageArrayFloat(ranges, mask, data, GetProcessingParameters(), threads);
+}
+
+void m2::ImzMLSpectrumImage::GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                                           const mitk::Image *mask,
+                                           double *data,
+                                           unsigned int threads) const
+{
+  GetImageArray(ranges, mask, data, GetProcessingParameters(), threads);
+}
+
+void m2::ImzMLSpectrumImage::GetImageArrayFloat(const std::vector<std::pair<double, double>> &ranges,
+                                                const mitk::Image *mask,
+                                                float *data,
+                                                const m2::SpectrumProcessingParameters &processing,
+                                                unsigned int threads,
+                                                const std::function<void(unsigned int)> &progress) const
+{
+  m_SpectrumImageSource->GetImageArrayPrivate(
+    ranges, mask, data, processing, threads ? threads : GetNumberOfThreads(), progress);
+}
+
+void m2::ImzMLSpectrumImage::GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                                           const mitk::Image *mask,
+                                           double *data,
+                                           const m2::SpectrumProcessingParameters &processing,
+                                           unsigned int threads,
+                                           const std::function<void(unsigned int)> &progress) const
+{
+  m_SpectrumImageSource->GetImageArrayPrivate(
+    ranges, mask, data, processing, threads ? threads : GetNumberOfThreads(), progress);
+}
+
+m2::SpectrumProcessingParameters m2::ImzMLSpectrumImage::GetProcessingParameters() const
+{
+  m2::SpectrumProcessingParameters parameters;
+  parameters.Normalization = GetNormalizationStrategy();
+  parameters.Smoothing = GetSmoothingStrategy();
+  parameters.SmoothingHalfWindowSize = GetSmoothingHalfWindowSize();
+  parameters.BaselineCorrection = GetBaselineCorrectionStrategy();
+  parameters.BaselineCorrectionHalfWindowSize = GetBaseLineCorrectionHalfWindowSize();
+  parameters.IntensityTransformation = GetIntensityTransformationStrategy();
+  parameters.RangePooling = GetRangePoolingStrategy();
+  parameters.NormalizationFactors = m_SpectrumImageSource->GetNormalizationFactors(parameters.Normalization);
+  parameters.Tolerance = GetTolerance();
+  parameters.UseToleranceInPPM = GetUseToleranceInPPM();
+  return parameters;
+}
 
-  if (mzValueTypeString.compare("32-bit float") == 0)
+void m2::ImzMLSpectrumImage::FillNearest(const mitk::Image *mask,
+                                         mitk::Image *img,
+                                         const m2::IonImageOptions &options) const
+{
+  mitk::ImagePixelWriteAccessor<m2::DisplayImagePixelType, 3> imageAccess(img);
+  std::shared_ptr<mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType, 3>> maskAccess;
+  if (mask)
+    maskAccess.reset(new mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType, 3>(mask));
+
+  // grid pixels are written by the pass itself, all other selected pixels
+  // take the value of the grid pixel at their lower-left grid corner
+  for (const auto &spectrum : GetSpectra())
   {
-    m_SpectrumType.XAxisType = m2::NumericType::Float;
-    if (intensitiesDataTypeString.compare("32-bit float") == 0)
-    {
-      m_SpectrumType.YAxisType = m2::NumericType::Float;
-      this->m_SpectrumImageSource.reset((ISpectrumImageSource *)new ImzMLSpectrumImageSource<float, float>(this));
-    }
-    else if (intensitiesDataTypeString.compare("64-bit float") == 0)
-    {
-      m_SpectrumType.YAxisType = m2::NumericType::Double;
-      this->m_SpectrumImageSource.reset((ISpectrumImageSource *)new ImzMLSpectrumImageSource<float, double>(this));
-    }
-    else if (intensitiesDataTypeString.compare("32-bit integer") == 0)
-    {
-      MITK_ERROR(GetStaticNameOfClass()) << "Using 32-bit integer. Not implemented!";
-      // this->m_SpectrumImageSource.reset((ProcessorBase *)new Processor<float, long int>(this));
-      // SetYInputType(m2::NumericType::Double);
-    }
-    else if (intensitiesDataTypeString.compare("64-bit integer") == 0)
+    const auto &index = spectrum.index;
+    if (!options.IsInside(index) || options.IsOnGrid(index, options.Stride))
+      continue;
+
+    if (maskAccess)
     {
-      MITK_ERROR(GetStaticNameOfClass()) << "Using 64-bit integer. Not implemented!";
-      // this->m_SpectrumImageSource.reset((ProcessorBase *)new Processor<float, long long int>(this));
-      // SetYInputType(m2::NumericType::Double);
+      const auto label = maskAccess->GetPixelByIndex(index);
+      if (options.Labels.empty() ? label == 0 : !options.IsLabelSelected(label))
+        continue;
     }
+
+    imageAccess.SetPixelByIndex(index, imageAccess.GetPixelByIndex(options.GetGridIndex(index)));
+  }
+}
+
+namespace
+{
+  m2::NumericType ToNumericType(const std::string &imzMLValueType)
+  {
+    if (imzMLValueType == "32-bit float")
+      return m2::NumericType::Float;
+    if (imzMLValueType == "64-bit float")
+      return m2::NumericType::Double;
+    if (imzMLValueType == "32-bit integer")
+      return m2::NumericType::Int32;
+    if (imzMLValueType == "64-bit integer")
+      return m2::NumericType::Int64;
+    return m2::NumericType::None;
   }
-  else if (mzValueTypeString.compare("64-bit float") == 0)
+
+  // Integer intensities are converted to double while reading, all
+  // signal processing is done in floating point.
+  template <class MassAxisType>
+  m2::ISpectrumImageSource *CreateSpectrumImageSource(m2::ImzMLSpectrumImage *owner, m2::NumericType intensityType)
   {
-    m_SpectrumType.XAxisType = m2::NumericType::Double;
-    if (intensitiesDataTypeString.compare("32-bit float") == 0)
-    {
-      m_SpectrumType.YAxisType = m2::NumericType::Float;
-      this->m_SpectrumImageSource.reset((ISpectrumImageSource *)new ImzMLSpectrumImageSource<double, float>(this));
-    }
-    else if (intensitiesDataTypeString.compare("64-bit float") == 0)
-    {
-      m_SpectrumType.YAxisType = m2::NumericType::Double;
-      this->m_SpectrumImageSource.reset((ISpectrumImageSource *)new ImzMLSpectrumImageSource<double, double>(this));
-    }
-    else if (intensitiesDataTypeString.compare("32-bit integer") == 0)
+    switch (intensityType)
     {
-      MITK_ERROR(GetStaticNameOfClass()) << "Using 32-bit integer. Not implemented!";
-      // this->m_SpectrumImageSource.reset((ProcessorBase *)new Processor<double, long int>(this));
-      // SetYInputType(m2::NumericType::Double);
-    }
-    else if (intensitiesDataTypeString.compare("64-bit integer") == 0)
-    {
-      // this->m_SpectrumImageSource.reset((ProcessorBase *)new Processor<double, long long int>(this));
-      MITK_ERROR(GetStaticNameOfClass()) << "Using 64-bit integer. Not implemented!";
-      // SetYInputType(m2::NumericType::Double);
+      case m2::NumericType::Float:
+        return new m2::ImzMLSpectrumImageSource<MassAxisType, float>(owner);
+      case m2::NumericType::Double:
+        return new m2::ImzMLSpectrumImageSource<MassAxisType, double>(owner);
+      case m2::NumericType::Int32:
+        return new m2::ImzMLSpectrumImageSource<MassAxisType, double, int32_t>(owner);
+      case m2::NumericType::Int64:
+        return new m2::ImzMLSpectrumImageSource<MassAxisType, double, int64_t>(owner);
+      case m2::NumericType::None:
+        break;
     }
+    return nullptr;
   }
+} // namespace
+
+void m2::ImzMLSpectrumImage::InitializeProcessor()
+{
+  m_MzGroupID = GetPropertyValue<std::string>("m2aia.imzml.mzGroupID");
+  m_IntensityGroupID = GetPropertyValue<std::string>("m2aia.imzml.intensityGroupID");
+
+  auto intensitiesDataTypeString = GetPropertyValue<std::string>("m2aia.imzml." + m_IntensityGroupID + ".value_type");
+  auto mzValueTypeString = GetPropertyValue<std::string>("m2aia.imzml." + m_MzGroupID + ".value_type");
+
+  const auto xType = ToNumericType(mzValueTypeString);
+  const auto yType = ToNumericType(intensitiesDataTypeString);
+
+  if (xType != m2::NumericType::Float && xType != m2::NumericType::Double)
+    mitkThrow() << "The m/z value type '" << mzValueTypeString << "' is not supported!";
+  if (yType == m2::NumericType::None)
+    mitkThrow() << "The intensity value type '" << intensitiesDataTypeString << "' is not supported!";
+
+  m_SpectrumType.XAxisType = xType;
+  m_SpectrumType.YAxisType = yType;
+
+  if (xType == m2::NumericType::Float)
+    this->m_SpectrumImageSource.reset(CreateSpectrumImageSource<float>(this, yType));
+  else
+    this->m_SpectrumImageSource.reset(CreateSpectrumImageSource<double>(this, yType));
 }
 
 void m2::ImzMLSpectrumImage::InitializeGeometry()
@@ -140,8 +242,7 @@ void m2::ImzMLSpectrumImage::InitializeImageAccess()
   }
 
   this->SetImageAccessInitialized(false); 
-
-  
+  m_IonImageCache->Clear();
 
   this->m_SpectrumImageSource->InitializeImageAccess();
 
@@ -339,6 +440,102 @@ void m2::ImzMLSpectrumImage::GetIntensities(unsigned int id, std::vector<double>
   m_SpectrumImageSource->GetYValues(id, ys);
 }
 
+void m2::ImzMLSpectrumImage::GetSpectraBatchFloat(const std::vector<unsigned int> &ids,
+                                                  size_t channels,
+                                                  float *xs,
+                                                  float *ys,
+                                                  bool processed,
+                                                  unsigned int threads) const
+{
+  if (processed)
+  {
+    const auto processing = GetProcessingParameters();
+    GetSpectraBatchFloat(ids, channels, xs, ys, &processing, threads);
+  }
+  else
+  {
+    GetSpectraBatchFloat(ids, channels, xs, ys, nullptr, threads);
+  }
+}
+
+void m2::ImzMLSpectrumImage::GetSpectraBatch(const std::vector<unsigned int> &ids,
+                                             size_t channels,
+                                             double *xs,
+                                             double *ys,
+                                             bool processed,
+                                             unsigned int threads) const
+{
+  if (processed)
+  {
+    const auto processing = GetProcessingParameters();
+    GetSpectraBatch(ids, channels, xs, ys, &processing, threads);
+  }
+  else
+  {
+    GetSpectraBatch(ids, channels, xs, ys, nullptr, threads);
+  }
+}
+
+void m2::ImzMLSpectrumImage::GetSpectraBatchFloat(const std::vector<unsigned int> &ids,
+                                                  size_t channels,
+                                                  float *xs,
+                                                  float *ys,
+                                                  const m2::SpectrumProcessingParameters *processing,
+                                                  unsigned int threads,
+                                                  std::ifstream *stream) const
+{
+  m_SpectrumImageSource->GetSpectraBatch(
+    ids, channels, xs, ys, processing, threads ? threads : GetNumberOfThreads(), stream);
+}
+
+void m2::ImzMLSpectrumImage::GetSpectraBatch(const std::vector<unsigned int> &ids,
+                                             size_t channels,
+                                             double *xs,
+                                             double *ys,
+                                             const m2::SpectrumProcessingParameters *processing,
+                                             unsigned int threads,
+                                             std::ifstream *stream) const
+{
+  m_SpectrumImageSource->GetSpectraBatch(
+    ids, channels, xs, ys, processing, threads ? threads : GetNumberOfThreads(), stream);
+}
+
+size_t m2::ImzMLSpectrumImage::GetSpectraBatchChannels(const std::vector<unsigned int> &ids,
+                                                       std::vector<size_t> *lengths) const
+{
+  size_t channels = 0;
+  if (lengths)
+    lengths->clear();
+  for (auto id : ids)
+  {
+    if (id >= m_Spectra.size())
+      mitkThrow() << "Spectrum id " << id << " is out of range [0, " << m_Spectra.size() << ").";
+    channels = std::max<size_t>(channels, m_Spectra[id].intLength);
+    if (lengths)
+      lengths->push_back(m_Spectra[id].intLength);
+  }
+  return channels;
+}
+
+void m2::ImzMLSpectrumImage::SetSpectrumCacheSize(size_t bytes)
+{
+  if (m_SpectrumImageSource)
+    m_SpectrumImageSource->SetSpectrumCacheSize(bytes);
+}
+
+m2::SpectrumCacheStatistics m2::ImzMLSpectrumImage::GetSpectrumCacheStatistics() const
+{
+  if (m_SpectrumImageSource)
+    return m_SpectrumImageSource->GetSpectrumCacheStatistics();
+  return {};
+}
+
+void m2::ImzMLSpectrumImage::ClearSpectrumCache()
+{
+  if (m_SpectrumImageSource)
+    m_SpectrumImageSource->ClearSpectrumCache();
+}
+
 // void m2::ImzMLSpectrumImage::GetIntensities(unsigned int id,
 //                                             std::vector<m2::Interval> &I,
 //                                             std::vector<float> &pys,
@@ -0,0 +1,153 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <m2ImzMLSpectrumImageView.h>
+#include <mitkExceptionMacro.h>
+#include <type_traits>
+
+m2::ImzMLSpectrumImageView::ImzMLSpectrumImageView(const ImzMLSpectrumImage *image)
+  : ImzMLSpectrumImageView(image, image ? image->GetProcessingParameters() : m2::SpectrumProcessingParameters())
+{
+}
+
+m2::ImzMLSpectrumImageView::ImzMLSpectrumImageView(const ImzMLSpectrumImage *image,
+                                                   m2::SpectrumProcessingParameters processing)
+{
+  if (!image)
+    mitkThrow() << "A spectrum image view requires an image.";
+  if (processing.Normalization != m2::NormalizationStrategyType::None && !processing.NormalizationFactors)
+    mitkThrow() << "Normalization factors are missing for the normalization strategy "
+                << m2::to_string(processing.Normalization) << ".";
+
+  auto state = std::make_shared<State>();
+  state->Image = image;
+  state->Processing = std::move(processing);
+  m_State = state;
+}
+
+m2::ImzMLSpectrumImageView::ImzMLSpectrumImageView(const ImzMLSpectrumImageView &other) : m_State(other.m_State) {}
+
+m2::ImzMLSpectrumImageView &m2::ImzMLSpectrumImageView::operator=(const ImzMLSpectrumImageView &other)
+{
+  if (this != &other)
+  {
+    m_State = other.m_State;
+    m_Stream.reset();
+  }
+  return *this;
+}
+
+m2::ImzMLSpectrumImageView::~ImzMLSpectrumImageView() = default;
+
+const m2::ImzMLSpectrumImage *m2::ImzMLSpectrumImageView::GetImage() const
+{
+  return m_State->Image;
+}
+
+const m2::SpectrumProcessingParameters &m2::ImzMLSpectrumImageView::GetProcessingParameters() const
+{
+  return m_State->Processing;
+}
+
+unsigned int m2::ImzMLSpectrumImageView::GetNumberOfSpectra() const
+{
+  return m_State->Image->GetSpectra().size();
+}
+
+std::ifstream *m2::ImzMLSpectrumImageView::GetStream() const
+{
+  if (!m_Stream)
+    m_Stream.reset(new std::ifstream());
+  return m_Stream.get();
+}
+
+template <class T>
+void m2::ImzMLSpectrumImageView::ReadSpectrum(unsigned int id, std::vector<T> *xs, std::vector<T> &ys) const
+{
+  const auto &spectra = m_State->Image->GetSpectra();
+  if (id >= spectra.size())
+    mitkThrow() << "Spectrum id " << id << " is out of range [0, " << spectra.size() << ").";
+
+  const std::vector<unsigned int> ids = {id};
+  const size_t length = spectra[id].intLength;
+  ys.resize(length);
+  if (xs)
+    xs->resize(length);
+  if constexpr (std::is_same<T, float>::value)
+    m_State->Image->GetSpectraBatchFloat(
+      ids, length, xs ? xs->data() : nullptr, ys.data(), &m_State->Processing, 1, GetStream());
+  else
+    m_State->Image->GetSpectraBatch(
+      ids, length, xs ? xs->data() : nullptr, ys.data(), &m_State->Processing, 1, GetStream());
+}
+
+void m2::ImzMLSpectrumImageView::GetSpectrum(unsigned int id, std::vector<double> &xs, std::vector<double> &ys) const
+{
+  ReadSpectrum(id, &xs, ys);
+}
+
+void m2::ImzMLSpectrumImageView::GetSpectrumFloat(unsigned int id, std::vector<float> &xs, std::vector<float> &ys) const
+{
+  ReadSpectrum(id, &xs, ys);
+}
+
+void m2::ImzMLSpectrumImageView::GetIntensities(unsigned int id, std::vector<double> &ys) const
+{
+  ReadSpectrum<double>(id, nullptr, ys);
+}
+
+void m2::ImzMLSpectrumImageView::GetIntensitiesFloat(unsigned int id, std::vector<float> &ys) const
+{
+  ReadSpectrum<float>(id, nullptr, ys);
+}
+
+void m2::ImzMLSpectrumImageView::GetSpectraBatchFloat(const std::vector<unsigned int> &ids,
+                                                      size_t channels,
+                                                      float *xs,
+                                                      float *ys,
+                                                      bool processed,
+                                                      unsigned int threads) const
+{
+  m_State->Image->GetSpectraBatchFloat(
+    ids, channels, xs, ys, processed ? &m_State->Processing : nullptr, std::max(1u, threads), GetStream());
+}
+
+void m2::ImzMLSpectrumImageView::GetSpectraBatch(const std::vector<unsigned int> &ids,
+                                                 size_t channels,
+                                                 double *xs,
+                                                 double *ys,
+                                                 bool processed,
+                                                 unsigned int threads) const
+{
+  m_State->Image->GetSpectraBatch(
+    ids, channels, xs, ys, processed ? &m_State->Processing : nullptr, std::max(1u, threads), GetStream());
+}
+
+void m2::ImzMLSpectrumImageView::GetImageArrayFloat(const std::vector<std::pair<double, double>> &ranges,
+                                                    const mitk::Image *mask,
+                                                    float *data,
+                                                    unsigned int threads) const
+{
+  m_State->Image->GetImageArrayFloat(ranges, mask, data, m_State->Processing, std::max(1u, threads));
+}
+
+void m2::ImzMLSpectrumImageView::GetImageArray(const std::vector<std::pair<double, double>> &ranges,
+                                               const mitk::Image *mask,
+                                               double *data,
+                                               unsigned int threads) const
+{
+  m_State->Image->GetImageArray(ranges, mask, data, m_State->Processing, std::max(1u, threads));
+}
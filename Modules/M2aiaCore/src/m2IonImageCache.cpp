@@ -0,0 +1,345 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <Poco/DeflatingStream.h>
+#include <Poco/InflatingStream.h>
+#include <Poco/TemporaryFile.h>
+#include <algorithm>
+#include <fstream>
+#include <m2IonImageCache.h>
+#include <mitkExceptionMacro.h>
+#include <mitkImagePixelReadAccessor.h>
+#include <mitkImagePixelWriteAccessor.h>
+#include <mitkImageReadAccessor.h>
+#include <string_view>
+
+namespace
+{
+  size_t NumberOfPixels(const mitk::Image *image)
+  {
+    size_t n = 1;
+    for (unsigned int i = 0; i < image->GetDimension(); ++i)
+      n *= image->GetDimension(i);
+    return n;
+  }
+} // namespace
+
+bool m2::IonImageCacheKey::operator==(const IonImageCacheKey &rhs) const
+{
+  return mz == rhs.mz && tol == rhs.tol && normalization == rhs.normalization && smoothing == rhs.smoothing &&
+         smoothingHalfWindowSize == rhs.smoothingHalfWindowSize && baseline == rhs.baseline &&
+         baselineHalfWindowSize == rhs.baselineHalfWindowSize && pooling == rhs.pooling &&
+         transformation == rhs.transformation && maskHash == rhs.maskHash && state == rhs.state;
+}
+
+size_t m2::IonImageCacheKey::Hash() const
+{
+  size_t seed = 0;
+  m2::HashCombine(seed, mz);
+  m2::HashCombine(seed, tol);
+  m2::HashCombine(seed, static_cast<unsigned int>(normalization));
+  m2::HashCombine(seed, static_cast<unsigned int>(smoothing));
+  m2::HashCombine(seed, smoothingHalfWindowSize);
+  m2::HashCombine(seed, static_cast<unsigned int>(baseline));
+  m2::HashCombine(seed, baselineHalfWindowSize);
+  m2::HashCombine(seed, static_cast<unsigned int>(pooling));
+  m2::HashCombine(seed, static_cast<unsigned int>(transformation));
+  m2::HashCombine(seed, maskHash);
+  m2::HashCombine(seed, state);
+  return seed;
+}
+
+m2::IonImageCache::IonImageCache(size_t capacityInBytes, size_t spillCapacityInBytes)
+  : m_Capacity(capacityInBytes), m_SpillCapacity(spillCapacityInBytes)
+{
+}
+
+m2::IonImageCache::~IonImageCache() = default;
+
+bool m2::IonImageCache::Get(const IonImageCacheKey &key, mitk::Image *target)
+{
+  const size_t pixels = NumberOfPixels(target);
+  std::shared_ptr<BufferType> data;
+  ListType spilled, stale;
+  size_t generation;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto it = m_Map.find(key);
+    auto s = m_SpilledMap.find(key);
+    if ((it != m_Map.end() && it->second->pixels != pixels) || (s != m_SpilledMap.end() && s->second->pixels != pixels))
+    {
+      // the image geometry changed, the entry can not be used any more; removed without holding the lock
+      stale = Remove(key);
+      ++m_Statistics.misses;
+    }
+    else if (it != m_Map.end())
+    {
+      m_List.splice(m_List.begin(), m_List, it->second);
+      data = it->second->data;
+      ++m_Statistics.hits;
+    }
+    else if (s != m_SpilledMap.end())
+    {
+      // the spilled entry is taken out and restored without holding the lock
+      m_Statistics.spilledBytes -= s->second->bytes;
+      spilled.splice(spilled.begin(), m_SpilledList, s->second);
+      m_SpilledMap.erase(s);
+    }
+    else
+    {
+      ++m_Statistics.misses;
+      return false;
+    }
+    generation = m_Generation;
+  }
+  if (!stale.empty())
+    return false;
+
+  if (!spilled.empty())
+  {
+    try
+    {
+      data = Restore(spilled.front());
+    }
+    catch (std::exception &e)
+    {
+      MITK_WARN << "Spilled ion image could not be restored: " << e.what();
+    }
+    spilled.clear(); // removes the temporary file
+
+    ListType evicted;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      if (!data || data->size() != pixels)
+      {
+        ++m_Statistics.misses;
+        return false;
+      }
+      ++m_Statistics.hits;
+      // not cached again if the cache was cleared or the image was inserted in the meantime
+      if (generation == m_Generation && !m_Map.count(key) && !m_SpilledMap.count(key))
+      {
+        const size_t bytes = data->size() * sizeof(BufferType::value_type);
+        m_List.push_front({key, data, nullptr, bytes, data->size()});
+        m_Map[key] = m_List.begin();
+        m_Statistics.bytes += bytes;
+        evicted = Shrink();
+      }
+    }
+    Spill(std::move(evicted), generation);
+  }
+
+  // the cached buffer is immutable, copy it without holding the lock
+  mitk::ImagePixelWriteAccessor<m2::DisplayImagePixelType, 3> access(target);
+  std::copy(std::begin(*data), std::end(*data), access.GetData());
+  return true;
+}
+
+bool m2::IonImageCache::Contains(const IonImageCacheKey &key) const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Map.count(key) || m_SpilledMap.count(key);
+}
+
+void m2::IonImageCache::Insert(const IonImageCacheKey &key, const mitk::Image *source)
+{
+  const auto n = NumberOfPixels(source);
+  const size_t bytes = n * sizeof(BufferType::value_type);
+  if (bytes > GetCapacity())
+    return;
+
+  auto data = std::make_shared<BufferType>(n);
+  {
+    mitk::ImagePixelReadAccessor<m2::DisplayImagePixelType, 3> access(source);
+    std::copy(access.GetData(), access.GetData() + n, std::begin(*data));
+  }
+
+  ListType removed, evicted;
+  size_t generation;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    removed = Remove(key);
+    m_List.push_front({key, data, nullptr, bytes, n});
+    m_Map[key] = m_List.begin();
+    m_Statistics.bytes += bytes;
+    evicted = Shrink();
+    generation = m_Generation;
+  }
+  Spill(std::move(evicted), generation);
+}
+
+void m2::IonImageCache::SetCapacity(size_t capacityInBytes)
+{
+  ListType evicted;
+  size_t generation;
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Capacity = capacityInBytes;
+    evicted = Shrink();
+    generation = m_Generation;
+  }
+  Spill(std::move(evicted), generation);
+}
+
+size_t m2::IonImageCache::GetCapacity() const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Capacity;
+}
+
+void m2::IonImageCache::SetSpillCapacity(size_t capacityInBytes)
+{
+  ListType dropped;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_SpillCapacity = capacityInBytes;
+  dropped = ShrinkSpilled();
+}
+
+size_t m2::IonImageCache::GetSpillCapacity() const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_SpillCapacity;
+}
+
+void m2::IonImageCache::Clear()
+{
+  ListType list, spilledList;
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  list.swap(m_List);
+  spilledList.swap(m_SpilledList);
+  m_Map.clear();
+  m_SpilledMap.clear();
+  m_Statistics.bytes = 0;
+  m_Statistics.spilledBytes = 0;
+  ++m_Generation;
+}
+
+m2::IonImageCacheStatistics m2::IonImageCache::GetStatistics() const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  auto s = m_Statistics;
+  s.entries = m_Map.size();
+  s.spilledEntries = m_SpilledMap.size();
+  s.capacity = m_Capacity;
+  return s;
+}
+
+size_t m2::IonImageCache::HashMask(const mitk::Image *mask)
+{
+  if (!mask)
+    return 0;
+  mitk::ImageReadAccessor access(mask);
+  const auto bytes = NumberOfPixels(mask) * mask->GetPixelType().GetSize();
+  return std::hash<std::string_view>()(std::string_view(static_cast<const char *>(access.GetData()), bytes));
+}
+
+m2::IonImageCache::ListType m2::IonImageCache::Remove(const IonImageCacheKey &key)
+{
+  ListType removed;
+  auto it = m_Map.find(key);
+  if (it != m_Map.end())
+  {
+    m_Statistics.bytes -= it->second->bytes;
+    removed.splice(removed.end(), m_List, it->second);
+    m_Map.erase(it);
+  }
+  auto s = m_SpilledMap.find(key);
+  if (s != m_SpilledMap.end())
+  {
+    m_Statistics.spilledBytes -= s->second->bytes;
+    removed.splice(removed.end(), m_SpilledList, s->second);
+    m_SpilledMap.erase(s);
+  }
+  return removed;
+}
+
+m2::IonImageCache::ListType m2::IonImageCache::Shrink()
+{
+  ListType evicted;
+  while (m_Statistics.bytes > m_Capacity && !m_List.empty())
+  {
+    m_Statistics.bytes -= m_List.back().bytes;
+    m_Map.erase(m_List.back().key);
+    evicted.splice(evicted.end(), m_List, std::prev(m_List.end()));
+    ++m_Statistics.evictions;
+  }
+  if (m_SpillCapacity == 0)
+    evicted.clear();
+  return evicted;
+}
+
+m2::IonImageCache::ListType m2::IonImageCache::ShrinkSpilled()
+{
+  ListType dropped;
+  while (m_Statistics.spilledBytes > m_SpillCapacity && !m_SpilledList.empty())
+  {
+    m_Statistics.spilledBytes -= m_SpilledList.back().bytes;
+    m_SpilledMap.erase(m_SpilledList.back().key);
+    dropped.splice(dropped.end(), m_SpilledList, std::prev(m_SpilledList.end()));
+  }
+  return dropped;
+}
+
+void m2::IonImageCache::Spill(ListType &&entries, size_t generation)
+{
+  while (!entries.empty())
+  {
+    ListType spilled;
+    spilled.splice(spilled.end(), entries, entries.begin());
+    auto &entry = spilled.front();
+    try
+    {
+      auto file = std::make_shared<Poco::TemporaryFile>();
+      {
+        std::ofstream f(file->path(), std::ios::binary);
+        Poco::DeflatingOutputStream deflate(f, Poco::DeflatingStreamBuf::STREAM_ZLIB, 1);
+        deflate.write(reinterpret_cast<const char *>(entry.data->data()), entry.bytes);
+        deflate.close();
+        if (!f)
+          mitkThrow() << "Writing " << file->path() << " failed.";
+      }
+      entry.data.reset();
+      entry.file = file;
+      entry.bytes = file->getSize();
+    }
+    catch (std::exception &e)
+    {
+      MITK_WARN << "Ion image could not be spilled to disk: " << e.what();
+      continue;
+    }
+
+    // spilled and dropped entries are destroyed (and their files removed) after the lock was released
+    ListType dropped;
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (generation != m_Generation || m_Map.count(entry.key) || m_SpilledMap.count(entry.key))
+      continue;
+    m_Statistics.spilledBytes += entry.bytes;
+    ++m_Statistics.spills;
+    m_SpilledList.splice(m_SpilledList.begin(), spilled);
+    m_SpilledMap[m_SpilledList.front().key] = m_SpilledList.begin();
+    dropped = ShrinkSpilled();
+  }
+}
+
+std::shared_ptr<m2::IonImageCache::BufferType> m2::IonImageCache::Restore(const Entry &entry)
+{
+  auto data = std::make_shared<BufferType>(entry.pixels);
+  std::ifstream f(entry.file->path(), std::ios::binary);
+  Poco::InflatingInputStream inflate(f, Poco::InflatingStreamBuf::STREAM_ZLIB);
+  inflate.read(reinterpret_cast<char *>(data->data()), entry.pixels * sizeof(BufferType::value_type));
+  if (static_cast<size_t>(inflate.gcount()) != entry.pixels * sizeof(BufferType::value_type))
+    mitkThrow() << "Unexpected end of " << entry.file->path() << ".";
+  return data;
+}
@@ -0,0 +1,212 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <m2ShuffledSpectrumIterator.h>
+#include <mitkExceptionMacro.h>
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+
+m2::ShuffledSpectrumIterator::ShuffledSpectrumIterator(const ImzMLSpectrumImageView &view,
+                                                       Options options,
+                                                       std::vector<unsigned int> ids)
+  : m_View(view), m_Options(options), m_Ids(std::move(ids))
+{
+  m_Options.BlockSize = std::max(1u, m_Options.BlockSize);
+  m_Options.BufferSize = std::max(1u, m_Options.BufferSize);
+  m_Options.PrefetchBlocks = std::max(1u, m_Options.PrefetchBlocks);
+  m_Options.Threads = std::max(1u, m_Options.Threads);
+
+  const auto &spectra = m_View.GetImage()->GetSpectra();
+  if (m_Ids.empty())
+  {
+    m_Ids.resize(spectra.size());
+    std::iota(std::begin(m_Ids), std::end(m_Ids), 0);
+  }
+  for (auto id : m_Ids)
+    if (id >= spectra.size())
+      mitkThrow() << "Spectrum id " << id << " is out of range [0, " << spectra.size() << ").";
+
+  std::stable_sort(std::begin(m_Ids),
+                   std::end(m_Ids),
+                   [&spectra](unsigned int a, unsigned int b) { return spectra[a].intOffset < spectra[b].intOffset; });
+}
+
+m2::ShuffledSpectrumIterator::~ShuffledSpectrumIterator()
+{
+  Stop();
+}
+
+void m2::ShuffledSpectrumIterator::Stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Abort = true;
+  }
+  m_SpaceCondition.notify_all();
+  m_ReadyCondition.notify_all();
+  for (auto &t : m_Workers)
+    t.join();
+  m_Workers.clear();
+  m_Started = false;
+}
+
+void m2::ShuffledSpectrumIterator::StartEpoch(unsigned int epoch)
+{
+  Stop();
+
+  m_Epoch = epoch;
+  std::seed_seq seed{std::uint32_t(m_Options.Seed), std::uint32_t(m_Options.Seed >> 32), std::uint32_t(epoch)};
+  m_Random.seed(seed);
+
+  // the first block has a random length, which shifts all block boundaries of this epoch
+  const size_t blockSize = m_Options.BlockSize;
+  m_Blocks.clear();
+  size_t first = 0;
+  size_t last = std::uniform_int_distribution<size_t>(1, blockSize)(m_Random);
+  while (first < m_Ids.size())
+  {
+    last = std::min(last, m_Ids.size());
+    m_Blocks.emplace_back(first, last);
+    first = last;
+    last = first + blockSize;
+  }
+  std::shuffle(std::begin(m_Blocks), std::end(m_Blocks), m_Random);
+
+  m_Buffer.clear();
+  m_Ready.clear();
+  m_NextRead = m_NextConsumed = 0;
+  m_Abort = false;
+  m_Error = nullptr;
+  m_Started = true;
+
+  const auto threads = std::min<size_t>(m_Options.Threads, m_Blocks.size());
+  for (size_t t = 0; t < threads; ++t)
+    m_Workers.emplace_back(&ShuffledSpectrumIterator::Worker, this, m_View.Clone());
+}
+
+std::vector<m2::ShuffledSpectrumIterator::Spectrum> m2::ShuffledSpectrumIterator::ReadBlock(
+  const ImzMLSpectrumImageView &view, size_t first, size_t last) const
+{
+  const std::vector<unsigned int> ids(std::begin(m_Ids) + first, std::begin(m_Ids) + last);
+  std::vector<size_t> lengths;
+  const auto channels = view.GetImage()->GetSpectraBatchChannels(ids, &lengths);
+
+  std::vector<float> xs(m_Options.ReadXValues ? ids.size() * channels : 0);
+  std::vector<float> ys(ids.size() * channels);
+  view.GetSpectraBatchFloat(
+    ids, channels, m_Options.ReadXValues ? xs.data() : nullptr, ys.data(), m_Options.Processed, 1);
+
+  std::vector<Spectrum> spectra(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+  {
+    spectra[i].Id = ids[i];
+    const auto row = i * channels;
+    spectra[i].YValues.assign(std::begin(ys) + row, std::begin(ys) + row + lengths[i]);
+    if (m_Options.ReadXValues)
+      spectra[i].XValues.assign(std::begin(xs) + row, std::begin(xs) + row + lengths[i]);
+  }
+  return spectra;
+}
+
+void m2::ShuffledSpectrumIterator::Worker(ImzMLSpectrumImageView view)
+{
+  try
+  {
+    while (true)
+    {
+      size_t k;
+      {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_SpaceCondition.wait(lock,
+                              [&]
+                              {
+                                return m_Abort || m_NextRead >= m_Blocks.size() ||
+                                       m_NextRead < m_NextConsumed + m_Options.PrefetchBlocks;
+                              });
+        if (m_Abort || m_NextRead >= m_Blocks.size())
+          break;
+        k = m_NextRead++;
+      }
+
+      auto spectra = ReadBlock(view, m_Blocks[k].first, m_Blocks[k].second);
+
+      {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Ready[k] = std::move(spectra);
+      }
+      m_ReadyCondition.notify_all();
+    }
+  }
+  catch (...)
+  {
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (!m_Error)
+      m_Error = std::current_exception();
+    m_Abort = true;
+    m_ReadyCondition.notify_all();
+    m_SpaceCondition.notify_all();
+  }
+}
+
+bool m2::ShuffledSpectrumIterator::FetchBlock()
+{
+  if (m_NextConsumed >= m_Blocks.size())
+    return false;
+
+  std::vector<Spectrum> spectra;
+  {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_ReadyCondition.wait(lock, [&] { return m_Error || m_Ready.count(m_NextConsumed); });
+    if (m_Error)
+    {
+      auto error = m_Error;
+      lock.unlock();
+      Stop();
+      std::rethrow_exception(error);
+    }
+    auto it = m_Ready.find(m_NextConsumed);
+    spectra = std::move(it->second);
+    m_Ready.erase(it);
+    ++m_NextConsumed;
+  }
+  m_SpaceCondition.notify_all();
+
+  std::move(std::begin(spectra), std::end(spectra), std::back_inserter(m_Buffer));
+  return true;
+}
+
+bool m2::ShuffledSpectrumIterator::Next(Spectrum &spectrum)
+{
+  if (!m_Started)
+    StartEpoch(m_Epoch);
+
+  while (m_Buffer.size() < m_Options.BufferSize && FetchBlock())
+    ;
+
+  if (m_Buffer.empty())
+  {
+    Stop();
+    ++m_Epoch;
+    return false;
+  }
+
+  const auto i = std::uniform_int_distribution<size_t>(0, m_Buffer.size() - 1)(m_Random);
+  std::swap(m_Buffer[i], m_Buffer.back());
+  spectrum = std::move(m_Buffer.back());
+  m_Buffer.pop_back();
+  return true;
+}
@@ -0,0 +1,439 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <signal/m2SignalKernels.h>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define M2_KERNELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define M2_TARGET_AVX2
+#else
+#define M2_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace
+{
+  using m2::IntensityTransformationType;
+  using m2::Signal::Kernels::InstructionSet;
+
+  namespace Scalar
+  {
+    template <class T>
+    double Sum(const T *y, size_t n)
+    {
+      double s = 0;
+      for (size_t i = 0; i < n; ++i)
+        s += y[i];
+      return s;
+    }
+
+    template <class T>
+    double SumOfSquares(const T *y, size_t n)
+    {
+      double s = 0;
+      for (size_t i = 0; i < n; ++i)
+        s += y[i] * y[i];
+      return s;
+    }
+
+    template <class T>
+    double Maximum(const T *y, size_t n)
+    {
+      return n ? *std::max_element(y, y + n) : 0;
+    }
+
+    template <class X, class Y>
+    double TotalIonCurrent(const X *x, const Y *y, size_t n)
+    {
+      double s = 0;
+      for (size_t i = 0; i + 1 < n; ++i)
+        s += (y[i] + y[i + 1]) * 0.5 * (x[i + 1] - x[i]);
+      return s;
+    }
+
+    template <class T>
+    void Transform(IntensityTransformationType type, T *y, size_t n)
+    {
+      switch (type)
+      {
+        case IntensityTransformationType::Log10:
+          std::transform(y, y + n, y, [](const T &a) { return std::log10(a + 1); });
+          break;
+        case IntensityTransformationType::Log2:
+          std::transform(y, y + n, y, [](const T &a) { return std::log2(a + 1); });
+          break;
+        case IntensityTransformationType::SquareRoot:
+          std::transform(y, y + n, y, [](const T &a) { return std::sqrt(a); });
+          break;
+        case IntensityTransformationType::None:
+          break;
+      }
+    }
+  } // namespace Scalar
+
+#ifdef M2_KERNELS_X86
+  namespace Avx2
+  {
+    M2_TARGET_AVX2 inline double HorizontalSum(__m256d v)
+    {
+      const __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+      return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+
+    // four values as double: y[i], (y[i] + y[i+1]) and (x[i+1] - x[i]), the latter two in the source precision
+    M2_TARGET_AVX2 inline __m256d Load4(const float *y) { return _mm256_cvtps_pd(_mm_loadu_ps(y)); }
+    M2_TARGET_AVX2 inline __m256d Load4(const double *y) { return _mm256_loadu_pd(y); }
+    M2_TARGET_AVX2 inline __m256d PairSum4(const float *y)
+    {
+      return _mm256_cvtps_pd(_mm_add_ps(_mm_loadu_ps(y), _mm_loadu_ps(y + 1)));
+    }
+    M2_TARGET_AVX2 inline __m256d PairSum4(const double *y)
+    {
+      return _mm256_add_pd(_mm256_loadu_pd(y), _mm256_loadu_pd(y + 1));
+    }
+    M2_TARGET_AVX2 inline __m256d Diff4(const float *x)
+    {
+      return _mm256_cvtps_pd(_mm_sub_ps(_mm_loadu_ps(x + 1), _mm_loadu_ps(x)));
+    }
+    M2_TARGET_AVX2 inline __m256d Diff4(const double *x)
+    {
+      return _mm256_sub_pd(_mm256_loadu_pd(x + 1), _mm256_loadu_pd(x));
+    }
+
+    template <class T>
+    M2_TARGET_AVX2 double Sum(const T *y, size_t n)
+    {
+      __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        a = _mm256_add_pd(a, Load4(y + i));
+        b = _mm256_add_pd(b, Load4(y + i + 4));
+      }
+      double s = HorizontalSum(_mm256_add_pd(a, b));
+      for (; i < n; ++i)
+        s += y[i];
+      return s;
+    }
+
+    template <class T>
+    M2_TARGET_AVX2 double SumOfSquares(const T *y, size_t n)
+    {
+      __m256d a = _mm256_setzero_pd(), b = _mm256_setzero_pd();
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+      {
+        // squares in the source precision, like the scalar loop
+        if constexpr (std::is_same<T, float>::value)
+        {
+          const __m256 v = _mm256_loadu_ps(y + i);
+          const __m256 sq = _mm256_mul_ps(v, v);
+          a = _mm256_add_pd(a, _mm256_cvtps_pd(_mm256_castps256_ps128(sq)));
+          b = _mm256_add_pd(b, _mm256_cvtps_pd(_mm256_extractf128_ps(sq, 1)));
+        }
+        else
+        {
+          const __m256d v = _mm256_loadu_pd(y + i), w = _mm256_loadu_pd(y + i + 4);
+          a = _mm256_add_pd(a, _mm256_mul_pd(v, v));
+          b = _mm256_add_pd(b, _mm256_mul_pd(w, w));
+        }
+      }
+      double s = HorizontalSum(_mm256_add_pd(a, b));
+      for (; i < n; ++i)
+        s += y[i] * y[i];
+      return s;
+    }
+
+    template <class T>
+    M2_TARGET_AVX2 double Maximum(const T *y, size_t n)
+    {
+      if (n < 8)
+        return Scalar::Maximum(y, n);
+      __m256d m = Load4(y);
+      size_t i = 4;
+      for (; i + 4 <= n; i += 4)
+        m = _mm256_max_pd(m, Load4(y + i));
+      alignas(32) double lanes[4];
+      _mm256_store_pd(lanes, m);
+      double r = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+      for (; i < n; ++i)
+        r = std::max(r, double(y[i]));
+      return r;
+    }
+
+    template <class X, class Y>
+    M2_TARGET_AVX2 double TotalIonCurrent(const X *x, const Y *y, size_t n)
+    {
+      const __m256d half = _mm256_set1_pd(0.5);
+      __m256d a = _mm256_setzero_pd();
+      size_t i = 0;
+      // the loads read up to x[i + 4] and y[i + 4]
+      for (; i + 5 <= n; i += 4)
+        a = _mm256_add_pd(a, _mm256_mul_pd(_mm256_mul_pd(PairSum4(y + i), half), Diff4(x + i)));
+      double s = HorizontalSum(a);
+      for (; i + 1 < n; ++i)
+        s += (y[i] + y[i + 1]) * 0.5 * (x[i + 1] - x[i]);
+      return s;
+    }
+
+    // natural logarithm of normal, positive and finite values (Cephes logf)
+    M2_TARGET_AVX2 inline __m256 Log(__m256 x)
+    {
+      const __m256 one = _mm256_set1_ps(1.0f);
+      const __m256i bits = _mm256_castps_si256(x);
+      __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+      __m256 m = _mm256_or_ps(_mm256_castsi256_ps(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff))), one);
+
+      // m in [sqrt(0.5), sqrt(2))
+      const __m256 large = _mm256_cmp_ps(m, _mm256_set1_ps(1.41421356237f), _CMP_GE_OQ);
+      m = _mm256_blendv_ps(m, _mm256_mul_ps(m, _mm256_set1_ps(0.5f)), large);
+      e = _mm256_add_ps(e, _mm256_and_ps(large, one));
+
+      const __m256 f = _mm256_sub_ps(m, one);
+      const __m256 z = _mm256_mul_ps(f, f);
+      __m256 p = _mm256_set1_ps(7.0376836292E-2f);
+      for (float c : {-1.1514610310E-1f,
+                      1.1676998740E-1f,
+                      -1.2420140846E-1f,
+                      1.4249322787E-1f,
+                      -1.6668057665E-1f,
+                      2.0000714765E-1f,
+                      -2.4999993993E-1f,
+                      3.3333331174E-1f})
+        p = _mm256_add_ps(_mm256_mul_ps(p, f), _mm256_set1_ps(c));
+      __m256 r = _mm256_mul_ps(_mm256_mul_ps(p, f), z);
+      r = _mm256_add_ps(r, _mm256_mul_ps(e, _mm256_set1_ps(-2.12194440e-4f)));
+      r = _mm256_sub_ps(r, _mm256_mul_ps(z, _mm256_set1_ps(0.5f)));
+      r = _mm256_add_ps(f, r);
+      return _mm256_add_ps(r, _mm256_mul_ps(e, _mm256_set1_ps(0.693359375f)));
+    }
+
+    // y = log(y + 1) * scale; lanes with special values are left to the scalar transformation
+    M2_TARGET_AVX2 inline void LogChunk(IntensityTransformationType type, float *y, float scale)
+    {
+      const __m256 v = _mm256_loadu_ps(y);
+      const __m256 a = _mm256_add_ps(v, _mm256_set1_ps(1.0f));
+      const __m256 valid = _mm256_and_ps(_mm256_cmp_ps(a, _mm256_set1_ps(std::numeric_limits<float>::min()), _CMP_GE_OQ),
+                                         _mm256_cmp_ps(a, _mm256_set1_ps(std::numeric_limits<float>::max()), _CMP_LE_OQ));
+      const int mask = _mm256_movemask_ps(valid);
+      float special[8];
+      if (mask != 0xFF)
+        _mm256_storeu_ps(special, v);
+      _mm256_storeu_ps(y, _mm256_mul_ps(Log(a), _mm256_set1_ps(scale)));
+      for (int k = 0; mask != 0xFF && k < 8; ++k)
+      {
+        if (mask & (1 << k))
+          continue;
+        Scalar::Transform(type, special + k, 1);
+        y[k] = special[k];
+      }
+    }
+
+    M2_TARGET_AVX2 inline void TransformChunk(IntensityTransformationType type, float *y)
+    {
+      switch (type)
+      {
+        case IntensityTransformationType::Log10:
+          LogChunk(type, y, 0.434294481903f);
+          break;
+        case IntensityTransformationType::Log2:
+          LogChunk(type, y, 1.44269504089f);
+          break;
+        case IntensityTransformationType::SquareRoot:
+          _mm256_storeu_ps(y, _mm256_sqrt_ps(_mm256_loadu_ps(y)));
+          break;
+        case IntensityTransformationType::None:
+          break;
+      }
+    }
+
+    M2_TARGET_AVX2 void Transform(IntensityTransformationType type, float *y, size_t n)
+    {
+      if (type == IntensityTransformationType::None)
+        return;
+
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        TransformChunk(type, y + i);
+      // the remainder is padded, so each value is computed the same way
+      if (i < n)
+      {
+        float rest[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        std::memcpy(rest, y + i, (n - i) * sizeof(float));
+        TransformChunk(type, rest);
+        std::memcpy(y + i, rest, (n - i) * sizeof(float));
+      }
+    }
+
+    M2_TARGET_AVX2 void Transform(IntensityTransformationType type, double *y, size_t n)
+    {
+      if (type != IntensityTransformationType::SquareRoot)
+        return Scalar::Transform(type, y, n);
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(y + i, _mm256_sqrt_pd(_mm256_loadu_pd(y + i)));
+      Scalar::Transform(type, y + i, n - i);
+    }
+  } // namespace Avx2
+#endif
+
+  bool CpuSupportsAvx2()
+  {
+#ifdef M2_KERNELS_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    const bool osxsave = info[2] & (1 << 27);
+    const bool avx = info[2] & (1 << 28);
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+      return false;
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+#else
+    return false;
+#endif
+  }
+
+  std::atomic<InstructionSet> &Active()
+  {
+    static std::atomic<InstructionSet> set(CpuSupportsAvx2() ? InstructionSet::AVX2 : InstructionSet::Scalar);
+    return set;
+  }
+
+  bool UseAvx2()
+  {
+#ifdef M2_KERNELS_X86
+    return Active().load(std::memory_order_relaxed) == InstructionSet::AVX2;
+#else
+    return false;
+#endif
+  }
+} // namespace
+
+#ifdef M2_KERNELS_X86
+#define M2_DISPATCH(call) return UseAvx2() ? Avx2::call : Scalar::call
+#else
+#define M2_DISPATCH(call) return Scalar::call
+#endif
+
+m2::Signal::Kernels::InstructionSet m2::Signal::Kernels::GetInstructionSet()
+{
+  return Active();
+}
+
+bool m2::Signal::Kernels::SetInstructionSet(InstructionSet set)
+{
+  if (!IsSupported(set))
+    return false;
+  Active() = set;
+  return true;
+}
+
+bool m2::Signal::Kernels::IsSupported(InstructionSet set)
+{
+  switch (set)
+  {
+    case InstructionSet::Scalar:
+      return true;
+    case InstructionSet::AVX2:
+      return CpuSupportsAvx2();
+  }
+  return false;
+}
+
+std::string m2::Signal::Kernels::ToString(InstructionSet set)
+{
+  switch (set)
+  {
+    case InstructionSet::Scalar:
+      return "Scalar";
+    case InstructionSet::AVX2:
+      return "AVX2";
+  }
+  return "";
+}
+
+double m2::Signal::Kernels::Sum(const float *y, size_t n)
+{
+  M2_DISPATCH(Sum(y, n));
+}
+
+double m2::Signal::Kernels::Sum(const double *y, size_t n)
+{
+  M2_DISPATCH(Sum(y, n));
+}
+
+double m2::Signal::Kernels::SumOfSquares(const float *y, size_t n)
+{
+  M2_DISPATCH(SumOfSquares(y, n));
+}
+
+double m2::Signal::Kernels::SumOfSquares(const double *y, size_t n)
+{
+  M2_DISPATCH(SumOfSquares(y, n));
+}
+
+double m2::Signal::Kernels::Maximum(const float *y, size_t n)
+{
+  M2_DISPATCH(Maximum(y, n));
+}
+
+double m2::Signal::Kernels::Maximum(const double *y, size_t n)
+{
+  M2_DISPATCH(Maximum(y, n));
+}
+
+double m2::Signal::Kernels::TotalIonCurrent(const float *x, const float *y, size_t n)
+{
+  M2_DISPATCH(TotalIonCurrent(x, y, n));
+}
+
+double m2::Signal::Kernels::TotalIonCurrent(const float *x, const double *y, size_t n)
+{
+  M2_DISPATCH(TotalIonCurrent(x, y, n));
+}
+
+double m2::Signal::Kernels::TotalIonCurrent(const double *x, const float *y, size_t n)
+{
+  M2_DISPATCH(TotalIonCurrent(x, y, n));
+}
+
+double m2::Signal::Kernels::TotalIonCurrent(const double *x, const double *y, size_t n)
+{
+  M2_DISPATCH(TotalIonCurrent(x, y, n));
+}
+
+void m2::Signal::Kernels::Transform(IntensityTransformationType type, float *y, size_t n)
+{
+  M2_DISPATCH(Transform(type, y, n));
+}
+
+void m2::Signal::Kernels::Transform(IntensityTransformationType type, double *y, size_t n)
+{
+  M2_DISPATCH(Transform(type, y, n));
+}
@@ -14,7 +14,10 @@ See LICENSE.txt for details.
 
 ===================================================================*/
 #include <m2SpectrumImage.h>
+#include <mitkCoreServices.h>
 #include <mitkDataNode.h>
+#include <mitkIPreferences.h>
+#include <mitkIPreferencesService.h>
 #include <mitkImagePixelReadAccessor.h>
 #include <mitkLevelWindowProperty.h>
 #include <mitkLookupTableProperty.h>
@@ -173,10 +176,82 @@ const m2::SpectrumImage::SpectrumArtifactVectorType &m2::SpectrumImage::GetXAxis
   return m_XAxis;
 }
 
-void m2::SpectrumImage::GetImage(double, double, const mitk::Image *, mitk::Image *) const
+void m2::SpectrumImage::GetImage(double, double, const mitk::Image *, mitk::Image *, const m2::IonImageOptions &) const
 {
   MITK_WARN("SpectrumImage") << "Get image is not implemented in derived class!";
 }
 
+void m2::SpectrumImage::GetImages(const std::vector<std::pair<double, double>> &ranges,
+                                  const mitk::Image *mask,
+                                  const std::vector<mitk::Image *> &imgs,
+                                  const std::function<bool()> &cancelled) const
+{
+  m2::IonImageOptions options;
+  options.Cancelled = cancelled;
+  for (size_t i = 0; i < ranges.size() && !options.IsCancelled(); ++i)
+    GetImage(ranges[i].first, ranges[i].second, mask, imgs[i], options);
+}
+
+bool m2::SpectrumImage::GetImageFromCache(double mz, double tol, const mitk::Image *mask, mitk::Image *img)
+{
+  if (!m_IonImageCache->Get(GetIonImageCacheKey(mz, tol, mask), img))
+    return false;
+
+  SetProperty("m2aia.xs.selection.center", mitk::DoubleProperty::New(mz));
+  SetProperty("m2aia.xs.selection.tolerance", mitk::DoubleProperty::New(tol));
+  m_CurrentX = mz;
+  return true;
+}
+
+void m2::SpectrumImage::InsertImageIntoCache(double mz, double tol, const mitk::Image *mask, const mitk::Image *img)
+{
+  m_IonImageCache->Insert(GetIonImageCacheKey(mz, tol, mask), img);
+}
+
+m2::IonImageCacheKey m2::SpectrumImage::GetIonImageCacheKey(double mz, double tol, const mitk::Image *mask) const
+{
+  m2::IonImageCacheKey key;
+  key.mz = mz;
+  key.tol = tol;
+  key.normalization = GetNormalizationStrategy();
+  key.smoothing = GetSmoothingStrategy();
+  key.smoothingHalfWindowSize = GetSmoothingHalfWindowSize();
+  key.baseline = GetBaselineCorrectionStrategy();
+  key.baselineHalfWindowSize = GetBaseLineCorrectionHalfWindowSize();
+  key.pooling = GetRangePoolingStrategy();
+  key.transformation = GetIntensityTransformationStrategy();
+  key.maskHash = m2::IonImageCache::HashMask(mask);
+  key.state = GetIonImageCacheState();
+  return key;
+}
+
+size_t m2::SpectrumImage::GetIonImageCacheState() const
+{
+  // normalization images are replaced or modified (e.g. External) independently of the strategy
+  size_t seed = 0;
+  if (GetNormalizationStrategy() != m2::NormalizationStrategyType::None)
+  {
+    auto it = m_NormalizationImages.find(GetNormalizationStrategy());
+    if (it != m_NormalizationImages.end() && it->second.image)
+    {
+      m2::HashCombine(seed, static_cast<const void *>(it->second.image.GetPointer()));
+      m2::HashCombine(seed, it->second.image->GetMTime());
+      m2::HashCombine(seed, it->second.isInitialized);
+    }
+  }
+  return seed;
+}
+
 m2::SpectrumImage::~SpectrumImage() {}
-m2::SpectrumImage::SpectrumImage() : mitk::Image() {}
+m2::SpectrumImage::SpectrumImage() : mitk::Image()
+{
+  unsigned int cacheSize = 256, spillSize = 0;
+  if (auto *preferencesService = mitk::CoreServices::GetPreferencesService())
+    if (auto *preferences = preferencesService->GetSystemPreferences())
+    {
+      cacheSize = preferences->GetInt("m2aia.signal.IonImageCacheSize", cacheSize);
+      spillSize = preferences->GetInt("m2aia.signal.IonImageCacheSpillSize", spillSize);
+    }
+  m_IonImageCache =
+    std::make_shared<m2::IonImageCache>(size_t(cacheSize) * 1024 * 1024, size_t(spillSize) * 1024 * 1024);
+}
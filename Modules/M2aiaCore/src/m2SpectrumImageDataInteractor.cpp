@@ -64,9 +64,7 @@ bool m2::SpectrumImageDataInteractor::FilterEvents(mitk::InteractionEvent *inter
       auto *positionEvent = static_cast<mitk::InteractionPositionEvent *>(interactionEvent);
       mitk::Point3D pos = positionEvent->GetPositionInWorld();
 
-      auto imageNodes = this->GetDataStorage()->GetSubset(
-        mitk::NodePredicateAnd::New(mitk::TNodePredicateDataType<m2::SpectrumImage>::New(),
-        mitk::NodePredicateNot::New(mitk::TNodePredicateDataType<m2::SpectrumImageStack>::New())));
+      auto imageNodes = this->GetDataStorage()->GetSubset(mitk::TNodePredicateDataType<m2::SpectrumImage>::New());
       for (auto imageNode : *imageNodes)
       {
         auto image = dynamic_cast<m2::SpectrumImage *>(imageNode->GetData());
@@ -76,9 +74,19 @@ bool m2::SpectrumImageDataInteractor::FilterEvents(mitk::InteractionEvent *inter
         {
         
           image->GetGeometry()->WorldToIndex(pos, index);
-          auto indexImage = image->GetIndexImage();
-          mitk::ImagePixelReadAccessor<m2::IndexImagePixelType, 3> acc(indexImage);
-          auto id = acc.GetPixelByIndex(index);
+          unsigned int id;
+          if (dynamic_cast<m2::SpectrumImageStack *>(image))
+          {
+            // stacks map voxels to the spectra of their slices
+            const auto dims = image->GetDimensions();
+            id = index[0] + dims[0] * (index[1] + dims[1] * index[2]);
+          }
+          else
+          {
+            auto indexImage = image->GetIndexImage();
+            mitk::ImagePixelReadAccessor<m2::IndexImagePixelType, 3> acc(indexImage);
+            id = acc.GetPixelByIndex(index);
+          }
 
           auto singleSpectrumNode = FindSingleSpectrumDataNode(imageNode);
           if (!singleSpectrumNode)
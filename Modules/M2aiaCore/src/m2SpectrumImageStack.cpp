@@ -14,10 +14,13 @@ See LICENSE.txt for details.
 ===================================================================*/
 
 #include <array>
+#include <atomic>
 #include <cstdlib>
+#include <map>
 #include <itkSignedMaurerDistanceMapImageFilter.h>
 #include <itksys/SystemTools.hxx>
 #include <m2ImzMLSpectrumImage.h>
+#include <m2Process.hpp>
 #include <m2ISpectrumImageSource.h>
 #include <m2SpectrumImageStack.h>
 #include <mitkExtractSliceFilter.h>
@@ -42,12 +45,21 @@ namespace m2
     SetPropertyValue<double>("m2aia.xs.max", std::numeric_limits<double>::min());
 
     m_SliceTransformers.resize(stackSize);
+    m_WarpTables.resize(stackSize);
+    m_SpectrumIds.resize(stackSize);
   }
 
 
   void SpectrumImageStack::Insert(unsigned int sliceId, std::shared_ptr<m2::ElxRegistrationHelper> transformer)
   {
     m_SliceTransformers[sliceId] = transformer;
+    {
+      std::lock_guard<std::mutex> lock(m_WarpTablesMutex);
+      m_WarpTables[sliceId].reset();
+      m_SpectrumIds[sliceId].reset();
+    }
+    m_OverviewBins = 0;
+    m_IonImageCache->Clear();
 
     if (auto spectrumImage = dynamic_cast<m2::SpectrumImage *>(transformer->GetMovingImage().GetPointer()))
     {
@@ -141,11 +153,17 @@ namespace m2
 
   void SpectrumImageStack::InitializeImageAccess()
   {
-    std::list<m2::Interval> peaks;
+    m_IonImageCache->Clear();
     auto* preferencesService = mitk::CoreServices::GetPreferencesService();
     auto* preferences = preferencesService->GetSystemPreferences();
     const auto bins = preferences->GetInt("m2aia.view.spectrum.bins", 1500);
-    //    const auto normalizationStrategy = GetNormalizationStrategy();
+
+    // the overview spectra only change if slices are inserted or the number of bins changes
+    if (m_OverviewBins == bins && !GetXAxis().empty())
+    {
+      m_ImageAccessInitialized = true;
+      return;
+    }
 
     double max = 0;
     double min = std::numeric_limits<double>::max();
@@ -161,40 +179,48 @@ namespace m2
 
     binSize = (max - min) / double(bins);
     using SpectrumVector = m2::SpectrumImage::SpectrumArtifactVectorType;
-    SpectrumVector xSumVec(bins);
-    SpectrumVector hits(bins);
 
-    SpectrumVector ySumVec = GetSumSpectrum();
-    ySumVec.resize(bins, 0);
-    SpectrumVector yMeanVec = GetMeanSpectrum();
-    yMeanVec.resize(bins, 0);
-    SpectrumVector yMaxVec = GetSkylineSpectrum();
-    yMaxVec.resize(bins, 0);
-
-    for (auto &transformer : m_SliceTransformers)
+    // slices are binned in parallel, each thread into its own bins
+    struct Bins
     {
-      auto specImage = dynamic_cast<m2::SpectrumImage *>(transformer->GetMovingImage().GetPointer());
-      auto sliceXAxis = specImage->GetXAxis();
-      auto sliceSumVec = specImage->GetSumSpectrum();
-      auto sliceMaxVec = specImage->GetSkylineSpectrum();
-      auto sliceMeanVec = specImage->GetMeanSpectrum();
-
-      for (unsigned int k = 0; k < sliceXAxis.size(); ++k)
-      {
-        auto j = (long)((sliceXAxis[k] - min) / binSize);
-
-        if (j >= bins)
-          j = bins - 1;
-        else if (j < 0)
-          j = 0;
-
-        xSumVec[j] += sliceXAxis[k];
-        ySumVec[j] += sliceSumVec[k];
-        yMeanVec[j] += sliceMeanVec[k];
-        yMaxVec[j] = std::max(yMaxVec[j], double(sliceMaxVec[k]));
-        hits[j]++;
-      }
-    }
+      SpectrumVector xSum, ySum, yMean, yMax, hits;
+    };
+    const unsigned int threads = std::max(1u, std::min<unsigned int>(GetNumberOfThreads(), m_SliceTransformers.size()));
+    std::vector<Bins> binsT(threads);
+    m2::Process::Map(m_SliceTransformers.size(),
+                     threads,
+                     [&](unsigned int t, unsigned int a, unsigned int b)
+                     {
+                       auto &local = binsT[t];
+                       for (auto v : {&local.xSum, &local.ySum, &local.yMean, &local.yMax, &local.hits})
+                         v->assign(bins, 0);
+
+                       for (unsigned int i = a; i < b; ++i)
+                       {
+                         auto specImage = dynamic_cast<m2::SpectrumImage *>(
+                           m_SliceTransformers[i]->GetMovingImage().GetPointer());
+                         const auto &sliceXAxis = specImage->GetXAxis();
+                         const auto &sliceSumVec = specImage->GetSumSpectrum();
+                         const auto &sliceMaxVec = specImage->GetSkylineSpectrum();
+                         const auto &sliceMeanVec = specImage->GetMeanSpectrum();
+
+                         for (unsigned int k = 0; k < sliceXAxis.size(); ++k)
+                         {
+                           auto j = (long)((sliceXAxis[k] - min) / binSize);
+
+                           if (j >= bins)
+                             j = bins - 1;
+                           else if (j < 0)
+                             j = 0;
+
+                           local.xSum[j] += sliceXAxis[k];
+                           local.ySum[j] += sliceSumVec[k];
+                           local.yMean[j] += sliceMeanVec[k];
+                           local.yMax[j] = std::max(local.yMax[j], double(sliceMaxVec[k]));
+                           local.hits[j]++;
+                         }
+                       }
+                     });
 
     SpectrumVector &xVecFinal = GetXAxis();
     xVecFinal.clear();
@@ -207,12 +233,24 @@ namespace m2
 
     for (int k = 0; k < bins; ++k)
     {
-      if (hits[k] > 0)
+      double xSum = 0, ySum = 0, yMean = 0, yMax = 0, hits = 0;
+      for (const auto &local : binsT)
       {
-        xVecFinal.push_back(xSumVec[k] / (double)hits[k]);      // mean uof sum of x values within bin range
-        ySumVecFinal.push_back(ySumVec[k] / (double)hits[k]);   // mean of sums
-        yMeanVecFinal.push_back(yMeanVec[k] / (double)hits[k]); // mean of means
-        yMaxVecFinal.push_back(yMaxVec[k]);                     // max
+        if (local.hits.empty())
+          continue;
+        xSum += local.xSum[k];
+        ySum += local.ySum[k];
+        yMean += local.yMean[k];
+        yMax = std::max(yMax, local.yMax[k]);
+        hits += local.hits[k];
+      }
+
+      if (hits > 0)
+      {
+        xVecFinal.push_back(xSum / hits);      // mean uof sum of x values within bin range
+        ySumVecFinal.push_back(ySum / hits);   // mean of sums
+        yMeanVecFinal.push_back(yMean / hits); // mean of means
+        yMaxVecFinal.push_back(yMax);          // max
       }
     }
 
@@ -220,82 +258,464 @@ namespace m2
     SetPropertyValue<double>("m2aia.xs.min", xVecFinal.front());
     SetPropertyValue<double>("m2aia.xs.max", xVecFinal.back());
 
+    m_OverviewBins = bins;
     m_ImageAccessInitialized = true;
     
   }
 
+  std::shared_ptr<const std::vector<unsigned int>> SpectrumImageStack::GetSpectrumIds(unsigned int i) const
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_WarpTablesMutex);
+      if (m_SpectrumIds[i])
+        return m_SpectrumIds[i];
+    }
+
+    auto specImage = dynamic_cast<m2::SpectrumImage *>(m_SliceTransformers[i]->GetMovingImage().GetPointer());
+    if (!specImage || !specImage->GetIndexImage())
+      mitkThrow() << "Slice " << i << " has no index image.";
+
+    const auto indexImage = specImage->GetIndexImage();
+    const unsigned int n = indexImage->GetDimensions()[0] * indexImage->GetDimensions()[1];
+    auto ids = std::make_shared<std::vector<unsigned int>>(n);
+
+    mitk::ImageReadAccessor indexAccess(indexImage);
+    const auto index = static_cast<const m2::IndexImagePixelType *>(indexAccess.GetData());
+    std::copy(index, index + n, std::begin(*ids));
+
+    // pixels without a spectrum are not part of the mask
+    if (auto mask = specImage->GetMaskImage())
+    {
+      mitk::ImageReadAccessor maskAccess(mask);
+      const auto labels = static_cast<const mitk::LabelSetImage::PixelType *>(maskAccess.GetData());
+      for (unsigned int k = 0; k < n; ++k)
+        if (labels[k] == 0)
+          (*ids)[k] = WarpTable::InvalidIndex;
+    }
+
+    std::lock_guard<std::mutex> lock(m_WarpTablesMutex);
+    m_SpectrumIds[i] = ids;
+    return ids;
+  }
+
+  bool SpectrumImageStack::GetSourceSpectrum(unsigned int voxelIndex,
+                                             unsigned int &sliceIndex,
+                                             unsigned int &spectrumId) const
+  {
+    const unsigned int stackN = GetDimensions()[0] * GetDimensions()[1];
+    if (stackN == 0)
+      return false;
+    sliceIndex = voxelIndex / stackN;
+    if (sliceIndex >= m_SliceTransformers.size() || !m_SliceTransformers[sliceIndex])
+      return false;
+
+    const unsigned int k = voxelIndex % stackN;
+    const auto &transformer = m_SliceTransformers[sliceIndex];
+    unsigned int source;
+    if (!transformer->GetTransformation().empty())
+    {
+      // nearest neighbour of the transformed position
+      const auto table = GetWarpTable(sliceIndex);
+      if (k >= table->index.size() || table->index[k] == WarpTable::InvalidIndex)
+        return false;
+      source = table->index[k] + (table->fx[k] >= 0.5f ? table->stepX : 0) + (table->fy[k] >= 0.5f ? table->stepY : 0);
+    }
+    else
+    {
+      // the slice shares the in-plane index grid of the stack, but its buffer has its own row length
+      const auto *sliceDims = transformer->GetMovingImage()->GetDimensions();
+      const unsigned int x = k % GetDimensions()[0];
+      const unsigned int y = k / GetDimensions()[0];
+      if (x >= sliceDims[0] || y >= sliceDims[1])
+        return false;
+      source = y * sliceDims[0] + x;
+    }
+
+    const auto ids = GetSpectrumIds(sliceIndex);
+    if (source >= ids->size() || (*ids)[source] == WarpTable::InvalidIndex)
+      return false;
+    spectrumId = (*ids)[source];
+    return true;
+  }
+
+  void SpectrumImageStack::GetSpectra(const std::vector<unsigned int> &voxelIndices,
+                                      std::vector<std::vector<double>> &xs,
+                                      std::vector<std::vector<double>> &ys,
+                                      unsigned int threads) const
+  {
+    xs.assign(voxelIndices.size(), {});
+    ys.assign(voxelIndices.size(), {});
+
+    // requests grouped by slice: (position in the request, spectrum id)
+    std::map<unsigned int, std::vector<std::pair<unsigned int, unsigned int>>> requests;
+    for (unsigned int k = 0; k < voxelIndices.size(); ++k)
+    {
+      unsigned int sliceIndex, spectrumId;
+      if (GetSourceSpectrum(voxelIndices[k], sliceIndex, spectrumId))
+        requests[sliceIndex].emplace_back(k, spectrumId);
+    }
+    if (requests.empty())
+      return;
+
+    // a slice is read by a single thread, different slices in parallel
+    std::vector<std::pair<unsigned int, std::vector<std::pair<unsigned int, unsigned int>>>> groups(
+      std::begin(requests), std::end(requests));
+    threads = std::min<std::size_t>(threads ? threads : GetNumberOfThreads(), groups.size());
+    std::vector<std::string> errors(groups.size());
+    std::atomic<unsigned int> next{0};
+    m2::Process::Map(std::max(threads, 1u),
+                     std::max(threads, 1u),
+                     [&](unsigned int, unsigned int, unsigned int)
+                     {
+                       for (unsigned int g = next++; g < groups.size(); g = next++)
+                       {
+                         try
+                         {
+                           auto specImage = dynamic_cast<m2::SpectrumImage *>(
+                             m_SliceTransformers[groups[g].first]->GetMovingImage().GetPointer());
+                           for (const auto &[k, id] : groups[g].second)
+                             specImage->GetSpectrum(id, xs[k], ys[k]);
+                         }
+                         catch (std::exception &e)
+                         {
+                           errors[g] = e.what();
+                         }
+                       }
+                     });
+
+    for (unsigned int g = 0; g < groups.size(); ++g)
+      if (!errors[g].empty())
+        mitkThrow() << "Slice " << groups[g].first << ": " << errors[g];
+  }
+
+  void SpectrumImageStack::GetSpectrumFloat(unsigned int id, std::vector<float> &xs, std::vector<float> &ys) const
+  {
+    unsigned int sliceIndex, spectrumId;
+    xs.clear();
+    ys.clear();
+    if (GetSourceSpectrum(id, sliceIndex, spectrumId))
+      dynamic_cast<m2::SpectrumImage *>(m_SliceTransformers[sliceIndex]->GetMovingImage().GetPointer())
+        ->GetSpectrumFloat(spectrumId, xs, ys);
+  }
+
+  void SpectrumImageStack::GetIntensitiesFloat(unsigned int id, std::vector<float> &ys) const
+  {
+    unsigned int sliceIndex, spectrumId;
+    ys.clear();
+    if (GetSourceSpectrum(id, sliceIndex, spectrumId))
+      dynamic_cast<m2::SpectrumImage *>(m_SliceTransformers[sliceIndex]->GetMovingImage().GetPointer())
+        ->GetIntensitiesFloat(spectrumId, ys);
+  }
+
+  void SpectrumImageStack::GetSpectrum(unsigned int id, std::vector<double> &xs, std::vector<double> &ys) const
+  {
+    unsigned int sliceIndex, spectrumId;
+    xs.clear();
+    ys.clear();
+    if (GetSourceSpectrum(id, sliceIndex, spectrumId))
+      dynamic_cast<m2::SpectrumImage *>(m_SliceTransformers[sliceIndex]->GetMovingImage().GetPointer())
+        ->GetSpectrum(spectrumId, xs, ys);
+  }
+
+  void SpectrumImageStack::GetIntensities(unsigned int id, std::vector<double> &ys) const
+  {
+    unsigned int sliceIndex, spectrumId;
+    ys.clear();
+    if (GetSourceSpectrum(id, sliceIndex, spectrumId))
+      dynamic_cast<m2::SpectrumImage *>(m_SliceTransformers[sliceIndex]->GetMovingImage().GetPointer())
+        ->GetIntensities(spectrumId, ys);
+  }
+
   void SpectrumImageStack::SpectrumImageStack::CopyWarpedImageToStackImage(mitk::Image *warped,
                                                                            mitk::Image *stack,
                                                                            unsigned i) const
   {
-    auto warpN = warped->GetDimensions()[0] * warped->GetDimensions()[1];
     auto stackN = stack->GetDimensions()[0] * stack->GetDimensions()[1];
-    if (warpN != stackN)
-      mitkThrow() << "Slice dimensions are not equal for target slice with index !" << i;
     if (i >= stack->GetDimensions()[2])
       mitkThrow() << "Stack index is invalid! Z dim is " << stack->GetDimensions()[2];
 
     mitk::ImageWriteAccessor stackAccess(stack);
     auto stackData = static_cast<m2::DisplayImagePixelType *>(stackAccess.GetData());
+    CopyWarpedImageToStackData(warped, stackData, stackN, i, GetNumberOfThreads());
+  }
 
-    if(m_UseSliceWiseMaximumNormalization){
-      AccessByItk(warped,
+  void SpectrumImageStack::CopyWarpedImageToStackData(mitk::Image *warped,
+                                                      m2::DisplayImagePixelType *stackData,
+                                                      unsigned int stackN,
+                                                      unsigned i,
+                                                      unsigned int threads) const
+  {
+    auto warpN = warped->GetDimensions()[0] * warped->GetDimensions()[1];
+    if (warpN != stackN)
+      mitkThrow() << "Slice dimensions are not equal for target slice with index !" << i;
+
+    // small slices are not worth to start threads
+    threads = std::max(1u, std::min(threads, stackN / (1u << 16)));
+    auto target = stackData + (std::size_t(i) * stackN);
+
+    AccessByItk(warped,
                 (
                   [&](auto itkImg)
                   {
                     auto warpedData = itkImg->GetBufferPointer();
-                    auto max = *(std::max_element(warpedData, warpedData + stackN));
-                    std::transform(warpedData, warpedData + stackN, stackData + (i * stackN), [max](auto v){return v/max;});
+                    using PixelType = typename std::remove_pointer<decltype(warpedData)>::type;
+
+                    PixelType max = 1;
+                    if (m_UseSliceWiseMaximumNormalization)
+                    {
+                      std::vector<PixelType> maxT(threads, std::numeric_limits<PixelType>::lowest());
+                      m2::Process::Map(stackN,
+                                       threads,
+                                       [&](unsigned int t, unsigned int a, unsigned int b)
+                                       { maxT[t] = *std::max_element(warpedData + a, warpedData + b); });
+                      max = *std::max_element(std::begin(maxT), std::end(maxT));
+                    }
+
+                    m2::Process::Map(stackN,
+                                     threads,
+                                     [&](unsigned int, unsigned int a, unsigned int b)
+                                     {
+                                       if (m_UseSliceWiseMaximumNormalization)
+                                         std::transform(warpedData + a,
+                                                        warpedData + b,
+                                                        target + a,
+                                                        [max](auto v) { return v / max; });
+                                       else
+                                         std::copy(warpedData + a, warpedData + b, target + a);
+                                     });
                   }));
-    }else{
+  }
 
+  std::shared_ptr<const SpectrumImageStack::WarpTable> SpectrumImageStack::GetWarpTable(unsigned int i) const
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_WarpTablesMutex);
+      if (m_WarpTables[i])
+        return m_WarpTables[i];
+    }
 
-    AccessByItk(warped,
+    const auto &transformer = m_SliceTransformers[i];
+    auto moving = transformer->GetMovingImage();
+    const unsigned int w = moving->GetDimensions()[0];
+    const unsigned int h = moving->GetDimensions()[1];
+
+    // ramps of the source coordinates, warped with linear interpolation the ramps give the transformed
+    // position of each target pixel. Near the border, the interpolation mixes in the default pixel
+    // value 0 of positions outside of the source image, so a mask of ones is warped as well: only
+    // target pixels whose mask is 1 are interpolated from inside of the source image.
+    std::array<mitk::Image::Pointer, 3> ramps;
+    for (unsigned int d = 0; d < 3; ++d)
+    {
+      auto ramp = mitk::Image::New();
+      ramp->Initialize(mitk::MakeScalarPixelType<double>(), *moving->GetGeometry());
+      {
+        mitk::ImageWriteAccessor access(ramp);
+        auto data = static_cast<double *>(access.GetData());
+        for (unsigned int y = 0; y < h; ++y)
+          for (unsigned int x = 0; x < w; ++x)
+            data[y * w + x] = d == 0 ? x : (d == 1 ? y : 1.0);
+      }
+      ramps[d] = transformer->WarpImage(ramp, "double", 1);
+      if (ramps[d]->GetPixelType() != mitk::MakeScalarPixelType<double>())
+        mitkThrow() << "Unexpected pixel type of the warped coordinates of slice " << i << ".";
+    }
+
+    mitk::ImageReadAccessor xAccess(ramps[0]);
+    mitk::ImageReadAccessor yAccess(ramps[1]);
+    mitk::ImageReadAccessor maskAccess(ramps[2]);
+    const auto xs = static_cast<const double *>(xAccess.GetData());
+    const auto ys = static_cast<const double *>(yAccess.GetData());
+    const auto inside = static_cast<const double *>(maskAccess.GetData());
+    const unsigned int n = ramps[0]->GetDimensions()[0] * ramps[0]->GetDimensions()[1];
+
+    auto table = std::make_shared<WarpTable>();
+    table->sourceSize = w * h;
+    table->stepX = w > 1 ? 1 : 0;
+    table->stepY = h > 1 ? w : 0;
+    table->index.resize(n);
+    table->fx.resize(n);
+    table->fy.resize(n);
+    for (unsigned int k = 0; k < n; ++k)
+    {
+      double x = xs[k];
+      double y = ys[k];
+      if (!(inside[k] >= 1 - 1e-6 && x >= -1e-6 && y >= -1e-6 && x <= w - 1 + 1e-6 && y <= h - 1 + 1e-6))
+      {
+        table->index[k] = WarpTable::InvalidIndex;
+        continue;
+      }
+      x = std::min(std::max(x, 0.0), w - 1.0);
+      y = std::min(std::max(y, 0.0), h - 1.0);
+      const unsigned int x0 = std::min(unsigned(x), w - 1 - table->stepX);
+      const unsigned int y0 = std::min(unsigned(y), h - 1 - (h > 1 ? 1 : 0));
+      table->index[k] = y0 * w + x0;
+      table->fx[k] = x - x0;
+      table->fy[k] = y - y0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_WarpTablesMutex);
+    m_WarpTables[i] = table;
+    return table;
+  }
+
+  void SpectrumImageStack::ApplyWarpTable(const WarpTable &table,
+                                          mitk::Image *ionImage,
+                                          m2::DisplayImagePixelType *stackData,
+                                          unsigned int stackN,
+                                          unsigned i,
+                                          unsigned int threads) const
+  {
+    if (table.index.size() != stackN)
+      mitkThrow() << "Slice dimensions are not equal for target slice with index !" << i;
+    if (ionImage->GetDimensions()[0] * ionImage->GetDimensions()[1] != table.sourceSize)
+      mitkThrow() << "Ion image dimensions do not match the warp table of slice " << i;
+
+    threads = std::max(1u, std::min(threads, stackN / (1u << 16)));
+    auto target = stackData + (std::size_t(i) * stackN);
+
+    AccessByItk(ionImage,
                 (
                   [&](auto itkImg)
                   {
-                    auto warpedData = itkImg->GetBufferPointer();
-                    std::copy(warpedData, warpedData + stackN, stackData + (i * stackN));
+                    const auto source = itkImg->GetBufferPointer();
+                    m2::Process::Map(stackN,
+                                     threads,
+                                     [&](unsigned int, unsigned int a, unsigned int b)
+                                     {
+                                       for (unsigned int k = a; k < b; ++k)
+                                       {
+                                         const auto idx = table.index[k];
+                                         if (idx == WarpTable::InvalidIndex)
+                                         {
+                                           target[k] = 0;
+                                           continue;
+                                         }
+                                         const double fx = table.fx[k];
+                                         const double fy = table.fy[k];
+                                         const auto s = source + idx;
+                                         const double lower = (1 - fx) * s[0] + fx * s[table.stepX];
+                                         const double upper = (1 - fx) * s[table.stepY] + fx * s[table.stepY + table.stepX];
+                                         target[k] = (1 - fy) * lower + fy * upper;
+                                       }
+                                     });
                   }));
+
+    if (m_UseSliceWiseMaximumNormalization)
+    {
+      std::vector<m2::DisplayImagePixelType> maxT(threads, std::numeric_limits<m2::DisplayImagePixelType>::lowest());
+      m2::Process::Map(stackN,
+                       threads,
+                       [&](unsigned int t, unsigned int a, unsigned int b)
+                       { maxT[t] = *std::max_element(target + a, target + b); });
+      const auto max = *std::max_element(std::begin(maxT), std::end(maxT));
+      m2::Process::Map(stackN,
+                       threads,
+                       [&](unsigned int, unsigned int a, unsigned int b)
+                       { std::transform(target + a, target + b, target + a, [max](auto v) { return v / max; }); });
     }
   }
 
-  void SpectrumImageStack::GetImage(double center, double tol, const mitk::Image * /*mask*/, mitk::Image *img) const
+  size_t SpectrumImageStack::GetIonImageCacheState() const
   {
-    mitk::ProgressBar::GetInstance()->AddStepsToDo(m_SliceTransformers.size());
-    int sliceId = 0;
-    for (auto &transformer : m_SliceTransformers)
+    // slices are processed with their own parameters and masks
+    size_t seed = 0;
+    m2::HashCombine(seed, m_UseSliceWiseMaximumNormalization);
+    m2::HashCombine(seed, m_UseWarpTables);
+    for (const auto &transformer : m_SliceTransformers)
     {
-      mitk::ProgressBar::GetInstance()->Progress();
-      
-      
+      m2::HashCombine(seed, static_cast<const void *>(transformer.get()));
+      if (!transformer)
+        continue;
       if (auto spectrumImage = dynamic_cast<m2::SpectrumImage *>(transformer->GetMovingImage().GetPointer()))
-      {
-        // create temp image and copy requested image range to the stack
-        auto imageTemp = mitk::Image::New();
-        imageTemp->Initialize(spectrumImage);
-        spectrumImage->GetImage(center, tol, spectrumImage->GetMaskImage(), imageTemp);
-        if (!transformer->GetTransformation().empty())
-        {
-          imageTemp = transformer->WarpImage(imageTemp);
-          CopyWarpedImageToStackImage(imageTemp, img, sliceId);
-        }
-        else
-        {
-          CopyWarpedImageToStackImage(imageTemp, img, sliceId);
-        }
-      }
-      ++sliceId;
+        m2::HashCombine(seed, spectrumImage->GetIonImageCacheKey(0, 0, spectrumImage->GetMaskImage()).Hash());
+    }
+    return seed;
+  }
+
+  void SpectrumImageStack::GetImage(double center,
+                                    double tol,
+                                    const mitk::Image * /*mask*/,
+                                    mitk::Image *img,
+                                    const m2::IonImageOptions &options) const
+  {
+    // slices are warped, the region can only be applied slice-wise
+    std::vector<unsigned int> sliceIds;
+    for (unsigned int sliceId = 0; sliceId < m_SliceTransformers.size(); ++sliceId)
+      if (!options.UseRegion || (long(sliceId) >= options.Region.GetIndex(2) &&
+                                 long(sliceId) < options.Region.GetIndex(2) + long(options.Region.GetSize(2))))
+        sliceIds.push_back(sliceId);
+
+    mitk::ProgressBar::GetInstance()->AddStepsToDo(m_SliceTransformers.size());
+    if (sliceIds.empty())
+    {
+      mitk::ProgressBar::GetInstance()->Progress(m_SliceTransformers.size());
+      return;
     }
 
-    // current->GetImage(mz, tol, current->GetMaskImage(), current);
+    if (img->GetDimensions()[2] < m_SliceTransformers.size())
+      mitkThrow() << "Stack index is invalid! Z dim is " << img->GetDimensions()[2];
 
-    // auto warped = Transform(
-    //   current, transformations, [this](auto trafo) { ReplaceParameter(trafo, "ResultImagePixelType", "\"double\"");
-    //   });
+    // the thread budget is shared by concurrent slices, each slice gets an equal share for its own ion image
+    const unsigned int budget = options.GetThreads(GetNumberOfThreads());
+    const unsigned int concurrentSlices = std::min<std::size_t>(budget, sliceIds.size());
+    const unsigned int sliceThreads = std::max(1u, budget / concurrentSlices);
 
-    // auto warpedIndexImage = TransformImageUsingNNInterpolation(i);
-    // CopyWarpedImageToStack<IndexImagePixelType>(warpedIndexImage, GetIndexImage(), i);
+    mitk::ImageWriteAccessor stackAccess(img);
+    auto stackData = static_cast<m2::DisplayImagePixelType *>(stackAccess.GetData());
+    const unsigned int stackN = img->GetDimensions()[0] * img->GetDimensions()[1];
+
+    // exceptions must not leave the worker threads
+    std::vector<std::string> errors(sliceIds.size());
+    std::atomic<unsigned int> next{0};
+    m2::Process::Map(concurrentSlices,
+                     concurrentSlices,
+                     [&](unsigned int, unsigned int, unsigned int)
+                     {
+                       for (unsigned int k = next++; k < sliceIds.size() && !options.IsCancelled(); k = next++)
+                       {
+                         const auto sliceId = sliceIds[k];
+                         const auto &transformer = m_SliceTransformers[sliceId];
+                         try
+                         {
+                           auto spectrumImage =
+                             dynamic_cast<m2::SpectrumImage *>(transformer->GetMovingImage().GetPointer());
+                           if (!spectrumImage)
+                             continue;
+
+                           // create temp image and copy requested image range to the stack
+                           auto imageTemp = mitk::Image::New();
+                           imageTemp->Initialize(spectrumImage);
+                           m2::IonImageOptions sliceOptions;
+                           sliceOptions.Cancelled = options.Cancelled;
+                           sliceOptions.Threads = sliceThreads;
+                           spectrumImage->GetImage(center, tol, spectrumImage->GetMaskImage(), imageTemp, sliceOptions);
+                           if (sliceOptions.IsCancelled())
+                             continue;
+                           if (!transformer->GetTransformation().empty())
+                           {
+                             if (m_UseWarpTables)
+                             {
+                               ApplyWarpTable(
+                                 *GetWarpTable(sliceId), imageTemp, stackData, stackN, sliceId, sliceThreads);
+                               continue;
+                             }
+                             imageTemp = transformer->WarpImage(imageTemp);
+                           }
+                           CopyWarpedImageToStackData(imageTemp, stackData, stackN, sliceId, sliceThreads);
+                         }
+                         catch (std::exception &e)
+                         {
+                           errors[k] = e.what();
+                         }
+                       }
+                     });
+
+    // the progress bar is updated from this thread only
+    mitk::ProgressBar::GetInstance()->Progress(m_SliceTransformers.size());
+
+    for (unsigned int k = 0; k < sliceIds.size(); ++k)
+      if (!errors[k].empty())
+        mitkThrow() << "Slice " << sliceIds[k] << ": " << errors[k];
   }
 
 } // namespace m2
@@ -0,0 +1,223 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <m2SpectrumReadScheduler.h>
+#include <mitkExceptionMacro.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+m2::SpectrumReadScheduler::SpectrumReadScheduler(std::string path) : m_Path(std::move(path)) {}
+
+void m2::SpectrumReadScheduler::Add(OffsetType offset, LengthType length, unsigned int id)
+{
+  m_Requests.push_back({offset, length, id});
+}
+
+std::vector<m2::SpectrumReadScheduler::Block> m2::SpectrumReadScheduler::CreateBlocks(unsigned int threads)
+{
+  std::stable_sort(m_Requests.begin(),
+                   m_Requests.end(),
+                   [](const Request &a, const Request &b) { return a.offset < b.offset; });
+
+  // a few blocks per thread, so that the work is balanced even for small files
+  const size_t blocksPerThread = 4;
+  const size_t maximumRequests = std::max<size_t>(
+    1, (m_Requests.size() + threads * blocksPerThread - 1) / (threads * blocksPerThread));
+
+  std::vector<Block> blocks;
+  for (size_t i = 0; i < m_Requests.size(); ++i)
+  {
+    const auto &r = m_Requests[i];
+    if (!blocks.empty())
+    {
+      auto &b = blocks.back();
+      const auto blockEnd = b.offset + b.length;
+      const auto requestEnd = r.offset + r.length;
+      const auto mergedLength = std::max(blockEnd, requestEnd) - b.offset;
+      const auto requested = b.requested + r.length;
+      const auto gap = r.offset > blockEnd ? r.offset - blockEnd : 0;
+      // skipped bytes of the merged block must not exceed its requested bytes
+      const auto skipped = mergedLength > requested ? mergedLength - requested : 0;
+      if (gap <= m_MaximumGap && skipped <= requested && mergedLength <= m_MaximumBlockSize &&
+          b.last - b.first < maximumRequests)
+      {
+        b.length = mergedLength;
+        b.requested = requested;
+        b.last = i + 1;
+        continue;
+      }
+    }
+    blocks.push_back({r.offset, r.length, r.length, i, i + 1});
+  }
+  return blocks;
+}
+
+void m2::SpectrumReadScheduler::Run(unsigned int threads, const WorkerType &worker)
+{
+  if (threads < 1)
+    mitkThrow() << "The number of threads is < 1!";
+
+  m_NumberOfBlocks = 0;
+  m_NumberOfBytesRead = 0;
+  if (m_Requests.empty())
+    return;
+
+  const auto blocks = CreateBlocks(threads);
+  m_NumberOfBlocks = blocks.size();
+  LengthType plannedBytes = 0;
+  for (const auto &b : blocks)
+    plannedBytes += b.length;
+
+  unsigned int readers = m_NumberOfReaders;
+  if (readers == 0)
+  {
+    const LengthType smallBlockSize = 1024 * 1024;
+    readers = plannedBytes / blocks.size() < smallBlockSize ? threads : 1;
+  }
+  readers = std::max(1u, std::min<unsigned int>(readers, blocks.size()));
+  const unsigned int queueDepth = std::max(readers, m_QueueDepth);
+
+  struct Buffer
+  {
+    size_t block;
+    std::vector<char> data;
+  };
+
+  std::mutex mutex;
+  std::condition_variable readyCondition, spaceCondition;
+  std::deque<Buffer> ready;
+  std::vector<std::vector<char>> unused;
+  std::atomic<size_t> nextBlock(0);
+  unsigned int activeReaders = readers;
+  bool abort = false;
+  std::exception_ptr error;
+
+  const auto fail = [&](std::exception_ptr e)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = e;
+    abort = true;
+    readyCondition.notify_all();
+    spaceCondition.notify_all();
+  };
+
+  const auto reader = [&]()
+  {
+    try
+    {
+      std::ifstream f(m_Path, std::ios::binary);
+      if (!f)
+        mitkThrow() << "Can not open binary data file " << m_Path;
+
+      for (size_t k = nextBlock++; k < blocks.size(); k = nextBlock++)
+      {
+        std::vector<char> data;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          spaceCondition.wait(lock, [&] { return abort || ready.size() < queueDepth; });
+          if (abort)
+            break;
+          if (m_Cancelled && m_Cancelled())
+          {
+            abort = true;
+            readyCondition.notify_all();
+            spaceCondition.notify_all();
+            break;
+          }
+          if (!unused.empty())
+          {
+            data = std::move(unused.back());
+            unused.pop_back();
+          }
+        }
+
+        const auto &block = blocks[k];
+        data.resize(block.length);
+        f.seekg(block.offset);
+        f.read(data.data(), block.length);
+        if (static_cast<LengthType>(f.gcount()) != block.length)
+          mitkThrow() << "Unexpected end of binary data file " << m_Path << " at offset " << block.offset;
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          m_NumberOfBytesRead += block.length;
+          ready.push_back({k, std::move(data)});
+        }
+        readyCondition.notify_one();
+      }
+    }
+    catch (...)
+    {
+      fail(std::current_exception());
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    --activeReaders;
+    readyCondition.notify_all();
+  };
+
+  const auto processor = [&](unsigned int t)
+  {
+    try
+    {
+      while (true)
+      {
+        Buffer buffer;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          readyCondition.wait(lock, [&] { return abort || !ready.empty() || activeReaders == 0; });
+          if (abort || ready.empty())
+            break;
+          buffer = std::move(ready.front());
+          ready.pop_front();
+        }
+        spaceCondition.notify_one();
+
+        const auto &block = blocks[buffer.block];
+        for (size_t i = block.first; i < block.last; ++i)
+        {
+          const auto &r = m_Requests[i];
+          worker(t, r.id, buffer.data.data() + (r.offset - block.offset));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        unused.push_back(std::move(buffer.data));
+      }
+    }
+    catch (...)
+    {
+      fail(std::current_exception());
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (unsigned int r = 0; r < readers; ++r)
+    pool.emplace_back(reader);
+  for (unsigned int t = 0; t < threads; ++t)
+    pool.emplace_back(processor, t);
+  for (auto &t : pool)
+    t.join();
+
+  if (error)
+    std::rethrow_exception(error);
+}
@@ -0,0 +1,353 @@
+/*===================================================================
+
+MSI applications for interactive analysis in MITK (M2aia)
+
+Copyright (c) Jonas Cordes
+All rights reserved.
+
+This software is distributed WITHOUT ANY WARRANTY; without
+even the implied warranty of MERCHANTABILITY or FITNESS FOR
+A PARTICULAR PURPOSE.
+
+See LICENSE.txt for details.
+
+===================================================================*/
+
+#include <Poco/TemporaryFile.h>
+#include <cmath>
+#include <fstream>
+#include <m2Process.hpp>
+#include <mitkExceptionMacro.h>
+#include <queue>
+#include <signal/m2ToleranceBinning.h>
+
+namespace
+{
+  using m2::Signal::PeakTuple;
+
+  // m/z, then pixel and intensity for a deterministic order of equal m/z values
+  bool Less(const PeakTuple &a, const PeakTuple &b)
+  {
+    if (a.mz != b.mz)
+      return a.mz < b.mz;
+    if (a.pixel != b.pixel)
+      return a.pixel < b.pixel;
+    return a.intensity < b.intensity;
+  }
+
+  /**
+   * Consumes tuples in m/z order. Gaps larger than the tolerance close a cluster, which is
+   * refined and written as bins.
+   */
+  class Sweep
+  {
+  public:
+    Sweep(double tolerance, bool absoluteDistance, std::vector<m2::Interval> &bins, std::vector<unsigned int> *counts)
+      : m_Tolerance(tolerance), m_AbsoluteDistance(absoluteDistance), m_Bins(bins), m_Counts(counts)
+    {
+    }
+
+    bool IsBreak(double previous, double next) const
+    {
+      return next - previous > (m_AbsoluteDistance ? m_Tolerance : previous * m_Tolerance);
+    }
+
+    void Push(const PeakTuple &t)
+    {
+      if (!m_Cluster.empty() && IsBreak(m_Cluster.back().mz, t.mz))
+        Flush();
+      m_Cluster.push_back(t);
+    }
+
+    void Flush()
+    {
+      Refine(m_Cluster.data(), m_Cluster.data() + m_Cluster.size());
+      m_Cluster.clear();
+    }
+
+    // same rule as m2::Signal::toleranceBasedBinning
+    void Refine(const PeakTuple *s, const PeakTuple *e)
+    {
+      std::vector<std::pair<const PeakTuple *, const PeakTuple *>> ranges{{s, e}};
+      while (!ranges.empty())
+      {
+        const auto [first, last] = ranges.back();
+        ranges.pop_back();
+        if (first == last)
+          continue;
+
+        double sum = 0;
+        for (auto t = first; t != last; ++t)
+          sum += t->mz;
+        const double meanX = sum / double(last - first);
+        const double limit = m_AbsoluteDistance ? m_Tolerance : meanX * m_Tolerance;
+        const bool dirty =
+          std::any_of(first, last, [&](const PeakTuple &t) { return std::abs(t.mz - meanX) >= limit; });
+
+        if (dirty && last - first >= 2)
+        {
+          auto pivot = first + 1;
+          double max = 0;
+          for (auto t = first + 1; t != last; ++t)
+          {
+            if (t->mz - (t - 1)->mz > max)
+            {
+              max = t->mz - (t - 1)->mz;
+              pivot = t;
+            }
+          }
+          ranges.emplace_back(pivot, last);
+          ranges.emplace_back(first, pivot);
+          continue;
+        }
+
+        m2::Interval bin;
+        for (auto t = first; t != last; ++t)
+        {
+          bin.x(t->mz);
+          bin.y(t->intensity);
+        }
+        m_Bins.push_back(bin);
+
+        if (m_Counts)
+        {
+          m_Pixels.clear();
+          for (auto t = first; t != last; ++t)
+            m_Pixels.push_back(t->pixel);
+          std::sort(std::begin(m_Pixels), std::end(m_Pixels));
+          m_Counts->push_back(std::distance(std::begin(m_Pixels), std::unique(std::begin(m_Pixels), std::end(m_Pixels))));
+        }
+      }
+    }
+
+  private:
+    double m_Tolerance;
+    bool m_AbsoluteDistance;
+    std::vector<m2::Interval> &m_Bins;
+    std::vector<unsigned int> *m_Counts;
+    std::vector<PeakTuple> m_Cluster;
+    std::vector<unsigned int> m_Pixels;
+  };
+
+  /// Buffered sequential reader of a sorted run.
+  class RunReader
+  {
+  public:
+    explicit RunReader(const std::string &path) : m_File(path, std::ios::binary), m_Buffer(1 << 16)
+    {
+      if (!m_File)
+        mitkThrow() << "Could not open " << path << ".";
+    }
+
+    bool Next(PeakTuple &t)
+    {
+      if (m_Pos == m_Count)
+      {
+        m_File.read(reinterpret_cast<char *>(m_Buffer.data()), m_Buffer.size() * sizeof(PeakTuple));
+        m_Count = m_File.gcount() / sizeof(PeakTuple);
+        m_Pos = 0;
+        if (m_Count == 0)
+          return false;
+      }
+      t = m_Buffer[m_Pos++];
+      return true;
+    }
+
+  private:
+    std::ifstream m_File;
+    std::vector<PeakTuple> m_Buffer;
+    size_t m_Pos = 0;
+    size_t m_Count = 0;
+  };
+} // namespace
+
+m2::Signal::ToleranceBinning::ToleranceBinning(double tolerance, bool absoluteDistance, unsigned int threads)
+  : m_Tolerance(tolerance), m_AbsoluteDistance(absoluteDistance), m_Threads(std::max(threads, 1u))
+{
+}
+
+m2::Signal::ToleranceBinning::~ToleranceBinning() = default;
+
+void m2::Signal::ToleranceBinning::SetMemoryLimit(size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_MemoryLimit = bytes;
+}
+
+size_t m2::Signal::ToleranceBinning::GetMemoryLimit() const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_MemoryLimit;
+}
+
+void m2::Signal::ToleranceBinning::Add(std::vector<PeakTuple> &&tuples)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  m_NumberOfTuples += tuples.size();
+  if (m_Tuples.empty())
+    m_Tuples = std::move(tuples);
+  else
+    m_Tuples.insert(std::end(m_Tuples), std::begin(tuples), std::end(tuples));
+
+  if (m_MemoryLimit > 0 && m_Tuples.size() * sizeof(PeakTuple) > m_MemoryLimit)
+    Spill();
+}
+
+size_t m2::Signal::ToleranceBinning::GetNumberOfTuples() const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_NumberOfTuples;
+}
+
+size_t m2::Signal::ToleranceBinning::GetNumberOfRuns() const
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  return m_Runs.size();
+}
+
+void m2::Signal::ToleranceBinning::Spill()
+{
+  if (m_Tuples.empty())
+    return;
+  Sort(m_Tuples, m_Threads);
+
+  auto file = std::make_shared<Poco::TemporaryFile>();
+  std::ofstream f(file->path(), std::ios::binary);
+  f.write(reinterpret_cast<const char *>(m_Tuples.data()), m_Tuples.size() * sizeof(PeakTuple));
+  if (!f)
+    mitkThrow() << "Writing " << file->path() << " failed.";
+
+  m_Runs.push_back(file);
+  m_Tuples.clear();
+  m_Tuples.shrink_to_fit();
+}
+
+std::vector<m2::Interval> m2::Signal::ToleranceBinning::Run(std::vector<unsigned int> *pixelCounts)
+{
+  std::lock_guard<std::mutex> lock(m_Mutex);
+  std::vector<m2::Interval> bins;
+  if (pixelCounts)
+    pixelCounts->clear();
+
+  if (m_Runs.empty())
+  {
+    Sort(m_Tuples, m_Threads);
+    const size_t n = m_Tuples.size();
+
+    // chunks start at cluster breaks, so they can be swept independently
+    const unsigned int chunks = n < (1 << 16) ? 1 : m_Threads;
+    Sweep probe(m_Tolerance, m_AbsoluteDistance, bins, nullptr);
+    std::vector<size_t> bounds{0};
+    for (unsigned int c = 1; c < chunks; ++c)
+    {
+      size_t b = std::max(bounds.back(), n * c / chunks);
+      while (b > 0 && b < n && !probe.IsBreak(m_Tuples[b - 1].mz, m_Tuples[b].mz))
+        ++b;
+      bounds.push_back(b);
+    }
+    bounds.push_back(n);
+
+    std::vector<std::vector<m2::Interval>> chunkBins(chunks);
+    std::vector<std::vector<unsigned int>> chunkCounts(chunks);
+    m2::Process::Map(chunks,
+                     chunks,
+                     [&](unsigned int, unsigned int c, unsigned int)
+                     {
+                       Sweep sweep(m_Tolerance, m_AbsoluteDistance, chunkBins[c], pixelCounts ? &chunkCounts[c] : nullptr);
+                       for (size_t i = bounds[c]; i < bounds[c + 1]; ++i)
+                         sweep.Push(m_Tuples[i]);
+                       sweep.Flush();
+                     });
+
+    for (unsigned int c = 0; c < chunks; ++c)
+    {
+      std::move(std::begin(chunkBins[c]), std::end(chunkBins[c]), std::back_inserter(bins));
+      if (pixelCounts)
+        pixelCounts->insert(std::end(*pixelCounts), std::begin(chunkCounts[c]), std::end(chunkCounts[c]));
+    }
+  }
+  else
+  {
+    // k-way merge of the sorted runs
+    Spill();
+    std::vector<std::unique_ptr<RunReader>> readers;
+    for (const auto &run : m_Runs)
+      readers.emplace_back(new RunReader(run->path()));
+
+    using HeadType = std::pair<PeakTuple, size_t>;
+    const auto greater = [](const HeadType &a, const HeadType &b) { return Less(b.first, a.first); };
+    std::priority_queue<HeadType, std::vector<HeadType>, decltype(greater)> heads(greater);
+    PeakTuple t;
+    for (size_t r = 0; r < readers.size(); ++r)
+      if (readers[r]->Next(t))
+        heads.emplace(t, r);
+
+    Sweep sweep(m_Tolerance, m_AbsoluteDistance, bins, pixelCounts);
+    while (!heads.empty())
+    {
+      const auto [head, r] = heads.top();
+      heads.pop();
+      sweep.Push(head);
+      if (readers[r]->Next(t))
+        heads.emplace(t, r);
+    }
+    sweep.Flush();
+  }
+
+  m_Tuples.clear();
+  m_Tuples.shrink_to_fit();
+  m_Runs.clear();
+  m_NumberOfTuples = 0;
+  return bins;
+}
+
+void m2::Signal::ToleranceBinning::Sort(std::vector<PeakTuple> &tuples, unsigned int threads)
+{
+  const size_t n = tuples.size();
+  const unsigned int chunks = std::min<size_t>(std::max(threads, 1u), n / (1 << 14));
+  if (chunks <= 1)
+  {
+    std::sort(std::begin(tuples), std::end(tuples), Less);
+    return;
+  }
+
+  std::vector<size_t> bounds(chunks + 1);
+  for (unsigned int c = 0; c <= chunks; ++c)
+    bounds[c] = n * c / chunks;
+
+  m2::Process::Map(chunks,
+                   chunks,
+                   [&](unsigned int, unsigned int c, unsigned int)
+                   {
+                     std::sort(std::begin(tuples) + bounds[c], std::begin(tuples) + bounds[c + 1], Less);
+                   });
+
+  // pairwise merges of neighbouring chunks, the merges of a round run in parallel
+  std::vector<PeakTuple> buffer(n);
+  auto *src = &tuples;
+  auto *dst = &buffer;
+  for (unsigned int width = 1; width < chunks; width *= 2)
+  {
+    const unsigned int pairs = (chunks + 2 * width - 1) / (2 * width);
+    m2::Process::Map(pairs,
+                     std::min(pairs, threads),
+                     [&](unsigned int, unsigned int first, unsigned int last)
+                     {
+                       for (unsigned int p = first; p < last; ++p)
+                       {
+                         const size_t l = bounds[p * 2 * width];
+                         const size_t m = bounds[std::min(p * 2 * width + width, chunks)];
+                         const size_t r = bounds[std::min(p * 2 * width + 2 * width, chunks)];
+                         std::merge(std::begin(*src) + l,
+                                    std::begin(*src) + m,
+                                    std::begin(*src) + m,
+                                    std::begin(*src) + r,
+                                    std::begin(*dst) + l,
+                                    Less);
+                       }
+                     });
+    std::swap(src, dst);
+  }
+  if (src != &tuples)
+    tuples.swap(buffer);
+}
@@ -55,6 +55,8 @@ void m2ImzMLExportView::CreateQtPartControl(QWidget *parent)
 
   m_Controls.cmbBxOutputDatatypeInt->addItem("Float", static_cast<unsigned>(m2::NumericType::Float));
   m_Controls.cmbBxOutputDatatypeInt->addItem("Double", static_cast<unsigned>(m2::NumericType::Double));
+  m_Controls.cmbBxOutputDatatypeInt->addItem("Int32", static_cast<unsigned>(m2::NumericType::Int32));
+  m_Controls.cmbBxOutputDatatypeInt->addItem("Int64", static_cast<unsigned>(m2::NumericType::Int64));
 
   m_Controls.cmbBxOutputDatatypeMz->addItem("Float", static_cast<unsigned>(m2::NumericType::Float));
   m_Controls.cmbBxOutputDatatypeMz->addItem("Double", static_cast<unsigned>(m2::NumericType::Double));
@@ -98,7 +100,14 @@ void m2ImzMLExportView::CreateQtPartControl(QWidget *parent)
                 io.SetSpectrumFormat(format);
                 io.SetOutputLocation(name.toStdString());
                 io.mitk::AbstractFileIOWriter::SetInput(node->GetData());
-                io.Write();
+                try
+                {
+                  io.Write();
+                }
+                catch (mitk::Exception &e)
+                {
+                  QMessageBox::warning(parent, "Export failed!", e.GetDescription());
+                }
               }
             }
           });
@@ -63,6 +63,9 @@ void m2BrowserPreferencesPage::CreateQtControl(QWidget* parent)
     m_Ui->useMinIntensity->setChecked(m_Preferences->GetBool("m2aia.view.spectrum.useMinIntensity", true));
 	m_Ui->showSamplingPoints->setChecked(m_Preferences->GetBool("m2aia.view.spectrum.showSamplingPoints", false));
 	m_Ui->minimalImagingArea->setChecked(m_Preferences->GetBool("m2aia.view.image.minimal_area", true));
+	m_Ui->visibleRegionOnly->setChecked(m_Preferences->GetBool("m2aia.view.image.visible_region_only", false));
+	m_Ui->progressiveIonImages->setChecked(m_Preferences->GetBool("m2aia.view.image.progressive", false));
+	m_Ui->prefetchIonImages->setChecked(m_Preferences->GetBool("m2aia.view.image.prefetch", true));
 
 	m_ElastixPath = m_Preferences->Get("m2aia.external.elastix", "");
 	if (!m_ElastixPath.empty())
@@ -90,6 +93,18 @@ void m2BrowserPreferencesPage::CreateQtControl(QWidget* parent)
 	connect(m_Ui->useMinIntensity, SIGNAL(toggled(bool)), this, SLOT(OnUseMinIntensity(bool)));
 	connect(m_Ui->minimalImagingArea, SIGNAL(toggled(bool)), this, SLOT(OnUseMinimalImagingArea(bool)));
 
+	connect(m_Ui->visibleRegionOnly, &QCheckBox::toggled, this, [this](bool v){
+		m_Preferences->PutBool("m2aia.view.image.visible_region_only", v);
+	});
+
+	connect(m_Ui->progressiveIonImages, &QCheckBox::toggled, this, [this](bool v){
+		m_Preferences->PutBool("m2aia.view.image.progressive", v);
+	});
+
+	connect(m_Ui->prefetchIonImages, &QCheckBox::toggled, this, [this](bool v){
+		m_Preferences->PutBool("m2aia.view.image.prefetch", v);
+	});
+
 	connect(m_Ui->showSamplingPoints, &QCheckBox::toggled, this, [this](bool v){
 		m_Ui->showSamplingPoints->setChecked(v);
 		m_Preferences->PutBool("m2aia.view.image.showSamplingPoints",v);
@@ -47,10 +47,22 @@ See LICENSE.txt for details.
 #include <mitkNodePredicateOr.h>
 #include <mitkNodePredicateProperty.h>
 #include <mitkImagePixelWriteAccessor.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <regex>
+#include <vtkCamera.h>
+#include <vtkCommand.h>
+#include <vtkRenderer.h>
 
 const std::string m2Data::VIEW_ID = "org.mitk.views.m2.data";
 
+m2Data::~m2Data()
+{
+  if (m_ObservedCamera)
+    m_ObservedCamera->RemoveObserver(m_CameraObserverTag);
+}
+
 void m2Data::CreateQtPartControl(QWidget *parent)
 {
   // create GUI widgets from the Qt Designer's .ui file
@@ -66,6 +78,17 @@ void m2Data::CreateQtPartControl(QWidget *parent)
   auto serviceRef = m2::UIUtils::Instance();
   connect(serviceRef, SIGNAL(UpdateImage(qreal, qreal)), this, SLOT(OnGenerateImageData(qreal, qreal)));
 
+  // prefetching must not compete with the displayed image
+  m_PrefetchPool.setMaxThreadCount(1);
+
+  // zooming and panning is finished if the camera was not modified for a while
+  m_VisibleRegionTimer.setSingleShot(true);
+  m_VisibleRegionTimer.setInterval(250);
+  connect(&m_VisibleRegionTimer,
+          &QTimer::timeout,
+          this,
+          [this] { OnGenerateImageData(m_Controls.spnBxMz->value(), FROM_GUI); });
+
   connect(m_Controls.btnCreateImage,
           &QAbstractButton::clicked,
           this,
@@ -464,26 +487,142 @@ void m2Data::OnIncreaseTolerance()
   OnGenerateImageData(m_Controls.spnBxMz->value(), FROM_GUI);
 }
 
+qreal m2Data::GetGuiTolerance(qreal xRangeCenter)
+{
+  auto xRangeTol = Controls()->spnBxTol->value();
+  bool isPpm = Controls()->rbtnTolPPM->isChecked();
+  return isPpm ? m2::PartPerMillionToFactor(xRangeTol) * xRangeCenter : xRangeTol;
+}
+
 void m2Data::OnCreateNextImage()
 {
   auto center = m_Controls.spnBxMz->value();
-  auto offset = m_Controls.spnBxTol->value();
-  if (m_Controls.rbtnTolPPM->isChecked())
-  {
-    offset = m2::PartPerMillionToFactor(offset) * center;
-  }
-  this->OnGenerateImageData(center + offset, FROM_GUI);
+  m_NeighbourRequest = true;
+  this->OnGenerateImageData(center + GetGuiTolerance(center), FROM_GUI);
+  m_NeighbourRequest = false;
 }
 
 void m2Data::OnCreatePrevImage()
 {
   auto center = m_Controls.spnBxMz->value();
-  auto offset = m_Controls.spnBxTol->value();
-  if (m_Controls.rbtnTolPPM->isChecked())
+  m_NeighbourRequest = true;
+  this->OnGenerateImageData(center - GetGuiTolerance(center), FROM_GUI);
+  m_NeighbourRequest = false;
+}
+
+void m2Data::PrefetchNeighbourImages(mitk::DataNode::Pointer node,
+                                     std::shared_ptr<ImageRequestState> state,
+                                     unsigned int generation)
+{
+  // only imzML images provide ion images without modifying the image (GetImageArray)
+  m2::ImzMLSpectrumImage::Pointer data = dynamic_cast<m2::ImzMLSpectrumImage *>(node->GetData());
+  if (!data)
+    return;
+
+  // the ranges OnCreateNextImage and OnCreatePrevImage will request
+  const auto center = m_Controls.spnBxMz->value();
+  std::vector<std::pair<double, double>> ranges;
+  std::vector<m2::IonImageCacheKey> keys;
+  for (auto mz : {center + GetGuiTolerance(center), center - GetGuiTolerance(center)})
   {
-    offset = m2::PartPerMillionToFactor(offset) * center;
+    auto key = data->GetIonImageCacheKey(mz, GetGuiTolerance(mz), nullptr);
+    if (data->GetIonImageCache().Contains(key))
+      continue;
+    ranges.emplace_back(mz, GetGuiTolerance(mz));
+    keys.push_back(key);
   }
-  this->OnGenerateImageData(center - offset, FROM_GUI);
+  if (ranges.empty())
+    return;
+
+  // a newer request cancels the prefetch, unless it asks for one of the neighbours
+  const auto cancelled = [state, generation]()
+  {
+    std::lock_guard<std::mutex> lock(state->prefetchMutex);
+    return state->generation != generation &&
+           (state->generation != generation + 1 || state->neighbourOf != generation);
+  };
+
+  // requests for a neighbour wait until the prefetch is finished
+  const auto finish = [state, generation]()
+  {
+    {
+      std::lock_guard<std::mutex> lock(state->prefetchMutex);
+      if (state->prefetchGeneration == generation)
+        state->prefetchGeneration = 0;
+    }
+    state->prefetchCondition.notify_all();
+  };
+  {
+    std::lock_guard<std::mutex> lock(state->prefetchMutex);
+    state->prefetchGeneration = generation;
+  }
+
+  // settings and normalization factors are taken on the GUI thread
+  const auto processing = std::make_shared<m2::SpectrumProcessingParameters>(data->GetProcessingParameters());
+
+  QtConcurrent::run(&m_PrefetchPool,
+                    [data, ranges, keys, processing, cancelled, finish, this]()
+                    {
+                      QThread::currentThread()->setPriority(QThread::LowPriority);
+                      const auto *dims = data->GetDimensions();
+                      const size_t pixels = size_t(dims[0]) * dims[1] * dims[2];
+                      auto buffer = std::make_shared<std::vector<m2::DisplayImagePixelType>>(ranges.size() * pixels);
+
+                      // one pass over the data for all neighbours; the progress callback aborts the pass
+                      struct Cancelled
+                      {
+                      };
+                      try
+                      {
+                        if (cancelled())
+                          throw Cancelled();
+                        data->GetImageArray(ranges,
+                                            nullptr,
+                                            buffer->data(),
+                                            *processing,
+                                            0,
+                                            [&cancelled](unsigned int)
+                                            {
+                                              if (cancelled())
+                                                throw Cancelled();
+                                            });
+                      }
+                      catch (Cancelled &)
+                      {
+                        finish();
+                        return;
+                      }
+                      catch (std::exception &e)
+                      {
+                        MITK_WARN << "Neighbouring ion images could not be prefetched: " << e.what();
+                        finish();
+                        return;
+                      }
+
+                      // the cache is updated on the GUI thread
+                      QMetaObject::invokeMethod(
+                        this,
+                        [data, ranges, keys, buffer, pixels, cancelled, finish]()
+                        {
+                          for (size_t k = 0; k < ranges.size() && !cancelled(); ++k)
+                          {
+                            // skipped if the processing settings changed in the meantime
+                            const auto &range = ranges[k];
+                            if (!(data->GetIonImageCacheKey(range.first, range.second, nullptr) == keys[k]))
+                              continue;
+                            auto geom = data->GetGeometry()->Clone();
+                            auto image = mitk::Image::New();
+                            image->Initialize(mitk::MakeScalarPixelType<m2::DisplayImagePixelType>(), *geom);
+                            {
+                              mitk::ImagePixelWriteAccessor<m2::DisplayImagePixelType, 3> access(image);
+                              std::copy_n(buffer->data() + k * pixels, pixels, access.GetData());
+                            }
+                            data->GetIonImageCache().Insert(keys[k], image);
+                          }
+                          finish();
+                        },
+                        Qt::QueuedConnection);
+                    });
 }
 
 void m2Data::ApplySettingsToNodes(m2::UIUtils::NodesVectorType::Pointer v)
@@ -525,11 +664,7 @@ void m2Data::OnGenerateImageData(mitk::DataNode::Pointer node,
 {
   // tol < 0 indicates "use gui tol"
   if (xRangeTol < 0)
-  {
-    xRangeTol = Controls()->spnBxTol->value();
-    bool isPpm = Controls()->rbtnTolPPM->isChecked();
-    xRangeTol = isPpm ? m2::PartPerMillionToFactor(xRangeTol) * xRangeCenter : xRangeTol;
-  }
+    xRangeTol = GetGuiTolerance(xRangeCenter);
 
   if (emitRangeChanged)
     emit m2::UIUtils::Instance()->RangeChanged(xRangeCenter, xRangeTol);
@@ -549,6 +684,40 @@ void m2Data::OnGenerateImageData(mitk::DataNode::Pointer node,
 
     mitk::Image::Pointer maskImage;
 
+    // only the visible part of the image is generated if zoomed in
+    m2::IonImageOptions options;
+    auto *preferences = mitk::CoreServices::GetPreferencesService()->GetSystemPreferences();
+    if (preferences->GetBool("m2aia.view.image.visible_region_only", false))
+    {
+      ObserveAxialCamera();
+      itk::ImageRegion<3> region;
+      if (GetVisibleRegion(data, region))
+        options.SetRegion(region);
+    }
+
+    // progressive generation: publish a coarse image first and refine it in further passes
+    std::vector<unsigned int> strides = {1};
+    if (preferences->GetBool("m2aia.view.image.progressive", false) &&
+        dynamic_cast<m2::ImzMLSpectrumImage *>(data.GetPointer()) && !m_InitializeNewNode)
+      strides = {8, 4, 2, 1};
+
+    // a newer request for the same node supersedes and cancels this one
+    auto &state = m_ImageRequests[node.GetPointer()];
+    if (!state)
+      state = std::make_shared<ImageRequestState>();
+    unsigned int generation, neighbourOf;
+    {
+      std::lock_guard<std::mutex> lock(state->prefetchMutex);
+      generation = ++state->generation;
+      neighbourOf = m_NeighbourRequest ? generation - 1 : 0;
+      state->neighbourOf = neighbourOf;
+    }
+    state->prefetchCondition.notify_all();
+    options.Cancelled = [state, generation]() { return state->generation != generation; };
+
+    // only complete images are cached, e.g. Next/Prev or a peak selection may recall them instantly
+    const bool cacheable = !options.IsRestricted();
+
     // The smartpointer will stay alive until all captured copies are relesed. Additional
     // all connected signals must be disconnected to make sure that the future is not kept
     // alive after the 'finished-callback' is processed.
@@ -557,8 +726,15 @@ void m2Data::OnGenerateImageData(mitk::DataNode::Pointer node,
     //*************** Worker Finished Callback ******************//
     // capture holds a copy of the smartpointer, so it will stay alive. Make the lambda mutable to
     // allow the manipulation of captured varaibles that are copied by '='.
-    const auto futureFinished = [future, node, this]() mutable
+    const auto futureFinished = [future, node, cacheable, state, generation, this]() mutable
     {
+      // only the latest request is applied to the node
+      if (state->generation != generation)
+      {
+        future->disconnect();
+        return;
+      }
+
       auto image = future->result();
       UpdateLevelWindow(node);
       UpdateSpectrumImageTable(node);
@@ -566,24 +742,74 @@ void m2Data::OnGenerateImageData(mitk::DataNode::Pointer node,
       node->SetProperty("m2aia.xs.selection.tolerance", image->GetProperty("m2aia.xs.selection.tolerance"));
       this->RequestRenderWindowUpdate();
       future->disconnect();
+
+      // compute the images Next/Prev will ask for while this one is displayed
+      auto *preferences = mitk::CoreServices::GetPreferencesService()->GetSystemPreferences();
+      if (cacheable && preferences->GetBool("m2aia.view.image.prefetch", true))
+        PrefetchNeighbourImages(node, state, generation);
     };
 
     //*************** Worker Block******************//
-    const auto futureWorker = [xRangeCenter, xRangeTol, data, maskImage, this]()
+    const auto futureWorker =
+      [xRangeCenter, xRangeTol, data, maskImage, options, cacheable, strides, state, neighbourOf, node, this]()
     {
       // m2::Timer t("Create image @[" + std::to_string(xRangeCenter) + " " + std::to_string(xRangeTol) + "]");
+      // the request for a neighbour that is being prefetched waits for it and hits the cache
+      if (neighbourOf && cacheable)
+      {
+        std::unique_lock<std::mutex> lock(state->prefetchMutex);
+        state->prefetchCondition.wait(lock,
+                                      [&]
+                                      {
+                                        return state->prefetchGeneration != neighbourOf ||
+                                               state->generation != neighbourOf + 1;
+                                      });
+      }
+
+      // older requests writing into the same image abort at their next check
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (options.IsCancelled())
+        return mitk::Image::Pointer(data.GetPointer());
+
       if (m_InitializeNewNode)
       {
         auto geom = data->GetGeometry()->Clone();
         auto image = mitk::Image::New();
         image->Initialize(mitk::MakeScalarPixelType<m2::DisplayImagePixelType>(), *geom);
-        data->GetImage(xRangeCenter, xRangeTol, maskImage, image);
+        if (cacheable && data->GetImageFromCache(xRangeCenter, xRangeTol, maskImage, image))
+          return image;
+        data->GetImage(xRangeCenter, xRangeTol, maskImage, image, options);
+        if (cacheable && !options.IsCancelled())
+          data->InsertImageIntoCache(xRangeCenter, xRangeTol, maskImage, image);
         return image;
       }
       else
       {
-        data->GetImage(xRangeCenter, xRangeTol, maskImage, data);
         mitk::Image::Pointer imagePtr = data.GetPointer();
+        if (cacheable && data->GetImageFromCache(xRangeCenter, xRangeTol, maskImage, data))
+          return imagePtr;
+
+        for (unsigned int i = 0; i < strides.size() && !options.IsCancelled(); ++i)
+        {
+          auto passOptions = options;
+          passOptions.Stride = strides[i];
+          passOptions.PreviousStride = i ? strides[i - 1] : 0;
+          passOptions.FillNearest = true;
+          data->GetImage(xRangeCenter, xRangeTol, maskImage, data, passOptions);
+
+          // intermediate results are complete images, show them immediately
+          if (i + 1 < strides.size() && !options.IsCancelled())
+            QMetaObject::invokeMethod(
+              this,
+              [node, this]
+              {
+                UpdateLevelWindow(node);
+                this->RequestRenderWindowUpdate();
+              },
+              Qt::QueuedConnection);
+        }
+        if (cacheable && !options.IsCancelled())
+          data->InsertImageIntoCache(xRangeCenter, xRangeTol, maskImage, data);
         return imagePtr;
       }
     };
@@ -688,6 +914,90 @@ void m2Data::UpdateTextAnnotations(std::string text)
   }
 }
 
+bool m2Data::GetVisibleRegion(const mitk::Image *image, itk::ImageRegion<3> &region)
+{
+  auto renderWindowPart = GetRenderWindowPart();
+  if (!renderWindowPart)
+    return false;
+  auto renderWindow = renderWindowPart->GetQmitkRenderWindow("axial");
+  if (!renderWindow)
+    return false;
+
+  auto renderer = renderWindow->GetRenderer();
+  const auto *displaySize = renderer->GetSize();
+  const auto *geometry = image->GetGeometry();
+  const auto *dims = image->GetDimensions();
+
+  // project the display corners into the index space of the image
+  std::array<double, 2> lower = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+  std::array<double, 2> upper = {std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+  for (int x : {0, displaySize[0]})
+  {
+    for (int y : {0, displaySize[1]})
+    {
+      mitk::Point2D displayPoint;
+      displayPoint[0] = x;
+      displayPoint[1] = y;
+      mitk::Point3D world, index;
+      renderer->DisplayToWorld(displayPoint, world);
+      geometry->WorldToIndex(world, index);
+      for (unsigned int i = 0; i < 2; ++i)
+      {
+        lower[i] = std::min(lower[i], index[i]);
+        upper[i] = std::max(upper[i], index[i]);
+      }
+    }
+  }
+
+  itk::Index<3> start;
+  itk::Size<3> size;
+  for (unsigned int i = 0; i < 2; ++i)
+  {
+    // pixel k covers the continuous index range [k-0.5, k+0.5)
+    const long a = std::max(0l, long(std::floor(lower[i] + 0.5)));
+    const long b = std::min(long(dims[i]) - 1, long(std::floor(upper[i] + 0.5)));
+    if (b < a)
+      return false;
+    start[i] = a;
+    size[i] = b - a + 1;
+  }
+  start[2] = 0;
+  size[2] = dims[2];
+
+  if (size[0] == dims[0] && size[1] == dims[1])
+    return false;
+
+  region.SetIndex(start);
+  region.SetSize(size);
+  return true;
+}
+
+void m2Data::ObserveAxialCamera()
+{
+  auto renderWindowPart = GetRenderWindowPart();
+  if (!renderWindowPart)
+    return;
+  auto renderWindow = renderWindowPart->GetQmitkRenderWindow("axial");
+  if (!renderWindow)
+    return;
+
+  auto camera = renderWindow->GetRenderer()->GetVtkRenderer()->GetActiveCamera();
+  if (camera == m_ObservedCamera)
+    return;
+
+  if (m_ObservedCamera)
+    m_ObservedCamera->RemoveObserver(m_CameraObserverTag);
+  m_ObservedCamera = camera;
+  m_CameraObserverTag = camera->AddObserver(vtkCommand::ModifiedEvent, this, &m2Data::OnAxialCameraModified);
+}
+
+void m2Data::OnAxialCameraModified()
+{
+  auto *preferences = mitk::CoreServices::GetPreferencesService()->GetSystemPreferences();
+  if (preferences->GetBool("m2aia.view.image.visible_region_only", false))
+    m_VisibleRegionTimer.start();
+}
+
 mitk::DataNode::Pointer m2Data::FindChildNodeRegex(mitk::DataNode::Pointer &parent, std::string regexString)
 {
   auto deriv = this->GetDataStorage()->GetDerivations(parent.GetPointer(), nullptr, true);
@@ -1011,6 +1321,7 @@ void m2Data::SpectrumImageNodeAdded(const mitk::DataNode *node)
 
 void m2Data::NodeRemoved(const mitk::DataNode *node)
 {
+  m_ImageRequests.erase(node);
   if (dynamic_cast<m2::SpectrumImage *>(node->GetData()))
   {
     auto derivations = this->GetDataStorage()->GetDerivations(node);
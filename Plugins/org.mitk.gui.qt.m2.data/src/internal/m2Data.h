@@ -25,6 +25,14 @@ See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
 #include <m2UIUtils.h>
 
 #include <QThreadPool>
+#include <QTimer>
+#include <m2IonImageOptions.h>
+#include <vtkSmartPointer.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 
 /**
   \brief DataView
@@ -41,6 +49,7 @@ namespace m2
 }
 
 class QmitkMultiNodeSelectionWidget;
+class vtkCamera;
 
 class m2Data : public QmitkAbstractView
 {
@@ -50,6 +59,8 @@ class m2Data : public QmitkAbstractView
 
 public:
   static const std::string VIEW_ID;
+
+  ~m2Data() override;
   
 
   /**
@@ -141,6 +152,25 @@ protected:
   bool m_InitializeNewNode = false;
 
   QThreadPool m_pool;
+  QThreadPool m_PrefetchPool;
+
+  /// @brief Set while OnCreateNextImage or OnCreatePrevImage issue their request.
+  bool m_NeighbourRequest = false;
+
+  /// @brief Tolerance of the GUI for the given center (converts ppm if selected).
+  qreal GetGuiTolerance(qreal xRangeCenter);
+
+  /**
+   * @brief Generate the ion images of the next and the previous range in the background
+   * and store them in the ion image cache. The images are computed without modifying the
+   * node or its data and are inserted into the cache on the GUI thread. Cancelled if
+   * another request for the node was started in the meantime, unless it asks for one of
+   * the neighbours.
+   */
+  struct ImageRequestState;
+  void PrefetchNeighbourImages(mitk::DataNode::Pointer node,
+                               std::shared_ptr<ImageRequestState> state,
+                               unsigned int generation);
   m2::SpectrumType m_CurrentOverviewSpectrumType = m2::SpectrumType::Maximum;
 
   // m2::IonImageReference::Pointer m_IonImageReference;
@@ -156,6 +186,41 @@ protected:
   std::vector<mitk::ColorBarAnnotation::Pointer> m_ColorBarAnnotations;
   void UpdateTextAnnotations(std::string text);
 
+  /**
+   * @brief Index region of the image that is visible in the axial render window.
+   * @return False if the whole image is visible or if no render window is available.
+   */
+  bool GetVisibleRegion(const mitk::Image *image, itk::ImageRegion<3> &region);
+
+  /**
+   * @brief Regenerate the ion images after the axial view was zoomed or moved, if
+   * the preference "m2aia.view.image.visible_region_only" is enabled.
+   */
+  void ObserveAxialCamera();
+  void OnAxialCameraModified();
+  QTimer m_VisibleRegionTimer;
+  vtkSmartPointer<vtkCamera> m_ObservedCamera;
+  unsigned long m_CameraObserverTag = 0;
+
+  /**
+   * @brief Ion image requests of a node. Each request increments the generation, which
+   * cancels all older requests. The mutex serializes the workers writing into the image.
+   */
+  struct ImageRequestState
+  {
+    std::atomic<unsigned int> generation{0};
+    std::mutex mutex;
+
+    /// @brief Guards the prefetch bookkeeping below, it is never held while images are generated.
+    std::mutex prefetchMutex;
+    std::condition_variable prefetchCondition;
+    /// @brief Generation whose neighbours are prefetched, 0 if none.
+    unsigned int prefetchGeneration = 0;
+    /// @brief Generation whose neighbour (Next/Prev) the latest request asks for, 0 if none.
+    unsigned int neighbourOf = 0;
+  };
+  std::map<const mitk::DataNode *, std::shared_ptr<ImageRequestState>> m_ImageRequests;
+
   const int FROM_GUI = -1;
 
   mitk::IPreferences * m_M2aiaPreferences;
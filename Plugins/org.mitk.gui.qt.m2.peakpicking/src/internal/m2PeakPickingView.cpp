@@ -39,6 +39,7 @@ See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
 #include <signal/m2Binning.h>
 #include <signal/m2MedianAbsoluteDeviation.h>
 #include <signal/m2PeakDetection.h>
+#include <signal/m2ToleranceBinning.h>
 
 // itk
 #include <itkExtractImageFilter.h>
@@ -314,7 +315,9 @@ mitk::DataNode::Pointer m2PeakPickingView::CreatePeakList(const mitk::DataNode *
   return node;
 }
 
-std::vector<m2::Interval> m2PeakPickingView::PeakPicking(const std::vector<double> &xs, const std::vector<double> &ys)
+std::vector<m2::Interval> m2PeakPickingView::PeakPicking(const std::vector<double> &xs,
+                                                        const std::vector<double> &ys,
+                                                        unsigned int threads)
 {
   using namespace m2::Signal;
   const auto snr = m_Controls.sliderSNR->value();
@@ -322,6 +325,7 @@ std::vector<m2::Interval> m2PeakPickingView::PeakPicking(const std::vector<doubl
   const auto minCor = m_Controls.sliderCOR->value();
   const auto tol = m_Controls.sbTolerance->value();
   const auto dist = m_Controls.sbDistance->value();
+  const auto charge = m_Controls.sbCharge->value();
   const std::vector<unsigned int> sizes = {3, 4, 5, 6, 7, 8, 9, 10};
 
   std::vector<m2::Interval> peaks;
@@ -331,7 +335,7 @@ std::vector<m2::Interval> m2PeakPickingView::PeakPicking(const std::vector<doubl
   if (m_Controls.ckbMonoisotopic->isChecked())
     try
     {
-      peaks = monoisotopic(peaks, sizes, minCor, tol, dist);
+      peaks = monoisotopic(peaks, sizes, minCor, tol, dist, charge, threads);
     }
     catch (std::exception &e)
     {
@@ -445,8 +449,8 @@ void m2PeakPickingView::OnStartPeakPickingOverview()
     ys = sourceData->GetYMean();
     xs = sourceData->GetXMean();
 
-    targetData->GetIntervals() = PeakPicking(xs, ys);
     auto image = dynamic_cast<m2::SpectrumImage *>(parentNode->GetData());
+    targetData->GetIntervals() = PeakPicking(xs, ys, image->GetNumberOfThreads());
 
     targetData->SetProperty("spectrum.pixel.count", mitk::IntProperty::New(image->GetNumberOfValidPixels()));
     targetData->SetProperty("spectrum.xaxis.count", mitk::IntProperty::New(targetData->GetIntervals().size()));
@@ -464,18 +468,14 @@ void m2PeakPickingView::OnStartPeakPickingImage()
   if (auto image = dynamic_cast<m2::ImzMLSpectrumImage *>(imageNode->GetData()))
   {
     using namespace std;
-    auto N = image->GetXAxis().size();
-    vector<double> xs, ys, xsAll, ysAll;
-    vector<int> ssAll;
-    xsAll.reserve(N);
-    ysAll.reserve(N);
-    ssAll.reserve(N);
-    // idxAll.reserve(N);
-
-    auto xsAllIt = back_inserter(xsAll);
-    auto ysAllIt = back_inserter(ysAll);
-    auto ssAllIt = back_inserter(ssAll);
-    // auto idxAllIt = back_inserter(idxAll);z
+    vector<double> xs, ys, peakXs, peakYs;
+
+    // per-pixel peak lists are merged by a parallel sort and sweep over all peaks; the binning
+    // tolerance is relative (as in groupBinning), tuples are spilled to disk above 1 GB
+    m2::Signal::ToleranceBinning binning(
+      m_Controls.sbBinningTolerance->value(), false, image->GetNumberOfThreads());
+    binning.SetMemoryLimit(size_t(1) << 30);
+
     using MaskPixelAccessor = mitk::ImagePixelReadAccessor<mitk::LabelSetImage::PixelType,3>;
     std::unique_ptr<MaskPixelAccessor> maskAcc;
     if(auto maskNode = m_Controls.maskImageSelector->GetSelectedNode()){
@@ -498,42 +498,32 @@ void m2PeakPickingView::OnStartPeakPickingImage()
       {
         // Pick peaks
         auto peaks = PeakPicking(xs, ys);
+        peakXs.clear();
+        peakYs.clear();
         for_each(begin(peaks),
                  end(peaks),
                  [&](m2::Interval &i)
                  {
-                   xsAllIt = i.x.mean();
-                   ysAllIt = i.y.max();
+                   peakXs.push_back(i.x.mean());
+                   peakYs.push_back(i.y.max());
                  });
-        fill_n(ssAllIt, peaks.size(), i);
+        binning.Add(peakXs, peakYs, i);
       }
       else if (image->GetSpectrumType().Format == m2::SpectrumFormat::ProcessedCentroid)
       {
-        copy(begin(xs), end(xs), xsAllIt);
-        copy(begin(ys), end(ys), ysAllIt);
-        fill_n(ssAllIt, xs.size(), i);
+        binning.Add(xs, ys, i);
       }
  
     }
 
-    auto indices = m2::argsort(xsAll);
-    auto xsSorted = m2::argsortApply(xsAll, indices);
-    auto ysSorted = m2::argsortApply(ysAll, indices);
-    auto ssSorted = m2::argsortApply(ssAll, indices);
-    // idxSorted = m2::argsortApply(idxAll, indices);
-
-    using dIt = decltype(cbegin(xsAll));
-    using iIt = decltype(cbegin(ssAll));
-    auto Grouper = m2::Signal::grouperStrict<dIt, dIt, dIt, iIt>;
-    // auto Grouper = m2::Signal::grouperRelaxed<dIt, dIt, dIt, iIt>;
-    auto R = m2::Signal::groupBinning(xsSorted, ysSorted, ssSorted, Grouper, m_Controls.sbBinningTolerance->value());
-
+    // a bin is kept if it is found in more than the given percentage of pixels
+    std::vector<unsigned int> pixelCounts;
+    auto I = binning.Run(&pixelCounts);
     auto frequency = m_Controls.sbFilterPeaks->value() / double(100) * image->GetNumberOfValidPixels();
-    auto I = get<0>(R);
     decltype(I) newI;
-
-    copy_if(
-      begin(I), end(I), back_inserter(newI), [frequency](const m2::Interval &in) { return in.x.count() > frequency; });
+    for (size_t k = 0; k < I.size(); ++k)
+      if (pixelCounts[k] > frequency)
+        newI.push_back(I[k]);
 
     std::string targetNodeName = "Image Centeoids (" + imageNode->GetName() + ")";
     auto targetNode = GetDerivations(imageNode, targetNodeName);
@@ -64,7 +64,10 @@ protected:
   // PeakVectorType m_PeakList;
   QMetaObject::Connection m_Connection;
   mitk::DataNode::Pointer CreatePeakList(const mitk::DataNode *parent, std::string name);
-  std::vector<m2::Interval> PeakPicking(const std::vector<double> &xs, const std::vector<double> &ys);
+  /// Peak picking with the current UI settings. Threads are used by the monoisotopic peak search.
+  std::vector<m2::Interval> PeakPicking(const std::vector<double> &xs,
+                                        const std::vector<double> &ys,
+                                        unsigned int threads = 1);
 
   void SetGroupProcessProfileSpectraEnabled(bool v);
   void SetGroupProcessCentroidSpectraEnabled(bool v);
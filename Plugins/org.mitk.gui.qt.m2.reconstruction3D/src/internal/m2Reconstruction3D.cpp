@@ -22,8 +22,15 @@ See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
 // Qt
 #include <QMessageBox>
 
+// std
+#include <condition_variable>
+#include <deque>
+#include <string_view>
+#include <thread>
+
 // mitk
 #include <mitkNodePredicateDataType.h>
+#include <mitkImageReadAccessor.h>
 #include <mitkProgressBar.h>
 
 // m2aia
@@ -106,28 +113,67 @@ m2Reconstruction3D::DataTuple m2Reconstruction3D::GetImageDataById(unsigned int
   return m_referenceMap.at(referenceIndex);
 }
 
-std::shared_ptr<m2::ElxRegistrationHelper> m2Reconstruction3D::RegistrationStep(
-  unsigned int fixedId,
-  QListWidget *fixedSource,
-  std::shared_ptr<m2::ElxRegistrationHelper> fixedTransformer,
-  unsigned int movingId,
-  QListWidget *movingSource)
+namespace
 {
-  auto fixedData = GetImageDataById(fixedId, fixedSource);
-  auto movingData = GetImageDataById(movingId, movingSource);
-  auto fixedImage = fixedData.image;
+  void HashCombine(std::size_t &seed, std::size_t value)
+  {
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+  }
+
+  std::size_t HashImage(const mitk::Image *image)
+  {
+    std::size_t seed = 0;
+    std::size_t n = image->GetPixelType().GetSize();
+    for (unsigned int d = 0; d < image->GetDimension(); ++d)
+    {
+      n *= image->GetDimensions()[d];
+      HashCombine(seed, image->GetDimensions()[d]);
+    }
+    mitk::ImageReadAccessor access(image);
+    HashCombine(seed, std::hash<std::string_view>()(std::string_view(static_cast<const char *>(access.GetData()), n)));
+    return seed;
+  }
+
+  std::vector<unsigned int> GetDimensions(const mitk::Image *image)
+  {
+    return std::vector<unsigned int>(image->GetDimensions(), image->GetDimensions() + image->GetDimension());
+  }
+} // namespace
 
-  // check if a transformer exist for fixed image and apply
-  if (fixedTransformer && !fixedTransformer->GetTransformation().empty())
-    fixedImage = fixedTransformer->WarpImage(fixedImage);
+std::shared_ptr<m2::ElxRegistrationHelper> m2Reconstruction3D::RegistrationStep(
+  mitk::Image::Pointer fixedImage,
+  mitk::Image::Pointer movingImage,
+  const std::vector<std::string> &parameters)
+{
+  std::size_t key = 0;
+  HashCombine(key, HashImage(fixedImage));
+  HashCombine(key, HashImage(movingImage));
+  for (const auto &parameter : parameters)
+    HashCombine(key, std::hash<std::string>()(parameter));
 
-  std::vector<std::string> parameters = GetParameters();
+  RegistrationCacheEntry entry{parameters, GetDimensions(fixedImage), GetDimensions(movingImage), nullptr, 0};
+  {
+    std::lock_guard<std::mutex> lock(m_RegistrationCacheMutex);
+    auto it = m_RegistrationCache.find(key);
+    if (it != m_RegistrationCache.end() && it->second.parameters == entry.parameters &&
+        it->second.fixedDimensions == entry.fixedDimensions && it->second.movingDimensions == entry.movingDimensions)
+    {
+      it->second.run = m_RegistrationRun;
+      return std::make_shared<m2::ElxRegistrationHelper>(*it->second.result);
+    }
+  }
 
   // start of the registration procedure
   auto elxHelper = std::make_shared<m2::ElxRegistrationHelper>();
-  elxHelper->SetImageData(fixedImage, movingData.image);
+  elxHelper->SetImageData(fixedImage, movingImage);
   elxHelper->SetRegistrationParameters(parameters);
   elxHelper->GetRegistration();
+
+  // copied before the helper is handed out and used for warping
+  entry.result = std::make_shared<const m2::ElxRegistrationHelper>(*elxHelper);
+  std::lock_guard<std::mutex> lock(m_RegistrationCacheMutex);
+  entry.run = m_RegistrationRun;
+  m_RegistrationCache[key] = std::move(entry);
   return elxHelper;
 };
 
@@ -204,9 +250,6 @@ void m2Reconstruction3D::OnStartStacking()
    * M2-W1 order: 2-2 1-1 0-0 3-3 4-4 5-5 --> W2
    */
 
-  // prepare workbench
-  mitk::ProgressBar::GetInstance()->AddStepsToDo(numItems - 1);
-  
   const bool UseSubsequentOrdering = !m_Controls.chkBxCoRegistrationToSelected->isChecked();
   const auto currentRow = m_List1->currentRow() < 0 ? numItems / 2 : m_List1->currentRow();
 
@@ -217,46 +260,159 @@ void m2Reconstruction3D::OnStartStacking()
     elxHelper->SetImageData(M1.image, M1.image);
     elxHelper->SetRegistrationParameters({}); // identity
     spectrumImageStack1->Insert(currentRow, elxHelper);
-    mitk::ProgressBar::GetInstance()->Progress();
-  }
-
-  // Initialize stack 2
-  if(doMultiModalImageRegistration){
-    auto elxHelper = RegistrationStep(currentRow, m_List1, nullptr, currentRow, m_List2);
-    spectrumImageStack2->Insert(currentRow, elxHelper);
-    mitk::ProgressBar::GetInstance()->Progress();
   }
 
+  // Registrations of the stacks as jobs. A job depends on the job whose result warps its fixed
+  // image: with subsequent ordering on the previous slice of the same direction, for stack 2 on the
+  // stack 1 job of the same slice. Independent jobs run concurrently. The fixed image of a dependent
+  // job is the moving image of its dependency; it is warped once by the dependency itself, so that
+  // the transformer of a job is never used by two jobs at the same time.
+  struct Job
+  {
+    mitk::Image::Pointer fixed, moving;
+    int dependency; // -1: fixed image is not warped
+    int stack;
+    int sliceId;
+  };
+  std::vector<Job> jobs;
+  std::map<int, int> stack1Jobs; // slice id -> job
+
+  const auto AddJobs = [&](int movingId, int fixedId)
+  {
+    auto dependency = stack1Jobs.count(fixedId) ? stack1Jobs[fixedId] : -1;
+    jobs.push_back(
+      {GetImageDataById(fixedId, m_List1).image, GetImageDataById(movingId, m_List1).image, dependency, 1, movingId});
+    stack1Jobs[movingId] = jobs.size() - 1;
+
+    if (doMultiModalImageRegistration)
+      jobs.push_back({GetImageDataById(movingId, m_List1).image,
+                      GetImageDataById(movingId, m_List2).image,
+                      int(jobs.size() - 1),
+                      2,
+                      movingId});
+  };
+
+  if (doMultiModalImageRegistration)
+    jobs.push_back(
+      {GetImageDataById(currentRow, m_List1).image, GetImageDataById(currentRow, m_List2).image, -1, 2, currentRow});
   for (int movingId = currentRow - 1; movingId >= 0; --movingId)
+    AddJobs(movingId, UseSubsequentOrdering ? movingId + 1 : currentRow);
+  for (int movingId = currentRow + 1; movingId < numItems; ++movingId)
+    AddJobs(movingId, UseSubsequentOrdering ? movingId - 1 : currentRow);
+
+  // prepare workbench
+  mitk::ProgressBar::GetInstance()->AddStepsToDo(jobs.size() + 1);
+  mitk::ProgressBar::GetInstance()->Progress();
+
+  const auto parameters = GetParameters();
+  {
+    std::lock_guard<std::mutex> lock(m_RegistrationCacheMutex);
+    ++m_RegistrationRun;
+  }
+  std::vector<std::shared_ptr<m2::ElxRegistrationHelper>> results(jobs.size());
+  std::vector<mitk::Image::Pointer> warped(jobs.size());
+  std::vector<char> hasDependents(jobs.size(), 0);
+  for (const auto &job : jobs)
+    if (job.dependency >= 0)
+      hasDependents[job.dependency] = 1;
+  std::vector<std::string> errors(jobs.size());
+  std::vector<char> started(jobs.size(), 0), finished(jobs.size(), 0);
+  std::deque<int> completed;
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  const auto IsReady = [&](int j)
+  { return !started[j] && (jobs[j].dependency < 0 || finished[jobs[j].dependency]); };
+
+  const auto Worker = [&]()
   {
-    // stack 1
-    int fixedId = UseSubsequentOrdering ? movingId + 1 : currentRow;
-    auto fixedTransformer = spectrumImageStack1->GetSliceTransformers().at(fixedId);
-    auto elxHelper = RegistrationStep(fixedId, m_List1, fixedTransformer, movingId, m_List1);
-    spectrumImageStack1->Insert(movingId, elxHelper);
-
-    // stack 2
-    if(doMultiModalImageRegistration){
-      elxHelper = RegistrationStep(movingId, m_List1, elxHelper, movingId, m_List2);
-      spectrumImageStack2->Insert(movingId, elxHelper);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+      int j = -1;
+      cv.wait(lock,
+              [&]()
+              {
+                j = -1;
+                for (unsigned int k = 0; k < jobs.size() && j < 0; ++k)
+                  if (IsReady(k))
+                    j = k;
+                return j >= 0 || std::all_of(std::begin(started), std::end(started), [](char v) { return v; });
+              });
+      if (j < 0)
+        return;
+
+      started[j] = 1;
+      const auto dependency = jobs[j].dependency;
+      auto fixed = dependency < 0 ? jobs[j].fixed : warped[dependency];
+      lock.unlock();
+      std::shared_ptr<m2::ElxRegistrationHelper> result;
+      mitk::Image::Pointer warpedMoving;
+      std::string error;
+      try
+      {
+        if (!fixed)
+          error = "Registration of the fixed slice failed.";
+        else
+        {
+          result = RegistrationStep(fixed, jobs[j].moving, parameters);
+          // the fixed image of the dependent jobs
+          if (hasDependents[j])
+            warpedMoving = result->GetTransformation().empty() ? jobs[j].moving : result->WarpImage(jobs[j].moving);
+        }
+      }
+      catch (std::exception &e)
+      {
+        result = nullptr;
+        error = e.what();
+      }
+      lock.lock();
+      results[j] = result;
+      warped[j] = warpedMoving;
+      errors[j] = error;
+      finished[j] = 1;
+      completed.push_back(j);
+      cv.notify_all();
     }
+  };
+
+  const unsigned int numberOfJobs = std::min<std::size_t>(m_Controls.spinBoxJobs->value(), jobs.size());
+  std::vector<std::thread> threads;
+  for (unsigned int t = 0; t < numberOfJobs; ++t)
+    threads.emplace_back(Worker);
+
+  // progress is reported per registered pair from this thread
+  for (std::size_t done = 0; done < jobs.size(); ++done)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return !completed.empty(); });
+    const auto j = completed.front();
+    completed.pop_front();
+    lock.unlock();
+    MITK_INFO << "Registered slice " << jobs[j].sliceId << " of stack " << jobs[j].stack << " (" << done + 1 << "/"
+              << jobs.size() << ")" << (errors[j].empty() ? "" : " failed: " + errors[j]);
     mitk::ProgressBar::GetInstance()->Progress();
   }
+  for (auto &t : threads)
+    t.join();
 
-  for (int movingId = currentRow + 1; movingId < numItems; ++movingId)
+  // keep only the registrations of this run
+  {
+    std::lock_guard<std::mutex> lock(m_RegistrationCacheMutex);
+    for (auto it = m_RegistrationCache.begin(); it != m_RegistrationCache.end();)
+      it = it->second.run == m_RegistrationRun ? std::next(it) : m_RegistrationCache.erase(it);
+  }
+
+  for (unsigned int j = 0; j < jobs.size(); ++j)
   {
-    // stack 1
-    int fixedId = UseSubsequentOrdering ? movingId - 1 : currentRow;
-    auto fixedTransformer = spectrumImageStack1->GetSliceTransformers().at(fixedId);
-    auto elxHelper = RegistrationStep(fixedId, m_List1, fixedTransformer, movingId, m_List1);
-    spectrumImageStack1->Insert(movingId, elxHelper);
-
-    // stack 2
-    if(doMultiModalImageRegistration){
-      elxHelper = RegistrationStep(movingId, m_List1, elxHelper, movingId, m_List2);
-      spectrumImageStack2->Insert(movingId, elxHelper);
+    if (!results[j])
+    {
+      QMessageBox::warning(m_Parent,
+                           "Registration failed!",
+                           QString::fromStdString("Slice " + std::to_string(jobs[j].sliceId) + ": " + errors[j]));
+      return;
     }
-    mitk::ProgressBar::GetInstance()->Progress();
+    (jobs[j].stack == 1 ? spectrumImageStack1 : spectrumImageStack2)->Insert(jobs[j].sliceId, results[j]);
   }
 
   spectrumImageStack1->InitializeProcessor();
@@ -284,6 +440,10 @@ void m2Reconstruction3D::OnUpdateList()
   m_List1->clear();
   m_List2->clear();
   m_referenceMap.clear();
+  {
+    std::lock_guard<std::mutex> lock(m_RegistrationCacheMutex);
+    m_RegistrationCache.clear();
+  }
   unsigned int i = 0;
   // iterate all objects in data storage and create a list widged item
   //  unsigned id = 1;
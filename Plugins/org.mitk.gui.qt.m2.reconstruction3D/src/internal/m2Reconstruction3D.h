@@ -31,6 +31,7 @@ See LICENSE.txt or https://www.github.com/jtfcordes/m2aia for details.
 #include <m2SpectrumImageStack.h>
 #include <mitkImage.h>
 #include <mitkPointSet.h>
+#include <mutex>
 #include <qfuturewatcher.h>
 #include <qlistwidget.h>
 #include <qprocess.h>
@@ -68,13 +69,29 @@ protected:
 
   DataTuple GetImageDataById(unsigned int id, QListWidget *listWidget);
 
-  std::shared_ptr<m2::ElxRegistrationHelper> RegistrationStep(unsigned int fixedId,
-                                                                      QListWidget *fixedSource,
-                                                                      std::shared_ptr<m2::ElxRegistrationHelper> fixedTransformer,
-                                                                      unsigned int movingId,
-                                                                      QListWidget *movingSource);
+  /// Registers the moving image to the (already warped) fixed image.
+  /// Results are cached by the hashes of the input images and parameters. Each call returns a
+  /// helper of its own, so a cached registration is never shared by two slices. Thread-safe.
+  std::shared_ptr<m2::ElxRegistrationHelper> RegistrationStep(mitk::Image::Pointer fixedImage,
+                                                              mitk::Image::Pointer movingImage,
+                                                              const std::vector<std::string> &parameters);
   std::vector<std::string> GetParameters();
 
+  /// A hash collision must not return the result of another registration, so the
+  /// parameters and image dimensions are compared on a hit. The result is a private copy that
+  /// is only copied from, it never becomes a slice of a stack.
+  struct RegistrationCacheEntry
+  {
+    std::vector<std::string> parameters;
+    std::vector<unsigned int> fixedDimensions, movingDimensions;
+    std::shared_ptr<const m2::ElxRegistrationHelper> result;
+    unsigned int run;
+  };
+  /// Holds the registrations of the last stacking run only; cleared if the lists are updated.
+  std::map<std::size_t, RegistrationCacheEntry> m_RegistrationCache;
+  std::mutex m_RegistrationCacheMutex;
+  unsigned int m_RegistrationRun = 0;
+
   QListWidget *m_List1, *m_List2;
 
   std::map<unsigned int, DataTuple> m_referenceMap;